@@ -81,9 +81,15 @@ _start:
 	aligned at the time of the call instruction (which afterwards pushes
 	the return pointer of size 4 bytes). The stack was originally 16-byte
 	aligned above and we've pushed a multiple of 16 bytes to the
-	stack since (pushed 0 bytes so far), so the alignment has thus been
-	preserved and the call is well defined.
+	stack since (8 bytes of padding plus the two arguments), so the
+	alignment has thus been preserved and the call is well defined.
+
+	The bootloader left the multiboot magic in eax and the address of the
+	multiboot information structure in ebx, pass both to kernel_main.
 	*/
+	sub $8, %esp
+	push %ebx
+	push %eax
 	call kernel_main
 
 	/*
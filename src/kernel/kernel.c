@@ -4,15 +4,28 @@
 #include "libs/Drivers/kernel.h"
 #include "libs/Drivers/keyboard.h"
 #include "libs/Drivers/usb.h"
+#include "libs/Drivers/usb_storage.h"
 #include "libs/Drivers/disk.h"
 #include "libs/Drivers/pci.h"
+#include "libs/Drivers/block.h"
+#include "libs/Drivers/iosched.h"
+#include "libs/Drivers/nvme.h"
+#include "libs/Drivers/virtio_blk.h"
+#include "libs/Drivers/ramdisk.h"
+#include "libs/Drivers/zram.h"
+#include "libs/Drivers/raid.h"
+#include "libs/Drivers/ide.h"
 #include "libs/System/system.h"
+#include "libs/System/multiboot.h"
+#include "libs/System/vfs.h"
+#include "libs/System/pagecache.h"
+#include "libs/System/diskbench.h"
+#include "libs/System/init.h"
 #include "libs/BuiltIn/microshell.h"
 #include "libs/BuiltIn/keyboard_layouts.h"
 
 extern int initAcpi(void);       
 extern void acpiPowerOff(void);  
-extern int check_type(HBA_PORT *port);
 
 // KEYBOARD LAYOUT CHANGE IF NECESSERY
 KeyboardLayout current_layout = LAYOUT_US;
@@ -212,63 +225,6 @@ void outb(uint16_t port, uint8_t value) {
     __asm__ volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
 }
 
-struct ahci_device_list {
-    struct pci_device *pci_device;
-    int length;
-};
-
-int MAX_DEVICES = 128;
-
-HBA_PORT* get_hba_port(uint32_t bus, uint32_t device, uint32_t function)
-{
-    #define PROT_READ  0x1  // Page can be read
-    #define PROT_WRITE 0x2  // Page can be written
-    #define MAP_SHARED 0x01 // Changes are visible to other processes
-    // Read the PCI config space to get the BAR address (Base Address Register)
-    void* pci_config = pci_read_config_space(bus, device, function, 0x10);
-    uint32_t bar_address = *((uint32_t*)pci_config);  // BAR0 address for this example
-
-    // Map the memory for the HBA
-    HBA_PORT* hba_port = (HBA_PORT*)mmap(NULL, sizeof(HBA_PORT), PROT_READ | PROT_WRITE, MAP_SHARED, -1, bar_address);
-
-    return hba_port;
-}
-
-
-struct pci_device_list *get_ahci_devices(struct pci_device_list device_list) {
-    // Count how many AHCI devices there are
-    int ahci_count = 0;
-    for (int i = 0; i < device_list.length; ++i) {
-        struct pci_device *dev = &device_list.pci_device[i];
-        // Check if the device is AHCI using check_type function
-        if (check_type(get_hba_port(dev->bus,dev->device,dev->function))) {
-            ahci_count++;
-        }
-    }
-    printk(ahci_count);
-    // Allocate memory for the AHCI devices
-    struct pci_device *ahci_devices = malloc(ahci_count * sizeof(struct pci_device));
-
-    // Populate the AHCI devices list
-    int index = 0;
-    for (int i = 0; i < device_list.length; ++i) {
-        printk(i);
-        struct pci_device *dev = &device_list.pci_device[i];
-        if (check_type(get_hba_port(dev->bus,dev->device,dev->function))) {
-            ahci_devices[index] = *dev; // Copy the AHCI device to the list
-            index++;
-        }
-    }
-
-    // Return the list of AHCI devices
-    struct pci_device_list ahci_device_list = {
-        .pci_device = ahci_devices,
-        .length = ahci_count
-    };
-    struct pci_device_list *val = &ahci_device_list;
-    return val;
-}
-
 #define EDITOR_BUFFER_SIZE 4096
 static char editor_buffer[EDITOR_BUFFER_SIZE];
 #define KEY_CTRL_Q 16  // Typically Ctrl+Q
@@ -492,7 +448,9 @@ void terminal_prompt() {
         char* shift = 0;
 
         // Get user input
-        while (!terminal_input(command, &buffer_index, shift));
+        // Drivers still coming up get their turn between keys
+        while (!terminal_input(command, &buffer_index, shift))
+            init_poll();
 
         // Split the command into arguments
         int arg_count = split_command(command, args);
@@ -504,10 +462,29 @@ void terminal_prompt() {
             printk("\nAvailable commands:\n");
             printk("  help            - Show this help message\n");
             printk("  lsdisks         - Shows the disks\n");
+            printk("  lspci           - Shows the PCI devices and their drivers\n");
+            printk("  lsusb           - Shows the USB devices and their interfaces\n");
+            printk("  boottime        - Shows how long each part of the boot took\n");
+            printk("  iostat          - I/O scheduler merge and dispatch statistics\n");
+            printk("  diskbench <dev> [rw=] [bs=] [qd=] [time=] [size=] - Benchmark a block device\n");
+            printk("  ramdisk <KiB>   - Create a RAM disk\n");
+            printk("  zram [KiB]      - Create a compressed RAM disk, or show zram stats\n");
+            printk("  raid [<0|1> <chunk KiB> <dev> <dev>...] - Create a RAID array, or show RAID stats\n");
+            printk("  mount <dev> <dir> - Mount an exFAT volume on a directory\n");
+            printk("  umount <dir>    - Unmount the volume on a directory\n");
+            printk("  ls [path]       - List a directory\n");
+            printk("  cat <path>      - Print a file\n");
+            printk("  write <path> <text> - Append a line to a file, creating it\n");
+            printk("  mkdir <path>    - Create a directory\n");
+            printk("  rm <path>       - Delete a file or an empty directory\n");
+            printk("  sync            - Write all changes to the mounted volumes\n");
+            printk("  sum <path>      - Checksum a file through a mapping of it\n");
+            printk("  vfsstat         - Dentry, inode and page cache statistics\n");
             printk("  reboot          - Reboot the system\n");
             printk("  shutdown        - Exit the terminal\n");
             printk("  edit            - Start the program editor\n");
-            printk("  run             - Execute the current program\n");
+            printk("  run [file]      - Execute the current program, or a file\n");
+            printk("  save <file>     - Save the editor buffer to a file\n");
             printk("  cl              - Change Layout\n");
             printk("  getkey          - Shows keycode pressed\n");
         }
@@ -548,6 +525,30 @@ void terminal_prompt() {
                 editor_handle_input();
             }
         }
+        else if (strcmp(args[0], "run") == 0 && arg_count > 1) {
+            vfs_file_t *file = vfs_open(args[1], 0);
+            int n = file ? vfs_read(file, editor_buffer, EDITOR_BUFFER_SIZE - 1) : -1;
+            if (file) {
+                vfs_close(file);
+            }
+            if (n < 0) {
+                printk("Cannot read %s\n", args[1]);
+            } else {
+                editor_buffer_pos = n;
+                execute_buffer();
+            }
+        }
+        else if (strcmp(args[0], "save") == 0) {
+            vfs_file_t *file = arg_count > 1 ? vfs_open(args[1], VFS_O_CREATE | VFS_O_TRUNC) : NULL;
+            if (arg_count < 2) {
+                terminal_writestring("Usage: save <file>\n");
+            } else if (file == NULL || vfs_write(file, editor.buffer, editor.position) < 0) {
+                printk("Cannot write %s\n", args[1]);
+            }
+            if (file) {
+                vfs_close(file);
+            }
+        }
         else if (strcmp(args[0], "run") == 0) {
             if (editor_buffer_pos > 0) {
                 execute_buffer();
@@ -556,6 +557,7 @@ void terminal_prompt() {
             }
         }
         else if (strcmp(args[0], "reboot") == 0) {
+            vfs_sync();
             if (initAcpi() == 0) {
                 printk("ACPI initialization successfully.\n");
                 acpiPowerOff();
@@ -564,16 +566,209 @@ void terminal_prompt() {
             }
             break;
         }
+        else if (strcmp(args[0], "boottime") == 0) {
+            init_print_report();
+        }
+        else if (strcmp(args[0], "lspci") == 0) {
+            pci_print_devices();
+        }
+        else if (strcmp(args[0], "lsusb") == 0) {
+            usb_print_devices();
+        }
         else if (strcmp(args[0], "lsdisks") == 0) {
-            struct pci_device_list pci_devices = pci_enumerate_devices();
-            printk("Gotten disk list, checking type.\n");
-            struct pci_device_list *ahci_devices = get_ahci_devices(pci_devices);
-
-            for (int i = 0; i < ahci_devices->length; ++i) {
-                printk(ahci_devices->pci_device->device_id);
+            if (block_device_count() == 0) {
+                printk("No block devices registered.\n");
+            }
+            for (int i = 0; i < block_device_count(); i++) {
+                block_device_t *dev = block_get(i);
+                printk("  %s: %d MiB, %d byte sectors\n", dev->name,
+                       (int)(dev->sector_count * dev->sector_size >> 20), (int)dev->sector_size);
+            }
+        }
+        else if (strcmp(args[0], "iostat") == 0) {
+            if (block_device_count() == 0) {
+                printk("No block devices registered.\n");
+            }
+            for (int i = 0; i < block_device_count(); i++) {
+                iosched_print_stats(block_get(i)->sched);
+            }
+        }
+        else if (strcmp(args[0], "diskbench") == 0) {
+            diskbench_job_t job;
+            if (arg_count < 2) {
+                terminal_writestring("Usage: diskbench <device> [rw=read|write|randread|randwrite] [bs=4k] [qd=32] [time=10] [size=<bytes>]\n");
+            } else if (diskbench_parse(&job, arg_count - 1, &args[1])) {
+                diskbench_run(&job);
+            }
+        }
+        else if (strcmp(args[0], "ramdisk") == 0) {
+            int kib = arg_count > 1 ? atoi(args[1]) : 0;
+            if (kib <= 0) {
+                terminal_writestring("Usage: ramdisk <size in KiB>\n");
+            } else {
+                block_device_t *dev = ramdisk_create(kib * 2);
+                if (dev) {
+                    printk("%s: %d KiB RAM disk\n", dev->name, kib);
+                }
+            }
+        }
+        else if (strcmp(args[0], "zram") == 0) {
+            if (arg_count < 2) {
+                zram_print_stats();
+            } else if (atoi(args[1]) <= 0) {
+                terminal_writestring("Usage: zram [size in KiB]\n");
+            } else {
+                block_device_t *dev = zram_create(atoi(args[1]) * 2);
+                if (dev) {
+                    printk("%s: %d KiB compressed RAM disk\n", dev->name, atoi(args[1]));
+                }
+            }
+        }
+        else if (strcmp(args[0], "raid") == 0) {
+            block_device_t *members[RAID_MAX_MEMBERS];
+            int count = arg_count - 3;
+            bool ok = count >= 2 && count <= RAID_MAX_MEMBERS && atoi(args[2]) > 0;
+            for (int i = 0; ok && i < count; i++) {
+                members[i] = block_find(args[3 + i]);
+                if (members[i] == NULL) {
+                    printk("No such device: %s\n", args[3 + i]);
+                    ok = false;
+                }
+            }
+            if (arg_count < 2) {
+                raid_print_stats();
+            } else if (!ok) {
+                terminal_writestring("Usage: raid <0|1> <chunk in KiB> <device> <device> [...]\n");
+            } else {
+                block_device_t *dev = raid_create(atoi(args[1]), atoi(args[2]) * 2, members, count);
+                if (dev) {
+                    printk("%s: RAID-%d over %d devices, %d MiB\n", dev->name, atoi(args[1]), count,
+                           (int)(dev->sector_count * dev->sector_size >> 20));
+                }
+            }
+        }
+        else if (strcmp(args[0], "mount") == 0) {
+            block_device_t *dev = arg_count > 2 ? block_find(args[1]) : NULL;
+            if (arg_count < 3) {
+                terminal_writestring("Usage: mount <device> <directory>\n");
+            } else if (dev == NULL) {
+                printk("No such device: %s\n", args[1]);
+            } else {
+                vfs_mount("exfat", dev, args[2]);
+            }
+        }
+        else if (strcmp(args[0], "umount") == 0) {
+            if (arg_count < 2) {
+                terminal_writestring("Usage: umount <directory>\n");
+            } else {
+                vfs_umount(args[1]);
             }
         }
+        else if (strcmp(args[0], "ls") == 0) {
+            vfs_dirent_t entry;
+            const char *path = arg_count > 1 ? args[1] : "/";
+            vfs_file_t *dir = vfs_open(path, 0);
+            if (dir == NULL) {
+                printk("No such directory: %s\n", path);
+            } else if (!vfs_is_dir(dir)) {
+                printk("Not a directory: %s\n", path);
+            } else {
+                while (vfs_readdir(dir, &entry)) {
+                    if (entry.directory) {
+                        printk("  %s/\n", entry.name);
+                    } else {
+                        printk("  %s  %d\n", entry.name, (int)entry.size);
+                    }
+                }
+            }
+            if (dir) {
+                vfs_close(dir);
+            }
+        }
+        else if (strcmp(args[0], "cat") == 0) {
+            char data[257];
+            vfs_file_t *file = arg_count > 1 ? vfs_open(args[1], 0) : NULL;
+            if (arg_count < 2) {
+                terminal_writestring("Usage: cat <file>\n");
+            } else if (file == NULL) {
+                printk("No such file: %s\n", args[1]);
+            } else if (vfs_is_dir(file)) {
+                printk("Is a directory: %s\n", args[1]);
+            } else {
+                int n;
+                while ((n = vfs_read(file, data, 256)) > 0) {
+                    data[n] = '\0';
+                    terminal_writestring(data);
+                }
+            }
+            if (file) {
+                vfs_close(file);
+            }
+        }
+        else if (strcmp(args[0], "write") == 0) {
+            vfs_file_t *file = arg_count > 2 ? vfs_open(args[1], VFS_O_CREATE | VFS_O_APPEND) : NULL;
+            if (arg_count < 3) {
+                terminal_writestring("Usage: write <file> <text>\n");
+            } else if (file == NULL || vfs_is_dir(file)) {
+                printk("Cannot write %s\n", args[1]);
+            } else if (vfs_write(file, args[2], strlen(args[2])) < 0 || vfs_write(file, "\n", 1) < 0) {
+                printk("Write to %s failed\n", args[1]);
+            }
+            if (file) {
+                vfs_close(file);
+            }
+        }
+        else if (strcmp(args[0], "mkdir") == 0) {
+            if (arg_count < 2) {
+                terminal_writestring("Usage: mkdir <path>\n");
+            } else if (!vfs_mkdir(args[1])) {
+                printk("Cannot create %s\n", args[1]);
+            }
+        }
+        else if (strcmp(args[0], "rm") == 0) {
+            if (arg_count < 2) {
+                terminal_writestring("Usage: rm <path>\n");
+            } else if (!vfs_unlink(args[1])) {
+                printk("Cannot delete %s\n", args[1]);
+            }
+        }
+        else if (strcmp(args[0], "sync") == 0) {
+            if (!vfs_sync()) {
+                terminal_writestring("Sync failed.\n");
+            }
+        }
+        else if (strcmp(args[0], "sum") == 0) {
+            vfs_file_t *file = arg_count > 1 ? vfs_open(args[1], 0) : NULL;
+            if (arg_count < 2) {
+                terminal_writestring("Usage: sum <file>\n");
+            } else if (file == NULL || vfs_is_dir(file)) {
+                printk("Cannot read %s\n", args[1]);
+            } else if (vfs_size(file) == 0) {
+                printk("%s: 0 bytes, sum 0\n", args[1]);
+            } else {
+                uint32_t size = vfs_size(file);
+                uint8_t *data = mmap(NULL, size, PROT_READ, MAP_SHARED, vfs_file_fd(file), 0);
+                if (data == MAP_FAILED) {
+                    printk("Cannot map %s\n", args[1]);
+                } else {
+                    uint32_t sum = 0;
+                    for (uint32_t i = 0; i < size; i++) {
+                        sum = (sum << 1 | sum >> 31) + data[i];
+                    }
+                    printk("%s: %d bytes, sum %d\n", args[1], (int)size, (int)sum);
+                    munmap(data, size);
+                }
+            }
+            if (file) {
+                vfs_close(file);
+            }
+        }
+        else if (strcmp(args[0], "vfsstat") == 0) {
+            vfs_print_stats();
+            pcache_print_stats();
+        }
         else if (strcmp(args[0], "shutdown") == 0) {
+            vfs_sync();
             if (initAcpi() == 0) {
                 printk("ACPI initialization successfully.\n");
                 acpiPowerOff();
@@ -590,10 +785,54 @@ void terminal_prompt() {
     }
 }
 
-void kernel_main(void) 
+// Boot tasks ==========================================================
+
+static int init_vfs(void) { vfs_init(); return INIT_DONE; }
+static int init_ramdisk(void) { ramdisk_init_modules(); return INIT_DONE; }
+static int init_pci(void) { pci_init(); return INIT_DONE; }
+static int init_ide(void) { ide_init(); return INIT_DONE; }
+static int init_nvme(void) { nvme_init(); return INIT_DONE; }
+static int init_virtio_blk(void) { virtio_blk_init(); return INIT_DONE; }
+static int init_usb(void) { usb_init(); return INIT_DONE; }
+static int init_usb_storage(void) { usb_storage_init(); return INIT_DONE; }
+static int init_keyboard(void) { keyboard_init(); return INIT_DONE; }
+static int init_editor(void) { editor_init(); return INIT_DONE; }
+static int init_shell(void) { msh_init(); return INIT_DONE; }
+
+// Controllers are claimed on the first step, links and drives waited for on the next ones
+static int init_ahci(void) {
+    static bool started = false;
+    if (!started) {
+        started = true;
+        ahci_init();
+    }
+    return ahci_init_poll() ? INIT_DONE : INIT_PENDING;
+}
+
+static init_task_t boot_tasks[] = {
+    { .name = "vfs",        .step = init_vfs },
+    { .name = "ramdisk",    .step = init_ramdisk },
+    { .name = "pci",        .step = init_pci },
+    { .name = "ahci",       .step = init_ahci,       .deps = { "pci" } },
+    { .name = "ide",        .step = init_ide,        .deps = { "pci" } },
+    { .name = "nvme",       .step = init_nvme,       .deps = { "pci" } },
+    { .name = "virtio-blk", .step = init_virtio_blk, .deps = { "pci" } },
+    { .name = "usb",        .step = init_usb,        .deps = { "pci" } },
+    { .name = "usb-storage", .step = init_usb_storage, .deps = { "usb" } },
+    { .name = "keyboard",   .step = init_keyboard,   .deps = { "usb" } },
+    { .name = "editor",     .step = init_editor },
+    { .name = "shell",      .step = init_shell,      .deps = { "vfs", "editor" } },
+};
+
+void kernel_main(uint32_t multiboot_magic, uint32_t multiboot_info)
 {
 	terminal_initialize();
-    editor_init();
-    msh_init();
+    multiboot_init(multiboot_magic, multiboot_info);
+    for (size_t i = 0; i < sizeof(boot_tasks) / sizeof(boot_tasks[0]); i++) {
+        init_add(&boot_tasks[i]);
+    }
+    // The prompt comes up as soon as the shell can run; disks and other
+    // drivers finish from the prompt's idle loop
+    init_run_until("shell");
     terminal_prompt();
 }
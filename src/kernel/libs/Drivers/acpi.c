@@ -1,5 +1,6 @@
 #include "../System/system.h"
 #include "kernel.h"
+#include "acpi.h"
 extern uint16_t inw(uint16_t port);
 extern void outw(uint16_t port, uint16_t value);
 
@@ -131,6 +132,42 @@ int acpiCheckHeader(unsigned int *ptr, char *sig)
 
 
 
+// Walks the RSDT for the table with signature sig, NULL if there is none
+unsigned int *acpiFindTable(char *sig)
+{
+	unsigned int *ptr = acpiGetRSDPtr();
+
+	if (ptr == NULL || acpiCheckHeader(ptr, "RSDT") != 0)
+		return NULL;
+
+	int entrys = (*(ptr + 1) - 36) / 4;
+	ptr += 36/4;	// skip header information
+	while (0<entrys--)
+	{
+		if (acpiCheckHeader((unsigned int *) *ptr, sig) == 0)
+			return (unsigned int *) *ptr;
+		ptr++;
+	}
+	return NULL;
+}
+
+// Copies at most max ECAM windows out of the MCFG table, returns how many there were
+int acpiGetMcfg(struct acpi_mcfg_entry *entries, int max)
+{
+	unsigned int *mcfg = acpiFindTable("MCFG");
+	if (mcfg == NULL || *(mcfg + 1) < 44)
+		return 0;
+
+	// 36 byte header and 8 reserved bytes, then 16 bytes per window
+	int count = (*(mcfg + 1) - 44) / sizeof(struct acpi_mcfg_entry);
+	struct acpi_mcfg_entry *entry = (struct acpi_mcfg_entry *) ((byte *) mcfg + 44);
+	for (int i = 0; i < count && i < max; i++)
+		entries[i] = entry[i];
+	return count < max ? count : max;
+}
+
+
+
 int acpiEnable(void)
 {
 	// Check if acpi is enabled
@@ -0,0 +1,23 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+
+#define ACPI_MAX_MCFG 4
+
+// One ECAM window from the MCFG table
+struct acpi_mcfg_entry
+{
+	uint64_t base;		// Configuration space of start_bus, 1M per bus
+	uint16_t segment;
+	uint8_t start_bus;
+	uint8_t end_bus;
+	uint32_t reserved;
+} __attribute__((packed));
+
+int initAcpi(void);
+void acpiPowerOff(void);
+unsigned int *acpiFindTable(char *sig);
+int acpiGetMcfg(struct acpi_mcfg_entry *entries, int max);
+
+#endif // ACPI_H
@@ -0,0 +1,208 @@
+#include "block.h"
+#include "iosched.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+extern void itoa(int value, char *str, int base);
+
+// Registered block devices, every one gets its own deadline scheduler
+static block_device_t *block_devices[MAX_BLOCK_DEVICES];
+static io_sched_t block_scheds[MAX_BLOCK_DEVICES];
+static int block_devices_count = 0;
+
+// Requests queued per batch by the synchronous helpers
+#define BLOCK_SYNC_BATCH 16
+
+bool block_register(block_device_t *dev) {
+    if (block_devices_count >= MAX_BLOCK_DEVICES) {
+        printk("Error: Too many block devices, %s not registered.\n", dev->name);
+        return false;
+    }
+
+    if (dev->sector_size == 0) {
+        dev->sector_size = BLOCK_SECTOR_SIZE;
+    }
+    if (dev->max_sectors == 0) {
+        dev->max_sectors = 1;
+    }
+    if (dev->max_segs == 0 || dev->max_segs > BLOCK_MAX_SEGS) {
+        dev->max_segs = BLOCK_MAX_SEGS;
+    }
+    if (dev->queue && dev->queue_depth == 0) {
+        dev->queue_depth = 1;
+    }
+    dev->inflight = 0;
+
+    io_sched_t *s = &block_scheds[block_devices_count];
+    iosched_init(s, dev);
+    dev->sched = s;
+
+    block_devices[block_devices_count++] = dev;
+    return true;
+}
+
+int block_device_count() {
+    return block_devices_count;
+}
+
+block_device_t *block_get(int index) {
+    if (index < 0 || index >= block_devices_count) {
+        return NULL;
+    }
+    return block_devices[index];
+}
+
+block_device_t *block_find(const char *name) {
+    for (int i = 0; i < block_devices_count; i++) {
+        if (strcmp(block_devices[i]->name, name) == 0) {
+            return block_devices[i];
+        }
+    }
+    return NULL;
+}
+
+// Build "<prefix><index>", e.g. "sd0"
+void block_make_name(char *out, const char *prefix, int index) {
+    char num[12];
+    itoa(index, num, 10);
+    strncpy(out, prefix, 11);
+    out[11] = '\0';
+    strcat(out, num);
+}
+
+// Asynchronous path =====================================================
+
+void block_submit(block_device_t *dev, io_request_t *req) {
+    iosched_add(dev->sched, req);
+}
+
+// Hand as much as the driver accepts to it, then ring its doorbell once
+static bool block_kick(block_device_t *dev) {
+    bool issued = false;
+    while (iosched_dispatch(dev->sched)) {
+        issued = true;
+    }
+    if (issued && dev->commit) {
+        dev->commit(dev);
+    }
+    return issued;
+}
+
+// Dispatch everything that is queued and wait for it to finish
+void block_run(block_device_t *dev) {
+    if (!dev->queue) {
+        while (iosched_dispatch(dev->sched)) {
+        }
+        return;
+    }
+
+    while (iosched_pending(dev->sched) || dev->inflight > 0) {
+        block_kick(dev);
+        dev->poll(dev);
+    }
+}
+
+// Start what is queued and reap whatever has finished, without waiting for
+// the rest. Drivers without a queue finish everything right here. Returns
+// true while requests are still queued or in flight.
+bool block_poll(block_device_t *dev) {
+    if (!dev->queue) {
+        while (iosched_dispatch(dev->sched)) {
+        }
+        return false;
+    }
+    block_kick(dev);
+    if (dev->poll(dev) > 0) {
+        block_kick(dev);    // Reaping made room in the driver's queue
+    }
+    return iosched_pending(dev->sched) || dev->inflight > 0;
+}
+
+// Dispatch until req has completed. Other requests stay queued (for
+// synchronous drivers) so later submissions still get a chance to merge.
+bool block_wait(block_device_t *dev, io_request_t *req) {
+    while (req->status == IO_PENDING) {
+        if (dev->queue) {
+            block_kick(dev);
+            if (dev->poll(dev) == 0 && dev->inflight == 0 && !iosched_pending(dev->sched)) {
+                break;
+            }
+        } else if (!iosched_dispatch(dev->sched)) {
+            break;
+        }
+    }
+    return req->status == IO_DONE;
+}
+
+void block_complete(block_device_t *dev, io_request_t *req, bool ok) {
+    dev->inflight--;
+    iosched_complete(dev->sched, req, ok);
+}
+
+// Synchronous helpers ===================================================
+
+// Split count sectors into max_sectors sized requests, queue them together and wait for all
+static bool block_rw(block_device_t *dev, uint64_t lba, uint32_t count, uint8_t *buf, bool write) {
+    io_request_t reqs[BLOCK_SYNC_BATCH];
+    bool ok = true;
+
+    if (lba + count > dev->sector_count) {
+        printk("Error: %s access beyond end of device.\n", dev->name);
+        return false;
+    }
+
+    while (count > 0) {
+        int n = 0;
+        while (count > 0 && n < BLOCK_SYNC_BATCH) {
+            uint32_t chunk = count < dev->max_sectors ? count : dev->max_sectors;
+            memset(&reqs[n], 0, sizeof(io_request_t));
+            reqs[n].lba = lba;
+            reqs[n].count = chunk;
+            reqs[n].buf = buf;
+            reqs[n].write = write;
+            block_submit(dev, &reqs[n]);
+
+            lba += chunk;
+            count -= chunk;
+            buf += chunk * dev->sector_size;
+            n++;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (!block_wait(dev, &reqs[i])) {
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+bool block_read(block_device_t *dev, uint64_t lba, uint32_t count, void *buf) {
+    return block_rw(dev, lba, count, (uint8_t *)buf, false);
+}
+
+bool block_write(block_device_t *dev, uint64_t lba, uint32_t count, const void *buf) {
+    return block_rw(dev, lba, count, (uint8_t *)buf, true);
+}
+
+bool block_flush(block_device_t *dev) {
+    block_run(dev);
+    if (dev->flush) {
+        return dev->flush(dev);
+    }
+    return true;
+}
+
+// Zero-copy access for devices that live in memory, NULL if not possible
+void *block_direct_access(block_device_t *dev, uint64_t lba, uint32_t count) {
+    if (dev->direct_access == NULL || lba + count > dev->sector_count) {
+        return NULL;
+    }
+    if (iosched_pending(dev->sched)) {
+        block_run(dev);     // Queued writes must land before the memory is looked at
+    }
+    return dev->direct_access(dev, lba, count);
+}
@@ -0,0 +1,100 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MAX_BLOCK_DEVICES  16
+#define BLOCK_MAX_SEGS     32   // Upper bound for any driver's scatter-gather list
+#define BLOCK_SECTOR_SIZE  512
+
+// Request status
+#define IO_PENDING 0
+#define IO_DONE    1
+#define IO_ERROR   2
+
+typedef struct block_device block_device_t;
+
+// One contiguous piece of memory in a scatter-gather transfer
+typedef struct {
+    void *buf;
+    uint32_t count;        // Sectors
+} block_seg_t;
+
+// A single read or write submitted to a block device.
+// The caller owns the storage and must keep it alive until status leaves IO_PENDING.
+typedef struct io_request {
+    uint64_t lba;
+    uint32_t count;        // Sectors
+    void *buf;
+    bool write;
+    volatile int status;
+    void (*end_io)(struct io_request *req);  // Optional completion callback
+    void *private_data;                      // For the submitter
+
+    // Scheduler bookkeeping
+    uint64_t deadline;     // time_now_us() after which the request has expired
+    uint64_t grp_lba;      // Range covered by this request and everything merged into it
+    uint32_t grp_count;
+    uint32_t grp_segs;     // Scatter-gather entries the merged range needs
+    struct io_request *chain;       // Members in LBA order, only valid on the group head
+    struct io_request *chain_next;
+    struct io_request *sort_prev, *sort_next;
+    struct io_request *fifo_prev, *fifo_next;
+} io_request_t;
+
+struct io_sched;
+
+struct block_device {
+    char name[16];
+    uint32_t sector_size;
+    uint64_t sector_count;
+    uint32_t max_sectors;  // Largest single command the controller accepts
+    uint32_t max_segs;     // Scatter-gather entries per command
+    uint32_t virt_boundary; // If set, segments may only be joined where both sides sit on this byte alignment
+
+    // Issue one command covering lba..lba+sum(segs) and wait for it. Returns false
+    // on device error. Only used when the driver does not provide queue().
+    bool (*transfer)(block_device_t *dev, uint64_t lba, const block_seg_t *segs, int nsegs, bool write);
+    bool (*flush)(block_device_t *dev);  // May be NULL for devices without a write cache
+
+    // Optional asynchronous interface for drivers with hardware queues.
+    // queue() starts a command without waiting, commit() rings the doorbell once
+    // for everything queued since the last commit, and poll() reaps finished
+    // commands through block_complete() and returns how many it found.
+    bool (*queue)(block_device_t *dev, io_request_t *req, const block_seg_t *segs, int nsegs);
+    void (*commit)(block_device_t *dev);
+    int (*poll)(block_device_t *dev);
+    uint32_t queue_depth;  // Commands the driver accepts in flight
+    uint32_t inflight;
+
+    // Optional, for memory backed devices: pointer to count sectors at lba
+    // that can be read (and written) in place, or NULL if they are not contiguous
+    void *(*direct_access)(block_device_t *dev, uint64_t lba, uint32_t count);
+
+    void *driver_data;
+    struct io_sched *sched;
+};
+
+// Registry
+bool block_register(block_device_t *dev);
+int block_device_count();
+block_device_t *block_get(int index);
+block_device_t *block_find(const char *name);
+void block_make_name(char *out, const char *prefix, int index);
+
+// Asynchronous path: queue requests, then run the scheduler or wait for one of them
+void block_submit(block_device_t *dev, io_request_t *req);
+void block_run(block_device_t *dev);
+bool block_poll(block_device_t *dev);    // Make progress without waiting, true while busy
+bool block_wait(block_device_t *dev, io_request_t *req);
+void block_complete(block_device_t *dev, io_request_t *req, bool ok);  // Called by drivers from poll()
+
+// Synchronous helpers
+bool block_read(block_device_t *dev, uint64_t lba, uint32_t count, void *buf);
+bool block_write(block_device_t *dev, uint64_t lba, uint32_t count, const void *buf);
+bool block_flush(block_device_t *dev);
+void *block_direct_access(block_device_t *dev, uint64_t lba, uint32_t count);
+
+#endif // BLOCK_H
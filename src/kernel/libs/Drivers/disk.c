@@ -1,4 +1,9 @@
 #include "disk.h"
+#include "block.h"
+#include "kernel.h"
+#include "pci.h"
+#include "../System/system.h"
+#include "../System/time.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <stdarg.h>
@@ -15,6 +20,8 @@
 #define AHCI_DEV_SEMB 2
 #define AHCI_DEV_PM 3
 #define AHCI_DEV_SATAPI 4
+#define AHCI_DEV_INACTIVE 5
+#define AHCI_DEV_PM_NOSPM 6
 
 #define HBA_PORT_IPM_ACTIVE 1
 #define HBA_PORT_DET_PRESENT 3
@@ -30,7 +37,7 @@ int check_type(HBA_PORT *port)
 	if (det != HBA_PORT_DET_PRESENT)	// Check drive status
 		return AHCI_DEV_NULL;
 	if (ipm != HBA_PORT_IPM_ACTIVE)
-		return AHCI_DEV_NULL;
+		return AHCI_DEV_INACTIVE;
 
 	switch (port->sig)
 	{
@@ -45,217 +52,251 @@ int check_type(HBA_PORT *port)
 	}
 }
 
-void probe_port(HBA_MEM *abar)
+// Port setup ========================================================
+
+// Give the port its command list, received FIS area and command tables:
+// 1K list in the first page, 32 tables of 256 bytes (8 PRDT entries each)
+// in the next two, and a 4K FIS area that has room for the 16 devices of
+// FIS-based switching in the last
+bool port_rebase(HBA_PORT *port)
 {
-	// Search disk in implemented ports
-	uint32_t pi = abar->pi;
-	int i = 0;
-	while (i<32)
+	uint8_t *mem = alloc_pages(4);
+	if (mem == NULL)
 	{
-		if (pi & 1)
-		{
-			int dt = check_type(&abar->ports[i]);
-			if (dt == AHCI_DEV_SATA)
-			{
-				printk("SATA drive found at port %d\n", i);
-			}
-			else if (dt == AHCI_DEV_SATAPI)
-			{
-				printk("SATAPI drive found at port %d\n", i);
-			}
-			else if (dt == AHCI_DEV_SEMB)
-			{
-				printk("SEMB drive found at port %d\n", i);
-			}
-			else if (dt == AHCI_DEV_PM)
-			{
-				printk("PM drive found at port %d\n", i);
-			}
-			else
-			{
-				printk("No drive found at port %d\n", i);
-			}
-		}
-
-		pi >>= 1;
-		i ++;
+		printk("AHCI: out of memory for port structures\n");
+		return false;
 	}
-}
-
-#define	AHCI_BASE	0x400000	// 4M
+	memset(mem, 0, 4 * 4096);
 
-#define HBA_PxCMD_ST    0x0001
-#define HBA_PxCMD_FRE   0x0010
-#define HBA_PxCMD_FR    0x4000
-#define HBA_PxCMD_CR    0x8000
-
-void port_rebase(HBA_PORT *port, int portno)
-{
-	stop_cmd(port);	// Stop command engine
-
-	// Command list offset: 1K*portno
-	// Command list entry size = 32
-	// Command list entry maxim count = 32
-	// Command list maxim size = 32*32 = 1K per port
-	port->clb = AHCI_BASE + (portno<<10);
+	port->clb = (uint32_t) mem;
 	port->clbu = 0;
-	memset((void*)(port->clb), 0, 1024);
-
-	// FIS offset: 32K+256*portno
-	// FIS entry size = 256 bytes per port
-	port->fb = AHCI_BASE + (32<<10) + (portno<<8);
+	port->fb = (uint32_t) (mem + 3 * 4096);
 	port->fbu = 0;
-	memset((void*)(port->fb), 0, 256);
 
-	// Command table offset: 40K + 8K*portno
-	// Command table size = 256*32 = 8K per port
 	HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER*)(port->clb);
 	for (int i=0; i<32; i++)
 	{
-		cmdheader[i].prdtl = 8;	// 8 prdt entries per command table
-					// 256 bytes per command table, 64+16+48+16*8
-		// Command table offset: 40K + 8K*portno + cmdheader_index*256
-		cmdheader[i].ctba = AHCI_BASE + (40<<10) + (portno<<13) + (i<<8);
+		cmdheader[i].prdtl = AHCI_PRDT_PER_CMD;
+		cmdheader[i].ctba = (uint32_t) (mem + 4096 + (i<<8));
 		cmdheader[i].ctbau = 0;
-		memset((void*)cmdheader[i].ctba, 0, 256);
 	}
+	return true;
+}
 
-	start_cmd(port);	// Start command engine
+// Spin until (*reg & mask) == value, false after timeout_us
+static bool ahci_wait(volatile uint32_t *reg, uint32_t mask, uint32_t value, uint32_t timeout_us)
+{
+	uint64_t deadline = time_now_us() + timeout_us;
+	while ((*reg & mask) != value)
+	{
+		if (time_now_us() > deadline)
+			return false;
+	}
+	return true;
 }
 
 // Start command engine
-void start_cmd(HBA_PORT *port)
+bool start_cmd(HBA_PORT *port)
 {
 	// Wait until CR (bit15) is cleared
-	while (port->cmd & HBA_PxCMD_CR)
-		;
+	if (!ahci_wait(&port->cmd, HBA_PxCMD_CR, 0, AHCI_ENGINE_TIMEOUT_US))
+		return false;
 
 	// Set FRE (bit4) and ST (bit0)
 	port->cmd |= HBA_PxCMD_FRE;
-	port->cmd |= HBA_PxCMD_ST; 
+	port->cmd |= HBA_PxCMD_ST;
+	return true;
 }
 
 // Stop command engine
-void stop_cmd(HBA_PORT *port)
+bool stop_cmd(HBA_PORT *port)
 {
-	// Clear ST (bit0)
+	// Clear ST (bit0), wait for CR (bit15), then the same for FRE (bit4) and FR (bit14)
 	port->cmd &= ~HBA_PxCMD_ST;
-
-	// Clear FRE (bit4)
+	if (!ahci_wait(&port->cmd, HBA_PxCMD_CR, 0, AHCI_ENGINE_TIMEOUT_US))
+		return false;
 	port->cmd &= ~HBA_PxCMD_FRE;
-
-	// Wait until FR (bit14), CR (bit15) are cleared
-	while(1)
-	{
-		if (port->cmd & HBA_PxCMD_FR)
-			continue;
-		if (port->cmd & HBA_PxCMD_CR)
-			continue;
-		break;
-	}
-
+	return ahci_wait(&port->cmd, HBA_PxCMD_FR, 0, AHCI_ENGINE_TIMEOUT_US);
 }
 
 #define ATA_DEV_BUSY 0x80
 #define ATA_DEV_DRQ 0x08
 #define ATA_CMD_READ_DMA_EX 0x25
+#define ATA_CMD_WRITE_DMA_EX 0x35
+#define ATA_CMD_FLUSH_CACHE_EX 0xEA
+#define ATA_CMD_IDENTIFY 0xEC
+#define ATA_CMD_READ_PM 0xE4
+#define ATA_CMD_WRITE_PM 0xE8
+#define ATA_CTL_SRST 0x04
 #define HBA_PxIS_TFES (1 << 30)  // Task File Error Status
 
-bool read(HBA_PORT *port, uint32_t startl, uint32_t starth, uint32_t count, uint16_t *buf)
+#define AHCI_PRDT_MAX_SECTORS	8192		// 4M bytes per PRDT entry
+
+// Commands =========================================================
+
+// Fill in a register FIS for an LBA48 command
+static void ahci_fis(FIS_REG_H2D *fis, uint8_t pmp, uint8_t command, uint64_t lba, uint32_t count)
 {
-	port->is = (uint32_t) -1;		// Clear pending interrupt bits
-	int spin = 0; // Spin lock timeout counter
-	int slot = find_cmdslot(port);
-	if (slot == -1)
-		return false;
+	memset(fis, 0, sizeof(FIS_REG_H2D));
+	fis->fis_type = FIS_TYPE_REG_H2D;
+	fis->c = 1;	// Command
+	fis->pmport = pmp;
+	fis->command = command;
+
+	fis->lba0 = (uint8_t)lba;
+	fis->lba1 = (uint8_t)(lba>>8);
+	fis->lba2 = (uint8_t)(lba>>16);
+	fis->device = 1<<6;	// LBA mode
+
+	fis->lba3 = (uint8_t)(lba>>24);
+	fis->lba4 = (uint8_t)(lba>>32);
+	fis->lba5 = (uint8_t)(lba>>40);
+
+	fis->countl = count & 0xFF;
+	fis->counth = (count >> 8) & 0xFF;
+}
 
+// Write fis and the PRDT for segs into the slot's command table.
+// The command goes to the port multiplier port in the FIS.
+static bool ahci_build(HBA_PORT *port, int slot, const FIS_REG_H2D *fis,
+		const block_seg_t *segs, int nsegs, bool write)
+{
 	HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER*)port->clb;
 	cmdheader += slot;
 	cmdheader->cfl = sizeof(FIS_REG_H2D)/sizeof(uint32_t);	// Command FIS size
-	cmdheader->w = 0;		// Read from device
-	cmdheader->prdtl = (uint16_t)((count-1)>>4) + 1;	// PRDT entries count
+	cmdheader->w = write ? 1 : 0;
+	cmdheader->a = 0;
+	cmdheader->r = 0;
+	cmdheader->c = 0;
+	cmdheader->pmp = fis->pmport;
+	cmdheader->prdbc = 0;
 
 	HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL*)(cmdheader->ctba);
 	memset(cmdtbl, 0, sizeof(HBA_CMD_TBL) +
- 		(cmdheader->prdtl-1)*sizeof(HBA_PRDT_ENTRY));
-    
-    int i=0;
-	// 8K bytes (16 sectors) per PRDT
-	for (i<cmdheader->prdtl-1; i++;)
+		(AHCI_PRDT_PER_CMD-1)*sizeof(HBA_PRDT_ENTRY));
+
+	// One PRDT entry per segment, split where a segment exceeds 4M
+	int prdt = 0;
+	for (int i = 0; i < nsegs; i++)
 	{
-		cmdtbl->prdt_entry[i].dba = (uint32_t) buf;
-		cmdtbl->prdt_entry[i].dbc = 8*1024-1;	// 8K bytes (this value should always be set to 1 less than the actual value)
-		cmdtbl->prdt_entry[i].i = 1;
-		buf += 4*1024;	// 4K words
-		count -= 16;	// 16 sectors
+		uint8_t *buf = (uint8_t*) segs[i].buf;
+		uint32_t left = segs[i].count;
+		while (left > 0)
+		{
+			if (prdt == AHCI_PRDT_PER_CMD)
+			{
+				printk("Too many PRDT entries for one command\n");
+				return false;
+			}
+			uint32_t chunk = left < AHCI_PRDT_MAX_SECTORS ? left : AHCI_PRDT_MAX_SECTORS;
+			cmdtbl->prdt_entry[prdt].dba = (uint32_t) buf;
+			cmdtbl->prdt_entry[prdt].dbc = (chunk<<9)-1;	// 512 bytes per sector, 1 less than the actual value
+			cmdtbl->prdt_entry[prdt].i = 0;
+			buf += chunk<<9;
+			left -= chunk;
+			prdt++;
+		}
 	}
-	// Last entry
-	cmdtbl->prdt_entry[i].dba = (uint32_t) buf;
-	cmdtbl->prdt_entry[i].dbc = (count<<9)-1;	// 512 bytes per sector
-	cmdtbl->prdt_entry[i].i = 1;
+	if (prdt > 0)
+		cmdtbl->prdt_entry[prdt-1].i = 1;
+	cmdheader->prdtl = (uint16_t) prdt;
 
-	// Setup command
-	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&cmdtbl->cfis);
-
-	cmdfis->fis_type = FIS_TYPE_REG_H2D;
-	cmdfis->c = 1;	// Command
-	cmdfis->command = ATA_CMD_READ_DMA_EX;
-
-	cmdfis->lba0 = (uint8_t)startl;
-	cmdfis->lba1 = (uint8_t)(startl>>8);
-	cmdfis->lba2 = (uint8_t)(startl>>16);
-	cmdfis->device = 1<<6;	// LBA mode
-
-	cmdfis->lba3 = (uint8_t)(startl>>24);
-	cmdfis->lba4 = (uint8_t)starth;
-	cmdfis->lba5 = (uint8_t)(starth>>8);
+	memcpy(cmdtbl->cfis, fis, sizeof(FIS_REG_H2D));
+	return true;
+}
 
-	cmdfis->countl = count & 0xFF;
-	cmdfis->counth = (count >> 8) & 0xFF;
+// Stop and restart the command engine after an error or a timeout, which
+// clears PxCI and lets the port take commands again
+static void ahci_port_restart(HBA_PORT *port)
+{
+	stop_cmd(port);
+	port->serr = (uint32_t) -1;
+	port->is = (uint32_t) -1;
+	start_cmd(port);
+}
 
-	// The below loop waits until the port is no longer busy before issuing a new command
-	while ((port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < 1000000)
-	{
-		spin++;
-	}
-	if (spin == 1000000)
-	{
-		printk("Port is hung\n");
-		return false;
-	}
+// Issue a built command and spin until it completes
+static bool ahci_run_slot(HBA_PORT *port, int slot)
+{
+	uint64_t deadline = time_now_us() + AHCI_CMD_TIMEOUT_US;
 
 	port->ci = 1<<slot;	// Issue command
-
-	// Wait for completion
-	while (1)
+	while (port->ci & (1<<slot))
 	{
-		// In some longer duration reads, it may be helpful to spin on the DPS bit 
-		// in the PxIS port field as well (1 << 5)
-		if ((port->ci & (1<<slot)) == 0) 
-			break;
 		if (port->is & HBA_PxIS_TFES)	// Task file error
 		{
-			printk("Read disk error\n");
+			ahci_port_restart(port);
+			return false;
+		}
+		if (time_now_us() > deadline)
+		{
+			printk("AHCI: command timed out\n");
+			ahci_port_restart(port);
 			return false;
 		}
 	}
+	return !(port->is & HBA_PxIS_TFES);
+}
 
-	// Check again
-	if (port->is & HBA_PxIS_TFES)
+// Issue one command and spin until it completes. Only used while nothing
+// else runs on the port: during bring-up, and by read() and write().
+static bool ahci_issue(HBA_PORT *port, const FIS_REG_H2D *fis,
+		const block_seg_t *segs, int nsegs, bool write)
+{
+	port->is = (uint32_t) -1;		// Clear pending interrupt bits
+	int slot = find_cmdslot(port);
+	if (slot == -1)
+		return false;
+	if (!ahci_build(port, slot, fis, segs, nsegs, write))
+		return false;
+
+	// Wait until the port is no longer busy before issuing a new command
+	if (!ahci_wait(&port->tfd, ATA_DEV_BUSY | ATA_DEV_DRQ, 0, AHCI_CMD_TIMEOUT_US))
 	{
-		printk("Read disk error\n");
+		printk("Port is hung\n");
 		return false;
 	}
 
+	if (!ahci_run_slot(port, slot))
+	{
+		printk(write ? "Write disk error\n" : "Read disk error\n");
+		return false;
+	}
 	return true;
 }
 
+bool read(HBA_PORT *port, uint32_t startl, uint32_t starth, uint32_t count, uint16_t *buf)
+{
+	FIS_REG_H2D fis;
+	block_seg_t seg = { buf, count };
+	ahci_fis(&fis, 0, ATA_CMD_READ_DMA_EX, ((uint64_t)starth << 32) | startl, count);
+	return ahci_issue(port, &fis, &seg, 1, false);
+}
+
+bool write(HBA_PORT *port, uint32_t startl, uint32_t starth, uint32_t count, const uint16_t *buf)
+{
+	FIS_REG_H2D fis;
+	block_seg_t seg = { (void*) buf, count };
+	ahci_fis(&fis, 0, ATA_CMD_WRITE_DMA_EX, ((uint64_t)starth << 32) | startl, count);
+	return ahci_issue(port, &fis, &seg, 1, true);
+}
+
+// Read the 512 byte IDENTIFY DEVICE block of the drive at pmp
+bool ahci_identify(HBA_PORT *port, int pmp, uint16_t *buf)
+{
+	FIS_REG_H2D fis;
+	block_seg_t seg = { buf, 1 };
+	ahci_fis(&fis, pmp, ATA_CMD_IDENTIFY, 0, 0);
+	fis.device = 0;
+	return ahci_issue(port, &fis, &seg, 1, false);
+}
+
 // Find a free command list slot
 int find_cmdslot(HBA_PORT *port)
 {
 	// If not set in SACT and CI, the slot is free
 	uint32_t slots = (port->sact | port->ci);
-	for (int i=0; i<slots; i++)
+	for (int i=0; i<CMD_SLOTS; i++)
 	{
 		if ((slots&1) == 0)
 			return i;
@@ -263,4 +304,679 @@ int find_cmdslot(HBA_PORT *port)
 	}
 	printk("Cannot find free command list entry\n");
 	return -1;
-}
\ No newline at end of file
+}
+
+// Port multipliers =================================================
+//
+// A port multiplier answers at PMP 15 with its own registers: GSCR for
+// the multiplier and one PSCR set (SStatus, SError, SControl) per fan-out
+// port. Each fan-out port gets the same treatment as a host port: COMRESET,
+// wait for the link, soft reset and read the signature.
+
+// Soft reset the device at pmp: two control FISes with SRST set, then clear
+static bool ahci_softreset(HBA_PORT *port, int pmp)
+{
+	FIS_REG_H2D fis;
+	HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER*)port->clb;
+
+	port->is = (uint32_t) -1;
+	int slot = find_cmdslot(port);
+	if (slot == -1)
+		return false;
+
+	memset(&fis, 0, sizeof(FIS_REG_H2D));
+	fis.fis_type = FIS_TYPE_REG_H2D;
+	fis.pmport = pmp;
+	fis.control = ATA_CTL_SRST;
+	ahci_build(port, slot, &fis, NULL, 0, false);
+	cmdheader[slot].r = 1;	// Reset
+	cmdheader[slot].c = 1;	// Clear busy once the FIS is out, the device does not answer it
+	if (!ahci_run_slot(port, slot))
+		return false;
+
+	uint64_t start = time_now_us();
+	while (time_now_us() < start + 5)	// SRST is held for at least 5us
+		;
+
+	fis.control = 0;
+	ahci_build(port, slot, &fis, NULL, 0, false);
+	return ahci_run_slot(port, slot);
+}
+
+// Signature from the last register FIS the port received
+static uint32_t ahci_rfis_sig(HBA_PORT *port)
+{
+	HBA_FIS *rfis = (HBA_FIS*) port->fb;
+	return rfis->rfis.countl | (rfis->rfis.lba0 << 8) |
+		(rfis->rfis.lba1 << 16) | ((uint32_t)rfis->rfis.lba2 << 24);
+}
+
+static bool ahci_pm_read(HBA_PORT *port, int pmport, int reg, uint32_t *value)
+{
+	FIS_REG_H2D fis;
+	ahci_fis(&fis, AHCI_PM_CTRL_PORT, ATA_CMD_READ_PM, 0, 0);
+	fis.featurel = reg;
+	fis.featureh = reg >> 8;
+	fis.device = pmport;
+	if (!ahci_issue(port, &fis, NULL, 0, false))
+		return false;
+	*value = ahci_rfis_sig(port);	// Same layout: count, then LBA low, mid and high
+	return true;
+}
+
+static bool ahci_pm_write(HBA_PORT *port, int pmport, int reg, uint32_t value)
+{
+	FIS_REG_H2D fis;
+	ahci_fis(&fis, AHCI_PM_CTRL_PORT, ATA_CMD_WRITE_PM, (uint64_t)(value >> 8), value & 0xFF);
+	fis.featurel = reg;
+	fis.featureh = reg >> 8;
+	fis.device = pmport;
+	return ahci_issue(port, &fis, NULL, 0, false);
+}
+
+// Whether a port multiplier answers on the port. Leaves PxCMD.PMA set and
+// the port running if it does, and the port stopped if not.
+static bool ahci_pm_detect(HBA_PORT *port)
+{
+	port->cmd |= HBA_PxCMD_PMA;
+	if (start_cmd(port) && ahci_softreset(port, AHCI_PM_CTRL_PORT) &&
+		ahci_wait(&port->tfd, ATA_DEV_BUSY | ATA_DEV_DRQ, 0, AHCI_CMD_TIMEOUT_US) &&
+		ahci_rfis_sig(port) == SATA_SIG_PM)
+		return true;
+
+	stop_cmd(port);
+	port->cmd &= ~HBA_PxCMD_PMA;
+	return false;
+}
+
+// Reset every fan-out port at once and wait for their links and drives.
+// Returns a mask of the fan-out ports with an ATA drive ready behind them.
+static uint32_t ahci_pm_enumerate(HBA_PORT *port, int *fanout)
+{
+	uint32_t value = 0;
+	if (!ahci_pm_read(port, AHCI_PM_CTRL_PORT, PM_GSCR_INFO, &value))
+		return 0;
+	int ports = value & 0xF;
+	if (ports > AHCI_PM_CTRL_PORT)
+		ports = AHCI_PM_CTRL_PORT;
+	*fanout = ports;
+
+	for (int i = 0; i < ports; i++)
+		ahci_pm_write(port, i, PM_PSCR_SCONTROL, HBA_SCTL_IPM_NONE | HBA_SCTL_DET_INIT);
+	uint64_t start = time_now_us();
+	while (time_now_us() < start + AHCI_COMRESET_US)
+		;
+	for (int i = 0; i < ports; i++)
+		ahci_pm_write(port, i, PM_PSCR_SCONTROL, HBA_SCTL_IPM_NONE);
+	start = time_now_us();
+
+	uint32_t waiting = (1u << ports) - 1;
+	uint32_t linked = 0;
+	while (waiting)
+	{
+		uint64_t elapsed = time_now_us() - start;
+		for (int i = 0; i < ports; i++)
+		{
+			if (!(waiting & (1u << i)))
+				continue;
+			uint32_t det = 0;
+			if (!ahci_pm_read(port, i, PM_PSCR_SSTATUS, &value))
+				waiting &= ~(1u << i);
+			else if ((det = value & 0xF) == HBA_PORT_DET_PRESENT)
+			{
+				ahci_pm_write(port, i, PM_PSCR_SERROR, (uint32_t) -1);
+				linked |= 1u << i;
+				waiting &= ~(1u << i);
+			}
+			else if ((det == 0 && elapsed > AHCI_PRESENCE_US) || elapsed > AHCI_LINK_TIMEOUT_US)
+				waiting &= ~(1u << i);
+		}
+	}
+
+	// Soft reset each drive and read its signature once it is ready
+	uint32_t ready = 0;
+	for (int i = 0; i < ports; i++)
+	{
+		if (!(linked & (1u << i)))
+			continue;
+		if (!ahci_softreset(port, i) ||
+			!ahci_wait(&port->tfd, ATA_DEV_BUSY | ATA_DEV_DRQ, 0, AHCI_READY_TIMEOUT_US))
+		{
+			printk("AHCI: drive behind port multiplier port %d never became ready\n", i);
+			continue;
+		}
+		if (ahci_rfis_sig(port) == SATA_SIG_ATA)
+			ready |= 1u << i;
+		else
+			printk("AHCI: unsupported device behind port multiplier port %d\n", i);
+	}
+	port->serr = (uint32_t) -1;	// The multiplier reports its link changes here
+	return ready;
+}
+
+// Turn on FIS-based switching if both the HBA and the port support it.
+// PxFBS.EN may only change while the command engine is stopped.
+static bool ahci_enable_fbs(ahci_hba_t *hba, HBA_PORT *port)
+{
+	if (!(hba->cap & HBA_CAP_FBSS) || !(port->cmd & HBA_PxCMD_FBSCP))
+		return false;
+	if (!stop_cmd(port))
+		return false;
+	port->fbs |= HBA_PxFBS_EN;
+	start_cmd(port);
+	return (port->fbs & HBA_PxFBS_EN) != 0;
+}
+
+// Block device glue ================================================
+//
+// Every drive owns one command slot of its port (non-queued commands, one
+// at a time per drive). Commands are built into the slot by queue() and
+// issued by commit(); poll() reaps the whole port. Behind a port
+// multiplier with command-based switching only one drive may have a
+// command outstanding, so the others wait their turn in round-robin
+// order. With FIS-based switching every drive's command goes out at once.
+
+static ahci_port_t ahci_ports[AHCI_MAX_PORTS];
+static int ahci_port_count = 0;
+static ahci_disk_t ahci_disks[AHCI_MAX_DISKS];
+static int ahci_disk_count = 0;
+
+// Issue whatever the switching mode allows
+static void ahci_port_kick(ahci_port_t *ap)
+{
+	HBA_PORT *port = ap->port;
+
+	if (!ap->pm || ap->fbs)
+	{
+		for (int slot = 0; slot < ap->disks; slot++)
+		{
+			if (!(ap->ready & (1u << slot)))
+				continue;
+			// The HBA learns the target device from DEV without fetching the header
+			if (ap->fbs)
+				port->fbs = (port->fbs & ~(HBA_PxFBS_DEV_MASK | HBA_PxFBS_DEC)) |
+					(ap->owner[slot]->pmp << HBA_PxFBS_DEV_SHIFT);
+			port->ci = 1u << slot;
+			ap->issued |= 1u << slot;
+		}
+		ap->ready = 0;
+		return;
+	}
+
+	if (ap->issued || !ap->ready)
+		return;
+	for (int i = 0; i < ap->disks; i++)
+	{
+		int slot = (ap->next + i) % ap->disks;
+		if (ap->ready & (1u << slot))
+		{
+			port->ci = 1u << slot;
+			ap->issued = 1u << slot;
+			ap->ready &= ~(1u << slot);
+			ap->next = slot + 1;
+			return;
+		}
+	}
+}
+
+static void ahci_slot_done(ahci_port_t *ap, int slot, bool ok)
+{
+	ahci_disk_t *disk = ap->owner[slot];
+	io_request_t *rq = ap->req[slot];
+
+	ap->issued &= ~(1u << slot);
+	ap->req[slot] = NULL;
+	if (rq)
+		block_complete(&disk->blk, rq, ok);
+	else
+		disk->sync_status = ok ? IO_DONE : IO_ERROR;
+}
+
+// Reap finished commands of every drive on the port, returns how many belonged to disk
+static int ahci_port_poll(ahci_port_t *ap, ahci_disk_t *disk)
+{
+	HBA_PORT *port = ap->port;
+	int found = 0;
+
+	if (port->is & HBA_PxIS_TFES)
+	{
+		if (ap->fbs && (port->fbs & HBA_PxFBS_SDE))
+		{
+			// Only the drive in DWE failed, the others keep running
+			int pmp = (port->fbs >> HBA_PxFBS_DWE_SHIFT) & 0xF;
+			for (int slot = 0; slot < ap->disks; slot++)
+			{
+				if ((ap->issued & (1u << slot)) && ap->owner[slot]->pmp == pmp)
+				{
+					found += ap->owner[slot] == disk;
+					ahci_slot_done(ap, slot, false);
+				}
+			}
+			port->fbs |= HBA_PxFBS_DEC;
+			ahci_wait(&port->fbs, HBA_PxFBS_DEC, 0, AHCI_ENGINE_TIMEOUT_US);
+			port->is = HBA_PxIS_TFES;
+		}
+		else
+		{
+			for (int slot = 0; slot < ap->disks; slot++)
+			{
+				if (ap->issued & (1u << slot))
+				{
+					found += ap->owner[slot] == disk;
+					ahci_slot_done(ap, slot, false);
+				}
+			}
+			ahci_port_restart(port);
+		}
+	}
+
+	uint32_t done = ap->issued & ~port->ci;
+	for (int slot = 0; slot < ap->disks; slot++)
+	{
+		if (done & (1u << slot))
+		{
+			found += ap->owner[slot] == disk;
+			ahci_slot_done(ap, slot, true);
+		}
+	}
+	ahci_port_kick(ap);
+	return found;
+}
+
+static bool ahci_blk_queue(block_device_t *dev, io_request_t *rq, const block_seg_t *segs, int nsegs)
+{
+	ahci_disk_t *disk = (ahci_disk_t*) dev->driver_data;
+	ahci_port_t *ap = disk->ap;
+	FIS_REG_H2D fis;
+
+	ahci_fis(&fis, disk->pmp, rq->write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX,
+		rq->grp_lba, rq->grp_count);
+	if (!ahci_build(ap->port, disk->slot, &fis, segs, nsegs, rq->write))
+		return false;
+	ap->req[disk->slot] = rq;
+	ap->ready |= 1u << disk->slot;
+	return true;
+}
+
+static void ahci_blk_commit(block_device_t *dev)
+{
+	ahci_port_kick(((ahci_disk_t*) dev->driver_data)->ap);
+}
+
+static int ahci_blk_poll(block_device_t *dev)
+{
+	ahci_disk_t *disk = (ahci_disk_t*) dev->driver_data;
+	return ahci_port_poll(disk->ap, disk);
+}
+
+// The block layer drains the drive before a flush, so its slot is free
+static bool ahci_blk_flush(block_device_t *dev)
+{
+	ahci_disk_t *disk = (ahci_disk_t*) dev->driver_data;
+	ahci_port_t *ap = disk->ap;
+	FIS_REG_H2D fis;
+
+	ahci_fis(&fis, disk->pmp, ATA_CMD_FLUSH_CACHE_EX, 0, 0);
+	if (!ahci_build(ap->port, disk->slot, &fis, NULL, 0, false))
+		return false;
+	disk->sync_status = IO_PENDING;
+	ap->ready |= 1u << disk->slot;
+	ahci_port_kick(ap);
+	while (disk->sync_status == IO_PENDING)
+		ahci_port_poll(ap, disk);
+	return disk->sync_status == IO_DONE;
+}
+
+static ahci_port_t *ahci_add_port(ahci_hba_t *hba, HBA_PORT *port, bool pm)
+{
+	if (ahci_port_count >= AHCI_MAX_PORTS)
+		return NULL;
+	ahci_port_t *ap = &ahci_ports[ahci_port_count++];
+	memset(ap, 0, sizeof(ahci_port_t));
+	ap->port = port;
+	ap->pm = pm;
+	ap->slots = hba->slots;
+	return ap;
+}
+
+// Register the drive at pmp (0 when directly attached) as block device "sdN"
+block_device_t *ahci_register_port(ahci_port_t *ap, int pmp)
+{
+	static uint16_t identify[256];
+
+	if (ahci_disk_count >= AHCI_MAX_DISKS || ap->disks >= ap->slots)
+		return NULL;
+	if (!ahci_identify(ap->port, pmp, identify))
+	{
+		printk("IDENTIFY failed, port not registered\n");
+		return NULL;
+	}
+
+	ahci_disk_t *disk = &ahci_disks[ahci_disk_count];
+	memset(disk, 0, sizeof(ahci_disk_t));
+	disk->ap = ap;
+	disk->pmp = pmp;
+	disk->slot = ap->disks;
+
+	// Words 100-103 hold the LBA48 sector count when bit 10 of word 83 is set
+	if (identify[83] & (1<<10))
+		disk->blk.sector_count = (uint64_t)identify[100] | ((uint64_t)identify[101] << 16) |
+			((uint64_t)identify[102] << 32) | ((uint64_t)identify[103] << 48);
+	else
+		disk->blk.sector_count = (uint32_t)identify[60] | ((uint32_t)identify[61] << 16);
+
+	block_make_name(disk->blk.name, "sd", ahci_disk_count);
+	disk->blk.sector_size = 512;
+	disk->blk.max_sectors = AHCI_MAX_SECTORS;
+	disk->blk.max_segs = AHCI_PRDT_PER_CMD;
+	disk->blk.queue = ahci_blk_queue;
+	disk->blk.commit = ahci_blk_commit;
+	disk->blk.poll = ahci_blk_poll;
+	disk->blk.queue_depth = 1;
+	disk->blk.flush = ahci_blk_flush;
+	disk->blk.driver_data = disk;
+
+	if (!block_register(&disk->blk))
+		return NULL;
+	ap->owner[disk->slot] = disk;
+	ap->disks++;
+	ahci_disk_count++;
+
+	if (ap->pm)
+		printk("%s: %d MiB, port multiplier port %d\n", disk->blk.name, (int)(disk->blk.sector_count >> 11), pmp);
+	else
+		printk("%s: %d MiB\n", disk->blk.name, (int)(disk->blk.sector_count >> 11));
+	return &disk->blk;
+}
+
+// Controller bring-up ==============================================
+//
+// Every port of a controller goes through the same steps together: stop,
+// rebase, spin up, COMRESET, wait for the link and wait for the drive. The
+// waits poll all ports against one deadline, so a controller costs one
+// link timeout instead of one per port, and empty ports are dropped as
+// soon as they show no presence.
+//
+// ahci_init() only gets as far as the COMRESET. The waits after it are
+// steps of ahci_init_poll(), which returns at once while a link or a drive
+// is not there yet, so the rest of the boot goes on meanwhile.
+
+static ahci_hba_t ahci_hbas[AHCI_MAX_CONTROLLERS];
+static int ahci_hba_count = 0;
+
+// Take the HBA from the BIOS if it supports the handoff
+static void ahci_bios_handoff(HBA_MEM *abar)
+{
+	if (!(abar->cap2 & HBA_CAP2_BOH))
+		return;
+
+	abar->bohc |= HBA_BOHC_OOS;
+	// The BIOS gets 25ms to start cleaning up, then 2s to finish if it is busy
+	if (!ahci_wait(&abar->bohc, HBA_BOHC_BOS, 0, 25000) ||
+		((abar->bohc & HBA_BOHC_BB) && !ahci_wait(&abar->bohc, HBA_BOHC_BB, 0, 2000000)))
+		printk("AHCI: BIOS did not release the controller, taking it anyway\n");
+}
+
+static bool ahci_reset(HBA_MEM *abar)
+{
+	abar->ghc |= HBA_GHC_AE;
+	abar->ghc |= HBA_GHC_HR;
+	if (!ahci_wait(&abar->ghc, HBA_GHC_HR, 0, AHCI_RESET_TIMEOUT_US))
+	{
+		printk("AHCI: HBA reset timed out\n");
+		return false;
+	}
+	// The reset clears AE on controllers that also have a legacy mode
+	abar->ghc |= HBA_GHC_AE;
+	abar->ghc &= ~HBA_GHC_IE;	// Completions are polled
+	abar->is = (uint32_t) -1;
+	return true;
+}
+
+// Rebase and spin up every implemented port, then start a COMRESET on all of them
+static void ahci_start_ports(ahci_hba_t *hba)
+{
+	HBA_MEM *abar = hba->abar;
+	uint32_t ports = 0;
+
+	for (int i = 0; i < 32; i++)
+	{
+		if (!(hba->pi & (1u << i)))
+			continue;
+		HBA_PORT *port = &abar->ports[i];
+		if (!stop_cmd(port))
+		{
+			printk("AHCI: port %d does not stop, skipped\n", i);
+			continue;
+		}
+		if (!port_rebase(port))
+			break;
+		port->serr = (uint32_t) -1;
+		port->is = (uint32_t) -1;
+		port->ie = 0;
+		// FIS receive must be on for the signature FIS the reset produces
+		port->cmd |= HBA_PxCMD_FRE | HBA_PxCMD_POD | HBA_PxCMD_SUD;
+		ports |= 1u << i;
+	}
+
+	// COMRESET on all ports, held for at least 1ms; partial and slumber stay off
+	for (int i = 0; i < 32; i++)
+		if (ports & (1u << i))
+			abar->ports[i].sctl = (abar->ports[i].sctl & ~0xFFF) | HBA_SCTL_IPM_NONE | HBA_SCTL_DET_INIT;
+	hba->ports = ports;
+	hba->state = AHCI_HBA_COMRESET;
+	hba->phase_start = time_now_us();
+}
+
+// Link up: DET becomes 3. Ports that show no presence at all are empty.
+static void ahci_poll_link(ahci_hba_t *hba)
+{
+	HBA_MEM *abar = hba->abar;
+	uint64_t elapsed = time_now_us() - hba->phase_start;
+
+	for (int i = 0; i < 32; i++)
+	{
+		if (!(hba->waiting & (1u << i)))
+			continue;
+		uint32_t det = abar->ports[i].ssts & 0xF;
+		if (det == HBA_PORT_DET_PRESENT)
+		{
+			abar->ports[i].serr = (uint32_t) -1;	// Link bring-up leaves errors behind
+			hba->linked |= 1u << i;
+			hba->waiting &= ~(1u << i);
+		}
+		else if ((det == 0 && elapsed > AHCI_PRESENCE_US) || elapsed > AHCI_LINK_TIMEOUT_US)
+		{
+			hba->waiting &= ~(1u << i);
+		}
+	}
+}
+
+// Drive ready: BSY and DRQ clear once the signature FIS has arrived
+static void ahci_poll_ready(ahci_hba_t *hba)
+{
+	HBA_MEM *abar = hba->abar;
+	bool expired = time_now_us() - hba->phase_start > AHCI_READY_TIMEOUT_US;
+
+	for (int i = 0; i < 32; i++)
+	{
+		if (!(hba->waiting & (1u << i)))
+			continue;
+		if (!(abar->ports[i].tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)))
+		{
+			hba->ready |= 1u << i;
+			hba->waiting &= ~(1u << i);
+		}
+		else if (expired)
+		{
+			printk("AHCI: drive on port %d never became ready\n", i);
+			hba->waiting &= ~(1u << i);
+		}
+	}
+}
+
+// Register the drives on the ports that came up
+static void ahci_attach_ports(ahci_hba_t *hba)
+{
+	uint32_t vs = hba->abar->vs;
+	int ports = 0, found = 0;
+	for (int i = 0; i < 32; i++)
+	{
+		if (hba->pi & (1u << i))
+			ports++;
+		if (!(hba->ready & (1u << i)))
+			continue;
+		HBA_PORT *port = &hba->abar->ports[i];
+		int type = check_type(port);
+		// A multiplier only shows its own signature to a soft reset of PMP 15
+		if ((hba->cap & HBA_CAP_SPM) && (type == AHCI_DEV_SATA || type == AHCI_DEV_PM))
+			type = ahci_pm_detect(port) ? AHCI_DEV_PM : AHCI_DEV_SATA;
+		else if (type == AHCI_DEV_PM)
+			type = AHCI_DEV_PM_NOSPM;
+
+		ahci_port_t *ap = NULL;
+		switch (type)
+		{
+		case AHCI_DEV_SATA:
+			if (start_cmd(port) && (ap = ahci_add_port(hba, port, false)) && ahci_register_port(ap, 0))
+				found++;
+			break;
+		case AHCI_DEV_SATAPI:
+			printk("AHCI: SATAPI drive on port %d, not supported\n", i);
+			break;
+		case AHCI_DEV_SEMB:
+			printk("AHCI: enclosure bridge on port %d, not supported\n", i);
+			break;
+		case AHCI_DEV_PM:
+		{
+			int fanout = 0;
+			uint32_t drives = ahci_pm_enumerate(port, &fanout);
+			if ((ap = ahci_add_port(hba, port, true)) == NULL)
+				break;
+			for (int pmp = 0; pmp < fanout; pmp++)
+				if ((drives & (1u << pmp)) && ahci_register_port(ap, pmp))
+					found++;
+			// Identify ran with command-based switching, I/O gets FIS-based if it can
+			ap->fbs = ahci_enable_fbs(hba, port);
+			printk("AHCI: port multiplier on port %d, %d ports, %s switching\n",
+				i, fanout, ap->fbs ? "FIS-based" : "command-based");
+			break;
+		}
+		case AHCI_DEV_PM_NOSPM:
+			printk("AHCI: port multiplier on port %d, but the HBA does not support one\n", i);
+			break;
+		case AHCI_DEV_INACTIVE:
+			printk("AHCI: device on port %d is linked but not active (power state %d)\n",
+				i, (int)((port->ssts >> 8) & 0x0F));
+			break;
+		case AHCI_DEV_NULL:
+			printk("AHCI: port %d lost its link\n", i);
+			break;
+		}
+	}
+
+	printk("AHCI %d.%d: %d ports, %d slots, %d drives, up in %d ms\n",
+		(int)(vs >> 16), (int)((vs >> 8) & 0xFF), ports, hba->slots,
+		found, (int)((time_now_us() - hba->probe_start) / 1000));
+}
+
+// One step of bringing up a controller, returns true once it is up
+static bool ahci_hba_poll(ahci_hba_t *hba)
+{
+	switch (hba->state)
+	{
+	case AHCI_HBA_COMRESET:
+		if (time_now_us() < hba->phase_start + AHCI_COMRESET_US)
+			return false;
+		for (int i = 0; i < 32; i++)
+			if (hba->ports & (1u << i))
+				hba->abar->ports[i].sctl &= ~0xF;
+		hba->waiting = hba->ports;
+		hba->state = AHCI_HBA_LINK;
+		hba->phase_start = time_now_us();
+		return false;
+	case AHCI_HBA_LINK:
+		ahci_poll_link(hba);
+		if (hba->waiting)
+			return false;
+		hba->waiting = hba->linked;
+		hba->state = AHCI_HBA_READY;
+		hba->phase_start = time_now_us();
+		return false;
+	case AHCI_HBA_READY:
+		ahci_poll_ready(hba);
+		if (hba->waiting)
+			return false;
+		ahci_attach_ports(hba);
+		hba->state = AHCI_HBA_UP;
+		return true;
+	default:
+		return true;
+	}
+}
+
+static bool ahci_probe(struct pci_device *pdev)
+{
+	ahci_hba_t *hba = &ahci_hbas[ahci_hba_count];
+	memset(hba, 0, sizeof(ahci_hba_t));
+
+	// ABAR is BAR5, always 32-bit memory
+	uint32_t bar5 = pci_read_config_space(pdev->bus, pdev->device, pdev->function, 0x24);
+	if (bar5 & 1 || (bar5 & ~0xF) == 0)
+	{
+		printk("AHCI: controller without a memory BAR5\n");
+		return false;
+	}
+	hba->abar = (HBA_MEM*) (bar5 & ~0xF);
+
+	// Memory decoding and bus mastering on, legacy INTx off since completions are polled
+	uint32_t command = pci_read_config_space(pdev->bus, pdev->device, pdev->function, 0x04) & 0xFFFF;
+	pci_write_config_space(pdev->bus, pdev->device, pdev->function, 0x04,
+		command | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+
+	hba->probe_start = time_now_us();
+	ahci_bios_handoff(hba->abar);
+	if (!ahci_reset(hba->abar))
+		return false;
+
+	hba->cap = hba->abar->cap;
+	hba->pi = hba->abar->pi;
+	hba->slots = ((hba->cap >> 8) & 0x1F) + 1;
+	ahci_start_ports(hba);
+	return true;
+}
+
+static bool ahci_pci_probe(struct pci_device *dev, const struct pci_device_id *id)
+{
+	(void) id;
+	if (ahci_hba_count >= AHCI_MAX_CONTROLLERS || !ahci_probe(dev))
+		return false;
+	ahci_hba_count++;
+	return true;
+}
+
+static const struct pci_device_id ahci_pci_ids[] =
+{
+	{ PCI_ANY_ID, PCI_ANY_ID, AHCI_PCI_CLASS << 16 | AHCI_PCI_SUBCLASS << 8 | AHCI_PCI_PROG_IF, PCI_CLASS_MASK_PROG_IF },
+	{ 0 }
+};
+
+static struct pci_driver ahci_pci_driver = { "ahci", ahci_pci_ids, ahci_pci_probe };
+
+// Claim every AHCI controller on the PCI bus and start bringing it up,
+// returns how many were found. Drives appear as ahci_init_poll() gets there.
+int ahci_init()
+{
+	pci_register_driver(&ahci_pci_driver);
+	return ahci_hba_count;
+}
+
+// Move the bring-up of every controller along, returns true once all are up
+bool ahci_init_poll()
+{
+	bool up = true;
+	for (int i = 0; i < ahci_hba_count; i++)
+		if (!ahci_hba_poll(&ahci_hbas[i]))
+			up = false;
+	return up;
+}
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include "block.h"
 
 typedef struct {
     uint8_t  type;         // FIS type (Set Device Bit)
@@ -314,29 +315,136 @@ typedef struct tagHBA_CMD_TBL
 #define AHCI_DEV_SEMB     2
 #define AHCI_DEV_PM       3
 #define AHCI_DEV_SATAPI   4
+#define AHCI_DEV_INACTIVE 5     // Linked, but the interface is in a power saving state
+#define AHCI_DEV_PM_NOSPM 6     // Port multiplier signature on an HBA without SPM
 
 #define HBA_PORT_IPM_ACTIVE  1
 #define HBA_PORT_DET_PRESENT 3
 
-#define AHCI_BASE          0x400000   // 4M
 #define CMD_SLOTS          32        // Number of command slots
+#define AHCI_MAX_SECTORS   2048      // Largest command issued through the block layer (1M)
+#define AHCI_PRDT_PER_CMD  8         // port_rebase() sizes command tables for 8 entries
+#define AHCI_MAX_CONTROLLERS 4
+#define AHCI_MAX_PORTS     32        // Ports with drives, over all controllers
+#define AHCI_MAX_DISKS     32
+#define AHCI_PM_CTRL_PORT  15        // PMP of a port multiplier's own control port
+
+// PCI class of an AHCI controller: mass storage, SATA, AHCI 1.0
+#define AHCI_PCI_CLASS     0x01
+#define AHCI_PCI_SUBCLASS  0x06
+#define AHCI_PCI_PROG_IF   0x01
+
+// Bring-up timeouts, microseconds
+#define AHCI_RESET_TIMEOUT_US   1000000
+#define AHCI_ENGINE_TIMEOUT_US  500000
+#define AHCI_COMRESET_US        1000      // COMRESET is held at least this long
+#define AHCI_PRESENCE_US        20000     // No device detected by now means an empty port
+#define AHCI_LINK_TIMEOUT_US    1000000
+#define AHCI_READY_TIMEOUT_US   10000000  // Spin-up of a rotating drive
+#define AHCI_CMD_TIMEOUT_US     5000000   // Synchronous commands during bring-up
+
+// Generic host control
+#define HBA_CAP_FBSS       (1u << 16) // FIS-based switching
+#define HBA_CAP_SPM        (1u << 17) // Port multipliers
+#define HBA_CAP_SSS        (1u << 27) // Staggered spin-up
+#define HBA_GHC_HR         (1u << 0)  // HBA reset
+#define HBA_GHC_IE         (1u << 1)  // Interrupt enable
+#define HBA_GHC_AE         (1u << 31) // AHCI enable
+#define HBA_CAP2_BOH       (1u << 0)  // BIOS/OS handoff supported
+#define HBA_BOHC_BOS       (1u << 0)  // BIOS owned semaphore
+#define HBA_BOHC_OOS       (1u << 1)  // OS owned semaphore
+#define HBA_BOHC_BB        (1u << 4)  // BIOS busy
+
+// Port SATA control
+#define HBA_SCTL_DET_INIT  0x001      // Perform interface initialization (COMRESET)
+#define HBA_SCTL_IPM_NONE  0x300      // No transitions to partial or slumber
+
+// Port FIS-based switching control
+#define HBA_PxFBS_EN        (1u << 0)
+#define HBA_PxFBS_DEC       (1u << 1)  // Device error clear
+#define HBA_PxFBS_SDE       (1u << 2)  // Single device error, DWE names the device
+#define HBA_PxFBS_DEV_SHIFT 8          // Device the next PxCI bit is for
+#define HBA_PxFBS_DEV_MASK  (0xFu << 8)
+#define HBA_PxFBS_DWE_SHIFT 16
+
+// Port multiplier registers, read and written through the control port
+#define PM_GSCR_INFO        2          // Bits 3:0 are the number of fan-out ports
+#define PM_PSCR_SSTATUS     0
+#define PM_PSCR_SERROR      1
+#define PM_PSCR_SCONTROL    2
 
 // Command register definitions
 #define HBA_PxCMD_ST       0x0001
+#define HBA_PxCMD_SUD      0x0002
+#define HBA_PxCMD_POD      0x0004
 #define HBA_PxCMD_FRE      0x0010
 #define HBA_PxCMD_FR       0x4000
 #define HBA_PxCMD_CR       0x8000
+#define HBA_PxCMD_PMA      0x20000    // Port multiplier attached
+#define HBA_PxCMD_FBSCP    0x400000   // Port supports FIS-based switching
 
 #define ATA_DEV_BUSY       0x80
 #define ATA_DEV_DRQ        0x08
 
+// Controller bring-up states
+#define AHCI_HBA_COMRESET  0
+#define AHCI_HBA_LINK      1
+#define AHCI_HBA_READY     2
+#define AHCI_HBA_UP        3
+
+// One AHCI controller
+typedef struct
+{
+	HBA_MEM *abar;
+	uint32_t cap;
+	uint32_t pi;		// Implemented ports
+	int slots;		// Command slots per port
+	int state;		// AHCI_HBA_*
+	uint32_t ports;		// Ports being brought up
+	uint32_t waiting;	// Ports the current state still waits for
+	uint32_t linked;
+	uint32_t ready;
+	uint64_t phase_start;
+	uint64_t probe_start;
+} ahci_hba_t;
+
+struct ahci_disk;
+
+// A port with drives on it, directly or behind a port multiplier
+typedef struct
+{
+	HBA_PORT *port;
+	bool pm;		// Port multiplier attached
+	bool fbs;		// FIS-based switching enabled
+	int slots;		// Command slots of the HBA
+	int disks;		// Drive n owns command slot n
+	uint32_t ready;		// Slots with a command built, not issued yet
+	uint32_t issued;	// Slots in PxCI
+	int next;		// Command-based switching: first slot to look at
+	struct ahci_disk *owner[32];
+	io_request_t *req[32];	// NULL for a flush
+} ahci_port_t;
+
+typedef struct ahci_disk
+{
+	block_device_t blk;
+	ahci_port_t *ap;
+	int pmp;		// Port multiplier port, 0 when directly attached
+	int slot;
+	int sync_status;	// Flush result, IO_PENDING while it runs
+} ahci_disk_t;
+
 // Function declarations
-void probe_port(HBA_MEM *abar);
+int ahci_init();
+bool ahci_init_poll();
 int check_type(HBA_PORT *port);
-void port_rebase(HBA_PORT *port, int portno);
-void start_cmd(HBA_PORT *port);
-void stop_cmd(HBA_PORT *port);
+bool port_rebase(HBA_PORT *port);
+bool start_cmd(HBA_PORT *port);
+bool stop_cmd(HBA_PORT *port);
 bool read(HBA_PORT *port, uint32_t startl, uint32_t starth, uint32_t count, uint16_t *buf);
+bool write(HBA_PORT *port, uint32_t startl, uint32_t starth, uint32_t count, const uint16_t *buf);
+bool ahci_identify(HBA_PORT *port, int pmp, uint16_t *buf);
+block_device_t *ahci_register_port(ahci_port_t *ap, int pmp);
 int find_cmdslot(HBA_PORT *port);
 
 #endif // SYSTEM_H
@@ -0,0 +1,813 @@
+#include "ehci.h"
+#include "usb.h"
+#include "pci.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include "../System/time.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// EHCI host controller driver
+//
+// Every endpoint gets a queue head: control and bulk ones sit on the
+// asynchronous ring, interrupt ones in the periodic schedule behind the
+// skeleton QH for their interval, so one frame list entry per frame reaches
+// every interval dividing it. Transfers are chains of qTDs appended to the
+// queue through its dummy qTD. The kernel takes no interrupts: the
+// controller still raises USBINT/USBERRINT in USBSTS at the interrupt
+// threshold, and polling only walks the queues when one of them is set.
+//
+// Only high speed devices on root ports are handled. Full and low speed
+// devices are handed to the companion controller, for which there is no
+// driver; there is no hub driver and no hotplug.
+
+#define EHCI_PAGE_SIZE 4096
+
+static ehci_t ehci_ctrls[EHCI_MAX_CONTROLLERS];
+static int ehci_count = 0;
+
+static inline uint32_t ehci_read32(volatile uint8_t *base, uint32_t reg) {
+    return *(volatile uint32_t *)(base + reg);
+}
+
+static inline void ehci_write32(volatile uint8_t *base, uint32_t reg, uint32_t value) {
+    *(volatile uint32_t *)(base + reg) = value;
+}
+
+static bool ehci_wait(volatile uint8_t *base, uint32_t reg, uint32_t mask, uint32_t value, uint32_t timeout_us) {
+    uint64_t deadline = time_now_us() + timeout_us;
+    while ((ehci_read32(base, reg) & mask) != value) {
+        if (time_now_us() > deadline) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void ehci_delay_us(uint32_t us) {
+    uint64_t end = time_now_us() + us;
+    while (time_now_us() < end) {
+    }
+}
+
+static inline uint32_t ehci_addr(volatile void *p) {
+    return (uint32_t)(uintptr_t)p;
+}
+
+static inline ehci_qtd_t *ehci_qtd_ptr(uint32_t link) {
+    return (ehci_qtd_t *)(uintptr_t)(link & EHCI_LINK_ADDR);
+}
+
+// Pools =================================================================
+
+static ehci_qtd_t *ehci_qtd_alloc(ehci_t *ec) {
+    ehci_qtd_t *q = ec->qtd_free;
+    if (q == NULL) {
+        return NULL;
+    }
+    ec->qtd_free = ehci_qtd_ptr(q->next);
+    ec->qtd_free_count--;
+    return q;
+}
+
+static void ehci_qtd_free(ehci_t *ec, ehci_qtd_t *q) {
+    q->token = EHCI_QTD_HALTED;
+    q->xfer = NULL;
+    q->next = ec->qtd_free ? ehci_addr(ec->qtd_free) : EHCI_LINK_TERMINATE;
+    ec->qtd_free = q;
+    ec->qtd_free_count++;
+}
+
+// An inactive qTD to end a queue with
+static void ehci_qtd_dummy(ehci_qtd_t *q) {
+    q->next = EHCI_LINK_TERMINATE;
+    q->alt_next = EHCI_LINK_TERMINATE;
+    q->token = EHCI_QTD_HALTED;
+    q->xfer = NULL;
+    q->length = 0;
+    q->last = false;
+}
+
+static ehci_qh_t *ehci_qh_alloc(ehci_t *ec) {
+    for (int i = 0; i < EHCI_MAX_QHS; i++) {
+        ehci_qh_t *qh = &ec->qhs[i];
+        if (!qh->in_use) {
+            memset(qh, 0, sizeof(ehci_qh_t));
+            qh->in_use = true;
+            return qh;
+        }
+    }
+    return NULL;
+}
+
+// Schedules =============================================================
+
+// Frame i starts at the skeleton of the longest interval dividing it
+static int ehci_frame_level(int frame) {
+    int level = 0;
+    while (level < EHCI_PERIODIC_LEVELS - 1 && !(frame & (1 << level))) {
+        level++;
+    }
+    return level;
+}
+
+// Skeleton level of an interrupt endpoint. Intervals shorter than a frame
+// are served in several microframes of every frame instead.
+static int ehci_interval(usb_endpoint_t *ep, uint8_t *smask) {
+    int b = ep->polling_interval;
+    b = b < 1 ? 1 : b > 16 ? 16 : b;
+    uint32_t uframes = 1u << (b - 1);
+    if (uframes < 8) {
+        *smask = uframes == 1 ? 0xFF : uframes == 2 ? 0x55 : 0x11;
+        return 0;
+    }
+    int level = 0;
+    for (uint32_t frames = uframes / 8; frames > 1 && level < EHCI_PERIODIC_LEVELS - 1; frames >>= 1) {
+        level++;
+    }
+    *smask = 0x01;
+    return level;
+}
+
+static void ehci_qh_link(ehci_t *ec, ehci_qh_t *qh) {
+    ehci_qh_t *prev = qh->level < 0 ? ec->async_head : ec->skeleton[qh->level];
+    qh->link = prev->link;
+    qh->next_qh = prev->next_qh;
+    __asm__ volatile("" ::: "memory");
+    prev->link = ehci_addr(qh) | EHCI_LINK_QH;
+    prev->next_qh = qh;
+}
+
+// The controller may still hold a QH taken off the async ring; the async
+// advance doorbell tells when it has let go
+static void ehci_async_sync(ehci_t *ec) {
+    if (!(ehci_read32(ec->op, EHCI_OP_USBSTS) & EHCI_STS_ASS)) {
+        return;
+    }
+    ehci_write32(ec->op, EHCI_OP_USBSTS, EHCI_STS_IAA);
+    ehci_write32(ec->op, EHCI_OP_USBCMD, ehci_read32(ec->op, EHCI_OP_USBCMD) | EHCI_CMD_IAAD);
+    if (!ehci_wait(ec->op, EHCI_OP_USBSTS, EHCI_STS_IAA, EHCI_STS_IAA, EHCI_TIMEOUT_US)) {
+        printk("EHCI: async advance doorbell timed out\n");
+    }
+    ehci_write32(ec->op, EHCI_OP_USBSTS, EHCI_STS_IAA);
+}
+
+// Take a QH off its schedule and wait until the controller is done with it
+static void ehci_qh_unlink(ehci_t *ec, ehci_qh_t *qh) {
+    ehci_qh_t *prev = qh->level < 0 ? ec->async_head : ec->skeleton[qh->level];
+    while (prev && prev->next_qh != qh) {
+        prev = prev->next_qh;
+    }
+    if (prev == NULL) {
+        return;
+    }
+    prev->link = qh->link;
+    prev->next_qh = qh->next_qh;
+    if (qh->level < 0) {
+        ehci_async_sync(ec);
+    } else {
+        // The periodic schedule has no doorbell; a frame that started
+        // before the unlink is over two frames later
+        ehci_delay_us(2 * EHCI_FRAME_US);
+    }
+}
+
+// Overlay of an idle queue: not halted, DATA0, about to fetch the dummy
+static void ehci_qh_overlay(ehci_qh_t *qh) {
+    qh->current = 0;
+    qh->next = ehci_addr(qh->dummy);
+    qh->alt_next = EHCI_LINK_TERMINATE;
+    for (int i = 0; i < 5; i++) {
+        qh->buffer[i] = 0;
+        qh->buffer_hi[i] = 0;
+    }
+    __asm__ volatile("" ::: "memory");
+    qh->token = 0;
+}
+
+static ehci_qh_t *ehci_qh_create(ehci_t *ec, uint8_t address, uint8_t endpoint, uint16_t max_packet,
+                                 int level, uint8_t smask, bool control) {
+    ehci_qh_t *qh = ehci_qh_alloc(ec);
+    ehci_qtd_t *dummy = qh ? ehci_qtd_alloc(ec) : NULL;
+    if (dummy == NULL) {
+        if (qh) {
+            qh->in_use = false;
+        }
+        return NULL;
+    }
+    ehci_qtd_dummy(dummy);
+    qh->info1 = address | (uint32_t)endpoint << 8 | EHCI_QH_EPS_HIGH | EHCI_QH_MAXP(max_packet) |
+                (control ? EHCI_QH_DTC : 0) | (level < 0 ? EHCI_QH_RL(4) : 0);
+    qh->info2 = EHCI_QH_MULT1 | smask;
+    qh->level = level;
+    qh->control = control;
+    qh->head = qh->dummy = dummy;
+    ehci_qh_overlay(qh);
+    ehci_qh_link(ec, qh);
+    return qh;
+}
+
+// Free the qTDs from q up to stop, failing the transfers they belong to
+static void ehci_qh_fail(ehci_t *ec, ehci_qtd_t *q, ehci_qtd_t *stop) {
+    while (q != stop) {
+        ehci_qtd_t *next = ehci_qtd_ptr(q->next);
+        usb_transfer_t *xfer = q->xfer;
+        bool last = q->last;
+        ehci_qtd_free(ec, q);
+        if (last) {
+            usb_transfer_done(xfer, USB_XFER_ERROR, 0);
+        }
+        q = next;
+    }
+}
+
+// Fail everything queued and restart the queue clean, which also clears a halt
+static void ehci_qh_reset(ehci_t *ec, ehci_qh_t *qh) {
+    ehci_qh_unlink(ec, qh);
+    ehci_qtd_t *head = qh->head;
+    ehci_qtd_t *stop = qh->dummy;
+    qh->head = qh->dummy;
+    ehci_qh_overlay(qh);
+    ehci_qh_link(ec, qh);
+    ehci_qh_fail(ec, head, stop);
+}
+
+static void ehci_qh_remove(ehci_t *ec, ehci_qh_t *qh) {
+    ehci_qh_unlink(ec, qh);
+    ehci_qh_fail(ec, qh->head, qh->dummy);
+    ehci_qtd_free(ec, qh->dummy);
+    qh->in_use = false;
+}
+
+// Transfer descriptors ==================================================
+
+// A chain of qTDs being written. It starts in the queue's dummy, whose
+// token is written last, once the rest of the chain is in place.
+typedef struct {
+    ehci_t *ec;
+    ehci_qh_t *qh;
+    usb_transfer_t *xfer;
+    ehci_qtd_t *first;
+    ehci_qtd_t *last;
+    uint32_t first_token;
+    uint32_t alt;               // alt_next of every qTD
+} ehci_td_t;
+
+static ehci_qtd_t *ehci_td_add(ehci_td_t *td, uint32_t addr, uint32_t length, uint32_t token) {
+    ehci_qtd_t *q = td->last ? ehci_qtd_alloc(td->ec) : td->qh->dummy;
+    q->next = EHCI_LINK_TERMINATE;
+    q->alt_next = td->alt;
+    q->buffer[0] = addr;
+    for (int i = 1; i < 5; i++) {
+        q->buffer[i] = (addr & ~0xFFF) + i * EHCI_PAGE_SIZE;
+    }
+    for (int i = 0; i < 5; i++) {
+        q->buffer_hi[i] = 0;
+    }
+    q->xfer = td->xfer;
+    q->length = length;
+    q->last = false;
+    token |= EHCI_QTD_ACTIVE | EHCI_QTD_CERR | length << 16;
+    if (td->last) {
+        q->token = token;
+        td->last->next = ehci_addr(q);
+    } else {
+        td->first = q;
+        td->first_token = token;
+    }
+    td->last = q;
+    return q;
+}
+
+// Split a transfer's buffer (or scatter list) into qTDs of up to five pages,
+// or only count them with td NULL. Every qTD but the last holds whole
+// packets; returns -1 if the pieces do not allow that.
+static int ehci_td_buffer(ehci_td_t *td, usb_transfer_t *xfer, uint16_t max_packet, uint32_t token) {
+    usb_sg_t one = { xfer->buf, xfer->length };
+    const usb_sg_t *sg = xfer->nsg ? xfer->sg : &one;
+    int nsg = xfer->nsg ? xfer->nsg : 1;
+    int count = 0;
+    for (int i = 0; i < nsg; i++) {
+        uint32_t addr = (uint32_t)(uintptr_t)sg[i].buf;
+        uint32_t left = sg[i].length;
+        if (left == 0 && nsg > 1) {
+            continue;
+        }
+        if (i < nsg - 1 && left % max_packet) {
+            return -1;  // A short packet would end the transfer there
+        }
+        do {
+            uint32_t room = EHCI_QTD_MAX_BYTES - (addr & 0xFFF);
+            uint32_t chunk = left <= room ? left : room - room % max_packet;
+            if (td) {
+                ehci_td_add(td, addr, chunk, token);
+            }
+            addr += chunk;
+            left -= chunk;
+            count++;
+        } while (left);
+    }
+    return count;
+}
+
+// End the chain in a new dummy and hand it to the controller
+static void ehci_td_finish(ehci_td_t *td, ehci_qtd_t *dummy) {
+    td->last->last = true;
+    td->last->next = ehci_addr(dummy);
+    if (td->last == td->first) {
+        td->first_token |= EHCI_QTD_IOC;
+    } else {
+        td->last->token |= EHCI_QTD_IOC;
+    }
+    td->qh->dummy = dummy;
+    __asm__ volatile("" ::: "memory");
+    td->first->token = td->first_token;
+}
+
+// Complete the transfers at the front of a queue that the controller is
+// done with, returns how many
+static int ehci_qh_reap(ehci_t *ec, ehci_qh_t *qh) {
+    int found = 0;
+    while (qh->head != qh->dummy) {
+        ehci_qtd_t *q = qh->head;
+        usb_transfer_t *xfer = q->xfer;
+        uint32_t actual = 0;
+        int status = USB_XFER_DONE;
+        bool skipping = false;
+        for (;;) {
+            uint32_t token = q->token;
+            if (token & EHCI_QTD_ACTIVE) {
+                if (skipping && !q->last) {
+                    q = ehci_qtd_ptr(q->next);
+                    continue;
+                }
+                return found;   // Still running
+            }
+            if (EHCI_QTD_GET_PID(token) != EHCI_PID_SETUP) {
+                actual += q->length - EHCI_QTD_BYTES(token);
+            }
+            if (token & EHCI_QTD_HALTED) {
+                status = token & EHCI_QTD_ERRORS ? USB_XFER_ERROR : USB_XFER_STALL;
+                break;
+            }
+            if (q->last) {
+                break;
+            }
+            if (EHCI_QTD_BYTES(token)) {
+                // Short packet: the controller went on at alt_next, past the
+                // rest of a bulk transfer or to the status stage of a control one
+                if (!qh->control) {
+                    break;
+                }
+                skipping = true;
+            }
+            q = ehci_qtd_ptr(q->next);
+        }
+
+        q = qh->head;
+        for (;;) {
+            ehci_qtd_t *next = ehci_qtd_ptr(q->next);
+            bool last = q->last;
+            ehci_qtd_free(ec, q);
+            if (last) {
+                qh->head = next;
+                break;
+            }
+            q = next;
+        }
+        usb_transfer_done(xfer, status, actual);
+        found++;
+    }
+    return found;
+}
+
+// Reap every queue, but only once the controller flagged a completion
+static int ehci_scan(ehci_t *ec) {
+    uint32_t sts = ehci_read32(ec->op, EHCI_OP_USBSTS) & (EHCI_STS_USBINT | EHCI_STS_ERRINT);
+    if (sts == 0) {
+        return 0;
+    }
+    ehci_write32(ec->op, EHCI_OP_USBSTS, sts);
+    int found = 0;
+    for (int i = 0; i < EHCI_MAX_QHS; i++) {
+        ehci_qh_t *qh = &ec->qhs[i];
+        if (qh->in_use && qh->head != qh->dummy) {
+            found += ehci_qh_reap(ec, qh);
+        }
+    }
+    return found;
+}
+
+// Endpoints =============================================================
+
+static void ehci_ep_drop(ehci_t *ec, usb_endpoint_t *ep) {
+    ehci_qh_t *qh = ep->hc_data;
+    if (qh) {
+        ep->hc_data = NULL;
+        ehci_qh_remove(ec, qh);
+    }
+}
+
+// Drop the queues of old's endpoints and make queues for intf's.
+// Isochronous endpoints get none, there is no iTD support.
+static bool ehci_configure(usb_device_t *udev, usb_interface_t *old, usb_interface_t *intf) {
+    ehci_dev_t *ed = udev->hc_data;
+    ehci_t *ec = ed->ec;
+    if (old) {
+        for (int i = 0; i < old->num_endpoints; i++) {
+            ehci_ep_drop(ec, &udev->endpoints[old->first_endpoint + i]);
+        }
+    }
+    for (int i = 0; i < intf->num_endpoints; i++) {
+        usb_endpoint_t *ep = &udev->endpoints[intf->first_endpoint + i];
+        if (ep->transfer_type != USB_EP_BULK && ep->transfer_type != USB_EP_INTERRUPT) {
+            continue;
+        }
+        int level = -1;
+        uint8_t smask = 0;
+        if (ep->transfer_type == USB_EP_INTERRUPT) {
+            level = ehci_interval(ep, &smask);
+        }
+        ehci_qh_t *qh = ehci_qh_create(ec, ed->address, ep->endpoint_address & 0xF, ep->max_packet_size,
+                                       level, smask, false);
+        if (qh == NULL) {
+            for (int j = 0; j < i; j++) {
+                ehci_ep_drop(ec, &udev->endpoints[intf->first_endpoint + j]);
+            }
+            return false;
+        }
+        ep->hc_data = qh;
+    }
+    return true;
+}
+
+static bool ehci_reset_endpoint(usb_device_t *udev, usb_endpoint_t *ep) {
+    ehci_dev_t *ed = udev->hc_data;
+    ehci_qh_t *qh = ep ? ep->hc_data : ed->ep0;
+    if (qh == NULL) {
+        return false;
+    }
+    ehci_qh_reset(ed->ec, qh);
+    return true;
+}
+
+// Transfers =============================================================
+
+static int ehci_control(usb_device_t *udev, const usb_setup_t *setup, void *data) {
+    ehci_dev_t *ed = udev->hc_data;
+    ehci_t *ec = ed->ec;
+    ehci_qh_t *qh = ed->ep0;
+    bool in = (setup->request_type & USB_DIR_IN) != 0;
+
+    usb_transfer_t xfer;
+    memset(&xfer, 0, sizeof(usb_transfer_t));
+    xfer.dev = udev;
+    xfer.buf = data;
+    xfer.length = data ? setup->length : 0;
+    xfer.status = USB_XFER_PENDING;
+
+    int data_qtds = xfer.length ? ehci_td_buffer(NULL, &xfer, udev->max_packet0, 0) : 0;
+    if (data_qtds < 0 || ec->qtd_free_count < data_qtds + 2) {
+        return -1;
+    }
+
+    // Control data never needs more than one qTD, so DATA1 is right for all of it
+    ehci_qtd_t *end = ehci_qtd_alloc(ec);
+    ehci_qtd_dummy(end);
+    ehci_td_t td = { ec, qh, &xfer, NULL, NULL, 0, EHCI_LINK_TERMINATE };
+    ehci_td_add(&td, (uint32_t)(uintptr_t)setup, sizeof(usb_setup_t), EHCI_QTD_PID(EHCI_PID_SETUP));
+    if (xfer.length) {
+        ehci_td_buffer(&td, &xfer, udev->max_packet0, EHCI_QTD_PID(in ? EHCI_PID_IN : EHCI_PID_OUT) | EHCI_QTD_TOGGLE);
+    }
+    // The status stage goes the other way, IN when there is no data stage
+    ehci_qtd_t *status = ehci_td_add(&td, 0, 0, EHCI_QTD_TOGGLE |
+                                     EHCI_QTD_PID(xfer.length && in ? EHCI_PID_OUT : EHCI_PID_IN));
+    // A short data stage still goes on to the status stage
+    for (ehci_qtd_t *q = ehci_qtd_ptr(td.first->next); q != status; q = ehci_qtd_ptr(q->next)) {
+        q->alt_next = ehci_addr(status);
+    }
+    ehci_td_finish(&td, end);
+
+    uint64_t deadline = time_now_us() + USB_CTRL_TIMEOUT_US;
+    while (xfer.status == USB_XFER_PENDING) {
+        ehci_scan(ec);
+        if (xfer.status == USB_XFER_PENDING && time_now_us() > deadline) {
+            printk("EHCI: control transfer to address %d timed out\n", ed->address);
+            ehci_qh_reset(ec, qh);
+            return -1;
+        }
+    }
+    // A stall halts the queue
+    if (xfer.status == USB_XFER_STALL) {
+        ehci_qh_reset(ec, qh);
+    }
+    return xfer.status == USB_XFER_DONE ? (int)xfer.actual : -1;
+}
+
+static bool ehci_submit(usb_transfer_t *xfer) {
+    ehci_dev_t *ed = xfer->dev->hc_data;
+    ehci_t *ec = ed->ec;
+    ehci_qh_t *qh = xfer->ep->hc_data;
+    if (qh == NULL || xfer->stream) {
+        return false;
+    }
+    // One qTD goes into the current dummy, the new dummy makes up for it
+    int count = ehci_td_buffer(NULL, xfer, xfer->ep->max_packet_size, 0);
+    if (count <= 0 || ec->qtd_free_count < count) {
+        return false;
+    }
+    bool in = xfer->ep->direction != 0;
+    ehci_qtd_t *end = ehci_qtd_alloc(ec);
+    ehci_qtd_dummy(end);
+    // A short IN packet skips the rest of the transfer
+    ehci_td_t td = { ec, qh, xfer, NULL, NULL, 0, in ? ehci_addr(end) : EHCI_LINK_TERMINATE };
+    ehci_td_buffer(&td, xfer, xfer->ep->max_packet_size, EHCI_QTD_PID(in ? EHCI_PID_IN : EHCI_PID_OUT));
+    ehci_td_finish(&td, end);
+    return true;
+}
+
+static int ehci_poll(usb_hcd_t *hcd) {
+    return ehci_scan(hcd->data);
+}
+
+// Devices ===============================================================
+
+static void ehci_release_device(ehci_t *ec, usb_device_t *udev, ehci_dev_t *ed) {
+    for (int i = 0; i < udev->num_endpoints; i++) {
+        ehci_ep_drop(ec, &udev->endpoints[i]);
+    }
+    if (ed->ep0) {
+        ehci_qh_remove(ec, ed->ep0);
+        ed->ep0 = NULL;
+    }
+}
+
+// Address the device on an enabled port, then enumerate it
+static bool ehci_attach(ehci_t *ec, int port) {
+    if (ec->dev_count >= EHCI_MAX_DEVICES || ec->next_address > 127) {
+        printk("EHCI: port %d: too many devices\n", port);
+        return false;
+    }
+    ehci_dev_t *ed = &ec->devs[ec->dev_count];
+    memset(ed, 0, sizeof(ehci_dev_t));
+    ed->ec = ec;
+    ed->ep0 = ehci_qh_create(ec, 0, 0, 64, -1, 0, true);
+    if (ed->ep0 == NULL) {
+        printk("EHCI: port %d: out of queue heads\n", port);
+        return false;
+    }
+    usb_device_t *udev = usb_alloc_device(&ec->hcd);
+    if (udev == NULL) {
+        ehci_qh_remove(ec, ed->ep0);
+        return false;
+    }
+    udev->hc_data = ed;
+    udev->speed = USB_SPEED_HIGH;
+    udev->port = port;
+    udev->max_packet0 = 64;     // Always 64 at high speed
+
+    uint8_t address = ec->next_address;
+    if (usb_control_transfer(udev, USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE, USB_REQUEST_SET_ADDRESS,
+                             address, 0, NULL, 0) < 0) {
+        printk("EHCI: port %d: SET_ADDRESS failed\n", port);
+        ehci_release_device(ec, udev, ed);
+        return false;
+    }
+    ehci_delay_us(EHCI_SET_ADDRESS_US);
+    // QH fields outside the overlay only change off the schedule
+    ehci_qh_unlink(ec, ed->ep0);
+    ed->ep0->info1 = (ed->ep0->info1 & ~0x7F) | address;
+    ehci_qh_link(ec, ed->ep0);
+    ed->address = address;
+    udev->address = address;
+    ec->next_address++;
+
+    if (!usb_enumerate(udev)) {
+        ehci_release_device(ec, udev, ed);
+        return false;
+    }
+    ec->dev_count++;
+    return true;
+}
+
+static void ehci_port_release(ehci_t *ec, int port) {
+    uint32_t reg = EHCI_OP_PORTSC(port);
+    uint32_t sc = ehci_read32(ec->op, reg);
+    ehci_write32(ec->op, reg, (sc & ~EHCI_PORT_CHANGES) | EHCI_PORT_OWNER);
+    printk("EHCI: port %d: full/low speed device left to the companion controller\n", port);
+}
+
+static void ehci_scan_ports(ehci_t *ec) {
+    for (int port = 1; port <= ec->ports; port++) {
+        uint32_t reg = EHCI_OP_PORTSC(port);
+        uint32_t sc = ehci_read32(ec->op, reg);
+        if (!(sc & EHCI_PORT_CCS) || (sc & EHCI_PORT_OWNER)) {
+            continue;
+        }
+        // A low speed device shows a K state before the reset
+        if (EHCI_PORT_LS(sc) == EHCI_PORT_LS_K) {
+            ehci_port_release(ec, port);
+            continue;
+        }
+        ehci_write32(ec->op, reg, (sc & ~(EHCI_PORT_CHANGES | EHCI_PORT_PE)) | EHCI_PORT_PR);
+        ehci_delay_us(EHCI_PORT_RESET_US);
+        sc = ehci_read32(ec->op, reg);
+        ehci_write32(ec->op, reg, sc & ~(EHCI_PORT_CHANGES | EHCI_PORT_PR));
+        if (!ehci_wait(ec->op, reg, EHCI_PORT_PR, 0, EHCI_RESET_DONE_US)) {
+            printk("EHCI: port %d reset timed out\n", port);
+            continue;
+        }
+        sc = ehci_read32(ec->op, reg);
+        ehci_write32(ec->op, reg, sc);     // Clears the change bits
+        // A full speed device does not chirp, so the port stays disabled
+        if (!(sc & EHCI_PORT_PE)) {
+            ehci_port_release(ec, port);
+            continue;
+        }
+        ehci_delay_us(EHCI_RESET_DONE_US);  // Reset recovery
+        ehci_attach(ec, port);
+    }
+}
+
+// Controller ============================================================
+
+// Take the controller from the firmware and stop its SMIs
+static void ehci_bios_handoff(struct pci_device *pdev, uint32_t hccparams) {
+    uint32_t off = EHCI_HCC_EECP(hccparams);
+    while (off >= 0x40) {
+        uint32_t cap = pci_read_config_space(pdev->bus, pdev->device, pdev->function, off);
+        if ((cap & 0xFF) == EHCI_EXT_LEGACY) {
+            pci_write_config_space(pdev->bus, pdev->device, pdev->function, off, cap | EHCI_LEGACY_OS_OWNED);
+            uint64_t deadline = time_now_us() + EHCI_TIMEOUT_US;
+            while (pci_read_config_space(pdev->bus, pdev->device, pdev->function, off) & EHCI_LEGACY_BIOS_OWNED) {
+                if (time_now_us() > deadline) {
+                    printk("EHCI: BIOS did not release the controller, taking it\n");
+                    pci_write_config_space(pdev->bus, pdev->device, pdev->function, off,
+                                           (cap & ~EHCI_LEGACY_BIOS_OWNED) | EHCI_LEGACY_OS_OWNED);
+                    break;
+                }
+            }
+            pci_write_config_space(pdev->bus, pdev->device, pdev->function, off + 4, 0);
+        }
+        off = (cap >> 8) & 0xFF;
+    }
+}
+
+static bool ehci_reset(ehci_t *ec) {
+    ehci_write32(ec->op, EHCI_OP_USBCMD, ehci_read32(ec->op, EHCI_OP_USBCMD) & ~EHCI_CMD_RS);
+    if (!ehci_wait(ec->op, EHCI_OP_USBSTS, EHCI_STS_HCHALTED, EHCI_STS_HCHALTED, EHCI_TIMEOUT_US)) {
+        printk("EHCI: controller does not halt\n");
+        return false;
+    }
+    ehci_write32(ec->op, EHCI_OP_USBCMD, EHCI_CMD_HCRESET);
+    if (!ehci_wait(ec->op, EHCI_OP_USBCMD, EHCI_CMD_HCRESET, 0, EHCI_TIMEOUT_US)) {
+        printk("EHCI: controller reset timed out\n");
+        return false;
+    }
+    return true;
+}
+
+// A halted QH the controller passes over: the async ring's head, or a skeleton
+static ehci_qh_t *ehci_qh_static(ehci_t *ec, uint32_t info1, uint32_t info2, int level) {
+    ehci_qh_t *qh = ehci_qh_alloc(ec);
+    qh->info1 = info1 | EHCI_QH_EPS_HIGH;
+    qh->info2 = EHCI_QH_MULT1 | info2;
+    qh->next = EHCI_LINK_TERMINATE;
+    qh->alt_next = EHCI_LINK_TERMINATE;
+    qh->token = EHCI_QTD_HALTED;
+    qh->level = level;
+    return qh;
+}
+
+// Pools, the async ring's head, the periodic skeleton and frame list, then run
+static bool ehci_start(ehci_t *ec, uint32_t hccparams) {
+    size_t qh_pages = (EHCI_MAX_QHS * sizeof(ehci_qh_t) + EHCI_PAGE_SIZE - 1) / EHCI_PAGE_SIZE;
+    size_t qtd_pages = (EHCI_MAX_QTDS * sizeof(ehci_qtd_t) + EHCI_PAGE_SIZE - 1) / EHCI_PAGE_SIZE;
+    ec->qhs = alloc_pages(qh_pages);
+    ec->qtds = alloc_pages(qtd_pages);
+    ec->frame_list = alloc_page();
+    if (ec->qhs == NULL || ec->qtds == NULL || ec->frame_list == NULL) {
+        printk("EHCI: out of pages\n");
+        return false;
+    }
+    memset(ec->qhs, 0, qh_pages * EHCI_PAGE_SIZE);
+    memset(ec->qtds, 0, qtd_pages * EHCI_PAGE_SIZE);
+    for (int i = 0; i < EHCI_MAX_QTDS; i++) {
+        ehci_qtd_free(ec, &ec->qtds[i]);
+    }
+
+    ec->async_head = ehci_qh_static(ec, EHCI_QH_HEAD, 0, -1);
+    ec->async_head->link = ehci_addr(ec->async_head) | EHCI_LINK_QH;
+    for (int level = 0; level < EHCI_PERIODIC_LEVELS; level++) {
+        ehci_qh_t *qh = ehci_qh_static(ec, 0, 0x01, level);
+        qh->link = level ? ehci_addr(ec->skeleton[level - 1]) | EHCI_LINK_QH : EHCI_LINK_TERMINATE;
+        qh->next_qh = level ? ec->skeleton[level - 1] : NULL;
+        ec->skeleton[level] = qh;
+    }
+    for (int i = 0; i < EHCI_FRAMES; i++) {
+        ec->frame_list[i] = ehci_addr(ec->skeleton[ehci_frame_level(i)]) | EHCI_LINK_QH;
+    }
+
+    if (hccparams & EHCI_HCC_64BIT) {
+        ehci_write32(ec->op, EHCI_OP_CTRLDSSEGMENT, 0);
+    }
+    // Status bits are set at the interrupt threshold whether or not they
+    // interrupt; USBINTR stays clear since the kernel has no handler
+    ehci_write32(ec->op, EHCI_OP_USBINTR, 0);
+    ehci_write32(ec->op, EHCI_OP_USBSTS, EHCI_INTR_MASK);
+    ehci_write32(ec->op, EHCI_OP_PERIODICLISTBASE, ehci_addr(ec->frame_list));
+    ehci_write32(ec->op, EHCI_OP_ASYNCLISTADDR, ehci_addr(ec->async_head));
+    ehci_write32(ec->op, EHCI_OP_USBCMD, EHCI_CMD_ITC(1) | EHCI_CMD_ASE | EHCI_CMD_PSE | EHCI_CMD_RS);
+    if (!ehci_wait(ec->op, EHCI_OP_USBSTS, EHCI_STS_HCHALTED, 0, EHCI_TIMEOUT_US)) {
+        printk("EHCI: controller does not start\n");
+        return false;
+    }
+    // Route the ports to this controller instead of the companions
+    ehci_write32(ec->op, EHCI_OP_CONFIGFLAG, 1);
+    ehci_read32(ec->op, EHCI_OP_CONFIGFLAG);
+    return true;
+}
+
+static bool ehci_probe(struct pci_device *pdev) {
+    ehci_t *ec = &ehci_ctrls[ehci_count];
+    memset(ec, 0, sizeof(ehci_t));
+
+    struct pci_bar *bar = &pdev->bars[0];
+    if (!(bar->flags & PCI_BAR_MEM) || bar->base == 0) {
+        printk("EHCI: no register BAR\n");
+        return false;
+    }
+    if (bar->base >> 32) {
+        printk("EHCI: BAR0 above 4G is not reachable\n");
+        return false;
+    }
+
+    // Memory decoding and bus mastering on, legacy INTx off since completions are polled
+    uint32_t command = pci_read_config_space(pdev->bus, pdev->device, pdev->function, 0x04) & 0xFFFF;
+    pci_write_config_space(pdev->bus, pdev->device, pdev->function, 0x04,
+                           command | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+
+    ec->cap = (volatile uint8_t *)(uintptr_t)bar->base;
+    ec->op = ec->cap + (ehci_read32(ec->cap, EHCI_CAP_CAPLENGTH) & 0xFF);
+    uint32_t hcsparams = ehci_read32(ec->cap, EHCI_CAP_HCSPARAMS);
+    uint32_t hccparams = ehci_read32(ec->cap, EHCI_CAP_HCCPARAMS);
+    ec->ports = EHCI_HCS_N_PORTS(hcsparams);
+    ec->next_address = 1;
+
+    ehci_bios_handoff(pdev, hccparams);
+    if (!ehci_reset(ec) || !ehci_start(ec, hccparams)) {
+        return false;
+    }
+
+    memcpy(ec->name, "ehci", 4);
+    ec->name[4] = '0' + ehci_count;
+    ec->name[5] = '\0';
+    ec->hcd.name = ec->name;
+    ec->hcd.type = USB_HC_EHCI;
+    ec->hcd.data = ec;
+    ec->hcd.control = ehci_control;
+    ec->hcd.submit = ehci_submit;
+    ec->hcd.poll = ehci_poll;
+    ec->hcd.configure = ehci_configure;
+    ec->hcd.reset_endpoint = ehci_reset_endpoint;
+    ec->hcd.alloc_streams = NULL;
+    if (!usb_register_hcd(&ec->hcd)) {
+        return false;
+    }
+    ehci_count++;
+    printk("EHCI: %s, %d ports\n", ec->name, ec->ports);
+
+    // Power the ports if the controller switches them, then let connections settle
+    if (hcsparams & EHCI_HCS_PPC) {
+        for (int port = 1; port <= ec->ports; port++) {
+            uint32_t sc = ehci_read32(ec->op, EHCI_OP_PORTSC(port));
+            if (!(sc & EHCI_PORT_PP)) {
+                ehci_write32(ec->op, EHCI_OP_PORTSC(port), (sc & ~EHCI_PORT_CHANGES) | EHCI_PORT_PP);
+            }
+        }
+        ehci_delay_us(EHCI_POWER_US);
+    }
+    ehci_delay_us(EHCI_DEBOUNCE_US);
+    ehci_scan_ports(ec);
+    return true;
+}
+
+static bool ehci_pci_probe(struct pci_device *dev, const struct pci_device_id *id) {
+    (void)id;
+    return ehci_count < EHCI_MAX_CONTROLLERS && ehci_probe(dev);
+}
+
+static const struct pci_device_id ehci_pci_ids[] = {
+    { PCI_ANY_ID, PCI_ANY_ID, EHCI_PCI_CLASS << 16 | EHCI_PCI_SUBCLASS << 8 | EHCI_PCI_PROG_IF, PCI_CLASS_MASK_PROG_IF },
+    { 0 }
+};
+
+static struct pci_driver ehci_pci_driver = { "ehci", ehci_pci_ids, ehci_pci_probe };
+
+// Start every EHCI controller on the PCI bus and the high speed devices on
+// its ports, returns how many controllers came up
+int ehci_init() {
+    pci_register_driver(&ehci_pci_driver);
+    return ehci_count;
+}
@@ -0,0 +1,176 @@
+#ifndef EHCI_H
+#define EHCI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "usb.h"
+
+// PCI class 0Ch (serial bus), subclass 03h (USB), prog-if 20h (EHCI)
+#define EHCI_PCI_CLASS     0x0C
+#define EHCI_PCI_SUBCLASS  0x03
+#define EHCI_PCI_PROG_IF   0x20
+
+#define EHCI_MAX_CONTROLLERS 2
+#define EHCI_MAX_DEVICES     16     // Per controller
+#define EHCI_MAX_QHS         64     // Queue heads per controller, with the async head and skeletons
+#define EHCI_MAX_QTDS        512    // Transfer descriptors per controller
+#define EHCI_FRAMES          1024   // Periodic frame list entries
+#define EHCI_PERIODIC_LEVELS 6      // Skeleton QHs for intervals of 1, 2, 4 ... 32 frames
+#define EHCI_QTD_MAX_BYTES   (5 * 4096)     // Five buffer pages, less the first page's offset
+#define EHCI_TIMEOUT_US      1000000
+#define EHCI_PORT_RESET_US   50000  // Reset signalling on root ports
+#define EHCI_RESET_DONE_US   10000  // For PR to read back as cleared
+#define EHCI_POWER_US        20000
+#define EHCI_DEBOUNCE_US     100000
+#define EHCI_SET_ADDRESS_US  2000   // Recovery interval after SET_ADDRESS
+#define EHCI_FRAME_US        1000
+
+// Capability registers
+#define EHCI_CAP_CAPLENGTH  0x00
+#define EHCI_CAP_HCSPARAMS  0x04
+#define EHCI_CAP_HCCPARAMS  0x08
+
+#define EHCI_HCS_N_PORTS(v) ((v) & 0xF)
+#define EHCI_HCS_PPC        (1 << 4)    // Ports have power switches
+#define EHCI_HCC_64BIT      (1 << 0)
+#define EHCI_HCC_EECP(v)    (((v) >> 8) & 0xFF)     // Extended capabilities, in config space
+
+// Operational registers, from CAPLENGTH
+#define EHCI_OP_USBCMD      0x00
+#define EHCI_OP_USBSTS      0x04
+#define EHCI_OP_USBINTR     0x08
+#define EHCI_OP_FRINDEX     0x0C
+#define EHCI_OP_CTRLDSSEGMENT 0x10
+#define EHCI_OP_PERIODICLISTBASE 0x14
+#define EHCI_OP_ASYNCLISTADDR 0x18
+#define EHCI_OP_CONFIGFLAG  0x40
+#define EHCI_OP_PORTSC(n)   (0x44 + 4 * ((n) - 1))
+
+#define EHCI_CMD_RS         (1 << 0)
+#define EHCI_CMD_HCRESET    (1 << 1)
+#define EHCI_CMD_PSE        (1 << 4)
+#define EHCI_CMD_ASE        (1 << 5)
+#define EHCI_CMD_IAAD       (1 << 6)    // Interrupt on async advance doorbell
+#define EHCI_CMD_ITC(n)     ((uint32_t)(n) << 16)   // Interrupt threshold, microframes
+
+#define EHCI_STS_USBINT     (1 << 0)
+#define EHCI_STS_ERRINT     (1 << 1)
+#define EHCI_STS_IAA        (1 << 5)
+#define EHCI_STS_HCHALTED   (1 << 12)
+#define EHCI_STS_ASS        (1 << 15)
+#define EHCI_INTR_MASK      0x3F        // USBINT, ERRINT, PCD, FLR, HSE, IAA
+
+#define EHCI_PORT_CCS       (1 << 0)
+#define EHCI_PORT_CSC       (1 << 1)
+#define EHCI_PORT_PE        (1 << 2)
+#define EHCI_PORT_PEC       (1 << 3)
+#define EHCI_PORT_OCC       (1 << 5)
+#define EHCI_PORT_PR        (1 << 8)
+#define EHCI_PORT_LS(v)     (((v) >> 10) & 0x3)
+#define EHCI_PORT_LS_K      1           // Line state of a low speed device
+#define EHCI_PORT_PP        (1 << 12)
+#define EHCI_PORT_OWNER     (1 << 13)   // The companion controller has the port
+#define EHCI_PORT_CHANGES   (EHCI_PORT_CSC | EHCI_PORT_PEC | EHCI_PORT_OCC)    // Write 1 to clear
+
+// Legacy support extended capability, in PCI config space
+#define EHCI_EXT_LEGACY     1
+#define EHCI_LEGACY_BIOS_OWNED (1 << 16)
+#define EHCI_LEGACY_OS_OWNED   (1 << 24)
+
+// Link pointers
+#define EHCI_LINK_TERMINATE 1
+#define EHCI_LINK_QH        (1 << 1)
+#define EHCI_LINK_ADDR      0xFFFFFFE0
+
+// qTD token
+#define EHCI_QTD_ACTIVE     (1 << 7)
+#define EHCI_QTD_HALTED     (1 << 6)
+#define EHCI_QTD_BUFERR     (1 << 5)
+#define EHCI_QTD_BABBLE     (1 << 4)
+#define EHCI_QTD_XACTERR    (1 << 3)
+#define EHCI_QTD_ERRORS     (EHCI_QTD_BUFERR | EHCI_QTD_BABBLE | EHCI_QTD_XACTERR)
+#define EHCI_QTD_PID(p)     ((uint32_t)(p) << 8)
+#define EHCI_QTD_GET_PID(t) (((t) >> 8) & 0x3)
+#define EHCI_PID_OUT        0
+#define EHCI_PID_IN         1
+#define EHCI_PID_SETUP      2
+#define EHCI_QTD_CERR       (3 << 10)   // Retries on transaction errors
+#define EHCI_QTD_IOC        (1 << 15)
+#define EHCI_QTD_BYTES(t)   (((t) >> 16) & 0x7FFF)
+#define EHCI_QTD_TOGGLE     (1u << 31)
+
+// QH endpoint characteristics and capabilities
+#define EHCI_QH_EPS_HIGH    (2 << 12)
+#define EHCI_QH_DTC         (1 << 14)   // Data toggle from the qTDs, for control endpoints
+#define EHCI_QH_HEAD        (1 << 15)   // Head of the reclamation list
+#define EHCI_QH_MAXP(n)     ((uint32_t)(n) << 16)
+#define EHCI_QH_RL(n)       ((uint32_t)(n) << 28)   // NAK count reload, async list only
+#define EHCI_QH_MULT1       (1u << 30)
+
+struct ehci_qtd;
+
+// Queue element transfer descriptor, in the 64-bit layout which 32-bit
+// controllers simply do not read the end of
+typedef struct ehci_qtd {
+    volatile uint32_t next;
+    volatile uint32_t alt_next;     // Taken after a short packet
+    volatile uint32_t token;
+    volatile uint32_t buffer[5];
+    volatile uint32_t buffer_hi[5];
+    // Software state
+    usb_transfer_t *xfer;
+    uint32_t length;
+    bool last;                      // Last qTD of its transfer
+} __attribute__((aligned(32))) ehci_qtd_t;
+
+// Queue head. The queue ends in an inactive dummy qTD the controller keeps
+// rereading; a transfer is appended by filling the dummy in and activating
+// it last.
+typedef struct ehci_qh {
+    volatile uint32_t link;         // Horizontal link
+    volatile uint32_t info1;        // Endpoint characteristics
+    volatile uint32_t info2;        // Endpoint capabilities
+    volatile uint32_t current;
+    volatile uint32_t next;         // Transfer overlay
+    volatile uint32_t alt_next;
+    volatile uint32_t token;
+    volatile uint32_t buffer[5];
+    volatile uint32_t buffer_hi[5];
+    // Software state
+    ehci_qtd_t *head;               // Oldest qTD not reaped
+    ehci_qtd_t *dummy;
+    struct ehci_qh *next_qh;        // Async ring, or periodic chain
+    int level;                      // Periodic interval level, -1 on the async list
+    bool in_use;
+    bool control;
+} __attribute__((aligned(128))) ehci_qh_t;     // 32 to a page, so none crosses a 4K boundary
+
+struct ehci;
+
+typedef struct {
+    struct ehci *ec;
+    uint8_t address;
+    ehci_qh_t *ep0;
+} ehci_dev_t;
+
+typedef struct ehci {
+    usb_hcd_t hcd;
+    char name[8];
+    volatile uint8_t *cap;
+    volatile uint8_t *op;
+    int ports;
+    uint32_t *frame_list;
+    ehci_qh_t *async_head;          // Halted QH the async ring starts at
+    ehci_qh_t *skeleton[EHCI_PERIODIC_LEVELS];
+    ehci_qh_t *qhs;
+    ehci_qtd_t *qtds;
+    ehci_qtd_t *qtd_free;
+    int qtd_free_count;
+    ehci_dev_t devs[EHCI_MAX_DEVICES];
+    int dev_count;
+    uint8_t next_address;
+} ehci_t;
+
+int ehci_init();
+
+#endif // EHCI_H
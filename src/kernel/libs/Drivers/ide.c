@@ -0,0 +1,412 @@
+#include "ide.h"
+#include "pci.h"
+#include "block.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include "../System/time.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// PCI IDE driver with bus-master DMA
+//
+// For controllers in IDE mode, like QEMU's PIIX3 behind -hda. Every drive
+// gets a PRD table of its own, so queue() can build a command while the
+// other drive on the cable is still busy; commit() starts it as soon as
+// the channel is free. The two channels of a controller run in parallel.
+//
+// The kernel has no interrupt handling, so completion is taken from the
+// interrupt bit of the bus master status register, which latches the
+// drive's INTRQ line.
+
+static ide_ctrl_t ide_ctrls[IDE_MAX_CONTROLLERS];
+static int ide_ctrl_count = 0;
+static ide_drive_t ide_drives[IDE_MAX_DRIVES];
+static int ide_drive_count = 0;
+
+// Registers =============================================================
+
+// Status without clearing a pending interrupt
+static inline uint8_t ide_alt_status(ide_channel_t *ch) {
+    return inb(ch->ctrl);
+}
+
+// Reading the alternate status four times takes the 400ns a drive needs
+// to put up its status after a command or a select
+static void ide_delay(ide_channel_t *ch) {
+    for (int i = 0; i < 4; i++) {
+        ide_alt_status(ch);
+    }
+}
+
+// Wait until the bits of mask in the status are value, false after timeout_us
+static bool ide_wait(ide_channel_t *ch, uint8_t mask, uint8_t value, uint32_t timeout_us) {
+    uint64_t deadline = time_now_us() + timeout_us;
+    while ((ide_alt_status(ch) & mask) != value) {
+        if (time_now_us() > deadline) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Clear the interrupt and error latches, keeping the drive DMA bits
+static void ide_bm_ack(ide_channel_t *ch) {
+    outb(ch->bm + IDE_BM_STATUS, inb(ch->bm + IDE_BM_STATUS) | IDE_BM_SR_IRQ | IDE_BM_SR_ERR);
+}
+
+static void ide_select(ide_channel_t *ch, int slave, uint8_t lba_high) {
+    outb(ch->cmd + IDE_REG_DEVICE, IDE_DEV_LBA | (slave ? IDE_DEV_SLAVE : 0) | (lba_high & 0x0F));
+    ide_delay(ch);
+}
+
+// Soft reset both drives on the channel
+static void ide_reset_start(ide_channel_t *ch) {
+    outb(ch->ctrl, IDE_CTL_SRST);
+    uint64_t start = time_now_us();
+    while (time_now_us() < start + 5)   // SRST is held for at least 5us
+        ;
+    outb(ch->ctrl, 0);
+}
+
+// Bring-up ==============================================================
+
+// IDENTIFY DEVICE through PIO. False if there is no ATA drive at slave
+// (nothing at all, or an ATAPI device).
+static bool ide_identify(ide_channel_t *ch, int slave, uint16_t *buf) {
+    ide_select(ch, slave, 0);
+    outb(ch->cmd + IDE_REG_COUNT, 0);
+    outb(ch->cmd + IDE_REG_LBA0, 0);
+    outb(ch->cmd + IDE_REG_LBA1, 0);
+    outb(ch->cmd + IDE_REG_LBA2, 0);
+    outb(ch->cmd + IDE_REG_COMMAND, IDE_CMD_IDENTIFY);
+    ide_delay(ch);
+
+    uint8_t status = ide_alt_status(ch);
+    if (status == 0 || status == 0xFF) {
+        return false;   // No drive, or no channel
+    }
+    if (!ide_wait(ch, IDE_SR_BSY, 0, IDE_CMD_TIMEOUT_US)) {
+        return false;
+    }
+    // ATAPI and SATA bridges put their signature here and abort the command
+    if (inb(ch->cmd + IDE_REG_LBA1) != 0 || inb(ch->cmd + IDE_REG_LBA2) != 0) {
+        return false;
+    }
+    uint64_t deadline = time_now_us() + IDE_CMD_TIMEOUT_US;
+    while (!((status = ide_alt_status(ch)) & (IDE_SR_DRQ | IDE_SR_ERR))) {
+        if (time_now_us() > deadline) {
+            return false;
+        }
+    }
+    if (status & IDE_SR_ERR) {
+        return false;
+    }
+    for (int i = 0; i < 256; i++) {
+        buf[i] = inw(ch->cmd + IDE_REG_DATA);
+    }
+    inb(ch->cmd + IDE_REG_STATUS);      // Acknowledge the interrupt
+    return true;
+}
+
+// Commands ==============================================================
+
+// Fill the drive's PRD table. Entries stop at 64K boundaries of memory.
+static bool ide_build_prdt(ide_drive_t *d, const block_seg_t *segs, int nsegs) {
+    int n = 0;
+    for (int i = 0; i < nsegs; i++) {
+        uint32_t addr = (uint32_t)segs[i].buf;
+        uint32_t left = segs[i].count * d->blk.sector_size;
+        while (left > 0) {
+            if (n == IDE_PRD_ENTRIES) {
+                printk("IDE: too many PRD entries for one command\n");
+                return false;
+            }
+            uint32_t chunk = IDE_PRD_MAX_BYTES - (addr & (IDE_PRD_MAX_BYTES - 1));
+            if (chunk > left) {
+                chunk = left;
+            }
+            d->prdt[n].addr = addr;
+            d->prdt[n].bytes = (uint16_t)chunk;     // 64K wraps to 0, which means 64K
+            d->prdt[n].flags = 0;
+            addr += chunk;
+            left -= chunk;
+            n++;
+        }
+    }
+    if (n == 0) {
+        return false;
+    }
+    d->prdt[n - 1].flags = IDE_PRD_EOT;
+    return true;
+}
+
+// Program the task file and the bus master for the drive's request, then go
+static void ide_start(ide_channel_t *ch, ide_drive_t *d) {
+    io_request_t *rq = d->rq;
+    uint64_t lba = rq->grp_lba;
+    uint32_t count = rq->grp_count;
+
+    outb(ch->bm + IDE_BM_CMD, 0);
+    outl(ch->bm + IDE_BM_PRDT, (uint32_t)d->prdt);
+    ide_bm_ack(ch);
+    outb(ch->bm + IDE_BM_CMD, rq->write ? 0 : IDE_BM_CMD_READ);
+
+    uint8_t command;
+    if (d->lba48) {
+        ide_select(ch, d->slave, 0);
+        outb(ch->cmd + IDE_REG_COUNT, (count >> 8) & 0xFF);     // High bytes first
+        outb(ch->cmd + IDE_REG_LBA0, (lba >> 24) & 0xFF);
+        outb(ch->cmd + IDE_REG_LBA1, (lba >> 32) & 0xFF);
+        outb(ch->cmd + IDE_REG_LBA2, (lba >> 40) & 0xFF);
+        command = rq->write ? IDE_CMD_WRITE_DMA_EXT : IDE_CMD_READ_DMA_EXT;
+    } else {
+        ide_select(ch, d->slave, (lba >> 24) & 0x0F);
+        command = rq->write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA;
+    }
+    outb(ch->cmd + IDE_REG_COUNT, count & 0xFF);
+    outb(ch->cmd + IDE_REG_LBA0, lba & 0xFF);
+    outb(ch->cmd + IDE_REG_LBA1, (lba >> 8) & 0xFF);
+    outb(ch->cmd + IDE_REG_LBA2, (lba >> 16) & 0xFF);
+    outb(ch->cmd + IDE_REG_COMMAND, command);
+
+    outb(ch->bm + IDE_BM_CMD, (rq->write ? 0 : IDE_BM_CMD_READ) | IDE_BM_CMD_START);
+    d->ready = false;
+    ch->active = d;
+    ch->deadline = time_now_us() + IDE_CMD_TIMEOUT_US;
+}
+
+// Start a waiting drive if the channel is free, alternating between the two
+static void ide_channel_kick(ide_channel_t *ch) {
+    if (ch->active) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        ide_drive_t *d = ch->drives[(ch->next + i) & 1];
+        if (d && d->ready) {
+            ch->next = (d->slave + 1) & 1;
+            ide_start(ch, d);
+            return;
+        }
+    }
+}
+
+// Finish the running command if it is done, returns the drive it was for
+static ide_drive_t *ide_channel_reap(ide_channel_t *ch, bool *ok) {
+    ide_drive_t *d = ch->active;
+    if (d == NULL) {
+        return NULL;
+    }
+
+    uint8_t bm_status = inb(ch->bm + IDE_BM_STATUS);
+    if (!(bm_status & (IDE_BM_SR_IRQ | IDE_BM_SR_ERR))) {
+        if (time_now_us() <= ch->deadline) {
+            return NULL;
+        }
+        printk("IDE: %s command timed out\n", d->blk.name);
+        outb(ch->bm + IDE_BM_CMD, 0);
+        ide_reset_start(ch);
+        ide_wait(ch, IDE_SR_BSY, 0, IDE_RESET_TIMEOUT_US);
+        *ok = false;
+    } else {
+        outb(ch->bm + IDE_BM_CMD, 0);
+        uint8_t status = inb(ch->cmd + IDE_REG_STATUS);     // Also clears INTRQ
+        ide_bm_ack(ch);
+        *ok = !(bm_status & IDE_BM_SR_ERR) && !(status & (IDE_SR_ERR | IDE_SR_DF));
+    }
+    ch->active = NULL;
+    return d;
+}
+
+// Block device interface ================================================
+
+static bool ide_blk_queue(block_device_t *dev, io_request_t *rq, const block_seg_t *segs, int nsegs) {
+    ide_drive_t *d = (ide_drive_t *)dev->driver_data;
+    if (!ide_build_prdt(d, segs, nsegs)) {
+        return false;
+    }
+    d->rq = rq;
+    d->ready = true;
+    return true;
+}
+
+static void ide_blk_commit(block_device_t *dev) {
+    ide_channel_kick(((ide_drive_t *)dev->driver_data)->ch);
+}
+
+// Reaps for both drives of the channel, counts only the ones for dev
+static int ide_blk_poll(block_device_t *dev) {
+    ide_drive_t *d = (ide_drive_t *)dev->driver_data;
+    ide_channel_t *ch = d->ch;
+    bool ok = false;
+    int found = 0;
+
+    ide_drive_t *done = ide_channel_reap(ch, &ok);
+    if (done) {
+        io_request_t *rq = done->rq;
+        done->rq = NULL;
+        ide_channel_kick(ch);   // The other drive may be waiting
+        block_complete(&done->blk, rq, ok);
+        found = done == d;
+    }
+    return found;
+}
+
+// The block layer drains the drive first; the other drive on the cable may
+// still be busy, so wait for the channel before taking it
+static bool ide_blk_flush(block_device_t *dev) {
+    ide_drive_t *d = (ide_drive_t *)dev->driver_data;
+    ide_channel_t *ch = d->ch;
+    bool ok = false;
+
+    while (ch->active) {
+        ide_drive_t *done = ide_channel_reap(ch, &ok);
+        if (done) {
+            io_request_t *rq = done->rq;
+            done->rq = NULL;
+            block_complete(&done->blk, rq, ok);
+        }
+    }
+
+    ide_select(ch, d->slave, 0);
+    outb(ch->cmd + IDE_REG_COMMAND, d->lba48 ? IDE_CMD_FLUSH_CACHE_EXT : IDE_CMD_FLUSH_CACHE);
+    ide_delay(ch);
+    ok = ide_wait(ch, IDE_SR_BSY, 0, IDE_CMD_TIMEOUT_US) &&
+         !(inb(ch->cmd + IDE_REG_STATUS) & (IDE_SR_ERR | IDE_SR_DF));
+    ide_bm_ack(ch);
+
+    ide_channel_kick(ch);
+    return ok;
+}
+
+// Controller bring-up ===================================================
+
+static bool ide_register(ide_channel_t *ch, int slave, const uint16_t *id) {
+    if (ide_drive_count >= IDE_MAX_DRIVES) {
+        return false;
+    }
+    // Word 49 bit 8: DMA supported
+    if (!(id[49] & (1 << 8))) {
+        printk("IDE: drive without DMA skipped\n");
+        return false;
+    }
+    ide_drive_t *d = &ide_drives[ide_drive_count];
+    memset(d, 0, sizeof(ide_drive_t));
+    d->prdt = alloc_page();
+    if (d->prdt == NULL) {
+        printk("IDE: out of memory for PRD tables\n");
+        return false;
+    }
+    d->ch = ch;
+    d->slave = slave;
+
+    // Words 100-103 hold the LBA48 sector count when bit 10 of word 83 is set
+    d->lba48 = (id[83] & (1 << 10)) != 0;
+    if (d->lba48) {
+        d->blk.sector_count = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+                              ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+    } else {
+        d->blk.sector_count = (uint32_t)id[60] | ((uint32_t)id[61] << 16);
+    }
+
+    block_make_name(d->blk.name, "hd", ide_drive_count);
+    d->blk.sector_size = BLOCK_SECTOR_SIZE;
+    d->blk.max_sectors = d->lba48 ? IDE_MAX_SECTORS_LBA48 : IDE_MAX_SECTORS_LBA28;
+    d->blk.max_segs = BLOCK_MAX_SEGS;
+    d->blk.queue = ide_blk_queue;
+    d->blk.commit = ide_blk_commit;
+    d->blk.poll = ide_blk_poll;
+    d->blk.flush = ide_blk_flush;
+    d->blk.queue_depth = 1;
+    d->blk.driver_data = d;
+    if (!block_register(&d->blk)) {
+        return false;
+    }
+    ch->drives[slave] = d;
+    ide_drive_count++;
+
+    // Tell the BIOS-visible status which drives use DMA now
+    outb(ch->bm + IDE_BM_STATUS, (inb(ch->bm + IDE_BM_STATUS) & ~(IDE_BM_SR_IRQ | IDE_BM_SR_ERR)) |
+                                 (IDE_BM_SR_DMA0 << slave));
+
+    printk("%s: IDE %s %s, %d MiB, %s\n", d->blk.name, ch->cmd == IDE_PRIMARY_CMD ? "primary" :
+           ch->cmd == IDE_SECONDARY_CMD ? "secondary" : "native", slave ? "slave" : "master",
+           (int)(d->blk.sector_count >> 11), d->lba48 ? "LBA48" : "LBA28");
+    return true;
+}
+
+static bool ide_probe(struct pci_device *pdev) {
+    ide_ctrl_t *c = &ide_ctrls[ide_ctrl_count];
+    memset(c, 0, sizeof(ide_ctrl_t));
+    c->bus = pdev->bus;
+    c->device = pdev->device;
+    c->function = pdev->function;
+
+    uint32_t bar4 = pci_read_config_space(c->bus, c->device, c->function, 0x20);
+    if (!(pdev->prog_if & IDE_PROGIF_BUS_MASTER) || !(bar4 & 1) || (bar4 & ~3) == 0) {
+        printk("IDE: controller without bus mastering skipped\n");
+        return false;
+    }
+
+    // Ports: fixed in compatibility mode, from BAR0-3 in native mode
+    for (int i = 0; i < 2; i++) {
+        ide_channel_t *ch = &c->channels[i];
+        bool native = pdev->prog_if & (i == 0 ? IDE_PROGIF_PRIMARY_NATIVE : IDE_PROGIF_SECONDARY_NATIVE);
+        if (native) {
+            ch->cmd = pci_read_config_space(c->bus, c->device, c->function, 0x10 + i * 8) & ~3;
+            ch->ctrl = (pci_read_config_space(c->bus, c->device, c->function, 0x14 + i * 8) & ~3) + 2;
+        } else {
+            ch->cmd = i == 0 ? IDE_PRIMARY_CMD : IDE_SECONDARY_CMD;
+            ch->ctrl = i == 0 ? IDE_PRIMARY_CTRL : IDE_SECONDARY_CTRL;
+        }
+        ch->bm = (bar4 & ~3) + i * 8;
+    }
+
+    // I/O decoding and bus mastering on, legacy INTx off since completions are polled
+    uint32_t command = pci_read_config_space(c->bus, c->device, c->function, 0x04) & 0xFFFF;
+    pci_write_config_space(c->bus, c->device, c->function, 0x04,
+                           command | PCI_COMMAND_IO | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+
+    // Reset both channels together, then wait for them. An empty channel
+    // floats its status at 0xFF.
+    for (int i = 0; i < 2; i++) {
+        outb(c->channels[i].bm + IDE_BM_CMD, 0);
+        ide_reset_start(&c->channels[i]);
+    }
+    static uint16_t id[256];
+    int found = 0;
+    for (int i = 0; i < 2; i++) {
+        ide_channel_t *ch = &c->channels[i];
+        if (ide_alt_status(ch) == 0xFF || !ide_wait(ch, IDE_SR_BSY, 0, IDE_RESET_TIMEOUT_US)) {
+            continue;
+        }
+        for (int slave = 0; slave < 2; slave++) {
+            if (ide_identify(ch, slave, id) && ide_register(ch, slave, id)) {
+                found++;
+            }
+        }
+    }
+    return found > 0;
+}
+
+static bool ide_pci_probe(struct pci_device *dev, const struct pci_device_id *id) {
+    (void)id;
+    if (ide_ctrl_count >= IDE_MAX_CONTROLLERS || !ide_probe(dev)) {
+        return false;
+    }
+    ide_ctrl_count++;
+    return true;
+}
+
+static const struct pci_device_id ide_pci_ids[] = {
+    { PCI_ANY_ID, PCI_ANY_ID, IDE_PCI_CLASS << 16 | IDE_PCI_SUBCLASS << 8, PCI_CLASS_MASK_SUBCLASS },
+    { 0 }
+};
+
+static struct pci_driver ide_pci_driver = { "ide", ide_pci_ids, ide_pci_probe };
+
+// Probe every IDE controller on the PCI bus, returns how many have drives
+int ide_init() {
+    pci_register_driver(&ide_pci_driver);
+    return ide_ctrl_count;
+}
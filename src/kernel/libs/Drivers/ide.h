@@ -0,0 +1,112 @@
+#ifndef IDE_H
+#define IDE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block.h"
+
+// PCI class 01h (mass storage), subclass 01h (IDE)
+#define IDE_PCI_CLASS      0x01
+#define IDE_PCI_SUBCLASS   0x01
+#define IDE_PROGIF_PRIMARY_NATIVE    0x01
+#define IDE_PROGIF_SECONDARY_NATIVE  0x04
+#define IDE_PROGIF_BUS_MASTER        0x80
+
+#define IDE_MAX_CONTROLLERS  2
+#define IDE_MAX_DRIVES       8
+#define IDE_PRD_ENTRIES      512     // One page per drive
+#define IDE_PRD_MAX_BYTES    0x10000 // An entry may not cross a 64K boundary either
+#define IDE_MAX_SECTORS_LBA48 2048   // 1 MiB per command
+#define IDE_MAX_SECTORS_LBA28 256
+#define IDE_CMD_TIMEOUT_US   5000000
+#define IDE_RESET_TIMEOUT_US 5000000
+
+// Compatibility mode ports
+#define IDE_PRIMARY_CMD      0x1F0
+#define IDE_PRIMARY_CTRL     0x3F6
+#define IDE_SECONDARY_CMD    0x170
+#define IDE_SECONDARY_CTRL   0x376
+
+// Task file registers, offsets from the command block
+#define IDE_REG_DATA     0
+#define IDE_REG_ERROR    1
+#define IDE_REG_FEATURES 1
+#define IDE_REG_COUNT    2
+#define IDE_REG_LBA0     3
+#define IDE_REG_LBA1     4
+#define IDE_REG_LBA2     5
+#define IDE_REG_DEVICE   6
+#define IDE_REG_STATUS   7
+#define IDE_REG_COMMAND  7
+
+#define IDE_SR_BSY   0x80
+#define IDE_SR_DRDY  0x40
+#define IDE_SR_DF    0x20
+#define IDE_SR_DRQ   0x08
+#define IDE_SR_ERR   0x01
+
+#define IDE_CTL_SRST 0x04
+#define IDE_DEV_LBA  0x40
+#define IDE_DEV_SLAVE 0x10
+
+// Bus master registers, offsets from the channel's part of BAR4
+#define IDE_BM_CMD     0
+#define IDE_BM_STATUS  2
+#define IDE_BM_PRDT    4
+
+#define IDE_BM_CMD_START  0x01
+#define IDE_BM_CMD_READ   0x08   // Device to memory
+#define IDE_BM_SR_ACTIVE  0x01
+#define IDE_BM_SR_ERR     0x02
+#define IDE_BM_SR_IRQ     0x04   // Latched INTRQ, set when the command has finished
+#define IDE_BM_SR_DMA0    0x20   // Drive 0 is set up for DMA
+
+// ATA commands
+#define IDE_CMD_READ_DMA       0xC8
+#define IDE_CMD_WRITE_DMA      0xCA
+#define IDE_CMD_READ_DMA_EXT   0x25
+#define IDE_CMD_WRITE_DMA_EXT  0x35
+#define IDE_CMD_FLUSH_CACHE    0xE7
+#define IDE_CMD_FLUSH_CACHE_EXT 0xEA
+#define IDE_CMD_IDENTIFY       0xEC
+
+// Physical region descriptor
+typedef struct {
+    uint32_t addr;
+    uint16_t bytes;     // 0 means 64K
+    uint16_t flags;     // Bit 15 marks the last entry
+} __attribute__((packed)) ide_prd_t;
+
+#define IDE_PRD_EOT 0x8000
+
+struct ide_channel;
+
+typedef struct ide_drive {
+    block_device_t blk;
+    struct ide_channel *ch;
+    int slave;
+    bool lba48;
+    ide_prd_t *prdt;
+    io_request_t *rq;   // Built, then running once the channel is free
+    bool ready;         // rq waits for the channel
+} ide_drive_t;
+
+// One cable: a command at a time for its master and slave
+typedef struct ide_channel {
+    uint16_t cmd;
+    uint16_t ctrl;
+    uint16_t bm;
+    ide_drive_t *drives[2];
+    ide_drive_t *active;
+    uint64_t deadline;
+    int next;           // Drive that gets the channel first next time
+} ide_channel_t;
+
+typedef struct {
+    ide_channel_t channels[2];
+    uint8_t bus, device, function;
+} ide_ctrl_t;
+
+int ide_init();
+
+#endif // IDE_H
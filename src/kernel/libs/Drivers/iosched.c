@@ -0,0 +1,372 @@
+#include "iosched.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include "../System/time.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Deadline I/O scheduler
+//
+// Every direction keeps two views of the same requests: a list sorted by LBA
+// that the elevator walks, and a FIFO ordered by deadline. Requests are
+// dispatched in LBA order in batches of fifo_batch; between batches the FIFO
+// head is checked and an expired request restarts the elevator from there.
+// Reads are preferred, but writes get a batch after writes_starved read
+// batches so they cannot starve either.
+//
+// Adjacent requests in the same direction are merged into one command while
+// the result still fits the device's max_sectors/max_segs limits. A merged
+// group is represented by its head request; the members hang off head->chain
+// in LBA order and are each completed once the command finishes.
+
+static int rq_dir(io_request_t *rq) {
+    return rq->write ? IOSCHED_WRITE : IOSCHED_READ;
+}
+
+static uint8_t *rq_buf_end(io_sched_t *s, io_request_t *rq) {
+    return (uint8_t *)rq->buf + rq->count * s->dev->sector_size;
+}
+
+void iosched_init(io_sched_t *s, block_device_t *dev) {
+    memset(s, 0, sizeof(io_sched_t));
+    s->dev = dev;
+    s->last_dir = IOSCHED_READ;
+    s->read_expire = IOSCHED_READ_EXPIRE;
+    s->write_expire = IOSCHED_WRITE_EXPIRE;
+    s->fifo_batch = IOSCHED_FIFO_BATCH;
+    s->writes_starved = IOSCHED_WRITES_STARVED;
+}
+
+// Sorted list ===========================================================
+
+static void sort_insert_after(io_sched_t *s, int dir, io_request_t *prev, io_request_t *rq) {
+    rq->sort_prev = prev;
+    if (prev == NULL) {
+        rq->sort_next = s->sort_head[dir];
+        s->sort_head[dir] = rq;
+    } else {
+        rq->sort_next = prev->sort_next;
+        prev->sort_next = rq;
+    }
+    if (rq->sort_next) {
+        rq->sort_next->sort_prev = rq;
+    }
+}
+
+static void sort_remove(io_sched_t *s, int dir, io_request_t *rq) {
+    if (rq->sort_prev) {
+        rq->sort_prev->sort_next = rq->sort_next;
+    } else {
+        s->sort_head[dir] = rq->sort_next;
+    }
+    if (rq->sort_next) {
+        rq->sort_next->sort_prev = rq->sort_prev;
+    }
+    if (s->next_rq[dir] == rq) {
+        s->next_rq[dir] = rq->sort_next;
+    }
+    rq->sort_prev = rq->sort_next = NULL;
+}
+
+// Deadline FIFO =========================================================
+
+static void fifo_insert(io_sched_t *s, int dir, io_request_t *rq) {
+    // Almost always an append, walk back only past later deadlines
+    io_request_t *pos = s->fifo_tail[dir];
+    while (pos && pos->deadline > rq->deadline) {
+        pos = pos->fifo_prev;
+    }
+
+    rq->fifo_prev = pos;
+    if (pos == NULL) {
+        rq->fifo_next = s->fifo_head[dir];
+        s->fifo_head[dir] = rq;
+    } else {
+        rq->fifo_next = pos->fifo_next;
+        pos->fifo_next = rq;
+    }
+    if (rq->fifo_next) {
+        rq->fifo_next->fifo_prev = rq;
+    } else {
+        s->fifo_tail[dir] = rq;
+    }
+}
+
+static void fifo_remove(io_sched_t *s, int dir, io_request_t *rq) {
+    if (rq->fifo_prev) {
+        rq->fifo_prev->fifo_next = rq->fifo_next;
+    } else {
+        s->fifo_head[dir] = rq->fifo_next;
+    }
+    if (rq->fifo_next) {
+        rq->fifo_next->fifo_prev = rq->fifo_prev;
+    } else {
+        s->fifo_tail[dir] = rq->fifo_prev;
+    }
+    rq->fifo_prev = rq->fifo_next = NULL;
+}
+
+// Merging ===============================================================
+
+static bool merge_fits(io_sched_t *s, uint32_t count, uint32_t segs) {
+    return count <= s->dev->max_sectors && segs <= s->dev->max_segs;
+}
+
+// Can a new scatter-gather entry start at b right after one ending at a?
+static bool seg_boundary_ok(io_sched_t *s, uint8_t *a_end, void *b) {
+    uint32_t mask = s->dev->virt_boundary - 1;
+    if (s->dev->virt_boundary == 0) {
+        return true;
+    }
+    return ((uintptr_t)a_end & mask) == 0 && ((uintptr_t)b & mask) == 0;
+}
+
+static io_request_t *chain_tail(io_request_t *grp) {
+    io_request_t *m = grp->chain;
+    while (m->chain_next) {
+        m = m->chain_next;
+    }
+    return m;
+}
+
+static bool try_back_merge(io_sched_t *s, io_request_t *grp, io_request_t *rq) {
+    if (grp->grp_lba + grp->grp_count != rq->lba) {
+        return false;
+    }
+
+    io_request_t *last = chain_tail(grp);
+    bool contiguous = rq_buf_end(s, last) == (uint8_t *)rq->buf;
+    uint32_t segs = grp->grp_segs + (contiguous ? 0 : 1);
+    if (!merge_fits(s, grp->grp_count + rq->count, segs)) {
+        return false;
+    }
+    if (!contiguous && !seg_boundary_ok(s, rq_buf_end(s, last), rq->buf)) {
+        return false;
+    }
+
+    last->chain_next = rq;
+    rq->chain_next = NULL;
+    grp->grp_count += rq->count;
+    grp->grp_segs = segs;
+    return true;
+}
+
+static bool try_front_merge(io_sched_t *s, io_request_t *grp, io_request_t *rq) {
+    if (rq->lba + rq->count != grp->grp_lba) {
+        return false;
+    }
+
+    bool contiguous = rq_buf_end(s, rq) == (uint8_t *)grp->chain->buf;
+    uint32_t segs = grp->grp_segs + (contiguous ? 0 : 1);
+    if (!merge_fits(s, grp->grp_count + rq->count, segs)) {
+        return false;
+    }
+    if (!contiguous && !seg_boundary_ok(s, rq_buf_end(s, rq), grp->chain->buf)) {
+        return false;
+    }
+
+    rq->chain_next = grp->chain;
+    grp->chain = rq;
+    grp->grp_lba = rq->lba;
+    grp->grp_count += rq->count;
+    grp->grp_segs = segs;
+    return true;
+}
+
+// A merge may have closed the gap between two queued groups, join them
+static void try_coalesce(io_sched_t *s, int dir, io_request_t *a, io_request_t *b) {
+    if (a->grp_lba + a->grp_count != b->grp_lba) {
+        return;
+    }
+
+    io_request_t *last = chain_tail(a);
+    bool contiguous = rq_buf_end(s, last) == (uint8_t *)b->chain->buf;
+    uint32_t segs = a->grp_segs + b->grp_segs - (contiguous ? 1 : 0);
+    if (!merge_fits(s, a->grp_count + b->grp_count, segs)) {
+        return;
+    }
+    if (!contiguous && !seg_boundary_ok(s, rq_buf_end(s, last), b->chain->buf)) {
+        return;
+    }
+
+    sort_remove(s, dir, b);
+    fifo_remove(s, dir, b);
+
+    last->chain_next = b->chain;
+    a->grp_count += b->grp_count;
+    a->grp_segs = segs;
+
+    // The group must expire as early as its oldest member
+    if (b->deadline < a->deadline) {
+        fifo_remove(s, dir, a);
+        a->deadline = b->deadline;
+        fifo_insert(s, dir, a);
+    }
+    s->stats.coalesced++;
+}
+
+void iosched_add(io_sched_t *s, io_request_t *rq) {
+    int dir = rq_dir(rq);
+
+    rq->status = IO_PENDING;
+    rq->chain = rq;
+    rq->chain_next = NULL;
+    rq->grp_lba = rq->lba;
+    rq->grp_count = rq->count;
+    rq->grp_segs = 1;
+    rq->deadline = time_now_us() + (dir == IOSCHED_READ ? s->read_expire : s->write_expire);
+    s->stats.queued++;
+
+    // Find the last group starting at or before this request
+    io_request_t *prev = NULL;
+    for (io_request_t *g = s->sort_head[dir]; g && g->grp_lba <= rq->lba; g = g->sort_next) {
+        prev = g;
+    }
+    io_request_t *next = prev ? prev->sort_next : s->sort_head[dir];
+
+    if (prev && try_back_merge(s, prev, rq)) {
+        s->stats.back_merges++;
+        if (next) {
+            try_coalesce(s, dir, prev, next);
+        }
+        return;
+    }
+    if (next && try_front_merge(s, next, rq)) {
+        s->stats.front_merges++;
+        if (prev) {
+            try_coalesce(s, dir, prev, next);
+        }
+        return;
+    }
+
+    sort_insert_after(s, dir, prev, rq);
+    fifo_insert(s, dir, rq);
+}
+
+// Dispatch ==============================================================
+
+static io_request_t *iosched_select(io_sched_t *s) {
+    io_request_t *rq;
+    int dir;
+
+    // Continue the current batch in LBA order
+    if (s->next_rq[s->last_dir] && s->batching < s->fifo_batch) {
+        dir = s->last_dir;
+        rq = s->next_rq[dir];
+        goto dispatch;
+    }
+
+    bool reads = s->fifo_head[IOSCHED_READ] != NULL;
+    bool writes = s->fifo_head[IOSCHED_WRITE] != NULL;
+
+    if (reads) {
+        if (writes && s->starved++ >= s->writes_starved) {
+            goto dispatch_writes;
+        }
+        dir = IOSCHED_READ;
+        goto pick;
+    }
+    if (writes) {
+dispatch_writes:
+        s->starved = 0;
+        dir = IOSCHED_WRITE;
+        goto pick;
+    }
+    return NULL;
+
+pick:
+    // New batch: start at the oldest request if it expired or the elevator ran off the end
+    if (s->fifo_head[dir]->deadline <= time_now_us()) {
+        rq = s->fifo_head[dir];
+        s->stats.expired++;
+    } else if (s->next_rq[dir]) {
+        rq = s->next_rq[dir];
+    } else {
+        rq = s->fifo_head[dir];
+    }
+    s->batching = 0;
+
+dispatch:
+    s->last_dir = dir;
+    s->batching++;
+    s->next_rq[dir] = rq->sort_next;
+    sort_remove(s, dir, rq);
+    fifo_remove(s, dir, rq);
+    return rq;
+}
+
+bool iosched_dispatch(io_sched_t *s) {
+    block_device_t *dev = s->dev;
+    if (dev->queue && dev->inflight >= dev->queue_depth) {
+        return false;
+    }
+
+    io_request_t *rq = iosched_select(s);
+    if (rq == NULL) {
+        return false;
+    }
+
+    // Build the scatter-gather list, folding members whose buffers touch
+    block_seg_t segs[BLOCK_MAX_SEGS];
+    int nsegs = 0;
+    for (io_request_t *m = rq->chain; m; m = m->chain_next) {
+        if (nsegs > 0 && (uint8_t *)segs[nsegs-1].buf + segs[nsegs-1].count * dev->sector_size == (uint8_t *)m->buf) {
+            segs[nsegs-1].count += m->count;
+        } else {
+            segs[nsegs].buf = m->buf;
+            segs[nsegs].count = m->count;
+            nsegs++;
+        }
+    }
+
+    s->stats.dispatched++;
+    s->stats.sectors += rq->grp_count;
+
+    if (dev->queue) {
+        // Completion arrives later through the driver's poll()
+        dev->inflight++;
+        if (!dev->queue(dev, rq, segs, nsegs)) {
+            dev->inflight--;
+            iosched_complete(s, rq, false);
+        }
+        return true;
+    }
+
+    iosched_complete(s, rq, dev->transfer(dev, rq->grp_lba, segs, nsegs, rq->write));
+    return true;
+}
+
+// Finish every request merged into the group headed by rq
+void iosched_complete(io_sched_t *s, io_request_t *rq, bool ok) {
+    if (!ok) {
+        s->stats.errors++;
+    }
+
+    // Completion callbacks may recycle the request, so read chain_next first
+    io_request_t *m = rq->chain;
+    while (m) {
+        io_request_t *next = m->chain_next;
+        m->status = ok ? IO_DONE : IO_ERROR;
+        if (m->end_io) {
+            m->end_io(m);
+        }
+        m = next;
+    }
+}
+
+bool iosched_pending(io_sched_t *s) {
+    return s->fifo_head[IOSCHED_READ] != NULL || s->fifo_head[IOSCHED_WRITE] != NULL;
+}
+
+void iosched_print_stats(io_sched_t *s) {
+    io_sched_stats_t *st = &s->stats;
+    uint32_t saved = st->back_merges + st->front_merges + st->coalesced;
+
+    printk("%s: queued %d, dispatched %d, saved %d commands\n",
+           s->dev->name, st->queued, st->dispatched, saved);
+    printk("  merges: back %d, front %d, coalesced %d\n",
+           st->back_merges, st->front_merges, st->coalesced);
+    printk("  expired %d, errors %d, %d KiB transferred\n",
+           st->expired, st->errors, (int)(st->sectors * s->dev->sector_size / 1024));
+}
@@ -0,0 +1,56 @@
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block.h"
+
+// Deadline scheduler defaults (microseconds / request counts)
+#define IOSCHED_READ_EXPIRE   500000   // 0.5 s
+#define IOSCHED_WRITE_EXPIRE  5000000  // 5 s
+#define IOSCHED_FIFO_BATCH    16       // Requests dispatched in LBA order before re-checking deadlines
+#define IOSCHED_WRITES_STARVED 2       // Read batches allowed to pass pending writes
+
+#define IOSCHED_READ  0
+#define IOSCHED_WRITE 1
+
+typedef struct {
+    uint32_t queued;        // Requests submitted
+    uint32_t back_merges;   // Appended to the end of a queued request
+    uint32_t front_merges;  // Prepended to the start of a queued request
+    uint32_t coalesced;     // Two queued requests joined after a merge closed the gap
+    uint32_t dispatched;    // Commands actually sent to the driver
+    uint32_t expired;       // Dispatches forced by an expired deadline
+    uint32_t errors;
+    uint64_t sectors;
+} io_sched_stats_t;
+
+typedef struct io_sched {
+    block_device_t *dev;
+
+    // Per direction: LBA sorted list and deadline ordered FIFO
+    io_request_t *sort_head[2];
+    io_request_t *fifo_head[2];
+    io_request_t *fifo_tail[2];
+    io_request_t *next_rq[2];   // Where the elevator continues in each direction
+    uint32_t batching;
+    uint32_t starved;
+    int last_dir;
+
+    // Tunables
+    uint32_t read_expire;
+    uint32_t write_expire;
+    uint32_t fifo_batch;
+    uint32_t writes_starved;
+
+    io_sched_stats_t stats;
+} io_sched_t;
+
+void iosched_init(io_sched_t *s, block_device_t *dev);
+void iosched_add(io_sched_t *s, io_request_t *req);
+bool iosched_dispatch(io_sched_t *s);   // Issue one command, false if nothing was queued or the driver is full
+void iosched_complete(io_sched_t *s, io_request_t *rq, bool ok);
+bool iosched_pending(io_sched_t *s);
+void iosched_print_stats(io_sched_t *s);
+
+#endif // IOSCHED_H
@@ -10,5 +10,7 @@ uint16_t inw(uint16_t port);
 unsigned char inb(unsigned short port);
 void outw(uint16_t port, uint16_t value);
 void outb(uint16_t port, uint8_t value);
+uint32_t inl(uint32_t port);
+void outl(uint16_t port, uint32_t value);
 
 #endif // SYSTEM_H
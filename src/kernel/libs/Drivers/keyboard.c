@@ -1,5 +1,6 @@
 #include "usb.h"
 #include "kernel.h"
+#include "../System/system.h"
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -12,25 +13,52 @@
 // PS/2 Status Register Bits
 #define PS2_STATUS_OUTPUT_FULL 0x01
 #define PS2_STATUS_INPUT_FULL  0x02
+#define PS2_STATUS_AUX_DATA    0x20  // The byte is from the mouse port
 
 // USB Keyboard Specific Constants
 #define USB_KEYBOARD_INTERFACE_CLASS    USB_HID_CLASS
 #define USB_KEYBOARD_INTERFACE_SUBCLASS USB_HID_SUBCLASS_BOOT
 #define USB_KEYBOARD_INTERFACE_PROTOCOL USB_HID_PROTOCOL_KEYBOARD
-#define MAX_USB_DEVICES 128
+
+// HID class requests
+#define USB_HID_REQUEST_SET_IDLE     0x0A
+#define USB_HID_REQUEST_SET_PROTOCOL 0x0B
+#define USB_HID_BOOT_PROTOCOL        0
+
+// Boot protocol report: modifiers, reserved, then up to six pressed keys
+#define USB_HID_REPORT_SIZE   8
+#define USB_HID_MOD_CTRL      0x11  // Left or right
+#define USB_HID_MOD_SHIFT     0x22
+#define USB_HID_ROLLOVER      0x01  // Every key slot reads this when too many keys are down
+#define USB_KEYBOARD_MAX_ERRORS 3
+
+// Keys from both keyboards, in the codes of scancode_to_ascii
+#define KEY_RING_SIZE 64
+
+typedef struct {
+    usb_device_t *dev;
+    usb_endpoint_t *ep;
+    usb_transfer_t xfer;
+    uint8_t report[USB_HID_REPORT_SIZE] __attribute__((aligned(USB_HID_REPORT_SIZE)));
+    uint8_t prev[USB_HID_REPORT_SIZE];
+    bool failed;        // The interrupt transfer needs recovering
+    int errors;         // In a row
+} usb_keyboard_t;
 
 // Global USB Keyboard Device
 static usb_device_t *usb_keyboard_device = NULL;
-int max_devices = 128;
-usb_device_t usb_devices[128];
+static usb_keyboard_t usb_keyboard;
+
+static uint8_t key_ring[KEY_RING_SIZE];
+static uint32_t key_head = 0;
+static uint32_t key_tail = 0;
 
 // Function Prototypes
 static bool ps2_keyboard_wait_for_input();
-static uint8_t ps2_keyboard_read_data();
+static void ps2_keyboard_poll();
 static void ps2_keyboard_init();
-static bool usb_keyboard_init();
-static uint8_t usb_keyboard_read_key();
-int usb_enumerate_devices(usb_devices, max_devices);
+static bool usb_keyboard_probe(usb_device_t *dev, usb_interface_t *intf);
+static void usb_keyboard_poll();
 
 // PS/2 Keyboard Functions
 
@@ -68,12 +96,49 @@ char scancode_to_ascii[128] = {
     [0x37] = '*', [0x38] = 8, // Left Alt
     [0x39] = ' ', // Space
 };
-// Read a byte from the PS/2 data port
-static uint8_t ps2_keyboard_read_data() {
-    if (ps2_keyboard_wait_for_input()) {
-        return scancode_to_ascii[inb(PS2_DATA_PORT)];
+
+// HID keyboard usages (page 07h) as the set 1 scancodes PS/2 keyboards send
+static const uint8_t hid_usage_to_scancode[0x56] = {
+    [0x04] = 0x1E, [0x05] = 0x30, [0x06] = 0x2E, [0x07] = 0x20, // a b c d
+    [0x08] = 0x12, [0x09] = 0x21, [0x0A] = 0x22, [0x0B] = 0x23, // e f g h
+    [0x0C] = 0x17, [0x0D] = 0x24, [0x0E] = 0x25, [0x0F] = 0x26, // i j k l
+    [0x10] = 0x32, [0x11] = 0x31, [0x12] = 0x18, [0x13] = 0x19, // m n o p
+    [0x14] = 0x10, [0x15] = 0x13, [0x16] = 0x1F, [0x17] = 0x14, // q r s t
+    [0x18] = 0x16, [0x19] = 0x2F, [0x1A] = 0x11, [0x1B] = 0x2D, // u v w x
+    [0x1C] = 0x15, [0x1D] = 0x2C,                               // y z
+    [0x1E] = 0x02, [0x1F] = 0x03, [0x20] = 0x04, [0x21] = 0x05, // 1 2 3 4
+    [0x22] = 0x06, [0x23] = 0x07, [0x24] = 0x08, [0x25] = 0x09, // 5 6 7 8
+    [0x26] = 0x0A, [0x27] = 0x0B,                               // 9 0
+    [0x28] = 0x1C, // Enter
+    [0x29] = 0x01, // Escape
+    [0x2A] = 0x0E, // Backspace
+    [0x2B] = 0x0F, // Tab
+    [0x2C] = 0x39, // Space
+    [0x2D] = 0x0C, [0x2E] = 0x0D, [0x2F] = 0x1A, [0x30] = 0x1B, // - = [ ]
+    [0x31] = 0x2B, [0x32] = 0x2B,                               // \ and non-US #
+    [0x33] = 0x27, [0x34] = 0x28, [0x35] = 0x29,                // ; ' `
+    [0x36] = 0x33, [0x37] = 0x34, [0x38] = 0x35,                // , . /
+    [0x55] = 0x37, // Keypad *
+};
+
+// Key event ring
+
+static void keyboard_push(uint8_t key) {
+    if (key != 0 && key_head - key_tail < KEY_RING_SIZE) {
+        key_ring[key_head++ % KEY_RING_SIZE] = key;
+    }
+}
+
+// Move the scancodes the controller holds into the ring; key releases
+// and prefixes are dropped
+static void ps2_keyboard_poll() {
+    uint8_t status;
+    while ((status = inb(PS2_STATUS_PORT)) & PS2_STATUS_OUTPUT_FULL) {
+        uint8_t scancode = inb(PS2_DATA_PORT);
+        if (!(status & PS2_STATUS_AUX_DATA) && scancode < 0x80) {
+            keyboard_push(scancode_to_ascii[scancode]);
+        }
     }
-    return 0;
 }
 
 // Initialize the PS/2 keyboard
@@ -91,61 +156,156 @@ static void ps2_keyboard_init() {
     outb(PS2_COMMAND_PORT, 0xAE);
     outb(PS2_COMMAND_PORT, 0xA8);
 
-    // Enable keyboard interrupts
+    // Enable keyboard interrupts; the configuration byte is only written
+    // back once it was read, so scancode translation stays as it is
     outb(PS2_COMMAND_PORT, 0x20);
-    uint8_t status = inb(PS2_DATA_PORT) | 0x01;
-    outb(PS2_COMMAND_PORT, 0x60);
-    outb(PS2_DATA_PORT, status);
+    if (ps2_keyboard_wait_for_input()) {
+        uint8_t status = inb(PS2_DATA_PORT) | 0x01;
+        outb(PS2_COMMAND_PORT, 0x60);
+        outb(PS2_DATA_PORT, status);
+    }
 
     printk("PS/2 Keyboard Initialized\n");
 }
 
 // USB Keyboard Functions
 
-// Initialize the USB keyboard
-static bool usb_keyboard_init() {
-    for (uint8_t i = 0; i < 256; i++) {
-        usb_device_t *device = &usb_devices[i];
-        if (device->class_code == USB_KEYBOARD_INTERFACE_CLASS &&
-            device->subclass_code == USB_KEYBOARD_INTERFACE_SUBCLASS &&
-            device->protocol_code == USB_KEYBOARD_INTERFACE_PROTOCOL) {
-            usb_keyboard_device = device;
-            printk("USB Keyboard Found at Address: %d\n", device->address);
+static bool hid_report_has(const uint8_t *report, uint8_t usage) {
+    for (int i = 2; i < USB_HID_REPORT_SIZE; i++) {
+        if (report[i] == usage) {
             return true;
         }
     }
-    printk("No USB Keyboard Found\n");
     return false;
 }
 
-// Read a key from the USB keyboard
-static uint8_t usb_keyboard_read_key() {
-    if (!usb_keyboard_device) {
-        return 0;
+// Push the keys that went down since the previous report. Held modifiers
+// go first as their own codes, which is what the PS/2 keyboard's typematic
+// modifier make codes look like to the readers.
+static void usb_keyboard_report(usb_keyboard_t *kbd) {
+    const uint8_t *report = kbd->report;
+    if (report[2] == USB_HID_ROLLOVER) {
+        return;     // Phantom state: the keys are unknown, keep the old ones
+    }
+    for (int i = 2; i < USB_HID_REPORT_SIZE; i++) {
+        uint8_t usage = report[i];
+        if (usage < sizeof(hid_usage_to_scancode) && hid_usage_to_scancode[usage] &&
+            !hid_report_has(kbd->prev, usage)) {
+            if (report[0] & USB_HID_MOD_CTRL) {
+                keyboard_push(scancode_to_ascii[0x1D]);
+            }
+            if (report[0] & USB_HID_MOD_SHIFT) {
+                keyboard_push(scancode_to_ascii[0x2A]);
+            }
+            keyboard_push(scancode_to_ascii[hid_usage_to_scancode[usage]]);
+        }
     }
+    memcpy(kbd->prev, report, USB_HID_REPORT_SIZE);
+}
 
-    uint8_t buffer[8];
-    if (usb_control_transfer(usb_keyboard_device, 0x81, 0x06, 0x0100, 0x00, buffer, 8)) {
-        return buffer[2]; // Return the keycode from the HID report
+// The controller polls the interrupt endpoint at the device's interval;
+// a report only completes the transfer when the keys changed
+static void usb_keyboard_complete(usb_transfer_t *xfer) {
+    usb_keyboard_t *kbd = xfer->private_data;
+    if (xfer->status != USB_XFER_DONE) {
+        kbd->failed = true;
+        return;
+    }
+    kbd->errors = 0;
+    if (xfer->actual >= 3) {
+        usb_keyboard_report(kbd);
     }
-    return 0;
+    if (!usb_submit(xfer)) {
+        kbd->failed = true;
+    }
+}
+
+static bool usb_keyboard_start(usb_keyboard_t *kbd) {
+    usb_transfer_t *xfer = &kbd->xfer;
+    memset(xfer, 0, sizeof(usb_transfer_t));
+    xfer->dev = kbd->dev;
+    xfer->ep = kbd->ep;
+    xfer->buf = kbd->report;
+    xfer->length = kbd->ep->max_packet_size < USB_HID_REPORT_SIZE ? kbd->ep->max_packet_size : USB_HID_REPORT_SIZE;
+    xfer->complete = usb_keyboard_complete;
+    xfer->private_data = kbd;
+    return usb_submit(xfer);
 }
 
+static bool usb_keyboard_probe(usb_device_t *dev, usb_interface_t *intf) {
+    usb_keyboard_t *kbd = &usb_keyboard;
+    usb_endpoint_t *ep = usb_find_endpoint(dev, intf, USB_EP_INTERRUPT, true);
+    if (usb_keyboard_device || ep == NULL) {
+        return false;
+    }
+    // Boot protocol, so reports have the fixed 8 byte layout
+    if (usb_control_transfer(dev, USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE, USB_HID_REQUEST_SET_PROTOCOL,
+                             USB_HID_BOOT_PROTOCOL, intf->number, NULL, 0) < 0) {
+        printk("USB keyboard: SET_PROTOCOL failed\n");
+        return false;
+    }
+    // Report only on changes; optional, some keyboards stall it
+    usb_control_transfer(dev, USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE, USB_HID_REQUEST_SET_IDLE,
+                         0, intf->number, NULL, 0);
+
+    memset(kbd, 0, sizeof(usb_keyboard_t));
+    kbd->dev = dev;
+    kbd->ep = ep;
+    if (!usb_keyboard_start(kbd)) {
+        printk("USB keyboard: interrupt transfer not queued\n");
+        return false;
+    }
+    usb_keyboard_device = dev;
+    printk("USB Keyboard Found at Address: %d\n", dev->address);
+    return true;
+}
+
+// Reap reports; an endpoint that failed is cleared and polled again
+static void usb_keyboard_poll() {
+    usb_keyboard_t *kbd = &usb_keyboard;
+    if (!usb_keyboard_device) {
+        return;
+    }
+    usb_poll();
+    if (!kbd->failed) {
+        return;
+    }
+    kbd->failed = false;
+    if (++kbd->errors > USB_KEYBOARD_MAX_ERRORS) {
+        printk("USB keyboard: too many errors, detached\n");
+        usb_keyboard_device = NULL;
+        return;
+    }
+    if (!usb_clear_halt(kbd->dev, kbd->ep) || !usb_keyboard_start(kbd)) {
+        kbd->failed = true;
+    }
+}
+
+static usb_driver_t usb_keyboard_driver = {
+    "usb-keyboard",
+    USB_KEYBOARD_INTERFACE_CLASS,
+    USB_KEYBOARD_INTERFACE_SUBCLASS,
+    USB_KEYBOARD_INTERFACE_PROTOCOL,
+    usb_keyboard_probe,
+};
+
 // Combined Keyboard Functions
 
-// Initialize both USB and PS/2 keyboards
+// Initialize the PS/2 keyboard and take any USB boot keyboard
 void keyboard_init() {
     ps2_keyboard_init();
-    if (!usb_keyboard_init()) {
-        printk("Falling back to PS/2 Keyboard\n");
+    usb_register_driver(&usb_keyboard_driver);
+    if (!usb_keyboard_device) {
+        printk("No USB Keyboard Found\n");
     }
 }
 
-// Read a key from either USB or PS/2 keyboard
+// Next key from either keyboard, 0 if none is waiting
 uint8_t keyboard_read_key() {
-    if (usb_keyboard_device) {
-        return usb_keyboard_read_key();
-    } else {
-        return ps2_keyboard_read_data();
+    ps2_keyboard_poll();
+    usb_keyboard_poll();
+    if (key_head == key_tail) {
+        return 0;
     }
-}
\ No newline at end of file
+    return key_ring[key_tail++ % KEY_RING_SIZE];
+}
@@ -16,20 +16,8 @@
 #define USB_KEYBOARD_INTERFACE_SUBCLASS USB_HID_SUBCLASS_BOOT
 #define USB_KEYBOARD_INTERFACE_PROTOCOL USB_HID_PROTOCOL_KEYBOARD
 
-// Global USB Keyboard Device
-extern usb_device_t *usb_keyboard_device;
-
-// Function Prototypes for PS/2 Keyboard
-static bool ps2_keyboard_wait_for_input();
-static uint8_t ps2_keyboard_read_data();
-static void ps2_keyboard_init();
-
-// Function Prototypes for USB Keyboard
-static bool usb_keyboard_init();
-static uint8_t usb_keyboard_read_key();
-
-// Combined Keyboard Functions
-void keyboard_init();        // Initializes both USB and PS/2 keyboards
-uint8_t keyboard_read_key(); // Reads a key from either USB or PS/2 keyboard
+// Combined Keyboard Functions: both keyboards feed one key event ring
+void keyboard_init();        // Initializes the PS/2 keyboard and registers the USB boot keyboard driver
+uint8_t keyboard_read_key(); // Next key from either keyboard, 0 if none is waiting
 
 #endif // KEYBOARD_H
@@ -0,0 +1,507 @@
+#include "nvme.h"
+#include "pci.h"
+#include "block.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include "../System/time.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// NVMe driver
+//
+// Each controller gets the admin queue plus one I/O submission/completion
+// queue pair per CPU, so submitters never share a queue. Commands are
+// written into the SQ by the block layer's queue() hook and the doorbell is
+// only rung from commit(), once per batch the scheduler hands over. There is
+// no interrupt handling in the kernel yet, so completion queues are polled
+// through the phase tag.
+
+#define NVME_PAGE_SIZE 4096
+
+static nvme_ctrl_t nvme_ctrls[NVME_MAX_CONTROLLERS];
+static int nvme_ctrl_count = 0;
+
+static inline uint32_t nvme_read32(nvme_ctrl_t *c, uint32_t reg) {
+    return *(volatile uint32_t *)(c->regs + reg);
+}
+
+static inline void nvme_write32(nvme_ctrl_t *c, uint32_t reg, uint32_t value) {
+    *(volatile uint32_t *)(c->regs + reg) = value;
+}
+
+static uint64_t nvme_read64(nvme_ctrl_t *c, uint32_t reg) {
+    uint32_t lo = nvme_read32(c, reg);
+    uint32_t hi = nvme_read32(c, reg + 4);
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void nvme_write64(nvme_ctrl_t *c, uint32_t reg, uint64_t value) {
+    nvme_write32(c, reg, (uint32_t)value);
+    nvme_write32(c, reg + 4, (uint32_t)(value >> 32));
+}
+
+static bool nvme_wait_ready(nvme_ctrl_t *c, bool ready) {
+    uint64_t deadline = time_now_us() + (uint64_t)c->timeout_ms * 1000;
+    while (1) {
+        uint32_t csts = nvme_read32(c, NVME_REG_CSTS);
+        if (csts == 0xFFFFFFFF || (csts & NVME_CSTS_CFS)) {
+            printk("NVMe: controller fatal status\n");
+            return false;
+        }
+        if (((csts & NVME_CSTS_RDY) != 0) == ready) {
+            return true;
+        }
+        if (time_now_us() > deadline) {
+            printk("NVMe: timeout waiting for controller ready\n");
+            return false;
+        }
+    }
+}
+
+// Queues ================================================================
+
+static bool nvme_queue_alloc(nvme_ctrl_t *c, nvme_queue_t *q, uint16_t qid, uint16_t depth) {
+    memset(q, 0, sizeof(nvme_queue_t));
+    q->sq = alloc_page();
+    q->cq = alloc_page();
+    if (q->sq == NULL || q->cq == NULL) {
+        printk("NVMe: out of pages for queue %d\n", qid);
+        return false;
+    }
+    memset((void *)q->sq, 0, NVME_PAGE_SIZE);
+    memset((void *)q->cq, 0, NVME_PAGE_SIZE);
+
+    q->qid = qid;
+    q->depth = depth;
+    q->cq_phase = 1;
+    q->sq_db = (volatile uint32_t *)(c->regs + NVME_REG_DBS + (2 * qid) * c->db_stride);
+    q->cq_db = (volatile uint32_t *)(c->regs + NVME_REG_DBS + (2 * qid + 1) * c->db_stride);
+    return true;
+}
+
+static int nvme_alloc_cid(nvme_queue_t *q) {
+    // Keep one SQ slot empty so a full queue is distinguishable from an empty one
+    if (q->inflight >= q->depth - 1) {
+        return -1;
+    }
+    for (int i = 0; i < q->depth; i++) {
+        if (!(q->cid_used & (1u << i))) {
+            q->cid_used |= 1u << i;
+            q->sync_done[i] = false;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Copy a command into the next SQ slot without ringing the doorbell
+static void nvme_sq_push(nvme_queue_t *q, nvme_sqe_t *cmd) {
+    memcpy((void *)&q->sq[q->sq_tail], cmd, sizeof(nvme_sqe_t));
+    if (++q->sq_tail == q->depth) {
+        q->sq_tail = 0;
+    }
+    q->unrung++;
+    q->inflight++;
+}
+
+static void nvme_ring(nvme_queue_t *q) {
+    if (q->unrung == 0) {
+        return;
+    }
+    __asm__ volatile ("" ::: "memory");  // SQ entries must be written before the doorbell
+    *q->sq_db = q->sq_tail;
+    q->unrung = 0;
+}
+
+// Reap completions. I/O requests finish through the block layer, synchronous
+// commands only record their status for nvme_submit_sync().
+static int nvme_reap(nvme_ctrl_t *c, nvme_queue_t *q) {
+    int found = 0;
+
+    while ((q->cq[q->cq_head].status & 1) == q->cq_phase) {
+        volatile nvme_cqe_t *cqe = &q->cq[q->cq_head];
+        uint16_t cid = cqe->cid;
+        uint16_t status = cqe->status >> 1;
+        uint32_t result = cqe->result;
+
+        if (++q->cq_head == q->depth) {
+            q->cq_head = 0;
+            q->cq_phase ^= 1;
+        }
+        if (cid >= q->depth || !(q->cid_used & (1u << cid))) {
+            continue;
+        }
+
+        io_request_t *rq = q->rq[cid];
+        q->rq[cid] = NULL;
+        q->cid_used &= ~(1u << cid);
+        q->inflight--;
+        found++;
+
+        if (rq) {
+            if (status) {
+                printk("NVMe: I/O error, status %d\n", status);
+            }
+            block_complete(&c->blk, rq, status == 0);
+        } else {
+            q->sync_status[cid] = status;
+            q->sync_result[cid] = result;
+            q->sync_done[cid] = true;
+        }
+    }
+
+    if (found) {
+        __asm__ volatile ("" ::: "memory");
+        *q->cq_db = q->cq_head;
+    }
+    return found;
+}
+
+static bool nvme_submit_sync(nvme_ctrl_t *c, nvme_queue_t *q, nvme_sqe_t *cmd, uint32_t *result) {
+    uint64_t deadline = time_now_us() + (uint64_t)c->timeout_ms * 1000;
+
+    int cid = nvme_alloc_cid(q);
+    while (cid < 0) {
+        nvme_reap(c, q);
+        cid = nvme_alloc_cid(q);
+        if (cid < 0 && time_now_us() > deadline) {
+            printk("NVMe: queue %d stuck full\n", q->qid);
+            return false;
+        }
+    }
+
+    cmd->cid = cid;
+    q->rq[cid] = NULL;
+    nvme_sq_push(q, cmd);
+    nvme_ring(q);
+
+    while (!q->sync_done[cid]) {
+        nvme_reap(c, q);
+        if (!q->sync_done[cid] && time_now_us() > deadline) {
+            printk("NVMe: command %d timed out\n", cmd->opcode);
+            return false;
+        }
+    }
+
+    if (q->sync_status[cid] != 0) {
+        printk("NVMe: command %d failed, status %d\n", cmd->opcode, q->sync_status[cid]);
+        return false;
+    }
+    if (result) {
+        *result = q->sync_result[cid];
+    }
+    return true;
+}
+
+// The submitting CPU's queue pair
+static nvme_queue_t *nvme_cpu_queue(nvme_ctrl_t *c) {
+    return &c->ioq[cpu_current() % c->nr_io_queues];
+}
+
+// Describe the segments with PRP entries. The block layer's virt_boundary
+// guarantees that every segment but the first starts on a page and every
+// segment but the last ends on one, so the segments form a valid PRP list.
+static bool nvme_build_prp(nvme_ctrl_t *c, nvme_queue_t *q, int cid, const block_seg_t *segs, int nsegs, nvme_sqe_t *cmd) {
+    uint64_t *list = q->prp_list[cid];
+    int n = 0;      // Entries after PRP1
+    bool first = true;
+
+    for (int i = 0; i < nsegs; i++) {
+        uintptr_t addr = (uintptr_t)segs[i].buf;
+        uintptr_t end = addr + segs[i].count * c->blk.sector_size;
+        while (addr < end) {
+            if (first) {
+                cmd->prp1 = addr;
+                first = false;
+            } else {
+                if (list == NULL) {
+                    list = q->prp_list[cid] = alloc_page();
+                    if (list == NULL) {
+                        printk("NVMe: out of pages for PRP list\n");
+                        return false;
+                    }
+                }
+                if (n == NVME_PAGE_SIZE / 8) {
+                    return false;
+                }
+                list[n++] = addr;
+            }
+            addr = (addr & ~(uintptr_t)(NVME_PAGE_SIZE - 1)) + NVME_PAGE_SIZE;
+        }
+    }
+
+    if (n == 1) {
+        cmd->prp2 = list[0];        // Two pages fit in the command itself
+    } else if (n > 1) {
+        cmd->prp2 = (uintptr_t)list;
+    }
+    return true;
+}
+
+// Block device interface ================================================
+
+static bool nvme_blk_queue(block_device_t *dev, io_request_t *rq, const block_seg_t *segs, int nsegs) {
+    nvme_ctrl_t *c = (nvme_ctrl_t *)dev->driver_data;
+    nvme_queue_t *q = nvme_cpu_queue(c);
+
+    int cid = nvme_alloc_cid(q);
+    if (cid < 0) {
+        return false;
+    }
+
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = rq->write ? NVME_CMD_WRITE : NVME_CMD_READ;
+    cmd.cid = cid;
+    cmd.nsid = c->nsid;
+    if (!nvme_build_prp(c, q, cid, segs, nsegs, &cmd)) {
+        q->cid_used &= ~(1u << cid);
+        return false;
+    }
+    cmd.cdw10 = (uint32_t)rq->grp_lba;
+    cmd.cdw11 = (uint32_t)(rq->grp_lba >> 32);
+    cmd.cdw12 = rq->grp_count - 1;     // 0's based block count
+
+    q->rq[cid] = rq;
+    nvme_sq_push(q, &cmd);
+    return true;
+}
+
+// One doorbell write per queue for the whole batch
+static void nvme_blk_commit(block_device_t *dev) {
+    nvme_ctrl_t *c = (nvme_ctrl_t *)dev->driver_data;
+    for (int i = 0; i < c->nr_io_queues; i++) {
+        nvme_ring(&c->ioq[i]);
+    }
+}
+
+static int nvme_blk_poll(block_device_t *dev) {
+    nvme_ctrl_t *c = (nvme_ctrl_t *)dev->driver_data;
+    int found = 0;
+    for (int i = 0; i < c->nr_io_queues; i++) {
+        found += nvme_reap(c, &c->ioq[i]);
+    }
+    return found;
+}
+
+static bool nvme_blk_flush(block_device_t *dev) {
+    nvme_ctrl_t *c = (nvme_ctrl_t *)dev->driver_data;
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_CMD_FLUSH;
+    cmd.nsid = c->nsid;
+    return nvme_submit_sync(c, nvme_cpu_queue(c), &cmd, NULL);
+}
+
+// Controller bring-up ===================================================
+
+static bool nvme_identify(nvme_ctrl_t *c, uint32_t cns, uint32_t nsid, void *page) {
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = (uintptr_t)page;
+    cmd.cdw10 = cns;
+    return nvme_submit_sync(c, &c->admin, &cmd, NULL);
+}
+
+// iv is the MSI-X entry the CQ signals, 0 to leave its interrupts off
+static bool nvme_create_io_queue(nvme_ctrl_t *c, nvme_queue_t *q, uint16_t qid, uint16_t depth, uint16_t iv) {
+    if (!nvme_queue_alloc(c, q, qid, depth)) {
+        return false;
+    }
+
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = (uintptr_t)q->cq;
+    cmd.cdw10 = ((uint32_t)(depth - 1) << 16) | qid;
+    cmd.cdw11 = 1;                      // Physically contiguous
+    if (iv != 0) {
+        cmd.cdw11 |= ((uint32_t)iv << 16) | NVME_CQ_IEN;
+    }
+    if (!nvme_submit_sync(c, &c->admin, &cmd, NULL)) {
+        return false;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1 = (uintptr_t)q->sq;
+    cmd.cdw10 = ((uint32_t)(depth - 1) << 16) | qid;
+    cmd.cdw11 = ((uint32_t)qid << 16) | 1;  // Completes into the CQ with the same id
+    return nvme_submit_sync(c, &c->admin, &cmd, NULL);
+}
+
+static bool nvme_probe(struct pci_device *pdev) {
+    nvme_ctrl_t *c = &nvme_ctrls[nvme_ctrl_count];
+    memset(c, 0, sizeof(nvme_ctrl_t));
+    c->bus = pdev->bus;
+    c->device = pdev->device;
+    c->function = pdev->function;
+
+    uint32_t bar0 = pci_read_config_space(c->bus, c->device, c->function, 0x10);
+    uint32_t bar1 = pci_read_config_space(c->bus, c->device, c->function, 0x14);
+    if ((bar0 & 0x6) == 0x4 && bar1 != 0) {
+        printk("NVMe: BAR0 above 4G is not reachable\n");
+        return false;
+    }
+    c->regs = (volatile uint8_t *)(bar0 & ~0xF);
+
+    // Memory decoding and bus mastering on, legacy INTx off since completions are polled
+    uint32_t command = pci_read_config_space(c->bus, c->device, c->function, 0x04) & 0xFFFF;
+    pci_write_config_space(c->bus, c->device, c->function, 0x04,
+                           command | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+
+    uint64_t cap = nvme_read64(c, NVME_REG_CAP);
+    uint32_t mqes = (uint32_t)(cap & 0xFFFF) + 1;
+    c->timeout_ms = (uint32_t)((cap >> 24) & 0xFF) * 500;
+    c->db_stride = 4u << ((cap >> 32) & 0xF);
+    if (((cap >> 48) & 0xF) != 0) {
+        printk("NVMe: controller does not support 4K pages\n");
+        return false;
+    }
+    if (c->timeout_ms == 0) {
+        c->timeout_ms = 500;
+    }
+
+    // Reset, then bring the controller up with the admin queue
+    uint32_t cc = nvme_read32(c, NVME_REG_CC);
+    if (cc & NVME_CC_EN) {
+        nvme_write32(c, NVME_REG_CC, cc & ~NVME_CC_EN);
+    }
+    if (!nvme_wait_ready(c, false)) {
+        return false;
+    }
+
+    uint16_t admin_depth = mqes < NVME_ADMIN_DEPTH ? mqes : NVME_ADMIN_DEPTH;
+    if (!nvme_queue_alloc(c, &c->admin, 0, admin_depth)) {
+        return false;
+    }
+    nvme_write32(c, NVME_REG_AQA, ((uint32_t)(admin_depth - 1) << 16) | (admin_depth - 1));
+    nvme_write64(c, NVME_REG_ASQ, (uintptr_t)c->admin.sq);
+    nvme_write64(c, NVME_REG_ACQ, (uintptr_t)c->admin.cq);
+    nvme_write32(c, NVME_REG_INTMS, 0xFFFFFFFF);
+    nvme_write32(c, NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    if (!nvme_wait_ready(c, true)) {
+        return false;
+    }
+
+    uint8_t *id = alloc_page();
+    if (id == NULL || !nvme_identify(c, 1, 0, id)) {
+        printk("NVMe: identify controller failed\n");
+        return false;
+    }
+    uint8_t mdts = id[77];
+    uint32_t nn = *(uint32_t *)&id[516];
+    c->max_transfer = NVME_MAX_SECTORS_BYTES;
+    if (mdts != 0 && mdts < 20 && ((uint32_t)NVME_PAGE_SIZE << mdts) < c->max_transfer) {
+        c->max_transfer = (uint32_t)NVME_PAGE_SIZE << mdts;
+    }
+
+    // First active namespace becomes the block device
+    uint64_t nsze = 0;
+    uint32_t lba_size = 0;
+    for (uint32_t nsid = 1; nsid <= nn && nsze == 0; nsid++) {
+        if (!nvme_identify(c, 0, nsid, id)) {
+            continue;
+        }
+        nsze = *(uint64_t *)&id[0];
+        uint8_t flbas = id[26] & 0xF;
+        uint32_t lbaf = *(uint32_t *)&id[128 + 4 * flbas];
+        lba_size = 1u << ((lbaf >> 16) & 0xFF);
+        c->nsid = nsid;
+    }
+    free_page(id);
+    if (nsze == 0) {
+        printk("NVMe: no active namespace\n");
+        return false;
+    }
+
+    // One I/O queue pair per CPU, as many as the controller grants
+    int wanted = cpu_count();
+    if (wanted > NVME_MAX_IO_QUEUES) {
+        wanted = NVME_MAX_IO_QUEUES;
+    }
+    nvme_sqe_t cmd;
+    uint32_t granted = 0;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd.cdw11 = ((uint32_t)(wanted - 1) << 16) | (wanted - 1);
+    if (nvme_submit_sync(c, &c->admin, &cmd, &granted)) {
+        int nsq = (granted & 0xFFFF) + 1;
+        int ncq = (granted >> 16) + 1;
+        if (nsq < wanted) wanted = nsq;
+        if (ncq < wanted) wanted = ncq;
+    } else {
+        wanted = 1;
+    }
+
+    // An MSI-X vector per I/O queue, steered to the CPU that submits on it.
+    // Entry 0 belongs to the admin queue. The vectors stay masked while
+    // completions are polled, so the controller only sets pending bits.
+    int nvec = pci_enable_msix(pdev, wanted + 1);
+    for (int i = 0; i + 1 < nvec; i++) {
+        pci_set_vector_cpu(pdev, i + 1, i);
+    }
+
+    uint16_t io_depth = mqes < NVME_IO_DEPTH ? mqes : NVME_IO_DEPTH;
+    for (int i = 0; i < wanted; i++) {
+        if (!nvme_create_io_queue(c, &c->ioq[i], i + 1, io_depth, i + 1 < nvec ? i + 1 : 0)) {
+            break;
+        }
+        c->nr_io_queues++;
+    }
+    if (c->nr_io_queues == 0) {
+        pci_disable_msi(pdev);
+        printk("NVMe: could not create I/O queues\n");
+        return false;
+    }
+
+    char prefix[12];
+    block_make_name(prefix, "nvme", nvme_ctrl_count);
+    strcat(prefix, "n");
+    block_make_name(c->blk.name, prefix, c->nsid);
+    c->blk.sector_size = lba_size;
+    c->blk.sector_count = nsze;
+    c->blk.max_sectors = c->max_transfer / lba_size;
+    c->blk.max_segs = BLOCK_MAX_SEGS;
+    c->blk.virt_boundary = NVME_PAGE_SIZE;
+    c->blk.queue = nvme_blk_queue;
+    c->blk.commit = nvme_blk_commit;
+    c->blk.poll = nvme_blk_poll;
+    c->blk.flush = nvme_blk_flush;
+    c->blk.queue_depth = io_depth - 1;
+    c->blk.driver_data = c;
+    if (!block_register(&c->blk)) {
+        return false;
+    }
+
+    uint32_t vs = nvme_read32(c, NVME_REG_VS);
+    printk("%s: NVMe %d.%d, %d MiB, %d I/O queue pairs\n", c->blk.name, vs >> 16, (vs >> 8) & 0xFF,
+           (int)((nsze * lba_size) >> 20), c->nr_io_queues);
+    return true;
+}
+
+static bool nvme_pci_probe(struct pci_device *dev, const struct pci_device_id *id) {
+    (void)id;
+    if (nvme_ctrl_count >= NVME_MAX_CONTROLLERS || !nvme_probe(dev)) {
+        return false;
+    }
+    nvme_ctrl_count++;
+    return true;
+}
+
+static const struct pci_device_id nvme_pci_ids[] = {
+    { PCI_ANY_ID, PCI_ANY_ID, NVME_PCI_CLASS << 16 | NVME_PCI_SUBCLASS << 8, PCI_CLASS_MASK_SUBCLASS },
+    { 0 }
+};
+
+static struct pci_driver nvme_pci_driver = { "nvme", nvme_pci_ids, nvme_pci_probe };
+
+// Probe every NVMe controller on the PCI bus, returns how many came up
+int nvme_init() {
+    pci_register_driver(&nvme_pci_driver);
+    return nvme_ctrl_count;
+}
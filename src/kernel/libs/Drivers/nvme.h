@@ -0,0 +1,114 @@
+#ifndef NVME_H
+#define NVME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block.h"
+
+// PCI class 01h (mass storage), subclass 08h (non-volatile memory), prog-if 02h (NVMe)
+#define NVME_PCI_CLASS     0x01
+#define NVME_PCI_SUBCLASS  0x08
+
+#define NVME_MAX_CONTROLLERS  4
+#define NVME_MAX_IO_QUEUES    8     // Queue pairs per controller, one per CPU
+#define NVME_ADMIN_DEPTH      16
+#define NVME_IO_DEPTH         32    // Entries per I/O queue (one stays empty to tell full from empty)
+#define NVME_MAX_SECTORS_BYTES (1024 * 1024)  // Per command cap, keeps PRP lists in one page
+
+// Controller registers (offsets into BAR0)
+#define NVME_REG_CAP    0x00
+#define NVME_REG_VS     0x08
+#define NVME_REG_INTMS  0x0C
+#define NVME_REG_INTMC  0x10
+#define NVME_REG_CC     0x14
+#define NVME_REG_CSTS   0x1C
+#define NVME_REG_AQA    0x24
+#define NVME_REG_ASQ    0x28
+#define NVME_REG_ACQ    0x30
+#define NVME_REG_DBS    0x1000
+
+#define NVME_CC_EN          (1 << 0)
+#define NVME_CC_IOSQES      (6 << 16)   // 64 byte submission entries
+#define NVME_CC_IOCQES      (4 << 20)   // 16 byte completion entries
+#define NVME_CSTS_RDY       (1 << 0)
+#define NVME_CSTS_CFS       (1 << 1)
+
+// Admin opcodes
+#define NVME_ADMIN_CREATE_SQ   0x01
+#define NVME_ADMIN_CREATE_CQ   0x05
+#define NVME_ADMIN_IDENTIFY    0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+// I/O opcodes
+#define NVME_CMD_FLUSH  0x00
+#define NVME_CMD_WRITE  0x01
+#define NVME_CMD_READ   0x02
+
+#define NVME_FEAT_NUM_QUEUES 0x07
+
+#define NVME_CQ_IEN         (1 << 1)    // Create I/O CQ: interrupts enabled
+
+// Submission queue entry
+typedef struct {
+    uint8_t  opcode;
+    uint8_t  flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t rsvd;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed)) nvme_sqe_t;
+
+// Completion queue entry
+typedef struct {
+    uint32_t result;
+    uint32_t rsvd;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;    // Bit 0 is the phase tag
+} __attribute__((packed)) nvme_cqe_t;
+
+typedef struct {
+    volatile nvme_sqe_t *sq;
+    volatile nvme_cqe_t *cq;
+    volatile uint32_t *sq_db;
+    volatile uint32_t *cq_db;
+    uint16_t qid;
+    uint16_t depth;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint8_t  cq_phase;
+    uint16_t unrung;        // Entries written since the last doorbell write
+    uint16_t inflight;
+    uint32_t cid_used;      // Bitmap of command ids in flight
+    io_request_t *rq[NVME_IO_DEPTH];
+    uint64_t *prp_list[NVME_IO_DEPTH];  // One page per command id, allocated on first use
+    uint16_t sync_status[NVME_IO_DEPTH];
+    uint32_t sync_result[NVME_IO_DEPTH];
+    bool sync_done[NVME_IO_DEPTH];
+} nvme_queue_t;
+
+typedef struct {
+    block_device_t blk;
+    volatile uint8_t *regs;
+    uint32_t db_stride;     // Bytes between doorbells
+    uint32_t timeout_ms;    // CAP.TO
+    uint8_t bus, device, function;
+    nvme_queue_t admin;
+    nvme_queue_t ioq[NVME_MAX_IO_QUEUES];
+    int nr_io_queues;
+    uint32_t nsid;
+    uint32_t max_transfer;  // Bytes, from MDTS
+} nvme_ctrl_t;
+
+int nvme_init();
+
+#endif // NVME_H
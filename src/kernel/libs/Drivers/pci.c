@@ -1,14 +1,13 @@
 #include <stdint.h>
 #include "pci.h"
+#include "acpi.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include "../System/time.h"
 
 #define PCI_CONFIG_ADDRESS 0xCF8
 #define PCI_CONFIG_DATA 0xCFC
 
-// Function to write to PCI configuration address port
-void pci_write_config_address(uint32_t address) {
-    outl(PCI_CONFIG_ADDRESS, address);
-}
-
 uint32_t inl(uint32_t port) {
     uint32_t value;
     asm volatile ("inl %1, %0" : "=a"(value) : "Nd"(port));
@@ -19,12 +18,63 @@ void outl(uint16_t port, uint32_t value) {
     asm volatile ("outl %0, %1" : : "a"(value), "Nd"(port));
 }
 
-// Function to read from PCI configuration data port
-uint32_t pci_read_config_data() {
-    return inl(PCI_CONFIG_DATA);
+// Configuration space access
+//
+// With an ACPI MCFG table every function's 4K of configuration space is
+// memory mapped (ECAM), and a register is one load or store. Without one
+// the 0xCF8/0xCFC port pair is used, which takes two port accesses per
+// register, is not atomic and only reaches the first 256 bytes.
+
+static struct acpi_mcfg_entry pci_ecam[ACPI_MAX_MCFG];
+static int pci_ecam_count = 0;
+static bool pci_config_ready = false;
+
+// Pick the access method on first use
+static void pci_config_init() {
+    struct acpi_mcfg_entry entries[ACPI_MAX_MCFG];
+    int n = acpiGetMcfg(entries, ACPI_MAX_MCFG);
+
+    pci_config_ready = true;
+    for (int i = 0; i < n; i++) {
+        // Only segment 0 is addressed by bus/device/function, and without
+        // paging a window above 4G cannot be reached
+        if (entries[i].segment != 0 || (entries[i].base >> 32) != 0) {
+            continue;
+        }
+        pci_ecam[pci_ecam_count++] = entries[i];
+    }
+    if (pci_ecam_count > 0) {
+        printk("PCI: ECAM configuration access for buses %d-%d\n", pci_ecam[0].start_bus, pci_ecam[0].end_bus);
+    } else {
+        printk("PCI: no MCFG table, configuration access through ports\n");
+    }
+}
+
+// Memory mapped register of a function, NULL if no ECAM window covers its bus
+static volatile uint32_t *pci_ecam_reg(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset) {
+    if (!pci_config_ready) {
+        pci_config_init();
+    }
+    for (int i = 0; i < pci_ecam_count; i++) {
+        struct acpi_mcfg_entry *e = &pci_ecam[i];
+        if (bus >= e->start_bus && bus <= e->end_bus) {
+            uint32_t addr = (uint32_t)e->base + ((uint32_t)(bus - e->start_bus) << 20) +
+                            ((uint32_t)device << 15) + ((uint32_t)function << 12) + (offset & 0xFFC);
+            return (volatile uint32_t *)addr;
+        }
+    }
+    return NULL;
 }
 
-uint32_t pci_read_config_space(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
+// Registers at offset PCI_CONFIG_SIZE and up need ECAM and read as all ones without it
+uint32_t pci_read_config_space(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset) {
+    volatile uint32_t *reg = pci_ecam_reg(bus, device, function, offset);
+    if (reg) {
+        return *reg;
+    }
+    if (offset >= PCI_CONFIG_SIZE) {
+        return 0xFFFFFFFF;
+    }
     uint32_t address = (uint32_t)((bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC) | 0x80000000);
     __asm__ volatile ("outl %0, %1" :: "a"(address), "Nd"(PCI_CONFIG_ADDRESS));
     uint32_t data;
@@ -32,88 +82,628 @@ uint32_t pci_read_config_space(uint8_t bus, uint8_t device, uint8_t function, ui
     return data;
 }
 
+void pci_write_config_space(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint32_t value) {
+    volatile uint32_t *reg = pci_ecam_reg(bus, device, function, offset);
+    if (reg) {
+        *reg = value;
+        return;
+    }
+    if (offset >= PCI_CONFIG_SIZE) {
+        return;
+    }
+    uint32_t address = (uint32_t)((bus << 16) | (device << 11) | (function << 8) | (offset & 0xFC) | 0x80000000);
+    __asm__ volatile ("outl %0, %1" :: "a"(address), "Nd"(PCI_CONFIG_ADDRESS));
+    __asm__ volatile ("outl %0, %1" :: "a"(value), "Nd"(PCI_CONFIG_DATA));
+}
+
+// Whether registers past the first 256 bytes can be reached
+bool pci_extended_config() {
+    if (!pci_config_ready) {
+        pci_config_init();
+    }
+    return pci_ecam_count > 0;
+}
+
+
+// Enumeration ===========================================================
+//
+// Buses are walked the way they hang together: from the host bridges
+// through every PCI-to-PCI (and CardBus) bridge to its secondary bus, as
+// numbered by the firmware. Functions 1-7 are only probed on devices whose
+// function 0 has the multifunction bit set. A machine with a dozen
+// devices costs a few hundred configuration reads instead of 65,536.
+//
+// The walk runs once. Every function found keeps its configuration header
+// and decoded BARs in the registry, which is indexed by class and by
+// vendor:device so drivers find their hardware without a scan.
+
+static struct pci_device pci_devices[MAX_PCI_DEVICES];
+static int pci_device_count = 0;
+static bool pci_ready = false;
+static uint8_t pci_bus_seen[256 / 8];
+static struct pci_device *pci_class_hash[PCI_HASH_SIZE];
+static struct pci_device *pci_id_hash[PCI_HASH_SIZE];
+static struct pci_pir *pci_pir = NULL;
+static bool pci_pir_searched = false;
+
+// $PIR ==================================================================
+
+// The BIOS PCI IRQ routing table, somewhere in F0000-FFFFF on a 16 byte boundary
+static struct pci_pir *pci_find_pir() {
+    if (pci_pir_searched) {
+        return pci_pir;
+    }
+    pci_pir_searched = true;
+    for (uint32_t addr = PCI_PIR_START; addr < PCI_PIR_END; addr += 16) {
+        struct pci_pir *pir = (struct pci_pir *)addr;
+        if (memcmp(pir->signature, "$PIR", 4) != 0 || pir->size < sizeof(struct pci_pir) ||
+            addr + pir->size > PCI_PIR_END) {
+            continue;
+        }
+        uint8_t sum = 0;
+        for (uint16_t i = 0; i < pir->size; i++) {
+            sum += ((uint8_t *)pir)[i];
+        }
+        if (sum == 0) {
+            pci_pir = pir;
+            printk("PCI: $PIR routing table, %d slots\n",
+                   (int)((pir->size - sizeof(struct pci_pir)) / sizeof(struct pci_pir_slot)));
+            break;
+        }
+    }
+    return pci_pir;
+}
+
+// IRQs the interrupt pin of a device can be routed to, from $PIR. 0 if unknown.
+static uint16_t pci_pir_irq_mask(uint8_t bus, uint8_t device, uint8_t pin) {
+    struct pci_pir *pir = pci_find_pir();
+    if (pir == NULL || pin < 1 || pin > 4) {
+        return 0;
+    }
+    int slots = (pir->size - sizeof(struct pci_pir)) / sizeof(struct pci_pir_slot);
+    for (int i = 0; i < slots; i++) {
+        struct pci_pir_slot *slot = &pir->slots[i];
+        if (slot->bus == bus && (slot->devfn >> 3) == device) {
+            return slot->pins[pin - 1].link ? slot->pins[pin - 1].irq_mask : 0;
+        }
+    }
+    return 0;
+}
+
+// Registry ==============================================================
+
+static uint32_t pci_hash(uint32_t key) {
+    return (key * 2654435761u) >> (32 - PCI_HASH_BITS);
+}
+
+// Appended at the tail so every chain stays in bus order
+static void pci_index(struct pci_device *dev) {
+    struct pci_device **link = &pci_class_hash[pci_hash(dev->class_code << 8 | dev->subclass)];
+    while (*link) {
+        link = &(*link)->class_next;
+    }
+    *link = dev;
+
+    link = &pci_id_hash[pci_hash((uint32_t)dev->vendor_id << 16 | dev->device_id)];
+    while (*link) {
+        link = &(*link)->id_next;
+    }
+    *link = dev;
+}
+
+// Which address bits a BAR implements, by writing all ones and reading back
+static uint32_t pci_bar_probe(struct pci_device *dev, int index) {
+    uint16_t offset = 0x10 + index * 4;
+    pci_write_config_space(dev->bus, dev->device, dev->function, offset, 0xFFFFFFFF);
+    uint32_t value = pci_read_config_space(dev->bus, dev->device, dev->function, offset);
+    pci_write_config_space(dev->bus, dev->device, dev->function, offset, dev->config[4 + index]);
+    return value;
+}
+
+// Decode and size every BAR. Decoding is switched off meanwhile, so the
+// all-ones address never claims a cycle, except on host bridges, which
+// some chipsets stop answering on.
+static void pci_decode_bars(struct pci_device *dev) {
+    int count = dev->header_type == PCI_HEADER_NORMAL ? 6 : dev->header_type == PCI_HEADER_BRIDGE ? 2 : 0;
+    uint32_t command = dev->config[1] & 0xFFFF;
+    bool host_bridge = dev->class_code == 0x06 && dev->subclass == 0x00;
+
+    if (count == 0) {
+        return;
+    }
+    if (!host_bridge) {
+        pci_write_config_space(dev->bus, dev->device, dev->function, 0x04,
+                               command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+    }
+
+    for (int i = 0; i < count; i++) {
+        uint32_t raw = dev->config[4 + i];
+        struct pci_bar *bar = &dev->bars[i];
+        uint32_t probe = pci_bar_probe(dev, i);
+        if (probe == 0) {
+            continue;   // Not implemented
+        }
+        if (raw & PCI_BAR_IO_SPACE) {
+            bar->base = raw & ~3u;
+            bar->size = (~(probe & ~3u) + 1) & 0xFFFF;
+            bar->flags = PCI_BAR_IO;
+            continue;
+        }
+        bar->base = raw & ~0xFu;
+        bar->flags = PCI_BAR_MEM | (raw & PCI_BAR_PREFETCHABLE ? PCI_BAR_PREFETCH : 0);
+        uint64_t mask = 0xFFFFFFFF00000000ULL | (probe & ~0xFu);
+        if ((raw & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64 && i + 1 < count) {
+            // The next BAR holds the upper half and decodes as nothing itself
+            bar->base |= (uint64_t)dev->config[5 + i] << 32;
+            bar->flags |= PCI_BAR_64;
+            mask = (uint64_t)pci_bar_probe(dev, i + 1) << 32 | (probe & ~0xFu);
+            i++;
+        }
+        bar->size = ~mask + 1;
+    }
+
+    if (!host_bridge) {
+        pci_write_config_space(dev->bus, dev->device, dev->function, 0x04, command);
+    }
+}
+
+// Walk ==================================================================
+
+static void pci_scan_bus(uint8_t bus);
 
-#define MAX_PCI_DEVICES 128 // Define a maximum number of devices we can handle
+static void pci_scan_function(uint8_t bus, uint8_t device, uint8_t function) {
+    if (pci_device_count >= MAX_PCI_DEVICES) {
+        printk("Error: Exceeded maximum number of PCI devices (%d).\n", MAX_PCI_DEVICES);
+        return;
+    }
+    struct pci_device *dev = &pci_devices[pci_device_count++];
+    memset(dev, 0, sizeof(struct pci_device));
+    for (int i = 0; i < PCI_HEADER_DWORDS; i++) {
+        dev->config[i] = pci_read_config_space(bus, device, function, i * 4);
+    }
+
+    dev->bus = bus;
+    dev->device = device;
+    dev->function = function;
+    dev->vendor_id = dev->config[0] & 0xFFFF;
+    dev->device_id = dev->config[0] >> 16;
+    dev->class_code = dev->config[2] >> 24;
+    dev->subclass = (dev->config[2] >> 16) & 0xFF;
+    dev->prog_if = (dev->config[2] >> 8) & 0xFF;
+    dev->header_type = (dev->config[3] >> 16) & 0x7F;
+    dev->port = dev->config[4];  // BAR0
+    dev->irq_line = dev->config[15] & 0xFF;
+    dev->irq_pin = (dev->config[15] >> 8) & 0xFF;
+    dev->irq_mask = pci_pir_irq_mask(bus, device, dev->irq_pin);
+    pci_decode_bars(dev);
+    dev->msi_cap = pci_find_capability(dev, PCI_CAP_MSI);
+    dev->msix_cap = pci_find_capability(dev, PCI_CAP_MSIX);
+    pci_index(dev);
 
-// Function to enumerate all PCI devices
-// Function to enumerate PCI devices and retrieve their base address or port
+    // Bridges lead to another bus, 0 while the firmware has not numbered it
+    if (dev->header_type == PCI_HEADER_BRIDGE || dev->header_type == PCI_HEADER_CARDBUS) {
+        uint8_t secondary = (dev->config[6] >> 8) & 0xFF;
+        if (secondary != 0) {
+            pci_scan_bus(secondary);
+        }
+    }
+}
+
+static void pci_scan_device(uint8_t bus, uint8_t device) {
+    if ((pci_read_config_space(bus, device, 0, 0x00) & 0xFFFF) == 0xFFFF) {
+        return;
+    }
+    pci_scan_function(bus, device, 0);
+
+    if (!(pci_read_config_space(bus, device, 0, 0x0C) & PCI_HEADER_MULTIFUNCTION)) {
+        return;
+    }
+    for (uint8_t function = 1; function < 8; function++) {
+        if ((pci_read_config_space(bus, device, function, 0x00) & 0xFFFF) != 0xFFFF) {
+            pci_scan_function(bus, device, function);
+        }
+    }
+}
+
+static void pci_scan_bus(uint8_t bus) {
+    // A misprogrammed bridge must not send the walk around in circles
+    if (pci_bus_seen[bus / 8] & (1 << (bus % 8))) {
+        return;
+    }
+    pci_bus_seen[bus / 8] |= 1 << (bus % 8);
+
+    for (uint8_t device = 0; device < 32; device++) {
+        pci_scan_device(bus, device);
+    }
+}
+
+// Build the registry, once
+void pci_init() {
+    if (pci_ready) {
+        return;
+    }
+    pci_ready = true;
+    uint64_t start = time_now_us();
+
+    // A multifunction host bridge at 00:00 means one host bridge, and one
+    // root bus, per function
+    if (pci_read_config_space(0, 0, 0, 0x0C) & PCI_HEADER_MULTIFUNCTION) {
+        for (uint8_t function = 0; function < 8; function++) {
+            if ((pci_read_config_space(0, 0, function, 0x00) & 0xFFFF) != 0xFFFF) {
+                pci_scan_bus(function);
+            }
+        }
+    } else {
+        pci_scan_bus(0);
+    }
+    printk("PCI: %d devices, enumerated in %d us\n", pci_device_count, (int)(time_now_us() - start));
+
+    // Framebuffers sit behind the prefetchable BARs of display controllers
+    for (struct pci_device *dev = &pci_devices[0]; dev < &pci_devices[pci_device_count]; dev++) {
+        if (dev->class_code != 0x03) {
+            continue;
+        }
+        for (int i = 0; i < 6; i++) {
+            if ((dev->bars[i].flags & PCI_BAR_PREFETCH) && pci_map_wc(dev, i)) {
+                printk("PCI: display BAR%d, %d KiB, write combining\n", i, (int)(dev->bars[i].size >> 10));
+            }
+        }
+    }
+}
+
+// Every function on every bus reachable from the host bridges
 struct pci_device_list pci_enumerate_devices() {
-    struct pci_device_list dev_list;
-    dev_list.pci_device = malloc(MAX_PCI_DEVICES * sizeof(struct pci_device));
-
-    // Check if memory allocation was successful
-    if (!dev_list.pci_device) {
-        printk("Error: Failed to allocate memory for PCI devices list.\n");
-        dev_list.length = 0;
-        return dev_list;
-    }
-
-    int device_count = 0;
-    uint32_t vendor_device_id, vendor_id, device_id, base_address;
-
-    printk("Starting PCI enumeration...\n");
-
-    // Iterate over all buses, devices, and functions
-    for (uint8_t bus = 0; bus < 256; bus++) {
-        if (bus == 256) {
-            printk("Bus enumeration finished.\n");
-            break;  // Break the outer loop once bus reaches 256
-        }
-        for (uint8_t device = 0; device < 32; device++) {
-            for (uint8_t function = 0; function < 8; function++) {
-                // Build the PCI configuration address
-                uint32_t address = (bus << 16) | (device << 11) | (function << 8) | 0x80000000;
-                pci_write_config_address(address);
-
-                // Read vendor and device ID
-                vendor_device_id = pci_read_config_data();
-
-                // If we reach an invalid response, skip this device
-                if (vendor_device_id == 0xFFFFFFFF) {
-                    // Skip invalid device and continue to the next one
-                    continue;
-                }
-
-                vendor_id = vendor_device_id & 0xFFFF;
-                device_id = (vendor_device_id >> 16) & 0xFFFF;
-
-                // Check for valid vendor and device ID
-                if (vendor_id != 0xFFFF && device_id != 0xFFFF) {
-                    // Found a valid device, store its details
-                    if (device_count < MAX_PCI_DEVICES) {
-                        dev_list.pci_device[device_count].bus = bus;
-                        dev_list.pci_device[device_count].device = device;
-                        dev_list.pci_device[device_count].function = function;
-                        dev_list.pci_device[device_count].vendor_id = vendor_id;
-                        dev_list.pci_device[device_count].device_id = device_id;
-
-                        // Retrieve base address or I/O port of the device
-                        base_address = pci_read_config_data();  // Read BAR0
-                        if (base_address != 0) {
-                            dev_list.pci_device[device_count].port = base_address;
-                        } else {
-                            printk("Warning: Base address for device %d:%d:%d is invalid.\n", bus, device, function);
-                        }
-
-                        device_count++;
-                    } else {
-                        printk("Error: Exceeded maximum number of PCI devices (%d).\n", MAX_PCI_DEVICES);
-                        break;
-                    }
-                }
+    pci_init();
+    struct pci_device_list dev_list = { pci_devices, pci_device_count };
+    return dev_list;
+}
+
+// Next device of a class and subclass after from, the first one if from is NULL
+struct pci_device *pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_device *from) {
+    pci_init();
+    struct pci_device *dev = from ? from->class_next : pci_class_hash[pci_hash(class_code << 8 | subclass)];
+    while (dev && (dev->class_code != class_code || dev->subclass != subclass)) {
+        dev = dev->class_next;
+    }
+    return dev;
+}
+
+// Next device with a vendor and device ID after from, the first one if from is NULL
+struct pci_device *pci_find_id(uint16_t vendor_id, uint16_t device_id, struct pci_device *from) {
+    pci_init();
+    struct pci_device *dev = from ? from->id_next : pci_id_hash[pci_hash((uint32_t)vendor_id << 16 | device_id)];
+    while (dev && (dev->vendor_id != vendor_id || dev->device_id != device_id)) {
+        dev = dev->id_next;
+    }
+    return dev;
+}
+
+// Drivers ===============================================================
+
+// Map a prefetchable memory BAR write combining, so streams of stores to it
+// (a framebuffer, a queue in device memory) go out as bursts instead of one
+// uncached transaction each
+bool pci_map_wc(struct pci_device *dev, int index) {
+    if (index < 0 || index > 5) {
+        return false;
+    }
+    struct pci_bar *bar = &dev->bars[index];
+    if (bar->flags & PCI_BAR_WC) {
+        return true;
+    }
+    if (!(bar->flags & PCI_BAR_PREFETCH) || bar->base == 0 || !cpu_set_write_combining(bar->base, bar->size)) {
+        return false;
+    }
+    bar->flags |= PCI_BAR_WC;
+    return true;
+}
+
+static bool pci_match(const struct pci_device_id *id, struct pci_device *dev) {
+    uint32_t class = (uint32_t)dev->class_code << 16 | dev->subclass << 8 | dev->prog_if;
+    return (id->vendor_id == PCI_ANY_ID || id->vendor_id == dev->vendor_id) &&
+           (id->device_id == PCI_ANY_ID || id->device_id == dev->device_id) &&
+           (class & id->class_mask) == (id->class & id->class_mask);
+}
+
+static int pci_try_probe(struct pci_driver *drv, const struct pci_device_id *id, struct pci_device *dev) {
+    if (dev->driver != NULL || !pci_match(id, dev)) {
+        return 0;
+    }
+    if (!drv->probe(dev, id)) {
+        return 0;
+    }
+    dev->driver = drv;
+    return 1;
+}
+
+// Hand every unclaimed device in drv's match table to its probe, in bus
+// order per table entry. Returns how many devices the driver took.
+int pci_register_driver(struct pci_driver *drv) {
+    int bound = 0;
+    pci_init();
+
+    for (const struct pci_device_id *id = drv->ids; id->vendor_id != 0 || id->class_mask != 0; id++) {
+        if (id->vendor_id != PCI_ANY_ID && id->device_id != PCI_ANY_ID) {
+            for (struct pci_device *dev = pci_find_id(id->vendor_id, id->device_id, NULL); dev;
+                 dev = pci_find_id(id->vendor_id, id->device_id, dev)) {
+                bound += pci_try_probe(drv, id, dev);
+            }
+        } else if ((id->class_mask & PCI_CLASS_MASK_SUBCLASS) == PCI_CLASS_MASK_SUBCLASS) {
+            uint8_t class_code = id->class >> 16;
+            uint8_t subclass = (id->class >> 8) & 0xFF;
+            for (struct pci_device *dev = pci_find_class(class_code, subclass, NULL); dev;
+                 dev = pci_find_class(class_code, subclass, dev)) {
+                bound += pci_try_probe(drv, id, dev);
+            }
+        } else {
+            for (int i = 0; i < pci_device_count; i++) {
+                bound += pci_try_probe(drv, id, &pci_devices[i]);
             }
         }
+    }
+    return bound;
+}
 
-        // If we've reached the maximum device count, break out of the bus loop
-        if (device_count >= MAX_PCI_DEVICES) {
-            break;
+// MSI and MSI-X =========================================================
+//
+// A device with MSI or MSI-X gets vectors of its own instead of a shared
+// INTx line, and each MSI-X vector can be steered to a different CPU by the
+// destination APIC ID in its message address. Vectors come from one
+// allocator over PCI_VECTOR_FIRST-PCI_VECTOR_LAST. MSI needs a power of two
+// block aligned to its size, since the function ORs the vector number into
+// the low bits of the message data.
+//
+// Vectors are enabled masked. Unmasking one is up to its driver, once the
+// vector has a handler.
+
+static uint32_t pci_vector_map[256 / 32];
+
+uint8_t pci_find_capability(struct pci_device *dev, uint8_t id) {
+    if (!(dev->config[1] & PCI_STATUS_CAP_LIST)) {
+        return 0;
+    }
+    uint8_t offset = pci_read_config_space(dev->bus, dev->device, dev->function, PCI_CAP_POINTER) & 0xFC;
+    // 48 capabilities fit in the header at most, so a loop ends there
+    for (int n = 0; offset >= 0x40 && n < 48; n++) {
+        uint32_t cap = pci_read_config_space(dev->bus, dev->device, dev->function, offset);
+        if ((cap & 0xFF) == id) {
+            return offset;
         }
+        offset = (cap >> 8) & 0xFC;
     }
+    return 0;
+}
 
-    dev_list.length = device_count;
-    printk("PCI enumeration finished. %d devices found.\n", device_count);
+static bool pci_vector_used(int vector) {
+    return pci_vector_map[vector / 32] & (1u << (vector % 32));
+}
 
-    return dev_list;
+// First of count free vectors in a row, -1 if there is no such run.
+// aligned asks for a power of two count starting on a multiple of itself.
+int pci_alloc_vectors(int count, bool aligned) {
+    int step = aligned ? count : 1;
+    int first = (PCI_VECTOR_FIRST + step - 1) / step * step;
+
+    for (; first + count - 1 <= PCI_VECTOR_LAST; first += step) {
+        int i = 0;
+        while (i < count && !pci_vector_used(first + i)) {
+            i++;
+        }
+        if (i == count) {
+            for (i = 0; i < count; i++) {
+                pci_vector_map[(first + i) / 32] |= 1u << ((first + i) % 32);
+            }
+            return first;
+        }
+    }
+    return -1;
+}
+
+void pci_free_vectors(int first, int count) {
+    for (int i = first; i < first + count; i++) {
+        pci_vector_map[i / 32] &= ~(1u << (i % 32));
+    }
+}
+
+static uint16_t pci_msg_control(struct pci_device *dev, uint8_t cap) {
+    return pci_read_config_space(dev->bus, dev->device, dev->function, cap) >> 16;
+}
+
+static void pci_set_msg_control(struct pci_device *dev, uint8_t cap, uint16_t control) {
+    uint32_t reg = pci_read_config_space(dev->bus, dev->device, dev->function, cap);
+    pci_write_config_space(dev->bus, dev->device, dev->function, cap, (reg & 0xFFFF) | (uint32_t)control << 16);
+}
+
+static void pci_disable_intx(struct pci_device *dev) {
+    uint32_t command = pci_read_config_space(dev->bus, dev->device, dev->function, 0x04) & 0xFFFF;
+    pci_write_config_space(dev->bus, dev->device, dev->function, 0x04, command | PCI_COMMAND_INTX_DISABLE);
+}
+
+// Enable up to nvec MSI-X vectors, all masked and aimed at the current CPU.
+// Returns how many the device got, 0 if MSI-X is not available. The table
+// BAR must already be decoding.
+int pci_enable_msix(struct pci_device *dev, int nvec) {
+    if (dev->msix_cap == 0 || dev->irq_mode != PCI_IRQ_INTX || nvec <= 0) {
+        return 0;
+    }
+    uint16_t control = pci_msg_control(dev, dev->msix_cap);
+    int size = (control & PCI_MSIX_TABLE_SIZE) + 1;
+    uint32_t table = pci_read_config_space(dev->bus, dev->device, dev->function, dev->msix_cap + 4);
+    struct pci_bar *bar = &dev->bars[table & 0x7];
+    if ((table & 0x7) > 5 || !(bar->flags & PCI_BAR_MEM) || bar->base == 0 || bar->base >> 32) {
+        return 0;
+    }
+    if (nvec > size) {
+        nvec = size;
+    }
+    if (nvec > PCI_MAX_DEVICE_VECTORS) {
+        nvec = PCI_MAX_DEVICE_VECTORS;
+    }
+    int first = pci_alloc_vectors(nvec, false);
+    if (first < 0) {
+        return 0;
+    }
+
+    // Function masked while the table is written, every entry masked after
+    pci_set_msg_control(dev, dev->msix_cap, control | PCI_MSIX_ENABLE | PCI_MSIX_FUNC_MASK);
+    dev->msix_table = (volatile pci_msix_entry_t *)(uintptr_t)(bar->base + (table & ~0x7u));
+    for (int i = 0; i < size; i++) {
+        dev->msix_table[i].ctrl |= PCI_MSIX_ENTRY_MASKED;
+    }
+    for (int i = 0; i < nvec; i++) {
+        dev->vectors[i] = first + i;
+        dev->msix_table[i].addr_lo = PCI_MSI_ADDRESS | (uint32_t)cpu_current() << PCI_MSI_DEST_SHIFT;
+        dev->msix_table[i].addr_hi = 0;
+        dev->msix_table[i].data = first + i;
+    }
+    pci_set_msg_control(dev, dev->msix_cap, (control | PCI_MSIX_ENABLE) & ~PCI_MSIX_FUNC_MASK);
+    pci_disable_intx(dev);
+
+    dev->irq_mode = PCI_IRQ_MSIX;
+    dev->nvec = nvec;
+    return nvec;
+}
+
+// Offset of the MSI mask bits register, 0 without per-vector masking
+static uint8_t pci_msi_mask_reg(struct pci_device *dev) {
+    uint16_t control = pci_msg_control(dev, dev->msi_cap);
+    if (!(control & PCI_MSI_MASKABLE)) {
+        return 0;
+    }
+    return dev->msi_cap + (control & PCI_MSI_64BIT ? 0x10 : 0x0C);
+}
+
+// Enable MSI with up to nvec vectors, rounded down to a power of two.
+// Returns how many the device got, 0 if MSI is not available.
+int pci_enable_msi(struct pci_device *dev, int nvec) {
+    if (dev->msi_cap == 0 || dev->irq_mode != PCI_IRQ_INTX || nvec <= 0) {
+        return 0;
+    }
+    uint16_t control = pci_msg_control(dev, dev->msi_cap);
+    int log2 = 0;
+    while (log2 < ((control >> PCI_MSI_MMC_SHIFT) & 0x7) && (2 << log2) <= nvec) {
+        log2++;
+    }
+    nvec = 1 << log2;
+    int first = pci_alloc_vectors(nvec, true);
+    if (first < 0) {
+        return 0;
+    }
+
+    uint8_t cap = dev->msi_cap;
+    uint8_t mask = pci_msi_mask_reg(dev);
+    if (mask) {
+        pci_write_config_space(dev->bus, dev->device, dev->function, mask, 0xFFFFFFFF);
+    }
+    pci_write_config_space(dev->bus, dev->device, dev->function, cap + 4,
+                           PCI_MSI_ADDRESS | (uint32_t)cpu_current() << PCI_MSI_DEST_SHIFT);
+    if (control & PCI_MSI_64BIT) {
+        pci_write_config_space(dev->bus, dev->device, dev->function, cap + 8, 0);
+        pci_write_config_space(dev->bus, dev->device, dev->function, cap + 12, first);
+    } else {
+        pci_write_config_space(dev->bus, dev->device, dev->function, cap + 8, first);
+    }
+    control &= ~(0x7 << PCI_MSI_MME_SHIFT);
+    pci_set_msg_control(dev, cap, control | log2 << PCI_MSI_MME_SHIFT | PCI_MSI_ENABLE);
+    pci_disable_intx(dev);
+
+    for (int i = 0; i < nvec; i++) {
+        dev->vectors[i] = first + i;
+    }
+    dev->irq_mode = PCI_IRQ_MSI;
+    dev->nvec = nvec;
+    return nvec;
+}
+
+// Back to INTx, giving the vectors back
+void pci_disable_msi(struct pci_device *dev) {
+    if (dev->irq_mode == PCI_IRQ_MSIX) {
+        pci_set_msg_control(dev, dev->msix_cap, pci_msg_control(dev, dev->msix_cap) & ~PCI_MSIX_ENABLE);
+    } else if (dev->irq_mode == PCI_IRQ_MSI) {
+        pci_set_msg_control(dev, dev->msi_cap, pci_msg_control(dev, dev->msi_cap) & ~PCI_MSI_ENABLE);
+    } else {
+        return;
+    }
+    for (int i = 0; i < dev->nvec; i++) {
+        pci_free_vectors(dev->vectors[i], 1);
+    }
+    dev->irq_mode = PCI_IRQ_INTX;
+    dev->nvec = 0;
+    dev->msix_table = NULL;
+}
+
+// Mask or unmask one vector. MSI without mask bits can only be left as is.
+void pci_mask_vector(struct pci_device *dev, int index, bool masked) {
+    if (index < 0 || index >= dev->nvec) {
+        return;
+    }
+    if (dev->irq_mode == PCI_IRQ_MSIX) {
+        uint32_t ctrl = dev->msix_table[index].ctrl;
+        dev->msix_table[index].ctrl = masked ? ctrl | PCI_MSIX_ENTRY_MASKED : ctrl & ~PCI_MSIX_ENTRY_MASKED;
+        return;
+    }
+    uint8_t mask = pci_msi_mask_reg(dev);
+    if (dev->irq_mode == PCI_IRQ_MSI && mask) {
+        uint32_t bits = pci_read_config_space(dev->bus, dev->device, dev->function, mask);
+        bits = masked ? bits | 1u << index : bits & ~(1u << index);
+        pci_write_config_space(dev->bus, dev->device, dev->function, mask, bits);
+    }
+}
+
+// Deliver a vector to the CPU with the given local APIC ID. MSI vectors share
+// one address, so for MSI this moves all of them.
+bool pci_set_vector_cpu(struct pci_device *dev, int index, int apic_id) {
+    uint32_t addr = PCI_MSI_ADDRESS | (uint32_t)(apic_id & 0xFF) << PCI_MSI_DEST_SHIFT;
+    if (index < 0 || index >= dev->nvec) {
+        return false;
+    }
+    if (dev->irq_mode == PCI_IRQ_MSIX) {
+        // Entries are only rewritten while masked
+        uint32_t ctrl = dev->msix_table[index].ctrl;
+        dev->msix_table[index].ctrl = ctrl | PCI_MSIX_ENTRY_MASKED;
+        dev->msix_table[index].addr_lo = addr;
+        dev->msix_table[index].ctrl = ctrl;
+        return true;
+    }
+    pci_write_config_space(dev->bus, dev->device, dev->function, dev->msi_cap + 4, addr);
+    return true;
+}
+
+void pci_print_devices() {
+    pci_init();
+    for (int i = 0; i < pci_device_count; i++) {
+        struct pci_device *dev = &pci_devices[i];
+        char bdf[8], id[10], class[7];
+        hex_format(bdf, dev->bus, 2);
+        bdf[2] = ':';
+        hex_format(bdf + 3, dev->device, 2);
+        bdf[5] = '.';
+        hex_format(bdf + 6, dev->function, 1);
+        hex_format(id, dev->vendor_id, 4);
+        id[4] = ':';
+        hex_format(id + 5, dev->device_id, 4);
+        hex_format(class, dev->config[2] >> 8, 6);
+        const char *irq = dev->irq_mode == PCI_IRQ_MSIX ? " msi-x" : dev->irq_mode == PCI_IRQ_MSI ? " msi" : "";
+        printk("  %s %s class %s %s", bdf, id, class, dev->driver ? dev->driver->name : "-");
+        if (dev->nvec) {
+            printk("%s %d vectors", irq, dev->nvec);
+        }
+        printk("\n");
+
+        for (int b = 0; b < 6; b++) {
+            struct pci_bar *bar = &dev->bars[b];
+            char base[18];
+            if (bar->flags == 0) {
+                continue;
+            }
+            hex_format(base, bar->base >> 32, 8);
+            hex_format(base + 8, (uint32_t)bar->base, 8);
+            bool kib = bar->size >= 1024;
+            printk("    BAR%d %s %s, %d %s%s%s\n", b, bar->flags & PCI_BAR_IO ? "io " : "mem",
+                   base + (bar->base >> 32 ? 0 : 8), (int)(kib ? bar->size >> 10 : bar->size), kib ? "KiB" : "bytes",
+                   bar->flags & PCI_BAR_PREFETCH ? ", prefetchable" : "", bar->flags & PCI_BAR_WC ? ", wc" : "");
+        }
+    }
 }
 
 // I/O port access functions (these would need to be implemented for your platform)
@@ -1,13 +1,165 @@
 #ifndef PCI_H
 #define PCI_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
+// Command register bits (offset 0x04)
+#define PCI_COMMAND_IO          0x0001
+#define PCI_COMMAND_MEMORY      0x0002
+#define PCI_COMMAND_MASTER      0x0004
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+
+// Status register bits, in the upper half of the dword at 0x04
+#define PCI_STATUS_CAP_LIST     0x00100000
+
+// Capabilities
+#define PCI_CAP_POINTER         0x34
+#define PCI_CAP_MSI             0x05
+#define PCI_CAP_MSIX            0x11
+
+// MSI message control, in the upper half of the capability's first dword
+#define PCI_MSI_ENABLE          0x0001
+#define PCI_MSI_MMC_SHIFT       1       // log2 of the vectors the function can use
+#define PCI_MSI_MME_SHIFT       4       // log2 of the vectors enabled
+#define PCI_MSI_64BIT           0x0080
+#define PCI_MSI_MASKABLE        0x0100  // Per-vector mask bits
+
+// MSI-X message control
+#define PCI_MSIX_TABLE_SIZE     0x07FF  // Entries - 1
+#define PCI_MSIX_FUNC_MASK      0x4000
+#define PCI_MSIX_ENABLE         0x8000
+#define PCI_MSIX_ENTRY_MASKED   0x1
+
+// Message address for the local APIC with the given ID, fixed delivery
+#define PCI_MSI_ADDRESS         0xFEE00000
+#define PCI_MSI_DEST_SHIFT      12
+
+// Vectors handed out to devices, above the exceptions and legacy IRQs
+#define PCI_VECTOR_FIRST        0x30
+#define PCI_VECTOR_LAST         0xEF
+#define PCI_MAX_DEVICE_VECTORS  32
+
+#define PCI_IRQ_INTX            0
+#define PCI_IRQ_MSI             1
+#define PCI_IRQ_MSIX            2
+
+typedef struct {
+    uint32_t addr_lo;
+    uint32_t addr_hi;
+    uint32_t data;
+    uint32_t ctrl;
+} pci_msix_entry_t;
+
+#define PCI_CONFIG_SIZE         256     // Reachable through the legacy ports
+#define PCIE_CONFIG_SIZE        4096    // Extended space, ECAM only
+
+// Header type register (offset 0x0E)
+#define PCI_HEADER_MULTIFUNCTION 0x00800000     // In the dword at offset 0x0C
+#define PCI_HEADER_NORMAL        0x00
+#define PCI_HEADER_BRIDGE        0x01
+#define PCI_HEADER_CARDBUS       0x02
+
+// BIOS PCI IRQ routing table
+#define PCI_PIR_START 0xF0000
+#define PCI_PIR_END   0x100000
+
+struct pci_pir_slot {
+    uint8_t bus;
+    uint8_t devfn;          // Device in bits 7:3
+    struct {
+        uint8_t link;       // Interrupt router link value, 0 if the pin is not connected
+        uint16_t irq_mask;  // IRQs the link can be routed to
+    } __attribute__((packed)) pins[4];     // INTA# to INTD#
+    uint8_t slot;
+    uint8_t reserved;
+} __attribute__((packed));
+
+struct pci_pir {
+    char signature[4];      // "$PIR"
+    uint16_t version;
+    uint16_t size;          // Header and slot entries
+    uint8_t router_bus;
+    uint8_t router_devfn;
+    uint16_t exclusive_irqs;
+    uint32_t router_id;
+    uint32_t miniport;
+    uint8_t reserved[11];
+    uint8_t checksum;
+    struct pci_pir_slot slots[];
+} __attribute__((packed));
+
+#define MAX_PCI_DEVICES 128
+#define PCI_HASH_BITS   6
+#define PCI_HASH_SIZE   (1 << PCI_HASH_BITS)
+#define PCI_HEADER_DWORDS 16    // The 64 byte type 0/1/2 header
+
+// BAR register bits
+#define PCI_BAR_IO_SPACE     0x1
+#define PCI_BAR_TYPE_MASK    0x6
+#define PCI_BAR_TYPE_64      0x4
+#define PCI_BAR_PREFETCHABLE 0x8
+
+// Decoded BAR flags
+#define PCI_BAR_IO       0x01
+#define PCI_BAR_MEM      0x02
+#define PCI_BAR_64       0x04
+#define PCI_BAR_PREFETCH 0x08
+
+#define PCI_BAR_WC       0x10   // Mapped write combining
+
+struct pci_bar {
+    uint64_t base;      // 0 and no flags for unused BARs and upper halves
+    uint64_t size;
+    uint8_t flags;
+};
+
+struct pci_driver;
+
 struct pci_device {
     uint8_t bus;
     uint8_t device;
     uint8_t function;
     uint16_t vendor_id;
     uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t header_type;
     uint32_t port;  // Base address (or I/O port) for the device
+    uint8_t irq_line;   // Legacy IRQ the firmware routed the pin to
+    uint8_t irq_pin;    // 1-4 for INTA#-INTD#, 0 if the function has no interrupt
+    uint16_t irq_mask;  // IRQs $PIR allows for the pin, 0 if unknown
+    uint32_t config[PCI_HEADER_DWORDS];    // Header as read at enumeration
+    struct pci_bar bars[6];
+    struct pci_driver *driver;  // Driver that took the device, NULL if none
+    uint8_t msi_cap;        // Capability offsets, 0 if absent
+    uint8_t msix_cap;
+    uint8_t irq_mode;       // PCI_IRQ_*
+    uint8_t nvec;           // Vectors enabled for MSI or MSI-X
+    uint8_t vectors[PCI_MAX_DEVICE_VECTORS];
+    volatile pci_msix_entry_t *msix_table;
+    struct pci_device *class_next;  // Registry hash chains
+    struct pci_device *id_next;
+};
+
+// Driver match table entry. A table ends with an all zero entry.
+#define PCI_ANY_ID 0xFFFF
+#define PCI_CLASS_MASK_CLASS    0xFF0000
+#define PCI_CLASS_MASK_SUBCLASS 0xFFFF00
+#define PCI_CLASS_MASK_PROG_IF  0xFFFFFF
+
+struct pci_device_id {
+    uint16_t vendor_id;     // PCI_ANY_ID matches any
+    uint16_t device_id;
+    uint32_t class;         // class << 16 | subclass << 8 | prog_if
+    uint32_t class_mask;    // Bits of class that must match, 0 for any class
+};
+
+struct pci_driver {
+    const char *name;
+    const struct pci_device_id *ids;
+    bool (*probe)(struct pci_device *dev, const struct pci_device_id *id);  // true takes the device
 };
 
 struct pci_device_list {
@@ -15,7 +167,23 @@ struct pci_device_list {
     int length;
 };
 
+void pci_init();
 struct pci_device_list pci_enumerate_devices();
-uint32_t pci_read_config_space(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset);
+struct pci_device *pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_device *from);
+struct pci_device *pci_find_id(uint16_t vendor_id, uint16_t device_id, struct pci_device *from);
+int pci_register_driver(struct pci_driver *drv);
+bool pci_map_wc(struct pci_device *dev, int bar);
+void pci_print_devices();
+uint8_t pci_find_capability(struct pci_device *dev, uint8_t id);
+int pci_alloc_vectors(int count, bool aligned);
+void pci_free_vectors(int first, int count);
+int pci_enable_msix(struct pci_device *dev, int nvec);
+int pci_enable_msi(struct pci_device *dev, int nvec);
+void pci_disable_msi(struct pci_device *dev);
+void pci_mask_vector(struct pci_device *dev, int index, bool masked);
+bool pci_set_vector_cpu(struct pci_device *dev, int index, int apic_id);
+uint32_t pci_read_config_space(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset);
+void pci_write_config_space(uint8_t bus, uint8_t device, uint8_t function, uint16_t offset, uint32_t value);
+bool pci_extended_config();
 
-#endif // SYSTEM_H
+#endif // PCI_H
@@ -0,0 +1,342 @@
+#include "raid.h"
+#include "block.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include "../System/vfs.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Software RAID
+//
+// An "mdN" array is a queued block device stacked on its members. Every
+// request it is handed is cut at chunk boundaries into children, which go
+// to the members' own schedulers all at once, so a large request keeps
+// every member busy and the members merge whatever lands next to each
+// other again. The request completes when its last child does.
+//
+// RAID-0 stripes chunks across the members round robin. RAID-1 writes every
+// piece to every working mirror and sends each read piece to the mirror
+// with the fewest children outstanding, preferring one whose last read
+// ended where this one starts. A mirror that fails is dropped from the
+// array; reads it failed are retried on another one.
+
+static raid_t raids[RAID_MAX_ARRAYS];
+static int raid_count = 0;
+
+static void raid_fail_member(raid_t *r, int member) {
+    raid_member_t *m = &r->members[member];
+    if (!m->failed) {
+        m->failed = true;
+        r->active--;
+        printk("%s: %s failed, %d of %d members left\n", r->blk.name, m->dev->name, r->active, r->member_count);
+    }
+}
+
+// Mirror for a read at lba, excluding the members in tried. -1 if none is left.
+static int raid_pick(raid_t *r, uint64_t lba, uint8_t tried) {
+    int best = -1;
+    for (int i = 0; i < r->member_count; i++) {
+        raid_member_t *m = &r->members[i];
+        if (m->failed || (tried & (1u << i))) {
+            continue;
+        }
+        if (best < 0 || m->pending < r->members[best].pending ||
+            (m->pending == r->members[best].pending && m->next_lba == lba && r->members[best].next_lba != lba)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Completion ============================================================
+
+static void raid_finish(raid_t *r, raid_io_t *io) {
+    io->in_use = false;
+    r->completed++;
+    block_complete(&r->blk, io->parent, !io->failed);
+}
+
+static void raid_end_io(io_request_t *req) {
+    raid_child_t *c = req->private_data;
+    raid_t *r = c->raid;
+    raid_io_t *io = c->io;
+    raid_member_t *m = &r->members[c->member];
+
+    m->pending--;
+    if (req->status == IO_DONE) {
+        m->ios++;
+        m->sectors += req->count;
+    } else if (r->level == 1) {
+        raid_fail_member(r, c->member);
+        if (!req->write) {
+            int next = raid_pick(r, req->lba, c->tried);
+            if (next >= 0) {
+                // Same sectors on the next mirror, the child stays in flight
+                c->member = next;
+                c->tried |= 1u << next;
+                r->members[next].pending++;
+                r->stats.retries++;
+                block_submit(r->members[next].dev, req);
+                return;
+            }
+            io->failed = true;
+        } else if (r->active == 0) {
+            io->failed = true;
+        }
+    } else {
+        io->failed = true;
+    }
+
+    r->free_children[r->free_count++] = c - r->children;
+    if (--io->parts == 0) {
+        raid_finish(r, io);
+    }
+}
+
+// Submission ============================================================
+
+static void raid_submit_child(raid_t *r, raid_io_t *io, int member, uint64_t lba, uint32_t count, uint8_t *buf, bool write) {
+    raid_child_t *c = &r->children[r->free_children[--r->free_count]];
+    raid_member_t *m = &r->members[member];
+
+    memset(&c->req, 0, sizeof(io_request_t));
+    c->req.lba = lba;
+    c->req.count = count;
+    c->req.buf = buf;
+    c->req.write = write;
+    c->req.end_io = raid_end_io;
+    c->req.private_data = c;
+    c->io = io;
+    c->raid = r;
+    c->member = member;
+    c->tried = 1u << member;
+
+    io->parts++;
+    m->pending++;
+    if (!write) {
+        m->next_lba = lba + count;
+    }
+    r->stats.children++;
+    block_submit(m->dev, &c->req);
+}
+
+// Children one array request can need at most. Chunk and segment
+// boundaries cut it into at most sectors / chunk + nsegs + 1 runs, and
+// each run is cut again into pieces from wherever it starts, so a run
+// no longer than a chunk can take one piece more than chunk / piece does
+// when piece does not divide chunk.
+static uint32_t raid_children_per_io(raid_t *r, uint32_t sectors, int nsegs) {
+    uint32_t runs = sectors / r->chunk + nsegs + 1;
+    uint32_t pieces = runs * ((r->chunk + r->piece - 1) / r->piece);
+    return r->level == 1 ? pieces * r->member_count : pieces;
+}
+
+static bool raid_queue(block_device_t *dev, io_request_t *rq, const block_seg_t *segs, int nsegs) {
+    raid_t *r = dev->driver_data;
+    raid_io_t *io = NULL;
+
+    if (r->active == 0 || raid_children_per_io(r, rq->grp_count, nsegs) > r->free_count) {
+        return false;
+    }
+    for (int i = 0; i < RAID_MAX_QD; i++) {
+        if (!r->ios[i].in_use) {
+            io = &r->ios[i];
+            break;
+        }
+    }
+    if (io == NULL) {
+        return false;
+    }
+    io->parent = rq;
+    io->parts = 0;
+    io->failed = false;
+    io->in_use = true;
+    r->stats.requests++;
+
+    // Nothing completes before the members are polled, so parts only grows here
+    uint64_t lba = rq->grp_lba;
+    for (int i = 0; i < nsegs; i++) {
+        uint8_t *buf = segs[i].buf;
+        uint32_t left = segs[i].count;
+        while (left > 0) {
+            uint32_t n = r->chunk - lba % r->chunk;
+            if (n > r->piece) {
+                n = r->piece;
+            }
+            if (n > left) {
+                n = left;
+            }
+
+            if (r->level == 0) {
+                uint64_t stripe = lba / r->chunk;
+                int member = stripe % r->member_count;
+                uint64_t member_lba = stripe / r->member_count * r->chunk + lba % r->chunk;
+                raid_submit_child(r, io, member, member_lba, n, buf, rq->write);
+            } else if (rq->write) {
+                for (int m = 0; m < r->member_count; m++) {
+                    if (!r->members[m].failed) {
+                        raid_submit_child(r, io, m, lba, n, buf, true);
+                    }
+                }
+            } else {
+                raid_submit_child(r, io, raid_pick(r, lba, 0), lba, n, buf, false);
+            }
+
+            lba += n;
+            buf += n * r->blk.sector_size;
+            left -= n;
+        }
+    }
+    return true;
+}
+
+// Start the members that got children
+static void raid_commit(block_device_t *dev) {
+    raid_t *r = dev->driver_data;
+    for (int i = 0; i < r->member_count; i++) {
+        if (r->members[i].pending > 0) {
+            block_poll(r->members[i].dev);
+        }
+    }
+}
+
+static int raid_poll(block_device_t *dev) {
+    raid_t *r = dev->driver_data;
+    raid_commit(dev);
+    int found = r->completed;
+    r->completed = 0;
+    return found;
+}
+
+// The block layer drains the array first, so this only flushes caches
+static bool raid_flush(block_device_t *dev) {
+    raid_t *r = dev->driver_data;
+    bool ok = true;
+    for (int i = 0; i < r->member_count; i++) {
+        if (!r->members[i].failed && !block_flush(r->members[i].dev)) {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Arrays ================================================================
+
+// Build "mdN" from count members. chunk is in sectors.
+block_device_t *raid_create(int level, uint32_t chunk, block_device_t **members, int count) {
+    if (raid_count >= RAID_MAX_ARRAYS) {
+        printk("Error: Too many RAID arrays.\n");
+        return NULL;
+    }
+    if (level != 0 && level != 1) {
+        printk("Error: RAID level must be 0 or 1.\n");
+        return NULL;
+    }
+    if (count < 2 || count > RAID_MAX_MEMBERS) {
+        printk("Error: A RAID array needs 2 to %d members.\n", RAID_MAX_MEMBERS);
+        return NULL;
+    }
+    if (chunk == 0 || chunk > RAID_MAX_SECTORS) {
+        printk("Error: Chunk size must be between 1 and %d sectors.\n", RAID_MAX_SECTORS);
+        return NULL;
+    }
+
+    uint64_t smallest = members[0]->sector_count;
+    uint32_t piece = chunk;
+    for (int i = 0; i < count; i++) {
+        block_device_t *dev = members[i];
+        for (int j = 0; j < i; j++) {
+            if (members[j] == dev) {
+                printk("Error: %s is listed twice.\n", dev->name);
+                return NULL;
+            }
+        }
+        for (int a = 0; a < raid_count; a++) {
+            for (int m = 0; m < raids[a].member_count; m++) {
+                if (raids[a].members[m].dev == dev) {
+                    printk("Error: %s already belongs to %s.\n", dev->name, raids[a].blk.name);
+                    return NULL;
+                }
+            }
+        }
+        if (vfs_dev_mounted(dev)) {
+            printk("Error: %s is mounted.\n", dev->name);
+            return NULL;
+        }
+        if (dev->sector_size != members[0]->sector_size) {
+            printk("Error: Members have different sector sizes.\n");
+            return NULL;
+        }
+        if (dev->sector_count < smallest) {
+            smallest = dev->sector_count;
+        }
+        if (dev->max_sectors < piece) {
+            piece = dev->max_sectors;
+        }
+    }
+
+    raid_t *r = &raids[raid_count];
+    memset(r, 0, sizeof(raid_t));
+    r->level = level;
+    r->chunk = chunk;
+    r->piece = piece;
+    r->member_count = count;
+    r->active = count;
+    for (int i = 0; i < count; i++) {
+        r->members[i].dev = members[i];
+    }
+    for (uint32_t i = 0; i < RAID_MAX_CHILDREN; i++) {
+        r->free_children[i] = i;
+    }
+    r->free_count = RAID_MAX_CHILDREN;
+
+    block_make_name(r->blk.name, "md", raid_count);
+    r->blk.sector_size = members[0]->sector_size;
+    r->blk.sector_count = level == 0 ? smallest / chunk * chunk * count : smallest;
+    r->blk.max_sectors = RAID_MAX_SECTORS;
+    r->blk.max_segs = RAID_MAX_SEGS;
+    r->blk.queue = raid_queue;
+    r->blk.commit = raid_commit;
+    r->blk.poll = raid_poll;
+    r->blk.flush = raid_flush;
+    r->blk.driver_data = r;
+
+    // As many requests in flight as the children can always cover
+    uint32_t depth = RAID_MAX_CHILDREN / raid_children_per_io(r, RAID_MAX_SECTORS, RAID_MAX_SEGS);
+    r->blk.queue_depth = depth > RAID_MAX_QD ? RAID_MAX_QD : depth;
+
+    if (r->blk.sector_count == 0) {
+        printk("Error: Members are smaller than one chunk.\n");
+        return NULL;
+    }
+    if (depth == 0) {
+        // raid_queue() would turn the largest requests away forever
+        printk("Error: Chunk size is too small for these members.\n");
+        return NULL;
+    }
+    if (!block_register(&r->blk)) {
+        return NULL;
+    }
+    raid_count++;
+    return &r->blk;
+}
+
+void raid_print_stats() {
+    if (raid_count == 0) {
+        printk("No RAID arrays.\n");
+    }
+    for (int i = 0; i < raid_count; i++) {
+        raid_t *r = &raids[i];
+        printk("%s: RAID-%d, %d of %d members, chunk %d KiB, %d MiB\n", r->blk.name, r->level,
+               r->active, r->member_count, (int)(r->chunk * r->blk.sector_size / 1024),
+               (int)(r->blk.sector_count * r->blk.sector_size >> 20));
+        printk("  %d requests split into %d, %d retries\n",
+               r->stats.requests, r->stats.children, r->stats.retries);
+        for (int m = 0; m < r->member_count; m++) {
+            raid_member_t *mb = &r->members[m];
+            printk("  %s: %s, %d requests, %d MiB\n", mb->dev->name, mb->failed ? "failed" : "ok",
+                   mb->ios, (int)(mb->sectors * mb->dev->sector_size >> 20));
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef RAID_H
+#define RAID_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block.h"
+
+#define RAID_MAX_ARRAYS     2
+#define RAID_MAX_MEMBERS    8
+#define RAID_MAX_QD         32      // Requests in flight on the array
+#define RAID_MAX_CHILDREN   512     // Requests in flight on the members, over all array requests
+#define RAID_MAX_SECTORS    2048    // Largest array request (1 MiB)
+#define RAID_MAX_SEGS       8
+#define RAID_DEFAULT_CHUNK  128     // Sectors (64 KiB)
+
+typedef struct {
+    block_device_t *dev;
+    uint32_t pending;       // Children submitted, not completed yet
+    uint64_t next_lba;      // Where the last read sent here ended
+    bool failed;
+    uint32_t ios;           // Children completed
+    uint64_t sectors;
+} raid_member_t;
+
+// One request on the array
+typedef struct {
+    io_request_t *parent;
+    uint32_t parts;         // Children not completed yet
+    bool failed;
+    bool in_use;
+} raid_io_t;
+
+// One piece of an array request, submitted to a member
+typedef struct {
+    io_request_t req;
+    raid_io_t *io;
+    struct raid *raid;
+    int member;
+    uint8_t tried;          // RAID-1 reads: members this piece was sent to
+} raid_child_t;
+
+typedef struct {
+    uint32_t requests;      // Array requests
+    uint32_t children;      // Member requests they were split into
+    uint32_t retries;       // RAID-1 reads sent to another mirror after an error
+} raid_stats_t;
+
+typedef struct raid {
+    block_device_t blk;
+    int level;              // 0 striping, 1 mirroring
+    uint32_t chunk;         // Sectors per stripe unit, or per read piece for RAID-1
+    uint32_t piece;         // Largest child, chunk capped by the members' max_sectors
+    raid_member_t members[RAID_MAX_MEMBERS];
+    int member_count;
+    int active;             // Members that have not failed
+    raid_io_t ios[RAID_MAX_QD];
+    raid_child_t children[RAID_MAX_CHILDREN];
+    uint16_t free_children[RAID_MAX_CHILDREN];
+    uint32_t free_count;
+    uint32_t completed;     // Array requests finished since the last poll
+    raid_stats_t stats;
+} raid_t;
+
+block_device_t *raid_create(int level, uint32_t chunk, block_device_t **members, int count);
+void raid_print_stats();
+
+#endif // RAID_H
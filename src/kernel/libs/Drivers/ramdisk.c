@@ -0,0 +1,165 @@
+#include "ramdisk.h"
+#include "block.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include "../System/multiboot.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// RAM disks
+//
+// Two kinds: "ramN" disks made at runtime out of pages from alloc_page(),
+// and disks over a multiboot module GRUB already loaded ("initrd" for a
+// "module ... initrd" line). Module disks are one contiguous range, so
+// direct_access() can hand out pointers into the module for any range; the
+// page cache keeps such pointers as file pages, so reads through it copy
+// straight out of the module. Page backed disks can only do that within
+// one page.
+
+static ramdisk_t ramdisks[RAMDISK_MAX_DEVICES];
+static int ramdisk_count = 0;
+static int ramdisk_runtime_count = 0;
+
+static uint8_t *ramdisk_sector(ramdisk_t *rd, uint64_t lba) {
+    if (rd->base) {
+        return rd->base + lba * BLOCK_SECTOR_SIZE;
+    }
+    return rd->pages[lba / RAMDISK_SECTORS_PER_PAGE] + (lba % RAMDISK_SECTORS_PER_PAGE) * BLOCK_SECTOR_SIZE;
+}
+
+static bool ramdisk_transfer(block_device_t *dev, uint64_t lba, const block_seg_t *segs, int nsegs, bool write) {
+    ramdisk_t *rd = (ramdisk_t *)dev->driver_data;
+
+    for (int i = 0; i < nsegs; i++) {
+        uint8_t *buf = segs[i].buf;
+        uint32_t left = segs[i].count;
+
+        while (left > 0) {
+            // Copy up to the end of the backing page in one go
+            uint32_t n = left;
+            if (rd->base == NULL) {
+                uint32_t in_page = RAMDISK_SECTORS_PER_PAGE - lba % RAMDISK_SECTORS_PER_PAGE;
+                if (n > in_page) {
+                    n = in_page;
+                }
+            }
+            if (write) {
+                memcpy(ramdisk_sector(rd, lba), buf, n * BLOCK_SECTOR_SIZE);
+            } else {
+                memcpy(buf, ramdisk_sector(rd, lba), n * BLOCK_SECTOR_SIZE);
+            }
+            lba += n;
+            buf += n * BLOCK_SECTOR_SIZE;
+            left -= n;
+        }
+    }
+    return true;
+}
+
+static void *ramdisk_direct_access(block_device_t *dev, uint64_t lba, uint32_t count) {
+    ramdisk_t *rd = (ramdisk_t *)dev->driver_data;
+    if (rd->base == NULL && lba / RAMDISK_SECTORS_PER_PAGE != (lba + count - 1) / RAMDISK_SECTORS_PER_PAGE) {
+        return NULL;
+    }
+    return ramdisk_sector(rd, lba);
+}
+
+static ramdisk_t *ramdisk_new(uint64_t sectors) {
+    if (ramdisk_count >= RAMDISK_MAX_DEVICES) {
+        printk("Error: Too many RAM disks.\n");
+        return NULL;
+    }
+    ramdisk_t *rd = &ramdisks[ramdisk_count];
+    memset(rd, 0, sizeof(ramdisk_t));
+    rd->blk.sector_size = BLOCK_SECTOR_SIZE;
+    rd->blk.sector_count = sectors;
+    rd->blk.max_sectors = 2048;
+    rd->blk.max_segs = BLOCK_MAX_SEGS;
+    rd->blk.transfer = ramdisk_transfer;
+    rd->blk.direct_access = ramdisk_direct_access;
+    rd->blk.driver_data = rd;
+    return rd;
+}
+
+// Make a zero filled RAM disk of the given size
+block_device_t *ramdisk_create(uint32_t sectors) {
+    uint32_t page_count = (sectors + RAMDISK_SECTORS_PER_PAGE - 1) / RAMDISK_SECTORS_PER_PAGE;
+    if (sectors == 0) {
+        return NULL;
+    }
+
+    ramdisk_t *rd = ramdisk_new(sectors);
+    if (rd == NULL) {
+        return NULL;
+    }
+    rd->pages = malloc(page_count * sizeof(uint8_t *));
+    if (rd->pages == NULL) {
+        printk("Error: Out of memory for RAM disk page table.\n");
+        return NULL;
+    }
+    for (uint32_t i = 0; i < page_count; i++) {
+        rd->pages[i] = alloc_page();
+        if (rd->pages[i] == NULL) {
+            printk("Error: Out of pages for RAM disk.\n");
+            while (i > 0) {
+                free_page(rd->pages[--i]);
+            }
+            return NULL;
+        }
+        memset(rd->pages[i], 0, RAMDISK_PAGE_SIZE);
+    }
+    rd->page_count = page_count;
+
+    block_make_name(rd->blk.name, "ram", ramdisk_runtime_count);
+    if (!block_register(&rd->blk)) {
+        for (uint32_t i = 0; i < page_count; i++) {
+            free_page(rd->pages[i]);
+        }
+        return NULL;
+    }
+    ramdisk_runtime_count++;
+    ramdisk_count++;
+    return &rd->blk;
+}
+
+// Expose memory that already holds a disk image, e.g. a multiboot module
+block_device_t *ramdisk_attach(void *base, uint32_t size, const char *name) {
+    if (size < BLOCK_SECTOR_SIZE) {
+        return NULL;
+    }
+
+    ramdisk_t *rd = ramdisk_new(size / BLOCK_SECTOR_SIZE);
+    if (rd == NULL) {
+        return NULL;
+    }
+    rd->base = base;
+    strncpy(rd->blk.name, name, sizeof(rd->blk.name) - 1);
+    rd->blk.name[sizeof(rd->blk.name) - 1] = '\0';
+    if (!block_register(&rd->blk)) {
+        return NULL;
+    }
+    ramdisk_count++;
+    return &rd->blk;
+}
+
+// Register a RAM disk for every multiboot module, named after its command line
+int ramdisk_init_modules() {
+    int found = 0;
+    for (int i = 0; i < multiboot_module_count(); i++) {
+        multiboot_module_t *mod = multiboot_module(i);
+        const char *name = multiboot_module_name(mod);
+        char fallback[16];
+        if (name[0] == '\0' || name[0] == '/' || strlen(name) >= sizeof(fallback)) {
+            block_make_name(fallback, "initrd", i);
+            name = fallback;
+        }
+
+        block_device_t *dev = ramdisk_attach((void *)mod->mod_start, mod->mod_end - mod->mod_start, name);
+        if (dev) {
+            printk("%s: %d KiB from boot module\n", dev->name, (int)(dev->sector_count / 2));
+            found++;
+        }
+    }
+    return found;
+}
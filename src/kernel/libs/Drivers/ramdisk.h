@@ -0,0 +1,23 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block.h"
+
+#define RAMDISK_MAX_DEVICES 4
+#define RAMDISK_PAGE_SIZE   4096
+#define RAMDISK_SECTORS_PER_PAGE (RAMDISK_PAGE_SIZE / BLOCK_SECTOR_SIZE)
+
+typedef struct {
+    block_device_t blk;
+    uint8_t *base;          // Contiguous backing memory (multiboot module), or NULL
+    uint8_t **pages;        // Page backed disks made at runtime
+    uint32_t page_count;
+} ramdisk_t;
+
+block_device_t *ramdisk_create(uint32_t sectors);
+block_device_t *ramdisk_attach(void *base, uint32_t size, const char *name);
+int ramdisk_init_modules();
+
+#endif // RAMDISK_H
@@ -2,100 +2,352 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include "usb.h"
+#include "xhci.h"
+#include "ehci.h"
 #include "kernel.h"
+#include "../System/system.h"
+#include "../System/time.h"
 
-// Global USB Host Controller
-usb_host_controller_t usb_hc;
-usb_device_t usb_devicesclass[128];
-
-// Function to read a byte from a port
-
-
-// Function to read a 32-bit value from PCI configuration space
-uint32_t pci_read_config(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
-    uint32_t address = (1 << 31) | (bus << 16) | (slot << 11) | (func << 8) | (offset & 0xFC);
-    outb(PCI_CONFIG_ADDRESS, address);
-    return inb(PCI_CONFIG_DATA);
-}
-
-// Function to detect the USB host controller
-bool detect_usb_host_controller() {
-    // Scan PCI devices for a USB host controller
-    for (uint8_t bus = 0; bus < 256; bus++) {
-        for (uint8_t slot = 0; slot < 32; slot++) {
-            for (uint8_t func = 0; func < 8; func++) {
-                uint32_t vendor_device = pci_read_config(bus, slot, func, 0x00);
-                uint16_t vendor_id = vendor_device & 0xFFFF;
-                uint16_t device_id = vendor_device >> 16;
-
-                // Check if this is a USB host controller
-                if (vendor_id == 0xFFFF) continue; // Invalid vendor ID
-                uint8_t class_code = pci_read_config(bus, slot, func, 0x08) >> 24;
-                uint8_t subclass_code = pci_read_config(bus, slot, func, 0x08) >> 16 & 0xFF;
-
-                if (class_code == 0x0C && subclass_code == 0x03) { // USB class and subclass
-                    uint8_t prog_if = pci_read_config(bus, slot, func, 0x08) >> 8 & 0xFF;
-                    usb_hc.type = prog_if & 0xF0; // Determine the type (UHCI, OHCI, EHCI, xHCI)
-                    usb_hc.base_address = pci_read_config(bus, slot, func, 0x10) & 0xFFFFFFF0; // Base address
-                    usb_hc.initialized = true;
-                    printk("USB Host Controller detected: ");
-                    return true;
-                }
-            }
-        }
+// USB core
+//
+// Host controller drivers find the devices on their root ports, give each
+// an address and hand it to usb_enumerate(), which reads the descriptors,
+// selects the first configuration and binds class drivers to its
+// interfaces. Transfers are queued through the controller's ops and
+// complete from usb_poll(); there are no interrupts, so whoever waits on
+// USB (the keyboard, a block device) polls.
+
+static usb_hcd_t *usb_hcds[USB_MAX_HCDS];
+static int usb_hcd_count = 0;
+static usb_device_t usb_devices[USB_MAX_DEVICES];
+static int usb_dev_count = 0;
+static usb_driver_t *usb_drivers[USB_MAX_DRIVERS];
+static int usb_driver_count = 0;
+static uint8_t *usb_desc_buf = NULL;    // Descriptors are read into this page
+
+bool usb_register_hcd(usb_hcd_t *hcd) {
+    if (usb_hcd_count >= USB_MAX_HCDS) {
+        printk("USB: too many host controllers\n");
+        return false;
     }
-    return false;
+    usb_hcds[usb_hcd_count++] = hcd;
+    return true;
 }
 
-// Function to perform a USB control transfer
-bool usb_control_transfer(usb_device_t *device, uint8_t request_type, uint8_t request,
-                          uint16_t value, uint16_t index, void *data, uint16_t length) {
-    // Placeholder for control transfer logic
-    printk("Control transfer to device ");
-    (void)request_type; (void)request; (void)value; (void)index; (void)data; (void)length; // Suppress unused parameter warnings
-    return true; // Return true if successful
+usb_device_t *usb_alloc_device(usb_hcd_t *hcd) {
+    if (usb_dev_count >= USB_MAX_DEVICES) {
+        printk("USB: too many devices\n");
+        return NULL;
+    }
+    usb_device_t *dev = &usb_devices[usb_dev_count];
+    memset(dev, 0, sizeof(usb_device_t));
+    dev->hcd = hcd;
+    return dev;
+}
+
+int usb_device_count() {
+    return usb_dev_count;
+}
+
+usb_device_t *usb_get_device(int index) {
+    return index >= 0 && index < usb_dev_count ? &usb_devices[index] : NULL;
+}
+
+// Transfers ===========================================================
+
+// Returns the bytes transferred, -1 on error
+int usb_control_transfer(usb_device_t *device, uint8_t request_type, uint8_t request,
+                         uint16_t value, uint16_t index, void *data, uint16_t length) {
+    usb_setup_t setup = { request_type, request, value, index, length };
+    return device->hcd->control(device, &setup, data);
 }
 
-// Function to read a USB device descriptor
 bool usb_get_descriptor(usb_device_t *device, uint8_t descriptor_type, uint8_t index, void *buffer, uint16_t length) {
-    // Send a GET_DESCRIPTOR request
-    uint8_t request_type = 0x80; // IN, standard, device
-    return usb_control_transfer(device, request_type, USB_REQUEST_GET_DESCRIPTOR, (descriptor_type << 8) | index, 0, buffer, length);
+    uint8_t request_type = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE;
+    return usb_control_transfer(device, request_type, USB_REQUEST_GET_DESCRIPTOR,
+                                (descriptor_type << 8) | index, 0, buffer, length) > 0;
 }
 
-// Function to enumerate USB devices
-int usb_enumerate_devices(usb_device_t *device_list, int max_devices) {
-    int device_count = 0;
+bool usb_submit(usb_transfer_t *xfer) {
+    xfer->status = USB_XFER_PENDING;
+    xfer->actual = 0;
+    if (!xfer->dev->hcd->submit(xfer)) {
+        xfer->status = USB_XFER_ERROR;
+        return false;
+    }
+    return true;
+}
 
-    for (uint8_t address = 1; address <= 127 && device_count < max_devices; address++) {
-        usb_device_t device = {0};
-        device.address = address;
+// Called by the host controller driver for every transfer that finished
+void usb_transfer_done(usb_transfer_t *xfer, int status, uint32_t actual) {
+    xfer->actual = actual;
+    xfer->status = status;
+    if (xfer->complete) {
+        xfer->complete(xfer);
+    }
+}
 
-        uint8_t device_descriptor[18];
-        if (!usb_get_descriptor(&device, USB_DESCRIPTOR_DEVICE, 0, device_descriptor, sizeof(device_descriptor))) {
-            continue; // No device found
+// Poll until xfer is done. On a timeout the endpoint is reset, which fails xfer.
+bool usb_wait(usb_transfer_t *xfer, uint32_t timeout_us) {
+    uint64_t deadline = time_now_us() + timeout_us;
+    while (xfer->status == USB_XFER_PENDING) {
+        usb_poll();
+        if (xfer->status == USB_XFER_PENDING && time_now_us() > deadline) {
+            xfer->dev->hcd->reset_endpoint(xfer->dev, xfer->ep);
+            usb_poll();
+            return false;
         }
+    }
+    return xfer->status == USB_XFER_DONE;
+}
 
-        device.class_code = device_descriptor[4];
-        device.subclass_code = device_descriptor[5];
-        device.protocol_code = device_descriptor[6];
+int usb_poll() {
+    int found = 0;
+    for (int i = 0; i < usb_hcd_count; i++) {
+        found += usb_hcds[i]->poll(usb_hcds[i]);
+    }
+    return found;
+}
 
-        // Store device in the list
-        device_list[device_count++] = device;
+// Recover an endpoint that stalled: the controller forgets its queue and
+// the device its halt, and both start again at DATA0
+bool usb_clear_halt(usb_device_t *dev, usb_endpoint_t *ep) {
+    if (!dev->hcd->reset_endpoint(dev, ep)) {
+        return false;
     }
+    return usb_control_transfer(dev, USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_ENDPOINT,
+                                USB_REQUEST_CLEAR_FEATURE, USB_FEATURE_ENDPOINT_HALT,
+                                ep->endpoint_address, NULL, 0) >= 0;
+}
 
-    return device_count; // Return number of detected devices
+usb_endpoint_t *usb_find_endpoint(usb_device_t *dev, usb_interface_t *intf, int type, bool in) {
+    for (int i = 0; i < intf->num_endpoints; i++) {
+        usb_endpoint_t *ep = &dev->endpoints[intf->first_endpoint + i];
+        if (ep->transfer_type == type && ep->direction == (in ? 1 : 0)) {
+            return ep;
+        }
+    }
+    return NULL;
 }
-// Main USB driver initialization
-void usb_driver_init() {
-    if (!detect_usb_host_controller()) {
-        printk("No USB Host Controller found!");
-        return;
+
+// Streams for bulk endpoints that were just configured, 0 if the
+// controller or an endpoint has none
+int usb_alloc_streams(usb_device_t *dev, usb_endpoint_t **eps, int count, int streams) {
+    if (dev->hcd->alloc_streams == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (eps[i]->max_streams == 0) {
+            return 0;
+        }
     }
+    return dev->hcd->alloc_streams(dev, eps, count, streams);
+}
 
-    if (usb_enumerate_devices(usb_devicesclass, 128) != 0) {
-        printk("USB Keyboard detected!");
-    } else {
-        printk("No USB Keyboard found.");
+// Switch an interface to another alternate setting
+bool usb_set_interface(usb_device_t *dev, usb_interface_t *intf) {
+    usb_interface_t *old = NULL;
+    for (int i = 0; i < dev->num_interfaces; i++) {
+        if (dev->interfaces[i].number == intf->number && dev->interfaces[i].active) {
+            old = &dev->interfaces[i];
+        }
+    }
+    if (old == intf) {
+        return true;
+    }
+    if (usb_control_transfer(dev, USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_INTERFACE, USB_REQUEST_SET_INTERFACE,
+                             intf->alt_setting, intf->number, NULL, 0) < 0) {
+        return false;
     }
-}
\ No newline at end of file
+    if (!dev->hcd->configure(dev, old, intf)) {
+        return false;
+    }
+    if (old) {
+        old->active = false;
+    }
+    intf->active = true;
+    return true;
+}
+
+// Enumeration =========================================================
+
+// Fill in interfaces and endpoints from a configuration descriptor
+static void usb_parse_config(usb_device_t *dev, const uint8_t *desc, int total) {
+    usb_interface_t *intf = NULL;
+    usb_endpoint_t *ep = NULL;
+
+    for (int pos = 0; pos + 2 <= total && desc[pos] >= 2 && pos + desc[pos] <= total; pos += desc[pos]) {
+        const uint8_t *d = &desc[pos];
+        switch (d[1]) {
+        case USB_DESCRIPTOR_CONFIG:
+            dev->config_value = d[5];
+            break;
+        case USB_DESCRIPTOR_INTERFACE:
+            ep = NULL;
+            intf = NULL;
+            if (d[0] < 9 || dev->num_interfaces >= USB_MAX_INTERFACES) {
+                break;
+            }
+            intf = &dev->interfaces[dev->num_interfaces++];
+            intf->number = d[2];
+            intf->alt_setting = d[3];
+            intf->class_code = d[5];
+            intf->subclass_code = d[6];
+            intf->protocol_code = d[7];
+            intf->first_endpoint = dev->num_endpoints;
+            break;
+        case USB_DESCRIPTOR_ENDPOINT:
+            ep = NULL;
+            if (intf == NULL || d[0] < 7 || dev->num_endpoints >= USB_MAX_ENDPOINTS) {
+                break;
+            }
+            ep = &dev->endpoints[dev->num_endpoints++];
+            ep->endpoint_address = d[2];
+            ep->direction = d[2] & USB_DIR_IN ? 1 : 0;
+            ep->transfer_type = d[3] & 0x3;
+            ep->max_packet_size = (d[4] | d[5] << 8) & 0x7FF;
+            ep->polling_interval = d[6];
+            intf->num_endpoints++;
+            break;
+        case USB_DESCRIPTOR_SS_COMPANION:
+            if (ep && d[0] >= 6) {
+                ep->max_burst = d[2];
+                if (ep->transfer_type == USB_EP_BULK) {
+                    ep->max_streams = d[3] & 0x1F;
+                }
+            }
+            break;
+        case USB_DESCRIPTOR_PIPE_USAGE:
+            if (ep && d[0] >= 4) {
+                ep->pipe_id = d[2];
+            }
+            break;
+        }
+    }
+}
+
+static void usb_bind(usb_device_t *dev, usb_interface_t *intf) {
+    for (int i = 0; i < usb_driver_count && !intf->claimed; i++) {
+        usb_driver_t *drv = usb_drivers[i];
+        if ((drv->class_code == USB_ANY || drv->class_code == intf->class_code) &&
+            (drv->subclass_code == USB_ANY || drv->subclass_code == intf->subclass_code) &&
+            (drv->protocol_code == USB_ANY || drv->protocol_code == intf->protocol_code) &&
+            drv->probe(dev, intf)) {
+            intf->claimed = true;
+        }
+    }
+}
+
+// Configure a device that has an address and bind drivers to its interfaces.
+// The device is kept if this returns true.
+bool usb_enumerate(usb_device_t *dev) {
+    if (usb_desc_buf == NULL && (usb_desc_buf = alloc_page()) == NULL) {
+        return false;
+    }
+    uint8_t *d = usb_desc_buf;
+
+    if (!usb_get_descriptor(dev, USB_DESCRIPTOR_DEVICE, 0, d, 18)) {
+        printk("USB: port %d: no device descriptor\n", dev->port);
+        return false;
+    }
+    dev->vendor_id = d[8] | d[9] << 8;
+    dev->product_id = d[10] | d[11] << 8;
+    dev->class_code = d[4];
+    dev->subclass_code = d[5];
+    dev->protocol_code = d[6];
+
+    if (!usb_get_descriptor(dev, USB_DESCRIPTOR_CONFIG, 0, d, 9)) {
+        printk("USB: port %d: no configuration descriptor\n", dev->port);
+        return false;
+    }
+    int total = d[2] | d[3] << 8;
+    if (total > USB_CONFIG_MAX) {
+        total = USB_CONFIG_MAX;
+    }
+    if (!usb_get_descriptor(dev, USB_DESCRIPTOR_CONFIG, 0, d, total)) {
+        return false;
+    }
+    usb_parse_config(dev, d, total);
+
+    if (usb_control_transfer(dev, USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE, USB_REQUEST_SET_CONFIGURATION,
+                             dev->config_value, 0, NULL, 0) < 0) {
+        printk("USB: port %d: SET_CONFIGURATION failed\n", dev->port);
+        return false;
+    }
+    // Alternate setting 0 of every interface is selected now
+    for (int i = 0; i < dev->num_interfaces; i++) {
+        usb_interface_t *intf = &dev->interfaces[i];
+        if (intf->alt_setting == 0) {
+            if (!dev->hcd->configure(dev, NULL, intf)) {
+                printk("USB: port %d: endpoints of interface %d not configured\n", dev->port, intf->number);
+                continue;
+            }
+            intf->active = true;
+        }
+    }
+
+    usb_dev_count++;
+    char id[10];
+    hex_format(id, dev->vendor_id, 4);
+    id[4] = ':';
+    hex_format(id + 5, dev->product_id, 4);
+    printk("USB: %s on %s port %d, %d interfaces\n", id, dev->hcd->name, dev->port, dev->num_interfaces);
+
+    for (int i = 0; i < dev->num_interfaces; i++) {
+        if (dev->interfaces[i].active) {
+            usb_bind(dev, &dev->interfaces[i]);
+        }
+    }
+    return true;
+}
+
+// Drivers =============================================================
+
+// Register a class driver and offer it every interface nobody has yet
+bool usb_register_driver(usb_driver_t *drv) {
+    if (usb_driver_count >= USB_MAX_DRIVERS) {
+        printk("USB: too many drivers, %s dropped\n", drv->name);
+        return false;
+    }
+    usb_drivers[usb_driver_count++] = drv;
+    for (int d = 0; d < usb_dev_count; d++) {
+        for (int i = 0; i < usb_devices[d].num_interfaces; i++) {
+            usb_interface_t *intf = &usb_devices[d].interfaces[i];
+            if (intf->active && !intf->claimed) {
+                usb_bind(&usb_devices[d], intf);
+            }
+        }
+    }
+    return true;
+}
+
+void usb_print_devices() {
+    static const char *speeds[] = { "?", "full", "low", "high", "super" };
+    if (usb_dev_count == 0) {
+        printk("No USB devices.\n");
+    }
+    for (int i = 0; i < usb_dev_count; i++) {
+        usb_device_t *dev = &usb_devices[i];
+        char id[10], cls[7];
+        hex_format(id, dev->vendor_id, 4);
+        id[4] = ':';
+        hex_format(id + 5, dev->product_id, 4);
+        printk("  %s: %s port %d, address %d, %s speed\n", id, dev->hcd->name, dev->port, dev->address,
+               speeds[dev->speed <= USB_SPEED_SUPER ? dev->speed : 0]);
+        for (int j = 0; j < dev->num_interfaces; j++) {
+            usb_interface_t *intf = &dev->interfaces[j];
+            hex_format(cls, intf->class_code << 16 | intf->subclass_code << 8 | intf->protocol_code, 6);
+            printk("    interface %d.%d class %s, %d endpoints%s\n", intf->number, intf->alt_setting, cls,
+                   intf->num_endpoints, intf->claimed ? ", bound" : intf->active ? "" : ", inactive");
+        }
+    }
+}
+
+// Main USB driver initialization: bring up the host controllers, which
+// enumerate their root ports. Returns the number of devices found.
+// xHCI goes first: on Intel chipsets it takes over ports from EHCI.
+int usb_init() {
+    xhci_init();
+    ehci_init();
+    return usb_dev_count;
+}
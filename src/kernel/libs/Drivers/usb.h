@@ -4,81 +4,203 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-// PCI Constants
-#define PCI_CONFIG_ADDRESS 0xCF8
-#define PCI_CONFIG_DATA    0xCFC
-
-// USB Host Controller Types
+// USB Host Controller Types (PCI prog-if of class 0Ch/03h)
 #define USB_HC_UHCI 0x00
 #define USB_HC_OHCI 0x10
 #define USB_HC_EHCI 0x20
 #define USB_HC_XHCI 0x30
 
-// USB Constants
-#define USB_REQUEST_GET_DESCRIPTOR 0x06
+#define USB_MAX_HCDS        4
+#define USB_MAX_DEVICES     16
+#define USB_MAX_INTERFACES  8       // Interface descriptors per device, every alternate setting counts
+#define USB_MAX_ENDPOINTS   16      // Besides endpoint 0, over all interfaces
+#define USB_MAX_DRIVERS     8
+#define USB_CTRL_TIMEOUT_US 1000000
+#define USB_CONFIG_MAX      1024    // Largest configuration descriptor read
+
+// Standard requests
+#define USB_REQUEST_GET_STATUS        0x00
+#define USB_REQUEST_CLEAR_FEATURE     0x01
+#define USB_REQUEST_SET_FEATURE       0x03
+#define USB_REQUEST_SET_ADDRESS       0x05
+#define USB_REQUEST_GET_DESCRIPTOR    0x06
+#define USB_REQUEST_SET_CONFIGURATION 0x09
+#define USB_REQUEST_SET_INTERFACE     0x0B
+
+#define USB_FEATURE_ENDPOINT_HALT     0
+
+// bmRequestType
+#define USB_DIR_OUT          0x00
+#define USB_DIR_IN           0x80
+#define USB_TYPE_STANDARD    0x00
+#define USB_TYPE_CLASS       0x20
+#define USB_RECIP_DEVICE     0x00
+#define USB_RECIP_INTERFACE  0x01
+#define USB_RECIP_ENDPOINT   0x02
+
+// Descriptor types
 #define USB_DESCRIPTOR_DEVICE      0x01
 #define USB_DESCRIPTOR_CONFIG      0x02
+#define USB_DESCRIPTOR_STRING      0x03
 #define USB_DESCRIPTOR_INTERFACE   0x04
 #define USB_DESCRIPTOR_ENDPOINT    0x05
+#define USB_DESCRIPTOR_PIPE_USAGE  0x24    // UAS
+#define USB_DESCRIPTOR_SS_COMPANION 0x30
+
+// Endpoint transfer types
+#define USB_EP_CONTROL     0
+#define USB_EP_ISOCHRONOUS 1
+#define USB_EP_BULK        2
+#define USB_EP_INTERRUPT   3
+
+// Device speeds, numbered like the xHCI protocol speed IDs
+#define USB_SPEED_FULL   1
+#define USB_SPEED_LOW    2
+#define USB_SPEED_HIGH   3
+#define USB_SPEED_SUPER  4
 
 #define USB_HID_CLASS              0x03
 #define USB_HID_SUBCLASS_BOOT      0x01
 #define USB_HID_PROTOCOL_KEYBOARD  0x01
 
-// Maximum size for a configuration descriptor
-#define MAX_CONFIG_DESCRIPTOR_SIZE 256
+#define USB_ANY 0xFFFF  // Driver match wildcard
 
-// USB Device Structure
+// Transfer status
+#define USB_XFER_PENDING 0
+#define USB_XFER_DONE    1
+#define USB_XFER_ERROR   2
+#define USB_XFER_STALL   3
+
+// Setup packet of a control transfer
 typedef struct {
-    uint8_t address;
+    uint8_t request_type;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    uint16_t length;
+} __attribute__((packed)) usb_setup_t;
+
+typedef struct {
+    uint8_t endpoint_address;   // Bit 7 set for IN
+    uint8_t transfer_type;      // USB_EP_*
+    uint8_t direction;          // 1 for IN
+    uint16_t max_packet_size;
+    uint8_t polling_interval;   // bInterval as the descriptor has it
+    uint8_t max_burst;          // SuperSpeed companion, packets - 1
+    uint8_t max_streams;        // SuperSpeed companion, log2 of the streams of a bulk endpoint
+    uint8_t pipe_id;            // UAS pipe usage, 0 without one
+    void *hc_data;              // Host controller's state, while the endpoint is configured
+} usb_endpoint_t;
+
+// One interface descriptor, for one alternate setting
+typedef struct {
+    uint8_t number;
+    uint8_t alt_setting;
     uint8_t class_code;
     uint8_t subclass_code;
     uint8_t protocol_code;
     uint8_t num_endpoints;
-    struct {
-        uint8_t endpoint_address;
-        uint8_t transfer_type;
-        uint8_t direction;
-        uint16_t max_packet_size;
-        uint8_t polling_interval;
-    } endpoints[16];
-} usb_device_t;
-
-// USB Host Controller Structure
-typedef struct {
-    uint32_t base_address;
-    uint8_t type;
-    bool initialized;
-} usb_host_controller_t;
-
-// Global USB Host Controller
-extern usb_host_controller_t usb_hc;
+    uint8_t first_endpoint;     // Its endpoints follow each other in the device's endpoints[]
+    bool active;                // The selected alternate setting of its interface
+    bool claimed;               // A driver has it
+} usb_interface_t;
 
-// Function Prototypes
+struct usb_hcd;
 
-// Low-level I/O functions
-uint8_t inb(uint16_t port);
-void outb(uint16_t port, uint8_t value);
-
-// PCI Configuration Space Access
-uint32_t pci_read_config(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+// One piece of a scattered transfer buffer
+typedef struct {
+    void *buf;
+    uint32_t length;
+} usb_sg_t;
 
-// USB Host Controller Detection
-bool detect_usb_host_controller();
+typedef struct usb_device {
+    struct usb_hcd *hcd;
+    void *hc_data;              // Host controller's state for the device
+    uint8_t address;
+    uint8_t speed;              // USB_SPEED_*
+    uint8_t port;               // Root hub port, from 1
+    uint16_t max_packet0;       // Endpoint 0
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint8_t class_code;
+    uint8_t subclass_code;
+    uint8_t protocol_code;
+    uint8_t config_value;
+    uint8_t num_interfaces;
+    usb_interface_t interfaces[USB_MAX_INTERFACES];
+    uint8_t num_endpoints;
+    usb_endpoint_t endpoints[USB_MAX_ENDPOINTS];
+} usb_device_t;
 
-// USB Control Transfer
-bool usb_control_transfer(usb_device_t *device, uint8_t request_type, uint8_t request,
+// A bulk or interrupt transfer. It completes from usb_poll(), which calls
+// complete; complete may submit the transfer again.
+typedef struct usb_transfer {
+    usb_device_t *dev;
+    usb_endpoint_t *ep;
+    void *buf;                  // Physically contiguous
+    uint32_t length;            // Total, also with sg
+    const usb_sg_t *sg;         // If nsg is set the data is in sg[] instead of buf
+    int nsg;
+    uint16_t stream;            // Stream ID on endpoints with streams, 0 otherwise
+    uint32_t actual;            // Bytes transferred
+    volatile int status;        // USB_XFER_*
+    void (*complete)(struct usb_transfer *xfer);
+    void *private_data;
+    uint32_t hc_count;          // Host controller bookkeeping
+    void *hc_data;
+} usb_transfer_t;
+
+// What a host controller driver provides
+typedef struct usb_hcd {
+    const char *name;
+    int type;                   // USB_HC_*
+    void *data;
+    // Control transfer on endpoint 0, waits for it. Returns the bytes transferred or -1.
+    int (*control)(usb_device_t *dev, const usb_setup_t *setup, void *data);
+    // Queue a bulk or interrupt transfer
+    bool (*submit)(usb_transfer_t *xfer);
+    // Reap finished transfers, returns how many
+    int (*poll)(struct usb_hcd *hcd);
+    // Make the endpoints of intf usable, after those of old (NULL if none) are dropped
+    bool (*configure)(usb_device_t *dev, usb_interface_t *old, usb_interface_t *intf);
+    // Fail every transfer queued on an endpoint and clear the controller's halt state
+    bool (*reset_endpoint)(usb_device_t *dev, usb_endpoint_t *ep);
+    // Give bulk endpoints streams, returns how many each got, 0 without support. May be NULL.
+    int (*alloc_streams)(usb_device_t *dev, usb_endpoint_t **eps, int count, int streams);
+} usb_hcd_t;
+
+// Class drivers bind to interfaces
+typedef struct {
+    const char *name;
+    uint16_t class_code;        // USB_ANY matches any
+    uint16_t subclass_code;
+    uint16_t protocol_code;
+    bool (*probe)(usb_device_t *dev, usb_interface_t *intf);   // true takes the interface
+} usb_driver_t;
+
+// Core
+bool usb_register_hcd(usb_hcd_t *hcd);
+usb_device_t *usb_alloc_device(usb_hcd_t *hcd);
+bool usb_enumerate(usb_device_t *dev);
+bool usb_register_driver(usb_driver_t *drv);
+int usb_device_count();
+usb_device_t *usb_get_device(int index);
+int usb_poll();
+void usb_print_devices();
+
+// Transfers
+int usb_control_transfer(usb_device_t *device, uint8_t request_type, uint8_t request,
     uint16_t value, uint16_t index, void *data, uint16_t length);
-
-// USB Descriptor Handling
 bool usb_get_descriptor(usb_device_t *device, uint8_t descriptor_type, uint8_t index, void *buffer, uint16_t length);
-
-// USB Device Enumeration
-extern usb_device_t usb_devices[128];
-
-int usb_enumerate_devices(usb_device_t *device_list, int max_devices);
+bool usb_submit(usb_transfer_t *xfer);
+void usb_transfer_done(usb_transfer_t *xfer, int status, uint32_t actual);
+bool usb_wait(usb_transfer_t *xfer, uint32_t timeout_us);
+bool usb_set_interface(usb_device_t *dev, usb_interface_t *intf);
+bool usb_clear_halt(usb_device_t *dev, usb_endpoint_t *ep);
+usb_endpoint_t *usb_find_endpoint(usb_device_t *dev, usb_interface_t *intf, int type, bool in);
+int usb_alloc_streams(usb_device_t *dev, usb_endpoint_t **eps, int count, int streams);
 
 // Main USB Driver Initialization
-void usb_driver_init();
+int usb_init();
 
-#endif // USB_H
\ No newline at end of file
+#endif // USB_H
@@ -0,0 +1,660 @@
+#include "usb_storage.h"
+#include "usb.h"
+#include "block.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include "../System/time.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// USB mass storage driver
+//
+// SCSI commands go over one of two transports. Bulk-Only Transport (BOT)
+// allows a single command at a time, but its three phases (CBW, data, CSW)
+// are queued on the bulk rings back to back so the device never waits on
+// the host between them, and the next command is started from the CSW
+// completion so the bus stays busy while the block layer reaps the last.
+// USB Attached SCSI (UAS) is used on SuperSpeed devices whose controller
+// gives the bulk pipes streams: every command has its own tag, which is
+// also the stream ID its data and status move on, so several are in flight
+// at once. Transfers complete from usb_poll(); recovery after a stall or a
+// timeout needs control transfers and so only runs from the block layer's
+// poll(), never from a completion callback. Only LUN 0 is used.
+
+static usb_storage_t usb_storage_devs[USB_STORAGE_MAX_DEVICES];
+static int usb_storage_count = 0;
+
+static void us_put_be16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void us_put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void us_put_be64(uint8_t *p, uint64_t v) {
+    us_put_be32(p, (uint32_t)(v >> 32));
+    us_put_be32(p + 4, (uint32_t)v);
+}
+
+static uint32_t us_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void us_delay_us(uint32_t us) {
+    uint64_t end = time_now_us() + us;
+    while (time_now_us() < end) {
+    }
+}
+
+// Commands ============================================================
+
+static void us_cmd_finish(usb_storage_cmd_t *cmd);
+
+static usb_storage_cmd_t *us_cmd_alloc(usb_storage_t *us) {
+    for (int i = 0; i < us->depth; i++) {
+        usb_storage_cmd_t *cmd = &us->cmds[i];
+        if (!cmd->busy) {
+            cmd->busy = true;
+            cmd->started = false;
+            cmd->rq = NULL;
+            cmd->result = USB_STORAGE_PENDING;
+            cmd->xfer_failed = false;
+            cmd->actual = 0;
+            return cmd;
+        }
+    }
+    return NULL;
+}
+
+static void us_xfer_done(usb_transfer_t *xfer) {
+    usb_storage_cmd_t *cmd = (usb_storage_cmd_t *)xfer->private_data;
+    if (cmd->result != USB_STORAGE_PENDING) {
+        return;     // Failed by recovery already
+    }
+    if (xfer->status != USB_XFER_DONE) {
+        cmd->xfer_failed = true;
+    }
+    // A failed command waits for recovery in poll()
+    if (--cmd->waiting == 0 && !cmd->xfer_failed) {
+        us_cmd_finish(cmd);
+    }
+}
+
+static void us_xfer_init(usb_transfer_t *xfer, usb_storage_cmd_t *cmd, usb_endpoint_t *ep,
+                         void *buf, uint32_t length, uint16_t stream) {
+    memset(xfer, 0, sizeof(usb_transfer_t));
+    xfer->dev = cmd->us->dev;
+    xfer->ep = ep;
+    xfer->buf = buf;
+    xfer->length = length;
+    xfer->stream = stream;
+    xfer->complete = us_xfer_done;
+    xfer->private_data = cmd;
+}
+
+static void us_xfer_submit(usb_transfer_t *xfer) {
+    if (!usb_submit(xfer)) {
+        us_xfer_done(xfer);
+    }
+}
+
+// The data phase, on the pipe for its direction
+static void us_data_init(usb_storage_t *us, usb_storage_cmd_t *cmd, uint16_t stream) {
+    us_xfer_init(&cmd->data_xfer, cmd, cmd->in ? us->bulk_in : us->bulk_out, NULL, cmd->length, stream);
+    cmd->data_xfer.sg = cmd->sg;
+    cmd->data_xfer.nsg = cmd->nsg;
+}
+
+// Bulk-Only Transport =================================================
+
+static int bot_status(usb_storage_t *us, usb_storage_cmd_t *cmd) {
+    usb_bot_cbw_t *cbw = (usb_bot_cbw_t *)cmd->iu;
+    usb_bot_csw_t *csw = (usb_bot_csw_t *)(cmd->iu + USB_STORAGE_STATUS_OFFSET);
+    if (cmd->status_xfer.actual != USB_BOT_CSW_SIZE || csw->signature != USB_BOT_CSW_SIGNATURE ||
+        csw->tag != cbw->tag) {
+        us->recover = true;     // Out of step with the device
+        return USB_STORAGE_ERROR;
+    }
+    if (csw->status == USB_BOT_CSW_PASSED) {
+        return USB_STORAGE_GOOD;
+    }
+    if (csw->status == USB_BOT_CSW_FAILED) {
+        return USB_STORAGE_CHECK;
+    }
+    us->recover = true;         // Phase error
+    return USB_STORAGE_ERROR;
+}
+
+// Queue all three phases; the device works through them without the host
+// stepping in between
+static void bot_start(usb_storage_t *us, usb_storage_cmd_t *cmd) {
+    usb_bot_cbw_t *cbw = (usb_bot_cbw_t *)cmd->iu;
+    memset(cbw, 0, sizeof(usb_bot_cbw_t));
+    cbw->signature = USB_BOT_CBW_SIGNATURE;
+    cbw->tag = ++us->next_tag;
+    cbw->data_length = cmd->length;
+    cbw->flags = cmd->in ? USB_BOT_CBW_DATA_IN : 0;
+    cbw->cb_length = cmd->cdb_length;
+    memcpy(cbw->cb, cmd->cdb, cmd->cdb_length);
+
+    cmd->started = true;
+    cmd->deadline = time_now_us() + USB_STORAGE_TIMEOUT_US;
+    cmd->waiting = cmd->length ? 3 : 2;
+    us_xfer_init(&cmd->cmd_xfer, cmd, us->bulk_out, cbw, USB_BOT_CBW_SIZE, 0);
+    us_xfer_init(&cmd->status_xfer, cmd, us->bulk_in, cmd->iu + USB_STORAGE_STATUS_OFFSET, USB_BOT_CSW_SIZE, 0);
+    us_xfer_submit(&cmd->cmd_xfer);
+    if (cmd->length) {
+        us_data_init(us, cmd, 0);
+        us_xfer_submit(&cmd->data_xfer);
+    }
+    us_xfer_submit(&cmd->status_xfer);
+}
+
+// Start the command at the head of the queue if nothing holds it back
+static void bot_kick(usb_storage_t *us) {
+    if (us->bot_count > 0 && !us->recover) {
+        usb_storage_cmd_t *cmd = us->bot_fifo[us->bot_head];
+        if (!cmd->started) {
+            bot_start(us, cmd);
+        }
+    }
+}
+
+static void bot_enqueue(usb_storage_t *us, usb_storage_cmd_t *cmd) {
+    us->bot_fifo[(us->bot_head + us->bot_count) % USB_STORAGE_BOT_DEPTH] = cmd;
+    us->bot_count++;
+    bot_kick(us);
+}
+
+static void bot_pop(usb_storage_t *us) {
+    us->bot_head = (us->bot_head + 1) % USB_STORAGE_BOT_DEPTH;
+    us->bot_count--;
+}
+
+// Reset recovery (BOT 5.3.4): the class reset, then both bulk endpoints
+static void bot_reset(usb_storage_t *us) {
+    usb_control_transfer(us->dev, USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+                         USB_BOT_REQUEST_RESET, 0, us->intf->number, NULL, 0);
+    usb_clear_halt(us->dev, us->bulk_in);
+    usb_clear_halt(us->dev, us->bulk_out);
+    us->recover = false;
+}
+
+static bool bot_read_csw(usb_storage_t *us, usb_storage_cmd_t *cmd) {
+    for (int i = 0; i < 2; i++) {
+        us_xfer_init(&cmd->status_xfer, cmd, us->bulk_in, cmd->iu + USB_STORAGE_STATUS_OFFSET, USB_BOT_CSW_SIZE, 0);
+        cmd->status_xfer.complete = NULL;
+        if (usb_submit(&cmd->status_xfer) && usb_wait(&cmd->status_xfer, USB_STORAGE_TIMEOUT_US)) {
+            return true;
+        }
+        if (cmd->status_xfer.status != USB_XFER_STALL || !usb_clear_halt(us->dev, us->bulk_in)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// The head command failed a transfer or timed out
+static void bot_recover(usb_storage_t *us, usb_storage_cmd_t *cmd, bool timed_out) {
+    cmd->result = USB_STORAGE_ERROR;
+    if (!timed_out && cmd->cmd_xfer.status == USB_XFER_DONE && cmd->data_xfer.status == USB_XFER_STALL) {
+        // A stalled data phase is still followed by a CSW
+        usb_clear_halt(us->dev, cmd->data_xfer.ep);
+        if (cmd->status_xfer.status == USB_XFER_PENDING) {
+            usb_wait(&cmd->status_xfer, USB_STORAGE_TIMEOUT_US);
+        }
+        if (cmd->status_xfer.status == USB_XFER_DONE || bot_read_csw(us, cmd)) {
+            cmd->actual = cmd->data_xfer.actual;
+            cmd->result = bot_status(us, cmd);
+        } else {
+            us->recover = true;
+        }
+    } else {
+        us->recover = true;
+    }
+    cmd->waiting = 0;
+    bot_pop(us);
+}
+
+static void bot_check(usb_storage_t *us) {
+    if (us->bot_count > 0) {
+        usb_storage_cmd_t *cmd = us->bot_fifo[us->bot_head];
+        bool timed_out = cmd->started && time_now_us() > cmd->deadline;
+        if (cmd->started && cmd->result == USB_STORAGE_PENDING && (cmd->xfer_failed || timed_out)) {
+            bot_recover(us, cmd, timed_out);
+        }
+    }
+    if (us->recover) {
+        printk("%s: bulk-only reset\n", us->blk.name);
+        bot_reset(us);
+    }
+    bot_kick(us);
+}
+
+// USB Attached SCSI ===================================================
+
+static int uas_status(usb_storage_t *us, usb_storage_cmd_t *cmd) {
+    uint8_t *iu = cmd->iu + USB_STORAGE_STATUS_OFFSET;
+    uint16_t tag = (iu[2] << 8) | iu[3];
+    if (iu[0] != UAS_IU_SENSE || tag != cmd->tag) {
+        return USB_STORAGE_ERROR;
+    }
+    if (iu[6] == SCSI_STATUS_GOOD) {
+        return USB_STORAGE_GOOD;
+    }
+    if (iu[6] == SCSI_STATUS_CHECK) {
+        uint32_t length = (iu[14] << 8) | iu[15];
+        uint32_t room = cmd->status_xfer.actual > UAS_SENSE_HEADER ? cmd->status_xfer.actual - UAS_SENSE_HEADER : 0;
+        if (length > room) {
+            length = room;
+        }
+        if (length > USB_STORAGE_SENSE_SIZE) {
+            length = USB_STORAGE_SENSE_SIZE;
+        }
+        memset(us->sense, 0, USB_STORAGE_SENSE_SIZE);
+        memcpy(us->sense, iu + UAS_SENSE_HEADER, length);
+        return USB_STORAGE_CHECK;
+    }
+    return USB_STORAGE_ERROR;
+}
+
+// Post the status read and the data phase on the command's stream before
+// the command IU, so the device finds them waiting
+static void uas_start(usb_storage_t *us, usb_storage_cmd_t *cmd) {
+    uint8_t *iu = cmd->iu;
+    memset(iu, 0, UAS_COMMAND_IU_SIZE);
+    iu[0] = UAS_IU_COMMAND;
+    us_put_be16(iu + 2, cmd->tag);
+    memcpy(iu + 16, cmd->cdb, cmd->cdb_length);
+
+    cmd->started = true;
+    cmd->deadline = time_now_us() + USB_STORAGE_TIMEOUT_US;
+    cmd->waiting = cmd->length ? 3 : 2;
+    us_xfer_init(&cmd->status_xfer, cmd, us->status_pipe, cmd->iu + USB_STORAGE_STATUS_OFFSET,
+                 USB_STORAGE_IU_SIZE - USB_STORAGE_STATUS_OFFSET, cmd->tag);
+    us_xfer_init(&cmd->cmd_xfer, cmd, us->cmd_pipe, iu, UAS_COMMAND_IU_SIZE, 0);
+    us_xfer_submit(&cmd->status_xfer);
+    if (cmd->length) {
+        us_data_init(us, cmd, cmd->tag);
+        us_xfer_submit(&cmd->data_xfer);
+    }
+    us_xfer_submit(&cmd->cmd_xfer);
+}
+
+// Without task management a failed pipe takes every command in flight
+// with it: fail them all and reset the four pipes
+static void uas_check(usb_storage_t *us) {
+    bool reset = us->recover;
+    uint64_t now = time_now_us();
+    for (int i = 0; i < us->depth; i++) {
+        usb_storage_cmd_t *cmd = &us->cmds[i];
+        if (cmd->busy && cmd->started && cmd->result == USB_STORAGE_PENDING && (cmd->xfer_failed || now > cmd->deadline)) {
+            reset = true;
+        }
+    }
+    if (!reset) {
+        return;
+    }
+    printk("%s: UAS pipe reset\n", us->blk.name);
+    for (int i = 0; i < us->depth; i++) {
+        usb_storage_cmd_t *cmd = &us->cmds[i];
+        if (cmd->busy && cmd->result == USB_STORAGE_PENDING) {
+            cmd->result = USB_STORAGE_ERROR;
+            cmd->waiting = 0;
+        }
+    }
+    usb_clear_halt(us->dev, us->cmd_pipe);
+    usb_clear_halt(us->dev, us->status_pipe);
+    usb_clear_halt(us->dev, us->bulk_in);
+    usb_clear_halt(us->dev, us->bulk_out);
+    us->recover = false;
+}
+
+// Transport glue ======================================================
+
+// Every transfer of cmd completed normally: judge what the device reported
+static void us_cmd_finish(usb_storage_cmd_t *cmd) {
+    usb_storage_t *us = cmd->us;
+    cmd->actual = cmd->length ? cmd->data_xfer.actual : 0;
+    if (us->uas) {
+        cmd->result = uas_status(us, cmd);
+    } else {
+        cmd->result = bot_status(us, cmd);
+        bot_pop(us);
+        bot_kick(us);
+    }
+}
+
+static void us_cmd_start(usb_storage_t *us, usb_storage_cmd_t *cmd) {
+    if (us->uas) {
+        uas_start(us, cmd);
+    } else {
+        bot_enqueue(us, cmd);
+    }
+}
+
+// Failed transfers and timeouts
+static void us_check(usb_storage_t *us) {
+    if (us->uas) {
+        uas_check(us);
+    } else {
+        bot_check(us);
+    }
+}
+
+// Run one command and wait for it. BOT fetches the sense data of a CHECK
+// CONDITION with REQUEST SENSE; UAS delivers it in the sense IU.
+static int us_command(usb_storage_t *us, const uint8_t *cdb, int cdb_length, bool in, void *buf, uint32_t length) {
+    usb_storage_cmd_t *cmd = us_cmd_alloc(us);
+    if (cmd == NULL) {
+        return USB_STORAGE_ERROR;
+    }
+    memset(cmd->cdb, 0, sizeof(cmd->cdb));
+    memcpy(cmd->cdb, cdb, cdb_length);
+    cmd->cdb_length = cdb_length;
+    cmd->in = in;
+    cmd->length = length;
+    cmd->sg[0].buf = buf;
+    cmd->sg[0].length = length;
+    cmd->nsg = length ? 1 : 0;
+    us_cmd_start(us, cmd);
+    while (cmd->result == USB_STORAGE_PENDING) {
+        usb_poll();
+        us_check(us);
+    }
+    int result = cmd->result;
+    cmd->busy = false;
+
+    if (result == USB_STORAGE_CHECK && !us->uas && cdb[0] != SCSI_REQUEST_SENSE) {
+        uint8_t sense_cdb[6] = { SCSI_REQUEST_SENSE, 0, 0, 0, USB_STORAGE_SENSE_SIZE, 0 };
+        uint8_t sense[USB_STORAGE_SENSE_SIZE] __attribute__((aligned(64)));
+        memset(sense, 0, sizeof(sense));
+        if (us_command(us, sense_cdb, 6, true, sense, USB_STORAGE_SENSE_SIZE) == USB_STORAGE_GOOD) {
+            memcpy(us->sense, sense, USB_STORAGE_SENSE_SIZE);
+        }
+    }
+    return result;
+}
+
+static uint8_t us_sense_key(usb_storage_t *us) {
+    return us->sense[2] & 0x0F;
+}
+
+// READ/WRITE(10) while the range fits, (16) beyond 2^32 sectors
+static void scsi_rw_cdb(usb_storage_cmd_t *cmd, uint64_t lba, uint32_t count, bool write) {
+    memset(cmd->cdb, 0, sizeof(cmd->cdb));
+    if (lba + count <= 0xFFFFFFFFULL && count <= 0xFFFF) {
+        cmd->cdb[0] = write ? SCSI_WRITE_10 : SCSI_READ_10;
+        us_put_be32(&cmd->cdb[2], (uint32_t)lba);
+        us_put_be16(&cmd->cdb[7], count);
+        cmd->cdb_length = 10;
+    } else {
+        cmd->cdb[0] = write ? SCSI_WRITE_16 : SCSI_READ_16;
+        us_put_be64(&cmd->cdb[2], lba);
+        us_put_be32(&cmd->cdb[10], count);
+        cmd->cdb_length = 16;
+    }
+}
+
+// Block device ========================================================
+
+static bool us_blk_queue(block_device_t *dev, io_request_t *rq, const block_seg_t *segs, int nsegs) {
+    usb_storage_t *us = (usb_storage_t *)dev->driver_data;
+    usb_storage_cmd_t *cmd = us_cmd_alloc(us);
+    if (cmd == NULL) {
+        return false;
+    }
+    scsi_rw_cdb(cmd, rq->grp_lba, rq->grp_count, rq->write);
+    cmd->rq = rq;
+    cmd->in = !rq->write;
+    cmd->length = rq->grp_count * dev->sector_size;
+    for (int i = 0; i < nsegs; i++) {
+        cmd->sg[i].buf = segs[i].buf;
+        cmd->sg[i].length = segs[i].count * dev->sector_size;
+    }
+    cmd->nsg = nsegs;
+    us_cmd_start(us, cmd);
+    return true;
+}
+
+static int us_blk_poll(block_device_t *dev) {
+    usb_storage_t *us = (usb_storage_t *)dev->driver_data;
+    usb_poll();
+    us_check(us);
+
+    int found = 0;
+    for (int i = 0; i < us->depth; i++) {
+        usb_storage_cmd_t *cmd = &us->cmds[i];
+        if (!cmd->busy || cmd->rq == NULL || cmd->result == USB_STORAGE_PENDING) {
+            continue;
+        }
+        bool ok = cmd->result == USB_STORAGE_GOOD && cmd->actual == cmd->length;
+        if (!ok) {
+            printk("%s: %s failed\n", dev->name, cmd->rq->write ? "write" : "read");
+        }
+        io_request_t *rq = cmd->rq;
+        cmd->rq = NULL;
+        cmd->busy = false;
+        block_complete(dev, rq, ok);
+        found++;
+    }
+    return found;
+}
+
+// Devices that have no cache to sync reject the command, which is fine
+static bool us_blk_flush(block_device_t *dev) {
+    usb_storage_t *us = (usb_storage_t *)dev->driver_data;
+    uint8_t cdb[10] = { SCSI_SYNCHRONIZE_CACHE_10 };
+    int result = us_command(us, cdb, 10, false, NULL, 0);
+    return result == USB_STORAGE_GOOD ||
+           (result == USB_STORAGE_CHECK && us_sense_key(us) == SCSI_SENSE_ILLEGAL_REQUEST);
+}
+
+// Setup ===============================================================
+
+static bool bot_setup(usb_storage_t *us, usb_interface_t *intf) {
+    us->bulk_in = usb_find_endpoint(us->dev, intf, USB_EP_BULK, true);
+    us->bulk_out = usb_find_endpoint(us->dev, intf, USB_EP_BULK, false);
+    if (us->bulk_in == NULL || us->bulk_out == NULL) {
+        return false;
+    }
+    us->intf = intf;
+    us->uas = false;
+    us->depth = USB_STORAGE_BOT_DEPTH;
+    return true;
+}
+
+// Switch to the UAS alternate setting and give its bulk pipes streams
+static bool uas_setup(usb_storage_t *us, usb_interface_t *intf) {
+    usb_device_t *dev = us->dev;
+    if (dev->speed != USB_SPEED_SUPER || !usb_set_interface(dev, intf)) {
+        return false;
+    }
+    us->cmd_pipe = us->status_pipe = us->bulk_in = us->bulk_out = NULL;
+    for (int i = 0; i < intf->num_endpoints; i++) {
+        usb_endpoint_t *ep = &dev->endpoints[intf->first_endpoint + i];
+        if (ep->transfer_type != USB_EP_BULK) {
+            continue;
+        }
+        switch (ep->pipe_id) {
+            case UAS_PIPE_COMMAND:  us->cmd_pipe = ep; break;
+            case UAS_PIPE_STATUS:   us->status_pipe = ep; break;
+            case UAS_PIPE_DATA_IN:  us->bulk_in = ep; break;
+            case UAS_PIPE_DATA_OUT: us->bulk_out = ep; break;
+        }
+    }
+    if (us->cmd_pipe == NULL || us->status_pipe == NULL || us->bulk_in == NULL || us->bulk_out == NULL) {
+        return false;
+    }
+    usb_endpoint_t *eps[3] = { us->status_pipe, us->bulk_in, us->bulk_out };
+    int streams = usb_alloc_streams(dev, eps, 3, USB_STORAGE_MAX_TAGS);
+    if (streams < 1) {
+        return false;
+    }
+    us->intf = intf;
+    us->uas = true;
+    us->depth = streams < USB_STORAGE_MAX_TAGS ? streams : USB_STORAGE_MAX_TAGS;
+    return true;
+}
+
+// The alternate setting of intf's interface that speaks UAS
+static usb_interface_t *uas_find(usb_device_t *dev, usb_interface_t *intf) {
+    for (int i = 0; i < dev->num_interfaces; i++) {
+        usb_interface_t *alt = &dev->interfaces[i];
+        if (alt->number == intf->number && alt->class_code == USB_MSC_CLASS &&
+            alt->subclass_code == USB_MSC_SUBCLASS_SCSI && alt->protocol_code == USB_MSC_PROTOCOL_UAS) {
+            return alt;
+        }
+    }
+    return NULL;
+}
+
+static void us_copy_string(char *out, const uint8_t *in, int length) {
+    memcpy(out, in, length);
+    out[length] = 0;
+    for (int i = length - 1; i >= 0 && out[i] == ' '; i--) {
+        out[i] = 0;
+    }
+}
+
+// Identify the LUN, wait for the medium and read its size
+static bool us_scsi_init(usb_storage_t *us) {
+    uint8_t buf[36] __attribute__((aligned(64)));
+    uint8_t cdb[16];
+
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = SCSI_INQUIRY;
+    cdb[4] = sizeof(buf);
+    memset(buf, 0, sizeof(buf));
+    if (us_command(us, cdb, 6, true, buf, sizeof(buf)) != USB_STORAGE_GOOD) {
+        printk("usb-storage: INQUIRY failed\n");
+        return false;
+    }
+    if ((buf[0] & 0x1F) != 0) {
+        return false;   // Not a direct access block device
+    }
+    char vendor[9], product[17];
+    us_copy_string(vendor, buf + 8, 8);
+    us_copy_string(product, buf + 16, 16);
+
+    bool ready = false;
+    for (int i = 0; i < USB_STORAGE_READY_TRIES && !ready; i++) {
+        memset(cdb, 0, sizeof(cdb));
+        cdb[0] = SCSI_TEST_UNIT_READY;
+        ready = us_command(us, cdb, 6, false, NULL, 0) == USB_STORAGE_GOOD;
+        if (!ready) {
+            us_delay_us(USB_STORAGE_READY_WAIT_US);
+        }
+    }
+    if (!ready) {
+        printk("usb-storage: %s %s not ready\n", vendor, product);
+        return false;
+    }
+
+    uint64_t last;
+    uint32_t block_length;
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = SCSI_READ_CAPACITY_10;
+    if (us_command(us, cdb, 10, true, buf, 8) != USB_STORAGE_GOOD) {
+        printk("usb-storage: READ CAPACITY failed\n");
+        return false;
+    }
+    last = us_be32(buf);
+    block_length = us_be32(buf + 4);
+    if (last == 0xFFFFFFFF) {
+        memset(cdb, 0, sizeof(cdb));
+        cdb[0] = SCSI_SERVICE_ACTION_IN_16;
+        cdb[1] = SCSI_SA_READ_CAPACITY_16;
+        us_put_be32(&cdb[10], 32);
+        if (us_command(us, cdb, 16, true, buf, 32) != USB_STORAGE_GOOD) {
+            printk("usb-storage: READ CAPACITY(16) failed\n");
+            return false;
+        }
+        last = ((uint64_t)us_be32(buf) << 32) | us_be32(buf + 4);
+        block_length = us_be32(buf + 8);
+    }
+    if (block_length < 512 || block_length > 4096 || (block_length & (block_length - 1))) {
+        printk("usb-storage: unsupported block length %d\n", (int)block_length);
+        return false;
+    }
+
+    us->blk.sector_size = block_length;
+    us->blk.sector_count = last + 1;
+    printk("usb-storage: %s %s\n", vendor, product);
+    return true;
+}
+
+static bool usb_storage_probe(usb_device_t *dev, usb_interface_t *intf) {
+    if (usb_storage_count >= USB_STORAGE_MAX_DEVICES) {
+        return false;
+    }
+    usb_storage_t *us = &usb_storage_devs[usb_storage_count];
+    memset(us, 0, sizeof(usb_storage_t));
+    us->dev = dev;
+
+    // UAS when the device and controller both can, BOT otherwise
+    usb_interface_t *uas = uas_find(dev, intf);
+    if (uas == NULL || !uas_setup(us, uas)) {
+        if (intf->protocol_code != USB_MSC_PROTOCOL_BOT || !usb_set_interface(dev, intf) || !bot_setup(us, intf)) {
+            return false;
+        }
+    }
+
+    us->dma = alloc_page();
+    if (us->dma == NULL) {
+        return false;
+    }
+    memset(us->dma, 0, 4096);
+    for (int i = 0; i < USB_STORAGE_MAX_TAGS; i++) {
+        us->cmds[i].us = us;
+        us->cmds[i].tag = i + 1;
+        us->cmds[i].iu = us->dma + i * USB_STORAGE_IU_SIZE;
+    }
+
+    block_make_name(us->blk.name, "usb", usb_storage_count);
+    if (!us_scsi_init(us)) {
+        free_page(us->dma);
+        return false;
+    }
+    us->blk.max_sectors = USB_STORAGE_MAX_BYTES / us->blk.sector_size;
+    us->blk.max_segs = BLOCK_MAX_SEGS;
+    us->blk.queue = us_blk_queue;
+    us->blk.commit = NULL;
+    us->blk.poll = us_blk_poll;
+    us->blk.flush = us_blk_flush;
+    us->blk.queue_depth = us->depth;
+    us->blk.driver_data = us;
+    if (!block_register(&us->blk)) {
+        free_page(us->dma);
+        return false;
+    }
+    usb_storage_count++;
+
+    printk("%s: USB storage %d MiB, ", us->blk.name,
+           (int)((us->blk.sector_count * us->blk.sector_size) >> 20));
+    if (us->uas) {
+        printk("UAS %d tags\n", us->depth);
+    } else {
+        printk("bulk-only\n");
+    }
+    return true;
+}
+
+static usb_driver_t usb_storage_driver = {
+    "usb-storage",
+    USB_MSC_CLASS,
+    USB_MSC_SUBCLASS_SCSI,
+    USB_ANY,
+    usb_storage_probe
+};
+
+int usb_storage_init() {
+    usb_register_driver(&usb_storage_driver);
+    return usb_storage_count;
+}
@@ -0,0 +1,134 @@
+#ifndef USB_STORAGE_H
+#define USB_STORAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "usb.h"
+#include "block.h"
+
+// Interface class 08h (mass storage), subclass 06h (SCSI transparent command set)
+#define USB_MSC_CLASS           0x08
+#define USB_MSC_SUBCLASS_SCSI   0x06
+#define USB_MSC_PROTOCOL_BOT    0x50
+#define USB_MSC_PROTOCOL_UAS    0x62
+
+#define USB_STORAGE_MAX_DEVICES 4
+#define USB_STORAGE_MAX_TAGS    16      // Commands in flight over UAS, one stream each
+#define USB_STORAGE_BOT_DEPTH   2       // BOT: one command on the wire, the next ready behind it
+#define USB_STORAGE_MAX_BYTES   (128 * 1024)    // Per command
+#define USB_STORAGE_IU_SIZE     256     // DMA bytes per command: CBW or command IU, then CSW or sense IU
+#define USB_STORAGE_STATUS_OFFSET 32
+#define USB_STORAGE_SENSE_SIZE  18
+#define USB_STORAGE_TIMEOUT_US  10000000
+#define USB_STORAGE_READY_TRIES 25      // TEST UNIT READY while the medium spins up
+#define USB_STORAGE_READY_WAIT_US 200000
+
+// Command results
+#define USB_STORAGE_PENDING 0
+#define USB_STORAGE_GOOD    1
+#define USB_STORAGE_CHECK   2   // SCSI CHECK CONDITION, the sense data is in sense[]
+#define USB_STORAGE_ERROR   3
+
+// Bulk-Only Transport
+#define USB_BOT_CBW_SIGNATURE   0x43425355  // "USBC"
+#define USB_BOT_CSW_SIGNATURE   0x53425355  // "USBS"
+#define USB_BOT_CBW_SIZE        31
+#define USB_BOT_CSW_SIZE        13
+#define USB_BOT_CBW_DATA_IN     0x80
+#define USB_BOT_REQUEST_RESET   0xFF
+#define USB_BOT_CSW_PASSED      0
+#define USB_BOT_CSW_FAILED      1
+
+typedef struct {
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_length;
+    uint8_t flags;
+    uint8_t lun;
+    uint8_t cb_length;
+    uint8_t cb[16];
+} __attribute__((packed)) usb_bot_cbw_t;
+
+typedef struct {
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t residue;
+    uint8_t status;
+} __attribute__((packed)) usb_bot_csw_t;
+
+// USB Attached SCSI: pipe IDs from the pipe usage descriptors, and IUs.
+// IU fields are big endian.
+#define UAS_PIPE_COMMAND    1
+#define UAS_PIPE_STATUS     2
+#define UAS_PIPE_DATA_IN    3
+#define UAS_PIPE_DATA_OUT   4
+#define UAS_IU_COMMAND      0x01
+#define UAS_IU_SENSE        0x03
+#define UAS_IU_RESPONSE     0x04
+#define UAS_COMMAND_IU_SIZE 32
+#define UAS_SENSE_HEADER    16
+
+// SCSI
+#define SCSI_TEST_UNIT_READY    0x00
+#define SCSI_REQUEST_SENSE      0x03
+#define SCSI_INQUIRY            0x12
+#define SCSI_READ_CAPACITY_10   0x25
+#define SCSI_READ_10            0x28
+#define SCSI_WRITE_10           0x2A
+#define SCSI_SYNCHRONIZE_CACHE_10 0x35
+#define SCSI_READ_16            0x88
+#define SCSI_WRITE_16           0x8A
+#define SCSI_SERVICE_ACTION_IN_16 0x9E
+#define SCSI_SA_READ_CAPACITY_16  0x10
+#define SCSI_STATUS_GOOD        0x00
+#define SCSI_STATUS_CHECK       0x02
+#define SCSI_SENSE_ILLEGAL_REQUEST 0x05
+
+struct usb_storage;
+
+typedef struct {
+    struct usb_storage *us;
+    bool busy;
+    bool started;
+    uint16_t tag;               // UAS: also the stream ID
+    io_request_t *rq;           // NULL for commands the driver waits on itself
+    uint8_t cdb[16];
+    uint8_t cdb_length;
+    bool in;
+    uint32_t length;
+    uint32_t actual;            // Data bytes moved
+    usb_sg_t sg[BLOCK_MAX_SEGS];
+    int nsg;
+    int waiting;                // Transfers not completed yet
+    bool xfer_failed;           // One of them did not complete normally
+    volatile int result;        // USB_STORAGE_*
+    uint64_t deadline;
+    usb_transfer_t cmd_xfer;    // CBW, or the command IU
+    usb_transfer_t data_xfer;
+    usb_transfer_t status_xfer; // CSW, or the sense IU
+    uint8_t *iu;                // This command's part of the DMA page
+} usb_storage_cmd_t;
+
+typedef struct usb_storage {
+    block_device_t blk;
+    usb_device_t *dev;
+    usb_interface_t *intf;
+    bool uas;
+    usb_endpoint_t *bulk_in;    // BOT, or the UAS data-in pipe
+    usb_endpoint_t *bulk_out;   // BOT, or the UAS data-out pipe
+    usb_endpoint_t *cmd_pipe;   // UAS only
+    usb_endpoint_t *status_pipe;
+    int depth;                  // Commands the transport holds at once
+    usb_storage_cmd_t cmds[USB_STORAGE_MAX_TAGS];
+    uint8_t *dma;               // CBWs, CSWs and IUs
+    uint32_t next_tag;
+    bool recover;               // The transport needs a reset before it goes on
+    usb_storage_cmd_t *bot_fifo[USB_STORAGE_BOT_DEPTH];
+    int bot_head;
+    int bot_count;
+    uint8_t sense[USB_STORAGE_SENSE_SIZE];
+} usb_storage_t;
+
+int usb_storage_init();
+
+#endif // USB_STORAGE_H
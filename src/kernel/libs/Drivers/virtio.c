@@ -0,0 +1,444 @@
+#include "virtio.h"
+#include "pci.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Modern (1.x) virtio-pci transport with split and packed virtqueues.
+//
+// Both ring formats give every in-flight request an id in 0..size-1: the
+// head descriptor index for split rings, an allocated buffer id for packed
+// rings. Requests with more than one buffer go through an indirect table when
+// the device supports it, so each one costs a single ring slot. With
+// VIRTIO_RING_F_EVENT_IDX the device tells us which avail index it wants to
+// be notified at, and virtq_kick() skips the MMIO write otherwise.
+
+#define PCI_CAP_ID_VNDR 0x09
+
+static inline void virtio_mb() {
+    __asm__ volatile ("mfence" ::: "memory");
+}
+
+static inline void virtio_wmb() {
+    __asm__ volatile ("" ::: "memory");  // x86 keeps stores in order
+}
+
+// Transport =============================================================
+
+static volatile uint8_t *virtio_map_cap(struct pci_device *pdev, uint8_t cap, uint32_t *extra) {
+    uint8_t bar = pci_read_config_space(pdev->bus, pdev->device, pdev->function, cap + 4) & 0xFF;
+    uint32_t offset = pci_read_config_space(pdev->bus, pdev->device, pdev->function, cap + 8);
+    if (extra) {
+        *extra = pci_read_config_space(pdev->bus, pdev->device, pdev->function, cap + 16);
+    }
+    if (bar > 5) {
+        return NULL;
+    }
+
+    uint32_t lo = pci_read_config_space(pdev->bus, pdev->device, pdev->function, 0x10 + bar * 4);
+    if (lo & 1) {
+        return NULL;    // I/O BARs are only used by legacy devices
+    }
+    if ((lo & 0x6) == 0x4 && bar < 5) {
+        uint32_t hi = pci_read_config_space(pdev->bus, pdev->device, pdev->function, 0x14 + bar * 4);
+        if (hi != 0) {
+            printk("virtio: BAR%d above 4G is not reachable\n", bar);
+            return NULL;
+        }
+    }
+    return (volatile uint8_t *)((lo & ~0xF) + offset);
+}
+
+// Walk the capability list for the first virtio capability of cfg_type
+static uint8_t virtio_find_cap(struct pci_device *pdev, uint8_t cfg_type) {
+    uint32_t status = pci_read_config_space(pdev->bus, pdev->device, pdev->function, 0x04) >> 16;
+    if (!(status & 0x10)) {
+        return 0;
+    }
+
+    uint8_t ptr = pci_read_config_space(pdev->bus, pdev->device, pdev->function, 0x34) & 0xFC;
+    int guard = 48;
+    while (ptr && guard--) {
+        uint32_t header = pci_read_config_space(pdev->bus, pdev->device, pdev->function, ptr);
+        if ((header & 0xFF) == PCI_CAP_ID_VNDR && ((header >> 24) & 0xFF) == cfg_type) {
+            return ptr;
+        }
+        ptr = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+bool virtio_pci_init(virtio_dev_t *vdev, struct pci_device *pdev) {
+    memset(vdev, 0, sizeof(virtio_dev_t));
+    vdev->bus = pdev->bus;
+    vdev->device = pdev->device;
+    vdev->function = pdev->function;
+
+    uint8_t common = virtio_find_cap(pdev, VIRTIO_PCI_CAP_COMMON_CFG);
+    uint8_t notify = virtio_find_cap(pdev, VIRTIO_PCI_CAP_NOTIFY_CFG);
+    uint8_t isr = virtio_find_cap(pdev, VIRTIO_PCI_CAP_ISR_CFG);
+    uint8_t device = virtio_find_cap(pdev, VIRTIO_PCI_CAP_DEVICE_CFG);
+    if (!common || !notify) {
+        printk("virtio: legacy-only device, not supported\n");
+        return false;
+    }
+
+    vdev->common = (virtio_pci_common_cfg_t *)virtio_map_cap(pdev, common, NULL);
+    vdev->notify_base = virtio_map_cap(pdev, notify, &vdev->notify_mult);
+    vdev->isr = isr ? virtio_map_cap(pdev, isr, NULL) : NULL;
+    vdev->device_cfg = device ? virtio_map_cap(pdev, device, NULL) : NULL;
+    if (vdev->common == NULL || vdev->notify_base == NULL) {
+        return false;
+    }
+
+    uint32_t command = pci_read_config_space(pdev->bus, pdev->device, pdev->function, 0x04) & 0xFFFF;
+    pci_write_config_space(pdev->bus, pdev->device, pdev->function, 0x04,
+                           command | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+
+    // Reset, then announce ourselves
+    vdev->common->device_status = 0;
+    int spin = 1000000;
+    while (vdev->common->device_status != 0 && spin--) {
+    }
+    vdev->common->device_status = VIRTIO_STATUS_ACKNOWLEDGE;
+    vdev->common->device_status |= VIRTIO_STATUS_DRIVER;
+    return true;
+}
+
+bool virtio_negotiate(virtio_dev_t *vdev, uint64_t wanted) {
+    vdev->common->device_feature_select = 0;
+    uint64_t offered = vdev->common->device_feature;
+    vdev->common->device_feature_select = 1;
+    offered |= (uint64_t)vdev->common->device_feature << 32;
+
+    if (!(offered & (1ULL << VIRTIO_F_VERSION_1))) {
+        printk("virtio: device does not offer VERSION_1\n");
+        return false;
+    }
+
+    vdev->features = offered & (wanted | (1ULL << VIRTIO_F_VERSION_1));
+    vdev->common->driver_feature_select = 0;
+    vdev->common->driver_feature = (uint32_t)vdev->features;
+    vdev->common->driver_feature_select = 1;
+    vdev->common->driver_feature = (uint32_t)(vdev->features >> 32);
+
+    vdev->common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    if (!(vdev->common->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+        printk("virtio: device rejected our feature set\n");
+        return false;
+    }
+    return true;
+}
+
+bool virtio_has_feature(virtio_dev_t *vdev, int bit) {
+    return (vdev->features >> bit) & 1;
+}
+
+void virtio_driver_ok(virtio_dev_t *vdev) {
+    vdev->common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+}
+
+void virtio_fail(virtio_dev_t *vdev) {
+    vdev->common->device_status |= VIRTIO_STATUS_FAILED;
+}
+
+// Virtqueue setup =======================================================
+
+bool virtq_setup(virtio_dev_t *vdev, virtq_t *vq, uint16_t index) {
+    memset(vq, 0, sizeof(virtq_t));
+    vq->vdev = vdev;
+    vq->index = index;
+    vq->packed = virtio_has_feature(vdev, VIRTIO_F_RING_PACKED);
+    vq->event_idx = virtio_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
+    vq->indirect = virtio_has_feature(vdev, VIRTIO_RING_F_INDIRECT_DESC);
+
+    vdev->common->queue_select = index;
+    uint16_t size = vdev->common->queue_size;
+    if (size == 0) {
+        return false;
+    }
+    if (size > VIRTQ_MAX_SIZE) {
+        size = VIRTQ_MAX_SIZE;  // Still a power of two as split rings require
+    }
+    vq->size = size;
+    vq->num_free = size;
+
+    // One page holds the whole ring at these sizes
+    uint8_t *ring = alloc_page();
+    if (ring == NULL) {
+        printk("virtio: out of pages for queue %d\n", index);
+        return false;
+    }
+    memset(ring, 0, 4096);
+
+    uint8_t *driver_area, *device_area;
+    if (vq->packed) {
+        vq->pdesc = (volatile virtq_packed_desc_t *)ring;
+        vq->driver_event = (volatile virtq_event_t *)(ring + 1024);
+        vq->device_event = (volatile virtq_event_t *)(ring + 1028);
+        vq->avail_wrap = true;
+        vq->used_wrap = true;
+        for (uint16_t i = 0; i < size; i++) {
+            vq->free_ids[i] = size - 1 - i;
+        }
+        vq->free_id_count = size;
+        vq->driver_event->flags = VIRTQ_EVENT_F_DISABLE;  // Completions are polled
+        driver_area = (uint8_t *)vq->driver_event;
+        device_area = (uint8_t *)vq->device_event;
+    } else {
+        vq->desc = (volatile virtq_desc_t *)ring;
+        vq->avail = (volatile virtq_avail_t *)(ring + 1024);
+        vq->used = (volatile virtq_used_t *)(ring + 2048);
+        for (uint16_t i = 0; i < size; i++) {
+            vq->desc[i].next = i + 1;
+        }
+        // Completions are polled, so ask for no interrupts at all
+        if (vq->event_idx) {
+            vq->avail->ring[size] = 0xFFFF;  // used_event
+        } else {
+            vq->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+        }
+        driver_area = (uint8_t *)vq->avail;
+        device_area = (uint8_t *)vq->used;
+    }
+
+    vdev->common->queue_size = size;
+    vdev->common->queue_msix_vector = 0xFFFF;  // No vector
+    vdev->common->queue_desc_lo = (uint32_t)ring;
+    vdev->common->queue_desc_hi = 0;
+    vdev->common->queue_driver_lo = (uint32_t)driver_area;
+    vdev->common->queue_driver_hi = 0;
+    vdev->common->queue_device_lo = (uint32_t)device_area;
+    vdev->common->queue_device_hi = 0;
+    vq->notify = (volatile uint16_t *)(vdev->notify_base + vdev->common->queue_notify_off * vdev->notify_mult);
+    vdev->common->queue_enable = 1;
+    return true;
+}
+
+static void *virtq_indirect_table(virtq_t *vq, int id) {
+    int page = id / VIRTQ_INDIRECT_PER_PAGE;
+    if (vq->indirect_pages[page] == NULL) {
+        vq->indirect_pages[page] = alloc_page();
+        if (vq->indirect_pages[page] == NULL) {
+            return NULL;
+        }
+    }
+    return vq->indirect_pages[page] + (id % VIRTQ_INDIRECT_PER_PAGE) * VIRTQ_MAX_INDIRECT * 16;
+}
+
+// Id the next virtq_add() will use, -1 if the ring is full
+int virtq_next_id(virtq_t *vq) {
+    if (vq->num_free == 0) {
+        return -1;
+    }
+    if (vq->packed) {
+        return vq->free_id_count ? vq->free_ids[vq->free_id_count - 1] : -1;
+    }
+    return vq->free_head;
+}
+
+// Adding buffers ========================================================
+
+static bool virtq_add_split(virtq_t *vq, const virtq_buf_t *bufs, int nbufs, bool use_indirect) {
+    uint16_t head = vq->free_head;
+
+    if (use_indirect) {
+        volatile virtq_desc_t *table = virtq_indirect_table(vq, head);
+        for (int i = 0; i < nbufs; i++) {
+            table[i].addr = (uintptr_t)bufs[i].addr;
+            table[i].len = bufs[i].len;
+            table[i].flags = (bufs[i].write ? VIRTQ_DESC_F_WRITE : 0) | (i < nbufs - 1 ? VIRTQ_DESC_F_NEXT : 0);
+            table[i].next = i + 1;
+        }
+        vq->desc[head].addr = (uintptr_t)table;
+        vq->desc[head].len = nbufs * sizeof(virtq_desc_t);
+        vq->desc[head].flags = VIRTQ_DESC_F_INDIRECT;
+        vq->free_head = vq->desc[head].next;
+        vq->chain_len[head] = 1;
+    } else {
+        uint16_t i = head;
+        for (int k = 0; k < nbufs; k++) {
+            vq->desc[i].addr = (uintptr_t)bufs[k].addr;
+            vq->desc[i].len = bufs[k].len;
+            vq->desc[i].flags = (bufs[k].write ? VIRTQ_DESC_F_WRITE : 0) | (k < nbufs - 1 ? VIRTQ_DESC_F_NEXT : 0);
+            i = vq->desc[i].next;
+        }
+        vq->free_head = i;
+        vq->chain_len[head] = nbufs;
+    }
+
+    vq->num_free -= vq->chain_len[head];
+    vq->avail->ring[vq->avail_idx % vq->size] = head;
+    virtio_wmb();
+    vq->avail->idx = ++vq->avail_idx;
+    return true;
+}
+
+static bool virtq_add_packed(virtq_t *vq, const virtq_buf_t *bufs, int nbufs, bool use_indirect) {
+    uint16_t id = vq->free_ids[--vq->free_id_count];
+    uint16_t head = vq->next_avail;
+    uint16_t head_flags = 0;
+    int ndesc = use_indirect ? 1 : nbufs;
+
+    if (use_indirect) {
+        volatile virtq_packed_desc_t *table = virtq_indirect_table(vq, id);
+        for (int i = 0; i < nbufs; i++) {
+            table[i].addr = (uintptr_t)bufs[i].addr;
+            table[i].len = bufs[i].len;
+            table[i].id = 0;
+            table[i].flags = bufs[i].write ? VIRTQ_DESC_F_WRITE : 0;
+        }
+    }
+
+    for (int k = 0; k < ndesc; k++) {
+        uint16_t pos = vq->next_avail;
+        uint16_t flags = vq->avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED;
+
+        if (use_indirect) {
+            vq->pdesc[pos].addr = (uintptr_t)virtq_indirect_table(vq, id);
+            vq->pdesc[pos].len = nbufs * sizeof(virtq_packed_desc_t);
+            flags |= VIRTQ_DESC_F_INDIRECT;
+        } else {
+            vq->pdesc[pos].addr = (uintptr_t)bufs[k].addr;
+            vq->pdesc[pos].len = bufs[k].len;
+            flags |= (bufs[k].write ? VIRTQ_DESC_F_WRITE : 0) | (k < ndesc - 1 ? VIRTQ_DESC_F_NEXT : 0);
+        }
+        vq->pdesc[pos].id = id;
+
+        // The head's flags go last so the device never sees a partial chain
+        if (k == 0) {
+            head_flags = flags;
+        } else {
+            vq->pdesc[pos].flags = flags;
+        }
+
+        if (++vq->next_avail == vq->size) {
+            vq->next_avail = 0;
+            vq->avail_wrap = !vq->avail_wrap;
+        }
+    }
+
+    vq->num_free -= ndesc;
+    vq->num_added += ndesc;
+    vq->chain_len[id] = ndesc;
+    virtio_wmb();
+    vq->pdesc[head].flags = head_flags;
+    return true;
+}
+
+// Make one request available. The doorbell is left to virtq_kick().
+bool virtq_add(virtq_t *vq, const virtq_buf_t *bufs, int nbufs) {
+    bool use_indirect = vq->indirect && nbufs > 1 && nbufs <= VIRTQ_MAX_INDIRECT;
+    int id = virtq_next_id(vq);
+    if (id < 0) {
+        return false;
+    }
+    if (use_indirect && virtq_indirect_table(vq, id) == NULL) {
+        use_indirect = false;
+    }
+    if (vq->num_free < (use_indirect ? 1 : nbufs)) {
+        return false;
+    }
+
+    if (vq->packed) {
+        return virtq_add_packed(vq, bufs, nbufs, use_indirect);
+    }
+    vq->num_added++;
+    return virtq_add_split(vq, bufs, nbufs, use_indirect);
+}
+
+// Notification ==========================================================
+
+static bool vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+// Notify the device about everything added since the last kick, unless it
+// said it does not need to hear about it
+void virtq_kick(virtq_t *vq) {
+    if (vq->num_added == 0) {
+        return;
+    }
+    virtio_mb();    // Publish the ring before reading the device's suppression state
+
+    bool notify;
+    if (vq->packed) {
+        uint16_t flags = vq->device_event->flags;
+        if (flags == VIRTQ_EVENT_F_DESC) {
+            uint16_t off_wrap = vq->device_event->off_wrap;
+            uint16_t event_idx = off_wrap & 0x7FFF;
+            if ((bool)(off_wrap >> 15) != vq->avail_wrap) {
+                event_idx -= vq->size;
+            }
+            notify = vring_need_event(event_idx, vq->next_avail, vq->next_avail - vq->num_added);
+        } else {
+            notify = flags != VIRTQ_EVENT_F_DISABLE;
+        }
+    } else if (vq->event_idx) {
+        uint16_t avail_event = *(volatile uint16_t *)((volatile uint8_t *)vq->used + 4 + vq->size * sizeof(virtq_used_elem_t));
+        notify = vring_need_event(avail_event, vq->avail_idx, vq->avail_idx - vq->num_added);
+    } else {
+        notify = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    if (notify) {
+        *vq->notify = vq->index;
+    }
+    vq->num_added = 0;
+}
+
+// Completions ===========================================================
+
+// Return the id of one finished request, or -1 if there is none
+int virtq_get_used(virtq_t *vq, uint32_t *len) {
+    int id;
+
+    if (vq->packed) {
+        uint16_t flags = vq->pdesc[vq->last_used].flags;
+        bool avail = (flags & VIRTQ_DESC_F_AVAIL) != 0;
+        bool used = (flags & VIRTQ_DESC_F_USED) != 0;
+        if (avail != used || used != vq->used_wrap) {
+            return -1;
+        }
+        virtio_mb();
+        id = vq->pdesc[vq->last_used].id;
+        if (len) {
+            *len = vq->pdesc[vq->last_used].len;
+        }
+
+        vq->last_used += vq->chain_len[id];
+        if (vq->last_used >= vq->size) {
+            vq->last_used -= vq->size;
+            vq->used_wrap = !vq->used_wrap;
+        }
+        vq->free_ids[vq->free_id_count++] = id;
+        vq->num_free += vq->chain_len[id];
+        return id;
+    }
+
+    if (vq->last_used == vq->used->idx) {
+        return -1;
+    }
+    virtio_mb();
+    volatile virtq_used_elem_t *elem = &vq->used->ring[vq->last_used % vq->size];
+    id = elem->id;
+    if (len) {
+        *len = elem->len;
+    }
+    vq->last_used++;
+    if (vq->event_idx) {
+        vq->avail->ring[vq->size] = vq->last_used - 1;  // used_event: keep interrupts off
+    }
+
+    // Return the chain to the free list
+    uint16_t last = id;
+    for (int i = 1; i < vq->chain_len[id]; i++) {
+        last = vq->desc[last].next;
+    }
+    vq->desc[last].next = vq->free_head;
+    vq->free_head = id;
+    vq->num_free += vq->chain_len[id];
+    return id;
+}
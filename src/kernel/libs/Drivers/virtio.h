@@ -0,0 +1,173 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pci.h"
+
+#define VIRTIO_PCI_VENDOR 0x1AF4
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+#define VIRTIO_STATUS_FAILED      0x80
+
+// Transport feature bits
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#define VIRTIO_RING_F_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1          32
+#define VIRTIO_F_RING_PACKED        34
+
+// Vendor specific PCI capability types
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG    3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+// Descriptor flags
+#define VIRTQ_DESC_F_NEXT     1
+#define VIRTQ_DESC_F_WRITE    2
+#define VIRTQ_DESC_F_INDIRECT 4
+#define VIRTQ_DESC_F_AVAIL    (1 << 7)   // Packed ring only
+#define VIRTQ_DESC_F_USED     (1 << 15)  // Packed ring only
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY     1
+
+// Packed ring event suppression flags
+#define VIRTQ_EVENT_F_ENABLE  0
+#define VIRTQ_EVENT_F_DISABLE 1
+#define VIRTQ_EVENT_F_DESC    2
+
+#define VIRTQ_MAX_SIZE      64
+#define VIRTQ_MAX_INDIRECT  34   // Header + 32 data segments + status
+#define VIRTQ_INDIRECT_PER_PAGE (4096 / (VIRTQ_MAX_INDIRECT * 16))
+#define VIRTQ_INDIRECT_PAGES ((VIRTQ_MAX_SIZE + VIRTQ_INDIRECT_PER_PAGE - 1) / VIRTQ_INDIRECT_PER_PAGE)
+
+typedef volatile struct {
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t  device_status;
+    uint8_t  config_generation;
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    uint32_t queue_desc_lo;
+    uint32_t queue_desc_hi;
+    uint32_t queue_driver_lo;
+    uint32_t queue_driver_hi;
+    uint32_t queue_device_lo;
+    uint32_t queue_device_hi;
+} __attribute__((packed)) virtio_pci_common_cfg_t;
+
+// Split ring layout
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) virtq_desc_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];        // used_event follows the last entry
+} __attribute__((packed)) virtq_avail_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} __attribute__((packed)) virtq_used_elem_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    virtq_used_elem_t ring[];  // avail_event follows the last entry
+} __attribute__((packed)) virtq_used_t;
+
+// Packed ring layout
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} __attribute__((packed)) virtq_packed_desc_t;
+
+typedef struct {
+    uint16_t off_wrap;
+    uint16_t flags;
+} __attribute__((packed)) virtq_event_t;
+
+typedef struct {
+    uint8_t bus, device, function;
+    virtio_pci_common_cfg_t *common;
+    volatile uint8_t *notify_base;
+    uint32_t notify_mult;
+    volatile uint8_t *isr;
+    volatile uint8_t *device_cfg;
+    uint64_t features;      // Negotiated
+} virtio_dev_t;
+
+// One buffer of a request, write means the device writes into it
+typedef struct {
+    void *addr;
+    uint32_t len;
+    bool write;
+} virtq_buf_t;
+
+typedef struct {
+    virtio_dev_t *vdev;
+    uint16_t index;
+    uint16_t size;
+    bool packed;
+    bool event_idx;
+    bool indirect;
+    volatile uint16_t *notify;
+
+    // Split ring
+    volatile virtq_desc_t *desc;
+    volatile virtq_avail_t *avail;
+    volatile virtq_used_t *used;
+    uint16_t free_head;
+    uint16_t avail_idx;     // Shadow of avail->idx
+
+    // Packed ring
+    volatile virtq_packed_desc_t *pdesc;
+    volatile virtq_event_t *driver_event;
+    volatile virtq_event_t *device_event;
+    uint16_t next_avail;
+    bool avail_wrap;
+    bool used_wrap;
+    uint16_t free_ids[VIRTQ_MAX_SIZE];
+    uint16_t free_id_count;
+
+    uint16_t last_used;     // Split: used idx consumed, packed: next used slot
+    uint16_t num_free;      // Free ring descriptors
+    uint16_t num_added;     // Split: avail entries, packed: descriptors, since the last kick
+    uint16_t chain_len[VIRTQ_MAX_SIZE];
+    uint8_t *indirect_pages[VIRTQ_INDIRECT_PAGES];
+} virtq_t;
+
+// Transport
+bool virtio_pci_init(virtio_dev_t *vdev, struct pci_device *pdev);
+bool virtio_negotiate(virtio_dev_t *vdev, uint64_t wanted);
+bool virtio_has_feature(virtio_dev_t *vdev, int bit);
+void virtio_driver_ok(virtio_dev_t *vdev);
+void virtio_fail(virtio_dev_t *vdev);
+
+// Virtqueues
+bool virtq_setup(virtio_dev_t *vdev, virtq_t *vq, uint16_t index);
+int virtq_next_id(virtq_t *vq);
+bool virtq_add(virtq_t *vq, const virtq_buf_t *bufs, int nbufs);
+void virtq_kick(virtq_t *vq);
+int virtq_get_used(virtq_t *vq, uint32_t *len);
+
+#endif // VIRTIO_H
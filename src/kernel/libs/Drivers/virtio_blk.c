@@ -0,0 +1,265 @@
+#include "virtio_blk.h"
+#include "virtio.h"
+#include "pci.h"
+#include "block.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include "../System/time.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// virtio-blk driver
+//
+// Registers "vdN" devices with the block layer through the same async
+// queue()/commit()/poll() hooks as NVMe. Each CPU submits on its own
+// virtqueue when the device offers VIRTIO_BLK_F_MQ, and commit() kicks every
+// queue once per batch, which with EVENT_IDX usually costs no MMIO exit at
+// all while the device is still working through earlier requests. There are
+// no interrupts yet, so used rings are polled.
+
+#define VIRTIO_BLK_TIMEOUT_MS 30000
+
+static virtio_blk_t virtio_blks[VIRTIO_BLK_MAX_DEVICES];
+static int virtio_blk_count = 0;
+
+static uint32_t vblk_cfg32(virtio_blk_t *d, uint32_t offset) {
+    return *(volatile uint32_t *)(d->vdev.device_cfg + offset);
+}
+
+static virtio_blk_queue_t *vblk_cpu_queue(virtio_blk_t *d) {
+    return &d->queues[cpu_current() % d->nr_queues];
+}
+
+// Put header, data and status on the ring. Returns the request id or -1 if
+// the queue is full.
+static int vblk_add(virtio_blk_t *d, virtio_blk_queue_t *q, uint32_t type, uint64_t lba,
+                    const block_seg_t *segs, int nsegs, io_request_t *rq) {
+    virtq_buf_t bufs[BLOCK_MAX_SEGS + 2];
+    int id = virtq_next_id(&q->vq);
+    if (id < 0) {
+        return -1;
+    }
+
+    virtio_blk_cmd_t *cmd = &q->cmd[id];
+    cmd->type = type;
+    cmd->reserved = 0;
+    cmd->sector = lba * (d->blk.sector_size / 512);
+    cmd->status = 0xFF;
+
+    int n = 0;
+    bufs[n].addr = cmd;
+    bufs[n].len = 16;
+    bufs[n++].write = false;
+    for (int i = 0; i < nsegs; i++) {
+        bufs[n].addr = segs[i].buf;
+        bufs[n].len = segs[i].count * d->blk.sector_size;
+        bufs[n++].write = type == VIRTIO_BLK_T_IN;
+    }
+    bufs[n].addr = &cmd->status;
+    bufs[n].len = 1;
+    bufs[n++].write = true;
+
+    if (!virtq_add(&q->vq, bufs, n)) {
+        return -1;
+    }
+    q->rq[id] = rq;
+    q->sync_done[id] = false;
+    q->inflight++;
+    return id;
+}
+
+static int vblk_reap(virtio_blk_t *d, virtio_blk_queue_t *q) {
+    int found = 0;
+    int id;
+
+    while ((id = virtq_get_used(&q->vq, NULL)) >= 0) {
+        bool ok = q->cmd[id].status == VIRTIO_BLK_S_OK;
+        io_request_t *rq = q->rq[id];
+        q->rq[id] = NULL;
+        q->inflight--;
+        found++;
+
+        if (rq) {
+            if (!ok) {
+                printk("%s: I/O error, status %d\n", d->blk.name, q->cmd[id].status);
+            }
+            block_complete(&d->blk, rq, ok);
+        } else {
+            q->sync_done[id] = true;
+        }
+    }
+    return found;
+}
+
+// Block layer glue ======================================================
+
+static bool vblk_blk_queue(block_device_t *dev, io_request_t *rq, const block_seg_t *segs, int nsegs) {
+    virtio_blk_t *d = (virtio_blk_t *)dev->driver_data;
+    uint32_t type = rq->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    return vblk_add(d, vblk_cpu_queue(d), type, rq->grp_lba, segs, nsegs, rq) >= 0;
+}
+
+static void vblk_blk_commit(block_device_t *dev) {
+    virtio_blk_t *d = (virtio_blk_t *)dev->driver_data;
+    for (int i = 0; i < d->nr_queues; i++) {
+        virtq_kick(&d->queues[i].vq);
+    }
+}
+
+static int vblk_blk_poll(block_device_t *dev) {
+    virtio_blk_t *d = (virtio_blk_t *)dev->driver_data;
+    int found = 0;
+    for (int i = 0; i < d->nr_queues; i++) {
+        found += vblk_reap(d, &d->queues[i]);
+    }
+    return found;
+}
+
+static bool vblk_blk_flush(block_device_t *dev) {
+    virtio_blk_t *d = (virtio_blk_t *)dev->driver_data;
+    virtio_blk_queue_t *q = vblk_cpu_queue(d);
+    uint64_t deadline = time_now_us() + (uint64_t)VIRTIO_BLK_TIMEOUT_MS * 1000;
+
+    int id = vblk_add(d, q, VIRTIO_BLK_T_FLUSH, 0, NULL, 0, NULL);
+    while (id < 0) {
+        vblk_reap(d, q);
+        id = vblk_add(d, q, VIRTIO_BLK_T_FLUSH, 0, NULL, 0, NULL);
+        if (id < 0 && time_now_us() > deadline) {
+            printk("%s: queue stuck full\n", dev->name);
+            return false;
+        }
+    }
+    virtq_kick(&q->vq);
+
+    while (!q->sync_done[id]) {
+        vblk_reap(d, q);
+        if (!q->sync_done[id] && time_now_us() > deadline) {
+            printk("%s: flush timed out\n", dev->name);
+            return false;
+        }
+    }
+    return q->cmd[id].status == VIRTIO_BLK_S_OK;
+}
+
+// Device bring-up =======================================================
+
+static bool virtio_blk_probe(struct pci_device *pdev) {
+    virtio_blk_t *d = &virtio_blks[virtio_blk_count];
+    memset(d, 0, sizeof(virtio_blk_t));
+
+    if (!virtio_pci_init(&d->vdev, pdev)) {
+        return false;
+    }
+    if (d->vdev.device_cfg == NULL) {
+        virtio_fail(&d->vdev);
+        return false;
+    }
+
+    uint64_t wanted = (1ULL << VIRTIO_BLK_F_SIZE_MAX) | (1ULL << VIRTIO_BLK_F_SEG_MAX) |
+                      (1ULL << VIRTIO_BLK_F_BLK_SIZE) | (1ULL << VIRTIO_BLK_F_FLUSH) |
+                      (1ULL << VIRTIO_BLK_F_MQ) | (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |
+                      (1ULL << VIRTIO_RING_F_EVENT_IDX) | (1ULL << VIRTIO_F_RING_PACKED);
+    if (!virtio_negotiate(&d->vdev, wanted)) {
+        virtio_fail(&d->vdev);
+        return false;
+    }
+
+    uint32_t sector_size = BLOCK_SECTOR_SIZE;
+    if (virtio_has_feature(&d->vdev, VIRTIO_BLK_F_BLK_SIZE)) {
+        sector_size = vblk_cfg32(d, VIRTIO_BLK_CFG_BLK_SIZE);
+        if (sector_size < 512 || sector_size > 4096 || (sector_size & (sector_size - 1))) {
+            sector_size = BLOCK_SECTOR_SIZE;
+        }
+    }
+    uint64_t capacity = vblk_cfg32(d, VIRTIO_BLK_CFG_CAPACITY) |
+                        ((uint64_t)vblk_cfg32(d, VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+
+    // Largest single segment, every request segment is at most max_sectors long
+    uint32_t max_bytes = VIRTIO_BLK_MAX_BYTES;
+    if (virtio_has_feature(&d->vdev, VIRTIO_BLK_F_SIZE_MAX)) {
+        uint32_t size_max = vblk_cfg32(d, VIRTIO_BLK_CFG_SIZE_MAX);
+        if (size_max >= sector_size && size_max < max_bytes) {
+            max_bytes = size_max;
+        }
+    }
+
+    int nr_queues = 1;
+    if (virtio_has_feature(&d->vdev, VIRTIO_BLK_F_MQ)) {
+        nr_queues = *(volatile uint16_t *)(d->vdev.device_cfg + VIRTIO_BLK_CFG_NUM_QUEUES);
+        if (nr_queues > cpu_count()) nr_queues = cpu_count();
+        if (nr_queues > VIRTIO_BLK_MAX_QUEUES) nr_queues = VIRTIO_BLK_MAX_QUEUES;
+        if (nr_queues < 1) nr_queues = 1;
+    }
+    for (int i = 0; i < nr_queues; i++) {
+        if (!virtq_setup(&d->vdev, &d->queues[i].vq, i)) {
+            break;
+        }
+        d->nr_queues++;
+    }
+    if (d->nr_queues == 0) {
+        printk("virtio-blk: could not set up any virtqueue\n");
+        virtio_fail(&d->vdev);
+        return false;
+    }
+
+    // With indirect descriptors every request takes one ring slot, without
+    // them header, data and status each take one
+    virtq_t *vq = &d->queues[0].vq;
+    uint32_t max_segs = vq->indirect ? VIRTQ_MAX_INDIRECT - 2 : VIRTIO_BLK_DIRECT_SEGS;
+    if (virtio_has_feature(&d->vdev, VIRTIO_BLK_F_SEG_MAX)) {
+        uint32_t seg_max = vblk_cfg32(d, VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max > 0 && seg_max < max_segs) {
+            max_segs = seg_max;
+        }
+    }
+    if (max_segs > BLOCK_MAX_SEGS) {
+        max_segs = BLOCK_MAX_SEGS;
+    }
+
+    block_make_name(d->blk.name, "vd", virtio_blk_count);
+    d->blk.sector_size = sector_size;
+    d->blk.sector_count = capacity / (sector_size / 512);
+    d->blk.max_sectors = max_bytes / sector_size;
+    d->blk.max_segs = max_segs;
+    d->blk.queue = vblk_blk_queue;
+    d->blk.commit = vblk_blk_commit;
+    d->blk.poll = vblk_blk_poll;
+    d->blk.flush = virtio_has_feature(&d->vdev, VIRTIO_BLK_F_FLUSH) ? vblk_blk_flush : NULL;
+    d->blk.queue_depth = vq->indirect ? vq->size : vq->size / (max_segs + 2);
+    d->blk.driver_data = d;
+
+    virtio_driver_ok(&d->vdev);
+    if (!block_register(&d->blk)) {
+        return false;
+    }
+
+    printk("%s: virtio-blk %d MiB, %d queues\n", d->blk.name,
+           (int)((d->blk.sector_count * sector_size) >> 20), d->nr_queues);
+    printk("%s: %s ring", d->blk.name, vq->packed ? "packed" : "split");
+    printk("%s%s\n", vq->indirect ? ", indirect" : "", vq->event_idx ? ", event idx" : "");
+    return true;
+}
+
+static bool virtio_blk_pci_probe(struct pci_device *dev, const struct pci_device_id *id) {
+    (void)id;
+    if (virtio_blk_count >= VIRTIO_BLK_MAX_DEVICES || !virtio_blk_probe(dev)) {
+        return false;
+    }
+    virtio_blk_count++;
+    return true;
+}
+
+static const struct pci_device_id virtio_blk_pci_ids[] = {
+    { VIRTIO_PCI_VENDOR, VIRTIO_BLK_DEVICE_MODERN, 0, 0 },
+    { VIRTIO_PCI_VENDOR, VIRTIO_BLK_DEVICE_TRANSITIONAL, 0, 0 },
+    { 0 }
+};
+
+static struct pci_driver virtio_blk_pci_driver = { "virtio-blk", virtio_blk_pci_ids, virtio_blk_pci_probe };
+
+// Probe every virtio block device on the PCI bus, returns how many came up
+int virtio_blk_init() {
+    pci_register_driver(&virtio_blk_pci_driver);
+    return virtio_blk_count;
+}
@@ -0,0 +1,64 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block.h"
+#include "virtio.h"
+
+#define VIRTIO_BLK_DEVICE_MODERN       0x1042
+#define VIRTIO_BLK_DEVICE_TRANSITIONAL 0x1001
+
+#define VIRTIO_BLK_MAX_DEVICES 4
+#define VIRTIO_BLK_MAX_QUEUES  8     // One per CPU
+#define VIRTIO_BLK_DIRECT_SEGS 6     // Data segments per request without indirect descriptors
+#define VIRTIO_BLK_MAX_BYTES   (1024 * 1024)
+
+// Device feature bits
+#define VIRTIO_BLK_F_SIZE_MAX 1
+#define VIRTIO_BLK_F_SEG_MAX  2
+#define VIRTIO_BLK_F_BLK_SIZE 6
+#define VIRTIO_BLK_F_FLUSH    9
+#define VIRTIO_BLK_F_MQ       12
+
+// Request types
+#define VIRTIO_BLK_T_IN    0
+#define VIRTIO_BLK_T_OUT   1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VIRTIO_BLK_S_OK    0
+
+// Device configuration offsets
+#define VIRTIO_BLK_CFG_CAPACITY   0
+#define VIRTIO_BLK_CFG_SIZE_MAX   8
+#define VIRTIO_BLK_CFG_SEG_MAX    12
+#define VIRTIO_BLK_CFG_BLK_SIZE   20
+#define VIRTIO_BLK_CFG_NUM_QUEUES 34
+
+// Header and status of one request, the data buffers go between them
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;        // Always in 512 byte units
+    uint8_t status;
+    uint8_t pad[15];
+} __attribute__((packed)) virtio_blk_cmd_t;
+
+typedef struct {
+    virtq_t vq;
+    virtio_blk_cmd_t cmd[VIRTQ_MAX_SIZE];  // Indexed by request id
+    io_request_t *rq[VIRTQ_MAX_SIZE];
+    bool sync_done[VIRTQ_MAX_SIZE];
+    uint16_t inflight;
+} virtio_blk_queue_t;
+
+typedef struct {
+    block_device_t blk;
+    virtio_dev_t vdev;
+    virtio_blk_queue_t queues[VIRTIO_BLK_MAX_QUEUES];
+    int nr_queues;
+} virtio_blk_t;
+
+int virtio_blk_init();
+
+#endif // VIRTIO_BLK_H
@@ -0,0 +1,1076 @@
+#include "xhci.h"
+#include "usb.h"
+#include "pci.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include "../System/time.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// xHCI host controller driver
+//
+// Each controller gets a command ring, one event ring and a transfer ring per
+// configured endpoint, all single page segments. Rings remember which
+// transfer every TRB belongs to, so a transfer event finds its usb_transfer_t
+// without searching. The kernel takes no interrupts: interrupter 0 is set up
+// with a moderation interval as a controller would be for IRQs, but events
+// are consumed by polling, in batches, with one ERDP write per batch.
+//
+// Only devices on root ports are handled; there is no hub driver and no
+// hotplug, ports are scanned once when the controller starts.
+
+#define XHCI_PAGE_SIZE 4096
+
+static xhci_t xhci_ctrls[XHCI_MAX_CONTROLLERS];
+static int xhci_count = 0;
+
+static inline uint32_t xhci_read32(volatile uint8_t *base, uint32_t reg) {
+    return *(volatile uint32_t *)(base + reg);
+}
+
+static inline void xhci_write32(volatile uint8_t *base, uint32_t reg, uint32_t value) {
+    *(volatile uint32_t *)(base + reg) = value;
+}
+
+static void xhci_write64(volatile uint8_t *base, uint32_t reg, uint64_t value) {
+    xhci_write32(base, reg, (uint32_t)value);
+    xhci_write32(base, reg + 4, (uint32_t)(value >> 32));
+}
+
+static bool xhci_wait(volatile uint8_t *base, uint32_t reg, uint32_t mask, uint32_t value, uint32_t timeout_us) {
+    uint64_t deadline = time_now_us() + timeout_us;
+    while ((xhci_read32(base, reg) & mask) != value) {
+        if (time_now_us() > deadline) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void xhci_delay_us(uint32_t us) {
+    uint64_t end = time_now_us() + us;
+    while (time_now_us() < end) {
+    }
+}
+
+// Device context index of an endpoint: 1 is endpoint 0, then OUT and IN alternate
+static int xhci_dci(usb_endpoint_t *ep) {
+    return (ep->endpoint_address & 0xF) * 2 + ep->direction;
+}
+
+static uint32_t *xhci_in_slot(xhci_dev_t *xd) {
+    return (uint32_t *)(xd->in_ctx + xd->xc->ctx_size);
+}
+
+static uint32_t *xhci_in_ep(xhci_dev_t *xd, int dci) {
+    return (uint32_t *)(xd->in_ctx + (dci + 1) * xd->xc->ctx_size);
+}
+
+static uint32_t *xhci_out_ep(xhci_dev_t *xd, int dci) {
+    return (uint32_t *)(xd->out_ctx + dci * xd->xc->ctx_size);
+}
+
+// Rings =================================================================
+
+static xhci_ring_t *xhci_ring_alloc(xhci_t *xc) {
+    for (int i = 0; i < XHCI_MAX_RINGS; i++) {
+        xhci_ring_t *r = &xc->rings[i];
+        if (r->in_use) {
+            continue;
+        }
+        if (r->trbs == NULL && (r->trbs = alloc_page()) == NULL) {
+            printk("xHCI: out of pages for a ring\n");
+            return NULL;
+        }
+        memset((void *)r->trbs, 0, XHCI_PAGE_SIZE);
+        memset(r->owner, 0, sizeof(r->owner));
+        r->enq = 0;
+        r->cycle = 1;
+        r->pending = 0;
+        r->in_use = true;
+        // The link TRB gets its cycle bit when the producer reaches it
+        r->trbs[XHCI_RING_TRBS - 1].param = (uint32_t)(uintptr_t)r->trbs;
+        r->trbs[XHCI_RING_TRBS - 1].control = XHCI_TRB_TYPE(XHCI_TRB_LINK) | XHCI_TRB_TC;
+        return r;
+    }
+    printk("xHCI: out of rings\n");
+    return NULL;
+}
+
+// The page stays with the ring slot for the next user
+static void xhci_ring_free(xhci_ring_t *r) {
+    r->in_use = false;
+}
+
+static bool xhci_ring_room(xhci_ring_t *r, uint32_t count) {
+    return r->pending + count <= XHCI_RING_TRBS - 2;
+}
+
+// Write one TRB. With hold set its cycle bit is left wrong, so the
+// controller does not start on a TD before all of it is written.
+static uint32_t xhci_ring_put(xhci_ring_t *r, uint64_t param, uint32_t status, uint32_t control, bool hold) {
+    uint32_t idx = r->enq;
+    volatile xhci_trb_t *trb = &r->trbs[idx];
+    trb->param = param;
+    trb->status = status;
+    __asm__ volatile("" ::: "memory");
+    trb->control = control | (hold ? r->cycle ^ 1 : r->cycle);
+    if (++r->enq == XHCI_RING_TRBS - 1) {
+        r->trbs[r->enq].control = XHCI_TRB_TYPE(XHCI_TRB_LINK) | XHCI_TRB_TC | (control & XHCI_TRB_CH) | r->cycle;
+        r->enq = 0;
+        r->cycle ^= 1;
+    }
+    return idx;
+}
+
+// A TD being written
+typedef struct {
+    xhci_ring_t *ring;
+    usb_transfer_t *xfer;
+    uint32_t first;
+    uint32_t count;
+} xhci_td_t;
+
+static void xhci_td_add(xhci_td_t *td, uint64_t param, uint32_t status, uint32_t control, uint32_t offset) {
+    xhci_ring_t *r = td->ring;
+    uint32_t idx = xhci_ring_put(r, param, status, control, td->count == 0);
+    if (td->count++ == 0) {
+        td->first = idx;
+    }
+    r->owner[idx] = td->xfer;
+    r->offset[idx] = offset;
+}
+
+// Hand the TD over by flipping the cycle bit of its first TRB
+static void xhci_td_finish(xhci_td_t *td) {
+    xhci_ring_t *r = td->ring;
+    td->xfer->hc_count = td->count;
+    td->xfer->hc_data = (void *)(uintptr_t)td->first;
+    r->pending += td->count;
+    __asm__ volatile("" ::: "memory");
+    r->trbs[td->first].control ^= XHCI_TRB_CYCLE;
+}
+
+// Forget the TRBs of a transfer, before it is completed
+static void xhci_td_release(xhci_ring_t *r, usb_transfer_t *xfer) {
+    uint32_t idx = (uint32_t)(uintptr_t)xfer->hc_data;
+    for (uint32_t i = 0; i < xfer->hc_count; i++) {
+        r->owner[idx] = NULL;
+        if (++idx == XHCI_RING_TRBS - 1) {
+            idx = 0;
+        }
+    }
+    r->pending -= xfer->hc_count;
+    xfer->hc_count = 0;
+}
+
+// Bytes up to the next 64K boundary, which a TRB buffer may not cross
+static uint32_t xhci_chunk(uint32_t addr, uint32_t len) {
+    uint32_t room = XHCI_TRB_MAX_BYTES - (addr & (XHCI_TRB_MAX_BYTES - 1));
+    return len < room ? len : room;
+}
+
+static uint32_t xhci_count_span(uint32_t addr, uint32_t len) {
+    uint32_t count = 0;
+    do {
+        uint32_t n = xhci_chunk(addr, len);
+        addr += n;
+        len -= n;
+        count++;
+    } while (len);
+    return count;
+}
+
+static uint32_t xhci_count_trbs(usb_transfer_t *xfer) {
+    if (xfer->nsg == 0) {
+        return xhci_count_span((uint32_t)(uintptr_t)xfer->buf, xfer->length);
+    }
+    uint32_t count = 0;
+    for (int i = 0; i < xfer->nsg; i++) {
+        count += xhci_count_span((uint32_t)(uintptr_t)xfer->sg[i].buf, xfer->sg[i].length);
+    }
+    return count;
+}
+
+// TD Size: packets still to come after this TRB
+static uint32_t xhci_td_size(uint32_t remaining, uint16_t max_packet) {
+    uint32_t packets = max_packet ? (remaining + max_packet - 1) / max_packet : 0;
+    return (packets > 31 ? 31 : packets) << 17;
+}
+
+// Queue the buffer (or scatter list) of the TD's transfer as TRBs of one
+// 64K window each. The first is of type first_type with dir; all but the
+// last chain on.
+static void xhci_td_buffer(xhci_td_t *td, uint32_t first_type, uint32_t dir, uint32_t flags, uint32_t last_flags,
+                           uint16_t max_packet) {
+    usb_transfer_t *xfer = td->xfer;
+    usb_sg_t single = { xfer->buf, xfer->length };
+    const usb_sg_t *sg = xfer->nsg ? xfer->sg : &single;
+    int nsg = xfer->nsg ? xfer->nsg : 1;
+    uint32_t offset = 0;
+    uint32_t type = first_type;
+    for (int i = 0; i < nsg; i++) {
+        uint32_t addr = (uint32_t)(uintptr_t)sg[i].buf;
+        uint32_t done = 0;
+        do {
+            uint32_t n = xhci_chunk(addr + done, sg[i].length - done);
+            bool last = i == nsg - 1 && done + n == sg[i].length;
+            uint32_t status = n | xhci_td_size(xfer->length - offset - n, max_packet);
+            uint32_t control = XHCI_TRB_TYPE(type) | flags | (last ? last_flags : XHCI_TRB_CH) |
+                               (type == XHCI_TRB_DATA ? dir : 0);
+            xhci_td_add(td, addr + done, status, control, offset);
+            done += n;
+            offset += n;
+            type = XHCI_TRB_NORMAL;
+        } while (done < sg[i].length);
+    }
+}
+
+// Complete every transfer still queued on a ring with an error
+static void xhci_ring_fail(xhci_ring_t *r) {
+    uint32_t count = r->pending;
+    uint32_t idx = r->enq;
+    for (uint32_t i = 0; i < count; i++) {
+        idx = idx == 0 ? XHCI_RING_TRBS - 2 : idx - 1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        usb_transfer_t *xfer = r->owner[idx];
+        if (xfer) {
+            xhci_td_release(r, xfer);
+            usb_transfer_done(xfer, USB_XFER_ERROR, 0);
+        }
+        if (++idx == XHCI_RING_TRBS - 1) {
+            idx = 0;
+        }
+    }
+}
+
+static bool xhci_ring_has(xhci_ring_t *r, uint64_t ptr) {
+    uint32_t base = r ? (uint32_t)(uintptr_t)r->trbs : 0;
+    return r && ptr >= base && ptr < base + XHCI_RING_TRBS * sizeof(xhci_trb_t);
+}
+
+// The ring a transfer goes on
+static xhci_ring_t *xhci_ep_ring(xhci_dev_t *xd, int dci, uint16_t stream) {
+    xhci_streams_t *s = xd->streams[dci];
+    if (s) {
+        return stream >= 1 && stream <= s->count ? s->rings[stream] : NULL;
+    }
+    return stream == 0 ? xd->rings[dci] : NULL;
+}
+
+// The ring an event's TRB pointer is on
+static xhci_ring_t *xhci_event_ring(xhci_dev_t *xd, int dci, uint64_t ptr) {
+    xhci_streams_t *s = xd->streams[dci];
+    if (s == NULL) {
+        return xhci_ring_has(xd->rings[dci], ptr) ? xd->rings[dci] : NULL;
+    }
+    for (int i = 1; i <= s->count; i++) {
+        if (xhci_ring_has(s->rings[i], ptr)) {
+            return s->rings[i];
+        }
+    }
+    return NULL;
+}
+
+static xhci_streams_t *xhci_streams_alloc(xhci_t *xc) {
+    for (int i = 0; i < XHCI_MAX_STREAM_EPS; i++) {
+        xhci_streams_t *s = &xc->stream_eps[i];
+        if (s->in_use) {
+            continue;
+        }
+        if (s->ctx == NULL && (s->ctx = alloc_page()) == NULL) {
+            return NULL;
+        }
+        memset(s->ctx, 0, XHCI_PAGE_SIZE);
+        memset(s->rings, 0, sizeof(s->rings));
+        s->count = 0;
+        s->in_use = true;
+        return s;
+    }
+    printk("xHCI: out of stream endpoints\n");
+    return NULL;
+}
+
+static void xhci_streams_free(xhci_streams_t *s) {
+    for (int i = 1; i <= XHCI_MAX_STREAMS; i++) {
+        if (s->rings[i]) {
+            xhci_ring_fail(s->rings[i]);
+            xhci_ring_free(s->rings[i]);
+            s->rings[i] = NULL;
+        }
+    }
+    s->in_use = false;
+}
+
+// Forget an endpoint's rings, failing what is still queued on them
+static void xhci_ep_free(xhci_dev_t *xd, int dci) {
+    if (xd->rings[dci]) {
+        xhci_ring_fail(xd->rings[dci]);
+        xhci_ring_free(xd->rings[dci]);
+        xd->rings[dci] = NULL;
+    }
+    if (xd->streams[dci]) {
+        xhci_streams_free(xd->streams[dci]);
+        xd->streams[dci] = NULL;
+    }
+}
+
+// Events ================================================================
+
+static int xhci_transfer_event(xhci_t *xc, uint64_t ptr, uint32_t status, uint32_t control) {
+    uint8_t slot = control >> 24;
+    uint8_t dci = (control >> 16) & 0x1F;
+    uint8_t code = status >> 24;
+    uint32_t residual = status & 0xFFFFFF;
+    if (slot == 0 || slot > xc->max_slots) {
+        return 0;
+    }
+    xhci_ring_t *r = xhci_event_ring(&xc->devs[slot - 1], dci, ptr);
+    if (r == NULL) {
+        return 0;
+    }
+    uint32_t idx = (uint32_t)(ptr - (uint32_t)(uintptr_t)r->trbs) / sizeof(xhci_trb_t);
+    usb_transfer_t *xfer = r->owner[idx];
+    // A TD that ended early on a short packet still reports its last TRB
+    if (xfer == NULL || xfer->status != USB_XFER_PENDING) {
+        return 0;
+    }
+
+    int result = USB_XFER_ERROR;
+    if (code == XHCI_CC_SUCCESS || code == XHCI_CC_SHORT_PACKET) {
+        result = USB_XFER_DONE;
+    } else if (code == XHCI_CC_STALL) {
+        result = USB_XFER_STALL;
+    }
+    uint32_t actual = r->offset[idx] + (r->trbs[idx].status & 0x1FFFF);
+    actual = residual < actual ? actual - residual : 0;
+    if (actual > xfer->length) {
+        actual = xfer->length;
+    }
+    xhci_td_release(r, xfer);
+    usb_transfer_done(xfer, result, actual);
+    return 1;
+}
+
+// Consume the events the controller has posted, returns the transfers completed
+static int xhci_poll_events(xhci_t *xc) {
+    int done = 0;
+    uint32_t seen = 0;
+    while (1) {
+        volatile xhci_trb_t *ev = &xc->events[xc->event_deq];
+        uint32_t control = ev->control;
+        if ((control & XHCI_TRB_CYCLE) != xc->event_cycle) {
+            break;
+        }
+        uint64_t param = ev->param;
+        uint32_t status = ev->status;
+        // Step past the event first: completions may wait on USB again
+        if (++xc->event_deq == XHCI_EVENT_TRBS) {
+            xc->event_deq = 0;
+            xc->event_cycle ^= 1;
+        }
+        seen++;
+
+        switch (XHCI_TRB_GET_TYPE(control)) {
+        case XHCI_TRB_TRANSFER_EVENT:
+            done += xhci_transfer_event(xc, param, status, control);
+            break;
+        case XHCI_TRB_CMD_COMPLETION:
+            if (param == xc->cmd_trb) {
+                xc->cmd_code = status >> 24;
+                xc->cmd_slot = control >> 24;
+                xc->cmd_done = true;
+            }
+            break;
+        default:
+            // Port status changes: ports are only scanned at start
+            break;
+        }
+        // Give the controller room on long runs
+        if ((seen & (XHCI_EVENT_TRBS / 2 - 1)) == 0) {
+            xhci_write64(xc->rt, XHCI_RT_ERDP, (uint32_t)(uintptr_t)&xc->events[xc->event_deq]);
+        }
+    }
+    if (seen) {
+        xhci_write64(xc->rt, XHCI_RT_ERDP, (uint32_t)(uintptr_t)&xc->events[xc->event_deq] | XHCI_ERDP_EHB);
+        xc->events_seen += seen;
+        xc->event_batches++;
+    }
+    return done;
+}
+
+// Run one command and wait for its completion. Returns the completion code, -1 on timeout.
+static int xhci_command(xhci_t *xc, uint64_t param, uint32_t status, uint32_t control) {
+    uint32_t idx = xhci_ring_put(xc->cmd, param, status, control, false);
+    xc->cmd_trb = (uint32_t)(uintptr_t)&xc->cmd->trbs[idx];
+    xc->cmd_done = false;
+    xc->db[0] = 0;
+
+    uint64_t deadline = time_now_us() + XHCI_TIMEOUT_US;
+    while (!xc->cmd_done) {
+        xhci_poll_events(xc);
+        if (!xc->cmd_done && time_now_us() > deadline) {
+            printk("xHCI: command %d timed out\n", XHCI_TRB_GET_TYPE(control));
+            return -1;
+        }
+    }
+    return xc->cmd_code;
+}
+
+// Endpoints =============================================================
+
+// Stop an endpoint (or recover it from a halt), point it past everything
+// queued and fail those transfers
+static bool xhci_reset_ring(xhci_dev_t *xd, int dci) {
+    xhci_t *xc = xd->xc;
+    xhci_streams_t *s = xd->streams[dci];
+    if (xd->rings[dci] == NULL && s == NULL) {
+        return false;
+    }
+    uint32_t state = xhci_out_ep(xd, dci)[0] & 0x7;
+    if (state == XHCI_EP_STATE_HALTED) {
+        xhci_command(xc, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_RESET_EP) | XHCI_TRB_EP(dci) | XHCI_TRB_SLOT(xd->slot));
+    } else if (state == XHCI_EP_STATE_RUNNING) {
+        xhci_command(xc, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_STOP_EP) | XHCI_TRB_EP(dci) | XHCI_TRB_SLOT(xd->slot));
+    }
+    // Every stream has its own dequeue pointer
+    int code = XHCI_CC_SUCCESS;
+    for (int sid = s ? 1 : 0; sid <= (s ? s->count : 0); sid++) {
+        xhci_ring_t *r = s ? s->rings[sid] : xd->rings[dci];
+        int c = xhci_command(xc, (uint32_t)(uintptr_t)&r->trbs[r->enq] | r->cycle | (s ? XHCI_SCT_PRIMARY : 0),
+                             XHCI_TRB_STREAM(sid),
+                             XHCI_TRB_TYPE(XHCI_TRB_SET_TR_DEQ) | XHCI_TRB_EP(dci) | XHCI_TRB_SLOT(xd->slot));
+        if (c != XHCI_CC_SUCCESS) {
+            code = c;
+        }
+        xhci_ring_fail(r);
+    }
+    if (code != XHCI_CC_SUCCESS) {
+        printk("xHCI: endpoint %d of slot %d not reset\n", dci, xd->slot);
+        return false;
+    }
+    return true;
+}
+
+// Interval field: a power of two of 125 us
+static uint32_t xhci_ep_interval(uint8_t speed, usb_endpoint_t *ep) {
+    int b = ep->polling_interval;
+    if (ep->transfer_type == USB_EP_BULK || ep->transfer_type == USB_EP_CONTROL) {
+        return 0;
+    }
+    if (speed == USB_SPEED_HIGH || speed == USB_SPEED_SUPER || ep->transfer_type == USB_EP_ISOCHRONOUS) {
+        // 2^(bInterval - 1) microframes, or frames at full speed
+        uint32_t interval = b < 1 ? 0 : b > 16 ? 15 : b - 1;
+        return speed == USB_SPEED_HIGH || speed == USB_SPEED_SUPER ? interval : interval + 3;
+    }
+    // Full and low speed interrupt endpoints give milliseconds
+    uint32_t interval = 3;
+    while (interval < 10 && (1 << (interval + 1)) <= b * 8) {
+        interval++;
+    }
+    return interval;
+}
+
+static void xhci_ep_context(xhci_dev_t *xd, uint32_t *ctx, usb_endpoint_t *ep, xhci_ring_t *r) {
+    uint32_t type = ep->transfer_type == USB_EP_BULK ? XHCI_EP_TYPE_BULK_OUT :
+                    ep->transfer_type == USB_EP_INTERRUPT ? XHCI_EP_TYPE_INTR_OUT : XHCI_EP_TYPE_ISOCH_OUT;
+    if (ep->direction) {
+        type += XHCI_EP_TYPE_IN;
+    }
+    uint32_t max_packet = ep->max_packet_size;
+    uint32_t esit = ep->transfer_type == USB_EP_BULK ? 0 : max_packet * (ep->max_burst + 1);
+    uint32_t cerr = ep->transfer_type == USB_EP_ISOCHRONOUS ? 0 : 3;
+    ctx[0] = xhci_ep_interval(xd->udev->speed, ep) << 16;
+    ctx[1] = cerr << 1 | type << 3 | (uint32_t)ep->max_burst << 8 | max_packet << 16;
+    ctx[2] = (uint32_t)(uintptr_t)r->trbs | r->cycle;
+    ctx[3] = 0;
+    ctx[4] = (ep->transfer_type == USB_EP_BULK ? 3072 : esit) | esit << 16;
+}
+
+// Drop the endpoints of old and add those of intf with one Configure Endpoint command
+static bool xhci_configure(usb_device_t *udev, usb_interface_t *old, usb_interface_t *intf) {
+    xhci_dev_t *xd = udev->hc_data;
+    xhci_t *xc = xd->xc;
+    if ((old == NULL || old->num_endpoints == 0) && intf->num_endpoints == 0) {
+        return true;
+    }
+
+    memset(xd->in_ctx, 0, XHCI_PAGE_SIZE);
+    uint32_t *icc = (uint32_t *)xd->in_ctx;
+    xhci_ring_t *added[32] = { 0 };
+    uint32_t drop = 0;
+    uint32_t add = 1;   // The slot context, for its context entries
+    if (old) {
+        for (int i = 0; i < old->num_endpoints; i++) {
+            drop |= 1u << xhci_dci(&udev->endpoints[old->first_endpoint + i]);
+        }
+    }
+    for (int i = 0; i < intf->num_endpoints; i++) {
+        usb_endpoint_t *ep = &udev->endpoints[intf->first_endpoint + i];
+        int dci = xhci_dci(ep);
+        xhci_ring_t *r = xhci_ring_alloc(xc);
+        if (r == NULL) {
+            for (int j = 0; j < 32; j++) {
+                if (added[j]) {
+                    xhci_ring_free(added[j]);
+                }
+            }
+            return false;
+        }
+        added[dci] = r;
+        add |= 1u << dci;
+        xhci_ep_context(xd, xhci_in_ep(xd, dci), ep, r);
+    }
+
+    int last = 1;
+    for (int dci = 31; dci > 1; dci--) {
+        if (added[dci] || ((xd->rings[dci] || xd->streams[dci]) && !(drop & (1u << dci)))) {
+            last = dci;
+            break;
+        }
+    }
+    uint32_t *slot = xhci_in_slot(xd);
+    memcpy(slot, xd->out_ctx, xc->ctx_size);
+    slot[0] = (slot[0] & ~(0x1Fu << 27)) | (uint32_t)last << 27;
+    icc[0] = drop;
+    icc[1] = add;
+
+    int code = xhci_command(xc, (uint32_t)(uintptr_t)xd->in_ctx, 0,
+                            XHCI_TRB_TYPE(XHCI_TRB_CONFIGURE_EP) | XHCI_TRB_SLOT(xd->slot));
+    if (code != XHCI_CC_SUCCESS) {
+        printk("xHCI: configure endpoint failed on slot %d (%d)\n", xd->slot, code);
+        for (int j = 0; j < 32; j++) {
+            if (added[j]) {
+                xhci_ring_free(added[j]);
+            }
+        }
+        return false;
+    }
+
+    if (old) {
+        for (int i = 0; i < old->num_endpoints; i++) {
+            usb_endpoint_t *ep = &udev->endpoints[old->first_endpoint + i];
+            xhci_ep_free(xd, xhci_dci(ep));
+            ep->hc_data = NULL;
+        }
+    }
+    for (int i = 0; i < intf->num_endpoints; i++) {
+        usb_endpoint_t *ep = &udev->endpoints[intf->first_endpoint + i];
+        int dci = xhci_dci(ep);
+        xd->rings[dci] = added[dci];
+        ep->hc_data = added[dci];
+    }
+    return true;
+}
+
+static bool xhci_reset_endpoint(usb_device_t *udev, usb_endpoint_t *ep) {
+    return xhci_reset_ring(udev->hc_data, ep ? xhci_dci(ep) : 1);
+}
+
+// Transfers =============================================================
+
+static int xhci_control(usb_device_t *udev, const usb_setup_t *setup, void *data) {
+    xhci_dev_t *xd = udev->hc_data;
+    xhci_t *xc = xd->xc;
+    xhci_ring_t *r = xd->rings[1];
+    bool in = (setup->request_type & USB_DIR_IN) != 0;
+
+    usb_transfer_t xfer;
+    memset(&xfer, 0, sizeof(usb_transfer_t));
+    xfer.dev = udev;
+    xfer.buf = data;
+    xfer.length = data ? setup->length : 0;
+    xfer.status = USB_XFER_PENDING;
+
+    uint32_t trbs = 2 + (xfer.length ? xhci_count_trbs(&xfer) : 0);
+    if (!xhci_ring_room(r, trbs)) {
+        return -1;
+    }
+
+    uint64_t packet;
+    memcpy(&packet, setup, sizeof(packet));
+    uint32_t trt = xfer.length == 0 ? 0 : in ? XHCI_TRB_TRT_IN : XHCI_TRB_TRT_OUT;
+    xhci_td_t td = { r, &xfer, 0, 0 };
+    xhci_td_add(&td, packet, 8, XHCI_TRB_TYPE(XHCI_TRB_SETUP) | XHCI_TRB_IDT | trt, 0);
+    if (xfer.length) {
+        xhci_td_buffer(&td, XHCI_TRB_DATA, in ? XHCI_TRB_DIR_IN : 0, in ? XHCI_TRB_ISP : 0, 0, udev->max_packet0);
+    }
+    // The status stage goes the other way, IN when there is no data stage
+    xhci_td_add(&td, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_STATUS) | XHCI_TRB_IOC |
+                (xfer.length && in ? 0 : XHCI_TRB_DIR_IN), xfer.length);
+    xhci_td_finish(&td);
+    xc->db[xd->slot] = 1;
+
+    uint64_t deadline = time_now_us() + USB_CTRL_TIMEOUT_US;
+    while (xfer.status == USB_XFER_PENDING) {
+        xhci_poll_events(xc);
+        if (xfer.status == USB_XFER_PENDING && time_now_us() > deadline) {
+            printk("xHCI: control transfer to slot %d timed out\n", xd->slot);
+            xhci_reset_ring(xd, 1);
+            return -1;
+        }
+    }
+    // A stall halts endpoint 0 in the controller too
+    if (xfer.status == USB_XFER_STALL) {
+        xhci_reset_ring(xd, 1);
+    }
+    return xfer.status == USB_XFER_DONE ? (int)xfer.actual : -1;
+}
+
+static bool xhci_submit(usb_transfer_t *xfer) {
+    xhci_dev_t *xd = xfer->dev->hc_data;
+    int dci = xhci_dci(xfer->ep);
+    xhci_ring_t *r = xhci_ep_ring(xd, dci, xfer->stream);
+    if (r == NULL || !xhci_ring_room(r, xhci_count_trbs(xfer))) {
+        return false;
+    }
+    xhci_td_t td = { r, xfer, 0, 0 };
+    xhci_td_buffer(&td, XHCI_TRB_NORMAL, 0, xfer->ep->direction ? XHCI_TRB_ISP : 0, XHCI_TRB_IOC,
+                   xfer->ep->max_packet_size);
+    xhci_td_finish(&td);
+    xd->xc->db[xd->slot] = dci | (uint32_t)xfer->stream << 16;
+    return true;
+}
+
+// Replace the rings of freshly configured bulk endpoints by stream rings,
+// one Configure Endpoint command dropping and adding them all
+static int xhci_alloc_streams(usb_device_t *udev, usb_endpoint_t **eps, int count, int streams) {
+    xhci_dev_t *xd = udev->hc_data;
+    xhci_t *xc = xd->xc;
+    xhci_streams_t *added[4] = { 0 };
+    if (xc->max_streams == 0 || count > 4) {
+        return 0;
+    }
+    if (streams > xc->max_streams) {
+        streams = xc->max_streams;
+    }
+    for (int i = 0; i < count; i++) {
+        if (streams > (1 << eps[i]->max_streams)) {
+            streams = 1 << eps[i]->max_streams;
+        }
+    }
+    // The array has a power of two entries, at least 4, and entry 0 is reserved
+    int size = 4;
+    int psa = 1;
+    while (size < streams + 1) {
+        size <<= 1;
+        psa++;
+    }
+
+    memset(xd->in_ctx, 0, XHCI_PAGE_SIZE);
+    uint32_t *icc = (uint32_t *)xd->in_ctx;
+    uint32_t flags = 0;
+    bool ok = true;
+    for (int i = 0; i < count && ok; i++) {
+        int dci = xhci_dci(eps[i]);
+        xhci_streams_t *s = added[i] = xhci_streams_alloc(xc);
+        if (s == NULL) {
+            ok = false;
+            break;
+        }
+        s->count = streams;
+        for (int sid = 1; sid <= streams; sid++) {
+            xhci_ring_t *r = s->rings[sid] = xhci_ring_alloc(xc);
+            if (r == NULL) {
+                ok = false;
+                break;
+            }
+            s->ctx[sid * 2] = (uint32_t)(uintptr_t)r->trbs | XHCI_SCT_PRIMARY | r->cycle;
+        }
+        if (ok) {
+            uint32_t *ctx = xhci_in_ep(xd, dci);
+            xhci_ep_context(xd, ctx, eps[i], s->rings[1]);
+            ctx[0] |= (uint32_t)psa << 10 | XHCI_EP_LSA;
+            ctx[2] = (uint32_t)(uintptr_t)s->ctx;
+            flags |= 1u << dci;
+        }
+    }
+
+    if (ok) {
+        memcpy(xhci_in_slot(xd), xd->out_ctx, xc->ctx_size);
+        icc[0] = flags;
+        icc[1] = flags | 1;
+        int code = xhci_command(xc, (uint32_t)(uintptr_t)xd->in_ctx, 0,
+                                XHCI_TRB_TYPE(XHCI_TRB_CONFIGURE_EP) | XHCI_TRB_SLOT(xd->slot));
+        if (code != XHCI_CC_SUCCESS) {
+            printk("xHCI: streams not set up on slot %d (%d)\n", xd->slot, code);
+            ok = false;
+        }
+    }
+    if (!ok) {
+        for (int i = 0; i < count; i++) {
+            if (added[i]) {
+                xhci_streams_free(added[i]);
+            }
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int dci = xhci_dci(eps[i]);
+        xhci_ep_free(xd, dci);
+        xd->streams[dci] = added[i];
+        eps[i]->hc_data = added[i];
+    }
+    return streams;
+}
+
+static int xhci_poll(usb_hcd_t *hcd) {
+    return xhci_poll_events(hcd->data);
+}
+
+// Devices ===============================================================
+
+static void xhci_release_slot(xhci_dev_t *xd) {
+    xhci_t *xc = xd->xc;
+    xhci_command(xc, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_DISABLE_SLOT) | XHCI_TRB_SLOT(xd->slot));
+    for (int dci = 1; dci < 32; dci++) {
+        xhci_ep_free(xd, dci);
+    }
+    xc->dcbaa[xd->slot] = 0;
+    xd->udev = NULL;
+}
+
+// Give the device on an enabled port a slot and an address, then enumerate it
+static bool xhci_attach(xhci_t *xc, int port, int speed) {
+    int code = xhci_command(xc, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_ENABLE_SLOT));
+    int slot = xc->cmd_slot;
+    if (code != XHCI_CC_SUCCESS || slot == 0 || slot > xc->max_slots) {
+        printk("xHCI: port %d: no device slot\n", port);
+        return false;
+    }
+    xhci_dev_t *xd = &xc->devs[slot - 1];
+    xd->xc = xc;
+    xd->slot = slot;
+    if (xd->in_ctx == NULL) {
+        xd->in_ctx = alloc_page();
+        xd->out_ctx = alloc_page();
+    }
+    xhci_ring_t *r = xd->in_ctx && xd->out_ctx ? xhci_ring_alloc(xc) : NULL;
+    if (r == NULL) {
+        printk("xHCI: port %d: out of memory\n", port);
+        xhci_release_slot(xd);
+        return false;
+    }
+    xd->rings[1] = r;
+    memset(xd->in_ctx, 0, XHCI_PAGE_SIZE);
+    memset(xd->out_ctx, 0, XHCI_PAGE_SIZE);
+    xc->dcbaa[slot] = (uint32_t)(uintptr_t)xd->out_ctx;
+
+    // Slot and endpoint 0, with the default max packet size for the speed
+    uint16_t max_packet = speed == USB_SPEED_SUPER ? 512 : speed == USB_SPEED_LOW ? 8 : 64;
+    uint32_t *icc = (uint32_t *)xd->in_ctx;
+    uint32_t *sc = xhci_in_slot(xd);
+    uint32_t *ep0 = xhci_in_ep(xd, 1);
+    icc[1] = 0x3;
+    sc[0] = (uint32_t)speed << 20 | 1u << 27;
+    sc[1] = (uint32_t)port << 16;
+    ep0[1] = 3 << 1 | XHCI_EP_TYPE_CONTROL << 3 | (uint32_t)max_packet << 16;
+    ep0[2] = (uint32_t)(uintptr_t)r->trbs | r->cycle;
+    ep0[4] = 8;
+    code = xhci_command(xc, (uint32_t)(uintptr_t)xd->in_ctx, 0,
+                        XHCI_TRB_TYPE(XHCI_TRB_ADDRESS_DEVICE) | XHCI_TRB_SLOT(slot));
+    if (code != XHCI_CC_SUCCESS) {
+        printk("xHCI: port %d: address device failed (%d)\n", port, code);
+        xhci_release_slot(xd);
+        return false;
+    }
+
+    usb_device_t *udev = usb_alloc_device(&xc->hcd);
+    if (udev == NULL) {
+        xhci_release_slot(xd);
+        return false;
+    }
+    udev->hc_data = xd;
+    udev->speed = speed;
+    udev->port = port;
+    udev->address = ((uint32_t *)xd->out_ctx)[3] & 0xFF;
+    udev->max_packet0 = max_packet;
+    xd->udev = udev;
+
+    // Full speed devices may use 8 to 64 bytes; the first 8 bytes of the
+    // device descriptor say which
+    if (speed == USB_SPEED_FULL) {
+        uint8_t desc[8];
+        if (usb_get_descriptor(udev, USB_DESCRIPTOR_DEVICE, 0, desc, 8) && desc[7] >= 8 && desc[7] != max_packet) {
+            memset(xd->in_ctx, 0, XHCI_PAGE_SIZE);
+            icc[1] = 1 << 1;
+            ep0[1] = 3 << 1 | XHCI_EP_TYPE_CONTROL << 3 | (uint32_t)desc[7] << 16;
+            code = xhci_command(xc, (uint32_t)(uintptr_t)xd->in_ctx, 0,
+                                XHCI_TRB_TYPE(XHCI_TRB_EVALUATE_CTX) | XHCI_TRB_SLOT(slot));
+            if (code == XHCI_CC_SUCCESS) {
+                udev->max_packet0 = desc[7];
+            }
+        }
+    }
+
+    if (!usb_enumerate(udev)) {
+        xhci_release_slot(xd);
+        return false;
+    }
+    return true;
+}
+
+static void xhci_scan_ports(xhci_t *xc) {
+    uint64_t link_deadline = time_now_us() + XHCI_LINK_WAIT_US;
+    for (int port = 1; port <= xc->max_ports; port++) {
+        uint32_t reg = XHCI_OP_PORTSC(port);
+        uint32_t sc = xhci_read32(xc->op, reg);
+        if (!(sc & XHCI_PORTSC_CCS)) {
+            continue;
+        }
+        if (xc->port_major[port] == 3) {
+            // USB3 ports enable themselves once the link trains; a stuck link gets a warm reset
+            while (!(sc & XHCI_PORTSC_PED) && time_now_us() < link_deadline) {
+                sc = xhci_read32(xc->op, reg);
+            }
+            if (!(sc & XHCI_PORTSC_PED)) {
+                xhci_write32(xc->op, reg, (sc & XHCI_PORTSC_PRESERVE) | XHCI_PORTSC_WPR);
+                xhci_wait(xc->op, reg, XHCI_PORTSC_PRC, XHCI_PORTSC_PRC, XHCI_PORT_RESET_US);
+            }
+        } else {
+            xhci_write32(xc->op, reg, (sc & XHCI_PORTSC_PRESERVE) | XHCI_PORTSC_PR);
+            if (!xhci_wait(xc->op, reg, XHCI_PORTSC_PRC, XHCI_PORTSC_PRC, XHCI_PORT_RESET_US)) {
+                printk("xHCI: port %d reset timed out\n", port);
+                continue;
+            }
+        }
+        sc = xhci_read32(xc->op, reg);
+        xhci_write32(xc->op, reg, (sc & XHCI_PORTSC_PRESERVE) | (sc & XHCI_PORTSC_CHANGES));
+        if (sc & XHCI_PORTSC_PED) {
+            xhci_attach(xc, port, XHCI_PORTSC_SPEED(sc));
+        }
+    }
+}
+
+// Controller ============================================================
+
+// Take the controller from the firmware and stop its SMIs
+static void xhci_bios_handoff(xhci_t *xc, uint32_t off) {
+    uint32_t legsup = xhci_read32(xc->cap, off);
+    xhci_write32(xc->cap, off, legsup | XHCI_LEGACY_OS_OWNED);
+    if (!xhci_wait(xc->cap, off, XHCI_LEGACY_BIOS_OWNED, 0, XHCI_TIMEOUT_US)) {
+        printk("xHCI: BIOS did not release the controller, taking it\n");
+        xhci_write32(xc->cap, off, xhci_read32(xc->cap, off) & ~XHCI_LEGACY_BIOS_OWNED);
+    }
+    uint32_t ctlsts = xhci_read32(xc->cap, off + 4);
+    xhci_write32(xc->cap, off + 4, (ctlsts & XHCI_LEGACY_SMI_KEEP) | XHCI_LEGACY_SMI_EVENTS);
+}
+
+static void xhci_ext_caps(xhci_t *xc, uint32_t hccparams) {
+    uint32_t off = ((hccparams >> 16) & 0xFFFF) << 2;
+    while (off) {
+        uint32_t cap = xhci_read32(xc->cap, off);
+        if ((cap & 0xFF) == XHCI_EXT_LEGACY) {
+            xhci_bios_handoff(xc, off);
+        } else if ((cap & 0xFF) == XHCI_EXT_PROTOCOL) {
+            uint32_t ports = xhci_read32(xc->cap, off + 8);
+            uint32_t first = ports & 0xFF;
+            uint32_t count = (ports >> 8) & 0xFF;
+            for (uint32_t p = first; p < first + count && p < 256; p++) {
+                xc->port_major[p] = cap >> 24;
+            }
+        }
+        uint32_t next = (cap >> 8) & 0xFF;
+        off = next ? off + (next << 2) : 0;
+    }
+}
+
+// Intel PCH ports start out on the EHCI controllers; switch every port
+// the chipset allows over to xHCI
+static void xhci_intel_route_ports(struct pci_device *pdev) {
+    static const uint16_t switchable[] = { 0x1E31, 0x8C31, 0x8CB1, 0x9C31, 0x9CB1, 0 };
+    for (int i = 0; switchable[i]; i++) {
+        if (pdev->device_id == switchable[i]) {
+            uint32_t ss = pci_read_config_space(pdev->bus, pdev->device, pdev->function, XHCI_INTEL_USB3PRM);
+            pci_write_config_space(pdev->bus, pdev->device, pdev->function, XHCI_INTEL_USB3PSSEN, ss);
+            uint32_t hs = pci_read_config_space(pdev->bus, pdev->device, pdev->function, XHCI_INTEL_USB2PRM);
+            pci_write_config_space(pdev->bus, pdev->device, pdev->function, XHCI_INTEL_USB2PR, hs);
+            return;
+        }
+    }
+}
+
+static bool xhci_reset(xhci_t *xc) {
+    xhci_write32(xc->op, XHCI_OP_USBCMD, xhci_read32(xc->op, XHCI_OP_USBCMD) & ~XHCI_CMD_RS);
+    if (!xhci_wait(xc->op, XHCI_OP_USBSTS, XHCI_STS_HCH, XHCI_STS_HCH, XHCI_TIMEOUT_US)) {
+        printk("xHCI: controller does not halt\n");
+        return false;
+    }
+    xhci_write32(xc->op, XHCI_OP_USBCMD, XHCI_CMD_HCRST);
+    if (!xhci_wait(xc->op, XHCI_OP_USBCMD, XHCI_CMD_HCRST, 0, XHCI_TIMEOUT_US) ||
+        !xhci_wait(xc->op, XHCI_OP_USBSTS, XHCI_STS_CNR, 0, XHCI_TIMEOUT_US)) {
+        printk("xHCI: controller reset timed out\n");
+        return false;
+    }
+    return true;
+}
+
+// Device context array, scratchpad, command and event rings, then run
+static bool xhci_start(xhci_t *xc, uint32_t hcsparams2) {
+    xhci_write32(xc->op, XHCI_OP_CONFIG, xc->max_slots);
+
+    xc->dcbaa = alloc_page();
+    xc->events = alloc_page();
+    xc->erst = alloc_page();
+    if (xc->dcbaa == NULL || xc->events == NULL || xc->erst == NULL) {
+        printk("xHCI: out of pages\n");
+        return false;
+    }
+    memset(xc->dcbaa, 0, XHCI_PAGE_SIZE);
+    memset((void *)xc->events, 0, XHCI_PAGE_SIZE);
+    memset(xc->erst, 0, XHCI_PAGE_SIZE);
+
+    uint32_t scratch = ((hcsparams2 >> 27) & 0x1F) | (((hcsparams2 >> 21) & 0x1F) << 5);
+    if (scratch) {
+        uint64_t *array = alloc_page();
+        if (array == NULL || scratch > XHCI_PAGE_SIZE / sizeof(uint64_t)) {
+            printk("xHCI: cannot provide %d scratchpad pages\n", scratch);
+            return false;
+        }
+        for (uint32_t i = 0; i < scratch; i++) {
+            void *page = alloc_page();
+            if (page == NULL) {
+                printk("xHCI: out of pages for the scratchpad\n");
+                return false;
+            }
+            memset(page, 0, XHCI_PAGE_SIZE);
+            array[i] = (uint32_t)(uintptr_t)page;
+        }
+        xc->dcbaa[0] = (uint32_t)(uintptr_t)array;
+    }
+    xhci_write64(xc->op, XHCI_OP_DCBAAP, (uint32_t)(uintptr_t)xc->dcbaa);
+
+    xc->cmd = xhci_ring_alloc(xc);
+    if (xc->cmd == NULL) {
+        return false;
+    }
+    xhci_write64(xc->op, XHCI_OP_CRCR, (uint32_t)(uintptr_t)xc->cmd->trbs | XHCI_CRCR_RCS);
+
+    xc->erst[0].base = (uint32_t)(uintptr_t)xc->events;
+    xc->erst[0].size = XHCI_EVENT_TRBS;
+    xc->event_deq = 0;
+    xc->event_cycle = 1;
+    xhci_write32(xc->rt, XHCI_RT_ERSTSZ, 1);
+    xhci_write64(xc->rt, XHCI_RT_ERDP, (uint32_t)(uintptr_t)xc->events);
+    xhci_write64(xc->rt, XHCI_RT_ERSTBA, (uint32_t)(uintptr_t)xc->erst);
+    // Moderation as if interrupts were taken; USBCMD.INTE stays off since
+    // the kernel has no handler and the event ring is polled
+    xhci_write32(xc->rt, XHCI_RT_IMOD, XHCI_IMOD_INTERVAL);
+    xhci_write32(xc->rt, XHCI_RT_IMAN, XHCI_IMAN_IP | XHCI_IMAN_IE);
+
+    xhci_write32(xc->op, XHCI_OP_USBCMD, XHCI_CMD_RS);
+    if (!xhci_wait(xc->op, XHCI_OP_USBSTS, XHCI_STS_HCH, 0, XHCI_TIMEOUT_US)) {
+        printk("xHCI: controller does not start\n");
+        return false;
+    }
+    return true;
+}
+
+static bool xhci_probe(struct pci_device *pdev) {
+    xhci_t *xc = &xhci_ctrls[xhci_count];
+    memset(xc, 0, sizeof(xhci_t));
+
+    struct pci_bar *bar = &pdev->bars[0];
+    if (!(bar->flags & PCI_BAR_MEM) || bar->base == 0) {
+        printk("xHCI: no register BAR\n");
+        return false;
+    }
+    if (bar->base >> 32) {
+        printk("xHCI: BAR0 above 4G is not reachable\n");
+        return false;
+    }
+
+    // Memory decoding and bus mastering on, legacy INTx off since events are polled
+    uint32_t command = pci_read_config_space(pdev->bus, pdev->device, pdev->function, 0x04) & 0xFFFF;
+    pci_write_config_space(pdev->bus, pdev->device, pdev->function, 0x04,
+                           command | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+    if (pdev->vendor_id == 0x8086) {
+        xhci_intel_route_ports(pdev);
+    }
+
+    xc->cap = (volatile uint8_t *)(uintptr_t)bar->base;
+    xc->op = xc->cap + (xhci_read32(xc->cap, XHCI_CAP_CAPLENGTH) & 0xFF);
+    xc->rt = xc->cap + (xhci_read32(xc->cap, XHCI_CAP_RTSOFF) & ~0x1F);
+    xc->db = (volatile uint32_t *)(xc->cap + (xhci_read32(xc->cap, XHCI_CAP_DBOFF) & ~0x3));
+    uint32_t hcsparams1 = xhci_read32(xc->cap, XHCI_CAP_HCSPARAMS1);
+    uint32_t hcsparams2 = xhci_read32(xc->cap, XHCI_CAP_HCSPARAMS2);
+    uint32_t hccparams = xhci_read32(xc->cap, XHCI_CAP_HCCPARAMS1);
+    xc->max_slots = hcsparams1 & 0xFF;
+    if (xc->max_slots > XHCI_MAX_SLOTS) {
+        xc->max_slots = XHCI_MAX_SLOTS;
+    }
+    xc->max_ports = (hcsparams1 >> 24) & 0xFF;
+    xc->ctx_size = hccparams & XHCI_HCC_CSZ ? 64 : 32;
+    if (XHCI_HCC_MAXPSA(hccparams)) {
+        int entries = 2 << XHCI_HCC_MAXPSA(hccparams);
+        xc->max_streams = entries - 1 < XHCI_MAX_STREAMS ? entries - 1 : XHCI_MAX_STREAMS;
+    }
+    for (int p = 1; p <= xc->max_ports; p++) {
+        xc->port_major[p] = 2;
+    }
+
+    xhci_ext_caps(xc, hccparams);
+    if (!xhci_reset(xc)) {
+        return false;
+    }
+    if (!(xhci_read32(xc->op, XHCI_OP_PAGESIZE) & 1)) {
+        printk("xHCI: controller does not support 4K pages\n");
+        return false;
+    }
+    if (!xhci_start(xc, hcsparams2)) {
+        return false;
+    }
+
+    memcpy(xc->name, "xhci", 4);
+    xc->name[4] = '0' + xhci_count;
+    xc->name[5] = '\0';
+    xc->hcd.name = xc->name;
+    xc->hcd.type = USB_HC_XHCI;
+    xc->hcd.data = xc;
+    xc->hcd.control = xhci_control;
+    xc->hcd.submit = xhci_submit;
+    xc->hcd.poll = xhci_poll;
+    xc->hcd.configure = xhci_configure;
+    xc->hcd.reset_endpoint = xhci_reset_endpoint;
+    xc->hcd.alloc_streams = xhci_alloc_streams;
+    if (!usb_register_hcd(&xc->hcd)) {
+        return false;
+    }
+    xhci_count++;
+    printk("xHCI: %s, %d ports, %d slots\n", xc->name, xc->max_ports, xc->max_slots);
+
+    // Power the ports if the controller switches them, then let connections settle
+    if (hccparams & XHCI_HCC_PPC) {
+        for (int port = 1; port <= xc->max_ports; port++) {
+            uint32_t sc = xhci_read32(xc->op, XHCI_OP_PORTSC(port));
+            if (!(sc & XHCI_PORTSC_PP)) {
+                xhci_write32(xc->op, XHCI_OP_PORTSC(port), (sc & XHCI_PORTSC_PRESERVE) | XHCI_PORTSC_PP);
+            }
+        }
+    }
+    xhci_delay_us(XHCI_DEBOUNCE_US);
+    xhci_scan_ports(xc);
+    return true;
+}
+
+static bool xhci_pci_probe(struct pci_device *dev, const struct pci_device_id *id) {
+    (void)id;
+    return xhci_count < XHCI_MAX_CONTROLLERS && xhci_probe(dev);
+}
+
+static const struct pci_device_id xhci_pci_ids[] = {
+    { PCI_ANY_ID, PCI_ANY_ID, XHCI_PCI_CLASS << 16 | XHCI_PCI_SUBCLASS << 8 | XHCI_PCI_PROG_IF, PCI_CLASS_MASK_PROG_IF },
+    { 0 }
+};
+
+static struct pci_driver xhci_pci_driver = { "xhci", xhci_pci_ids, xhci_pci_probe };
+
+// Start every xHCI controller on the PCI bus and the devices on its ports,
+// returns how many controllers came up
+int xhci_init() {
+    pci_register_driver(&xhci_pci_driver);
+    return xhci_count;
+}
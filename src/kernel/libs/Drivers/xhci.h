@@ -0,0 +1,216 @@
+#ifndef XHCI_H
+#define XHCI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "usb.h"
+
+// PCI class 0Ch (serial bus), subclass 03h (USB), prog-if 30h (xHCI)
+#define XHCI_PCI_CLASS     0x0C
+#define XHCI_PCI_SUBCLASS  0x03
+#define XHCI_PCI_PROG_IF   0x30
+
+#define XHCI_MAX_CONTROLLERS 2
+#define XHCI_MAX_SLOTS       16     // Devices per controller
+#define XHCI_MAX_RINGS       128    // Command ring and transfer rings per controller
+#define XHCI_MAX_STREAMS     16     // Stream IDs 1 to 16 on an endpoint with streams
+#define XHCI_MAX_STREAM_EPS  6      // Endpoints with streams per controller
+#define XHCI_RING_TRBS       256    // One page, the last TRB links back to the first
+#define XHCI_EVENT_TRBS      256
+#define XHCI_TRB_MAX_BYTES   65536  // A TRB's buffer may not cross a 64K boundary
+#define XHCI_IMOD_INTERVAL   1000   // 250 ns units: at most one interrupt per 250 us
+#define XHCI_TIMEOUT_US      1000000
+#define XHCI_PORT_RESET_US   500000
+#define XHCI_DEBOUNCE_US     100000 // Connect debounce before ports are reset
+#define XHCI_LINK_WAIT_US    300000 // For USB3 ports to train after the controller starts
+
+// Capability registers
+#define XHCI_CAP_CAPLENGTH  0x00
+#define XHCI_CAP_HCSPARAMS1 0x04
+#define XHCI_CAP_HCSPARAMS2 0x08
+#define XHCI_CAP_HCCPARAMS1 0x10
+#define XHCI_CAP_DBOFF      0x14
+#define XHCI_CAP_RTSOFF     0x18
+
+#define XHCI_HCC_AC64       (1 << 0)
+#define XHCI_HCC_CSZ        (1 << 2)    // 64 byte contexts
+#define XHCI_HCC_PPC        (1 << 3)    // Ports have power switches
+#define XHCI_HCC_MAXPSA(v)  (((v) >> 12) & 0xF)     // Primary stream arrays up to 2^(MaxPSASize + 1) entries
+
+// Operational registers, from CAPLENGTH
+#define XHCI_OP_USBCMD      0x00
+#define XHCI_OP_USBSTS      0x04
+#define XHCI_OP_PAGESIZE    0x08
+#define XHCI_OP_CRCR        0x18
+#define XHCI_OP_DCBAAP      0x30
+#define XHCI_OP_CONFIG      0x38
+#define XHCI_OP_PORTSC(n)   (0x400 + 0x10 * ((n) - 1))
+
+#define XHCI_CMD_RS         (1 << 0)
+#define XHCI_CMD_HCRST      (1 << 1)
+#define XHCI_STS_HCH        (1 << 0)
+#define XHCI_STS_HSE        (1 << 2)
+#define XHCI_STS_CNR        (1 << 11)
+#define XHCI_CRCR_RCS       (1 << 0)
+
+#define XHCI_PORTSC_CCS     (1 << 0)
+#define XHCI_PORTSC_PED     (1 << 1)
+#define XHCI_PORTSC_PR      (1 << 4)
+#define XHCI_PORTSC_PP      (1 << 9)
+#define XHCI_PORTSC_SPEED(v) (((v) >> 10) & 0xF)
+#define XHCI_PORTSC_CSC     (1 << 17)
+#define XHCI_PORTSC_PRC     (1 << 21)
+#define XHCI_PORTSC_WPR     (1u << 31)
+#define XHCI_PORTSC_CHANGES 0x00FE0000  // CSC, PEC, WRC, OCC, PRC, PLC, CEC: write 1 to clear
+#define XHCI_PORTSC_PRESERVE 0x0E00C3E0 // Bits written back as read; PED and the change bits clear on 1
+
+// Interrupter 0, from RTSOFF
+#define XHCI_RT_IMAN        0x20
+#define XHCI_RT_IMOD        0x24
+#define XHCI_RT_ERSTSZ      0x28
+#define XHCI_RT_ERSTBA      0x30
+#define XHCI_RT_ERDP        0x38
+#define XHCI_IMAN_IP        (1 << 0)
+#define XHCI_IMAN_IE        (1 << 1)
+#define XHCI_ERDP_EHB       (1 << 3)
+
+// Extended capabilities
+#define XHCI_EXT_LEGACY     1
+#define XHCI_EXT_PROTOCOL   2
+#define XHCI_LEGACY_BIOS_OWNED (1 << 16)
+#define XHCI_LEGACY_OS_OWNED   (1 << 24)
+#define XHCI_LEGACY_SMI_KEEP   ((0x7 << 1) | (0xFF << 5) | (0x7 << 17))   // Reserved bits of USBLEGCTLSTS
+#define XHCI_LEGACY_SMI_EVENTS (0x7u << 29)
+
+// Intel PCH port routing, config space: ports switch from EHCI to xHCI
+#define XHCI_INTEL_USB2PR   0xD0
+#define XHCI_INTEL_USB2PRM  0xD4
+#define XHCI_INTEL_USB3PSSEN 0xD8
+#define XHCI_INTEL_USB3PRM  0xDC
+
+// TRB types
+#define XHCI_TRB_NORMAL         1
+#define XHCI_TRB_SETUP          2
+#define XHCI_TRB_DATA           3
+#define XHCI_TRB_STATUS         4
+#define XHCI_TRB_LINK           6
+#define XHCI_TRB_ENABLE_SLOT    9
+#define XHCI_TRB_DISABLE_SLOT   10
+#define XHCI_TRB_ADDRESS_DEVICE 11
+#define XHCI_TRB_CONFIGURE_EP   12
+#define XHCI_TRB_EVALUATE_CTX   13
+#define XHCI_TRB_RESET_EP       14
+#define XHCI_TRB_STOP_EP        15
+#define XHCI_TRB_SET_TR_DEQ     16
+#define XHCI_TRB_TRANSFER_EVENT 32
+#define XHCI_TRB_CMD_COMPLETION 33
+#define XHCI_TRB_PORT_STATUS    34
+
+#define XHCI_TRB_TYPE(t)        ((uint32_t)(t) << 10)
+#define XHCI_TRB_GET_TYPE(c)    (((c) >> 10) & 0x3F)
+#define XHCI_TRB_CYCLE          (1 << 0)
+#define XHCI_TRB_TC             (1 << 1)    // Link: toggle cycle
+#define XHCI_TRB_ISP            (1 << 2)    // Event on short packet
+#define XHCI_TRB_CH             (1 << 4)    // Chained to the next TRB of the TD
+#define XHCI_TRB_IOC            (1 << 5)
+#define XHCI_TRB_IDT            (1 << 6)    // Setup: the packet is in the TRB
+#define XHCI_TRB_DIR_IN         (1 << 16)   // Data and status stages
+#define XHCI_TRB_TRT_OUT        (2 << 16)   // Setup: transfer type
+#define XHCI_TRB_TRT_IN         (3 << 16)
+#define XHCI_TRB_SLOT(s)        ((uint32_t)(s) << 24)
+#define XHCI_TRB_EP(dci)        ((uint32_t)(dci) << 16)
+#define XHCI_TRB_STREAM(s)      ((uint32_t)(s) << 16)   // Set TR Dequeue: status field
+
+// Completion codes
+#define XHCI_CC_SUCCESS      1
+#define XHCI_CC_STALL        6
+#define XHCI_CC_SHORT_PACKET 13
+
+// Endpoint context
+#define XHCI_EP_TYPE_ISOCH_OUT  1
+#define XHCI_EP_TYPE_BULK_OUT   2
+#define XHCI_EP_TYPE_INTR_OUT   3
+#define XHCI_EP_TYPE_CONTROL    4
+#define XHCI_EP_TYPE_IN         4       // Added to the OUT types for IN endpoints
+#define XHCI_EP_STATE_RUNNING   1
+#define XHCI_EP_STATE_HALTED    2
+#define XHCI_EP_LSA             (1 << 15)   // Linear stream array, no secondary arrays
+#define XHCI_SCT_PRIMARY        (1 << 1)    // Stream context type: primary TRB ring
+
+typedef struct {
+    uint64_t param;
+    uint32_t status;
+    uint32_t control;
+} __attribute__((packed)) xhci_trb_t;
+
+// Event ring segment table entry
+typedef struct {
+    uint64_t base;
+    uint32_t size;
+    uint32_t reserved;
+} __attribute__((packed)) xhci_erst_t;
+
+// A transfer or command ring: one segment with a link TRB at the end.
+// owner and offset describe the TD every queued TRB belongs to.
+typedef struct {
+    volatile xhci_trb_t *trbs;
+    uint32_t enq;
+    uint8_t cycle;
+    bool in_use;
+    uint32_t pending;           // TRBs of TDs not completed yet
+    usb_transfer_t *owner[XHCI_RING_TRBS];
+    uint32_t offset[XHCI_RING_TRBS];    // Bytes of the TD before the TRB
+} xhci_ring_t;
+
+// Rings of an endpoint with streams, one per stream ID
+typedef struct {
+    bool in_use;
+    uint64_t *ctx;              // Stream context array: two qwords per stream, entry 0 is reserved
+    int count;
+    xhci_ring_t *rings[XHCI_MAX_STREAMS + 1];
+} xhci_streams_t;
+
+struct xhci;
+
+typedef struct {
+    struct xhci *xc;
+    uint8_t slot;
+    uint8_t *in_ctx;            // Input context: control, slot and 31 endpoint contexts
+    uint8_t *out_ctx;           // Device context the controller writes
+    xhci_ring_t *rings[32];     // By device context index, 1 is endpoint 0
+    xhci_streams_t *streams[32];    // Instead of rings[] on endpoints with streams
+    usb_device_t *udev;
+} xhci_dev_t;
+
+typedef struct xhci {
+    usb_hcd_t hcd;
+    char name[8];
+    volatile uint8_t *cap;
+    volatile uint8_t *op;
+    volatile uint8_t *rt;
+    volatile uint32_t *db;
+    int ctx_size;               // 32 or 64 bytes
+    int max_slots;
+    int max_ports;
+    int max_streams;            // Per endpoint, 0 without stream support
+    uint64_t *dcbaa;
+    xhci_ring_t *cmd;
+    volatile xhci_trb_t *events;
+    xhci_erst_t *erst;
+    uint32_t event_deq;
+    uint8_t event_cycle;
+    uint64_t cmd_trb;           // Command waited for, and its completion
+    bool cmd_done;
+    uint8_t cmd_code;
+    uint8_t cmd_slot;
+    uint8_t port_major[256];    // USB major revision of each port, from the protocol capabilities
+    xhci_dev_t devs[XHCI_MAX_SLOTS];    // By slot ID - 1
+    xhci_ring_t rings[XHCI_MAX_RINGS];
+    xhci_streams_t stream_eps[XHCI_MAX_STREAM_EPS];
+    uint32_t events_seen;
+    uint32_t event_batches;     // ERDP writes, one per poll that found events
+} xhci_t;
+
+int xhci_init();
+
+#endif // XHCI_H
@@ -0,0 +1,308 @@
+#include "zram.h"
+#include "block.h"
+#include "kernel.h"
+#include "../System/system.h"
+#include "../System/lz4.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Compressed RAM disks
+//
+// Every 4 KiB page of a "zramN" disk is kept LZ4 compressed. Pages that are
+// one repeated 32-bit word (zeroes, mostly) store only that word. Compressed
+// objects live in a small pool: each size class of ZRAM_CLASS_STEP bytes gets
+// its own pages, split into equal slots, and a page goes back to
+// free_page() as soon as its last slot is freed. malloc() cannot be used
+// for this since it never frees.
+
+static zram_t zrams[ZRAM_MAX_DEVICES];
+static int zram_count = 0;
+
+// Scratch space, I/O is never reentered
+static uint8_t zram_page_buf[ZRAM_PAGE_SIZE] __attribute__((aligned(4)));
+static uint8_t zram_compr_buf[LZ4_COMPRESS_BOUND(ZRAM_PAGE_SIZE)];
+
+// Object pool ===========================================================
+
+static void zram_pool_unlink(zram_t *zr, int cls, zram_pool_page_t *page) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        zr->partial[cls] = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+    page->prev = page->next = NULL;
+}
+
+static void zram_pool_link(zram_t *zr, int cls, zram_pool_page_t *page) {
+    page->prev = NULL;
+    page->next = zr->partial[cls];
+    if (page->next) {
+        page->next->prev = page;
+    }
+    zr->partial[cls] = page;
+}
+
+static uint8_t *zram_pool_alloc(zram_t *zr, uint32_t size) {
+    int cls = (size + ZRAM_CLASS_STEP - 1) / ZRAM_CLASS_STEP - 1;
+    zram_pool_page_t *page = zr->partial[cls];
+
+    if (page == NULL) {
+        page = alloc_page();
+        if (page == NULL) {
+            return NULL;
+        }
+        zr->stats.mem_pages++;
+        page->class_size = (cls + 1) * ZRAM_CLASS_STEP;
+        page->slots = (ZRAM_PAGE_SIZE - sizeof(zram_pool_page_t)) / page->class_size;
+        page->used = 0;
+        page->free_head = 0;
+        // Thread every slot onto the free list, lowest offset first
+        for (int i = page->slots - 1; i >= 0; i--) {
+            uint16_t offset = sizeof(zram_pool_page_t) + i * page->class_size;
+            *(uint16_t *)((uint8_t *)page + offset) = page->free_head;
+            page->free_head = offset;
+        }
+        zram_pool_link(zr, cls, page);
+    }
+
+    uint8_t *obj = (uint8_t *)page + page->free_head;
+    page->free_head = *(uint16_t *)obj;
+    if (++page->used == page->slots) {
+        zram_pool_unlink(zr, cls, page);
+    }
+    return obj;
+}
+
+static void zram_pool_free(zram_t *zr, uint8_t *obj) {
+    zram_pool_page_t *page = (zram_pool_page_t *)((uintptr_t)obj & ~(uintptr_t)(ZRAM_PAGE_SIZE - 1));
+    int cls = page->class_size / ZRAM_CLASS_STEP - 1;
+    bool was_full = page->used == page->slots;
+
+    *(uint16_t *)obj = page->free_head;
+    page->free_head = obj - (uint8_t *)page;
+    page->used--;
+
+    if (page->used == 0) {
+        if (!was_full) {
+            zram_pool_unlink(zr, cls, page);
+        }
+        free_page(page);
+        zr->stats.mem_pages--;
+    } else if (was_full) {
+        zram_pool_link(zr, cls, page);
+    }
+}
+
+// Pages =================================================================
+
+static void zram_free_slot(zram_t *zr, zram_slot_t *slot) {
+    if (slot->flags & ZRAM_SAME) {
+        zr->stats.same_pages--;
+        zr->stats.pages_stored--;
+    } else if (slot->handle) {
+        if (slot->flags & ZRAM_HUGE) {
+            free_page(slot->handle);
+            zr->stats.mem_pages--;
+            zr->stats.huge_pages--;
+        } else {
+            zram_pool_free(zr, slot->handle);
+        }
+        zr->stats.compr_bytes -= slot->size;
+        zr->stats.pages_stored--;
+    }
+    slot->handle = NULL;
+    slot->size = 0;
+    slot->flags = 0;
+}
+
+static bool zram_same_filled(const uint8_t *page, uint32_t *value) {
+    const uint32_t *words = (const uint32_t *)page;
+    for (int i = 1; i < ZRAM_PAGE_SIZE / 4; i++) {
+        if (words[i] != words[0]) {
+            return false;
+        }
+    }
+    *value = words[0];
+    return true;
+}
+
+static bool zram_read_page(zram_t *zr, uint32_t index, uint8_t *dst) {
+    zram_slot_t *slot = &zr->slots[index];
+
+    if (slot->flags & ZRAM_SAME) {
+        uint32_t *words = (uint32_t *)dst;
+        for (int i = 0; i < ZRAM_PAGE_SIZE / 4; i++) {
+            words[i] = slot->value;
+        }
+        return true;
+    }
+    if (slot->handle == NULL) {
+        memset(dst, 0, ZRAM_PAGE_SIZE);     // Never written
+        return true;
+    }
+    if (slot->flags & ZRAM_HUGE) {
+        memcpy(dst, slot->handle, ZRAM_PAGE_SIZE);
+        return true;
+    }
+    if (lz4_decompress(slot->handle, slot->size, dst, ZRAM_PAGE_SIZE) != ZRAM_PAGE_SIZE) {
+        printk("%s: page %d is corrupt\n", zr->blk.name, index);
+        return false;
+    }
+    return true;
+}
+
+static bool zram_write_page(zram_t *zr, uint32_t index, const uint8_t *src) {
+    zram_slot_t *slot = &zr->slots[index];
+    uint32_t value;
+
+    zram_free_slot(zr, slot);
+
+    if (zram_same_filled(src, &value)) {
+        slot->flags = ZRAM_SAME;
+        slot->value = value;
+        zr->stats.same_pages++;
+        zr->stats.pages_stored++;
+        return true;
+    }
+
+    int len = lz4_compress(src, ZRAM_PAGE_SIZE, zram_compr_buf, sizeof(zram_compr_buf));
+    uint8_t *obj;
+    if (len < 0 || len > ZRAM_HUGE_SIZE) {
+        obj = alloc_page();
+        if (obj == NULL) {
+            zr->stats.failed_writes++;
+            return false;
+        }
+        memcpy(obj, src, ZRAM_PAGE_SIZE);
+        len = ZRAM_PAGE_SIZE;
+        slot->flags = ZRAM_HUGE;
+        zr->stats.mem_pages++;
+        zr->stats.huge_pages++;
+    } else {
+        obj = zram_pool_alloc(zr, len);
+        if (obj == NULL) {
+            zr->stats.failed_writes++;
+            return false;
+        }
+        memcpy(obj, zram_compr_buf, len);
+    }
+
+    slot->handle = obj;
+    slot->size = len;
+    zr->stats.compr_bytes += len;
+    zr->stats.pages_stored++;
+    return true;
+}
+
+// Block layer glue ======================================================
+
+static bool zram_transfer(block_device_t *dev, uint64_t lba, const block_seg_t *segs, int nsegs, bool write) {
+    zram_t *zr = (zram_t *)dev->driver_data;
+
+    for (int i = 0; i < nsegs; i++) {
+        uint8_t *buf = segs[i].buf;
+        uint32_t left = segs[i].count;
+
+        while (left > 0) {
+            uint32_t index = lba / ZRAM_SECTORS_PER_PAGE;
+            uint32_t first = lba % ZRAM_SECTORS_PER_PAGE;
+            uint32_t n = ZRAM_SECTORS_PER_PAGE - first;
+            if (n > left) {
+                n = left;
+            }
+            bool whole = n == ZRAM_SECTORS_PER_PAGE;
+
+            if (write) {
+                // Partial pages need a read-modify-write
+                const uint8_t *src = buf;
+                if (!whole) {
+                    if (!zram_read_page(zr, index, zram_page_buf)) {
+                        return false;
+                    }
+                    memcpy(zram_page_buf + first * BLOCK_SECTOR_SIZE, buf, n * BLOCK_SECTOR_SIZE);
+                    src = zram_page_buf;
+                }
+                if (!zram_write_page(zr, index, src)) {
+                    return false;
+                }
+            } else if (whole) {
+                if (!zram_read_page(zr, index, buf)) {
+                    return false;
+                }
+            } else {
+                if (!zram_read_page(zr, index, zram_page_buf)) {
+                    return false;
+                }
+                memcpy(buf, zram_page_buf + first * BLOCK_SECTOR_SIZE, n * BLOCK_SECTOR_SIZE);
+            }
+
+            lba += n;
+            buf += n * BLOCK_SECTOR_SIZE;
+            left -= n;
+        }
+    }
+    return true;
+}
+
+// Make a compressed RAM disk holding up to sectors of data
+block_device_t *zram_create(uint32_t sectors) {
+    uint32_t page_count = (sectors + ZRAM_SECTORS_PER_PAGE - 1) / ZRAM_SECTORS_PER_PAGE;
+    if (zram_count >= ZRAM_MAX_DEVICES) {
+        printk("Error: Too many zram devices.\n");
+        return NULL;
+    }
+    if (page_count == 0 || page_count > ZRAM_MAX_PAGES) {
+        printk("Error: zram size must be between 4 KiB and %d KiB.\n", ZRAM_MAX_PAGES * 4);
+        return NULL;
+    }
+
+    zram_t *zr = &zrams[zram_count];
+    memset(zr, 0, sizeof(zram_t));
+    zr->slots = malloc(page_count * sizeof(zram_slot_t));
+    if (zr->slots == NULL) {
+        printk("Error: Out of memory for zram slot table.\n");
+        return NULL;
+    }
+    memset(zr->slots, 0, page_count * sizeof(zram_slot_t));
+    zr->page_count = page_count;
+
+    block_make_name(zr->blk.name, "zram", zram_count);
+    zr->blk.sector_size = BLOCK_SECTOR_SIZE;
+    zr->blk.sector_count = (uint64_t)page_count * ZRAM_SECTORS_PER_PAGE;
+    zr->blk.max_sectors = 256;
+    zr->blk.max_segs = BLOCK_MAX_SEGS;
+    zr->blk.transfer = zram_transfer;
+    zr->blk.driver_data = zr;
+    if (!block_register(&zr->blk)) {
+        return NULL;
+    }
+    zram_count++;
+    return &zr->blk;
+}
+
+void zram_print_stats() {
+    if (zram_count == 0) {
+        printk("No zram devices.\n");
+    }
+    for (int i = 0; i < zram_count; i++) {
+        zram_t *zr = &zrams[i];
+        zram_stats_t *st = &zr->stats;
+        uint32_t orig_kib = st->pages_stored * (ZRAM_PAGE_SIZE / 1024);
+        uint32_t used_kib = st->mem_pages * (ZRAM_PAGE_SIZE / 1024);
+
+        printk("%s: %d of %d pages stored, %d KiB of data\n",
+               zr->blk.name, st->pages_stored, zr->page_count, orig_kib);
+        printk("  same-filled %d, incompressible %d, failed writes %d\n",
+               st->same_pages, st->huge_pages, st->failed_writes);
+        printk("  compressed %d KiB, memory used %d KiB", st->compr_bytes / 1024, used_kib);
+        if (used_kib > 0) {
+            printk(", ratio %d%s\n", orig_kib * 100 / used_kib, "%");
+        } else {
+            printk("\n");
+        }
+    }
+}
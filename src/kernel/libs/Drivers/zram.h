@@ -0,0 +1,56 @@
+#ifndef ZRAM_H
+#define ZRAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block.h"
+
+#define ZRAM_MAX_DEVICES  2
+#define ZRAM_PAGE_SIZE    4096
+#define ZRAM_SECTORS_PER_PAGE (ZRAM_PAGE_SIZE / BLOCK_SECTOR_SIZE)
+#define ZRAM_MAX_PAGES    16384     // 64 MiB of uncompressed data per device
+#define ZRAM_CLASS_STEP   32        // Compressed objects are rounded up to this
+#define ZRAM_HUGE_SIZE    3072      // Pages compressing worse than this are stored as is
+#define ZRAM_CLASSES      (ZRAM_HUGE_SIZE / ZRAM_CLASS_STEP)
+
+// Slot flags
+#define ZRAM_SAME 0x01              // Every word of the page is value, nothing stored
+#define ZRAM_HUGE 0x02              // Stored uncompressed in a page of its own
+
+typedef struct {
+    uint8_t *handle;        // Compressed data, NULL for empty and same-filled pages
+    uint16_t size;          // Compressed size
+    uint8_t flags;
+    uint32_t value;         // Fill word for ZRAM_SAME pages
+} zram_slot_t;
+
+// Header at the start of every page the object pool carves into equal slots
+typedef struct zram_pool_page {
+    struct zram_pool_page *prev, *next;     // In the class's list of pages with free slots
+    uint16_t free_head;     // Offset of the first free slot, 0 if none
+    uint16_t used;
+    uint16_t class_size;
+    uint16_t slots;
+} zram_pool_page_t;
+
+typedef struct {
+    uint32_t pages_stored;  // Pages holding data, same-filled ones included
+    uint32_t same_pages;
+    uint32_t huge_pages;
+    uint32_t compr_bytes;   // Sum of compressed sizes
+    uint32_t mem_pages;     // Pages taken from alloc_page()
+    uint32_t failed_writes;
+} zram_stats_t;
+
+typedef struct {
+    block_device_t blk;
+    zram_slot_t *slots;
+    uint32_t page_count;
+    zram_pool_page_t *partial[ZRAM_CLASSES];
+    zram_stats_t stats;
+} zram_t;
+
+block_device_t *zram_create(uint32_t sectors);
+void zram_print_stats();
+
+#endif // ZRAM_H
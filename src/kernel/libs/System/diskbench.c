@@ -0,0 +1,290 @@
+#include "diskbench.h"
+#include "ioring.h"
+#include "vfs.h"
+#include "system.h"
+#include "time.h"
+#include "../Drivers/block.h"
+#include "../Drivers/kernel.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Storage benchmark
+//
+// Keeps queue_depth requests of one size in flight against a block device
+// for a fixed time, through an ioring, and records the latency of every one
+// from the TSC clock. Requests are reissued as soon as they complete, so
+// the device sees a constant queue depth like fio's libaio/io_uring engines.
+//
+// Latencies go into an HDR-style histogram: one bucket per microsecond
+// below 64, then 32 buckets for every power of two above. Every value is
+// off by less than 1/32.
+
+static diskbench_hist_t diskbench_hist;
+
+// Parsing ===============================================================
+
+// "4096", "4k", "64K", "1m", "2g"
+static bool diskbench_parse_size(const char *str, uint64_t *out) {
+    uint64_t value = 0;
+    if (*str < '0' || *str > '9') {
+        return false;
+    }
+    while (*str >= '0' && *str <= '9') {
+        value = value * 10 + (*str++ - '0');
+    }
+    switch (*str) {
+    case 'k': case 'K': value <<= 10; str++; break;
+    case 'm': case 'M': value <<= 20; str++; break;
+    case 'g': case 'G': value <<= 30; str++; break;
+    }
+    if (*str != '\0') {
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+// argv: <device> [rw=read|write|randread|randwrite] [bs=<size>] [qd=<depth>]
+// [time=<seconds>] [size=<bytes of the device to use>]
+bool diskbench_parse(diskbench_job_t *job, int argc, char **argv) {
+    memset(job, 0, sizeof(diskbench_job_t));
+    job->random = true;
+    job->block_size = 4096;
+    job->queue_depth = 32;
+    job->seconds = 10;
+
+    if (argc < 1) {
+        return false;
+    }
+    job->dev = block_find(argv[0]);
+    if (job->dev == NULL) {
+        printk("diskbench: no such device: %s\n", argv[0]);
+        return false;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = arg;
+        while (*value && *value != '=') {
+            value++;
+        }
+        if (*value != '=') {
+            printk("diskbench: expected key=value: %s\n", arg);
+            return false;
+        }
+        value++;
+
+        uint64_t n = 0;
+        if (strncmp(arg, "rw=", 3) == 0) {
+            if (strcmp(value, "read") == 0 || strcmp(value, "write") == 0) {
+                job->random = false;
+            } else if (strcmp(value, "randread") != 0 && strcmp(value, "randwrite") != 0) {
+                printk("diskbench: rw is read, write, randread or randwrite\n");
+                return false;
+            }
+            job->write = strcmp(value, "write") == 0 || strcmp(value, "randwrite") == 0;
+        } else if (strncmp(arg, "bs=", 3) == 0 && diskbench_parse_size(value, &n) && n > 0 && n <= DISKBENCH_MAX_BUFFER) {
+            job->block_size = n;
+        } else if (strncmp(arg, "qd=", 3) == 0 && diskbench_parse_size(value, &n) && n > 0 && n <= DISKBENCH_MAX_QD) {
+            job->queue_depth = n;
+        } else if (strncmp(arg, "time=", 5) == 0 && diskbench_parse_size(value, &n) && n > 0 && n <= 3600) {
+            job->seconds = n;
+        } else if (strncmp(arg, "size=", 5) == 0 && diskbench_parse_size(value, &n)) {
+            job->size = n;
+        } else {
+            printk("diskbench: bad option %s\n", arg);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Histogram =============================================================
+
+static uint32_t diskbench_bucket(uint64_t us) {
+    uint32_t v = us > 0xFFFFFFFF ? 0xFFFFFFFF : us;
+    if (v < (1u << (DISKBENCH_SUB_BITS + 1))) {
+        return v;
+    }
+    uint32_t msb = 31 - __builtin_clz(v);
+    uint32_t sub = (v >> (msb - DISKBENCH_SUB_BITS)) & ((1u << DISKBENCH_SUB_BITS) - 1);
+    return (1u << (DISKBENCH_SUB_BITS + 1)) + ((msb - DISKBENCH_SUB_BITS - 1) << DISKBENCH_SUB_BITS) + sub;
+}
+
+// Smallest value that lands in bucket
+static uint64_t diskbench_bucket_low(uint32_t bucket) {
+    if (bucket < (1u << (DISKBENCH_SUB_BITS + 1))) {
+        return bucket;
+    }
+    bucket -= 1u << (DISKBENCH_SUB_BITS + 1);
+    uint32_t msb = (bucket >> DISKBENCH_SUB_BITS) + DISKBENCH_SUB_BITS + 1;
+    uint32_t sub = bucket & ((1u << DISKBENCH_SUB_BITS) - 1);
+    return (uint64_t)((1u << DISKBENCH_SUB_BITS) + sub) << (msb - DISKBENCH_SUB_BITS);
+}
+
+static void diskbench_record(diskbench_hist_t *h, uint64_t us) {
+    h->counts[diskbench_bucket(us)]++;
+    if (h->total == 0 || us < h->min) {
+        h->min = us;
+    }
+    if (us > h->max) {
+        h->max = us;
+    }
+    h->total++;
+    h->sum += us;
+}
+
+// Latency below which per_mille thousandths of all requests finished, as
+// the highest value of its bucket (never below the real value)
+static uint64_t diskbench_percentile(diskbench_hist_t *h, uint32_t per_mille) {
+    uint64_t want = (h->total * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < DISKBENCH_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= want && seen > 0) {
+            uint64_t high = b + 1 < DISKBENCH_BUCKETS ? diskbench_bucket_low(b + 1) - 1 : h->max;
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Running ===============================================================
+
+static uint32_t diskbench_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+bool diskbench_run(const diskbench_job_t *job) {
+    block_device_t *dev = job->dev;
+    uint32_t sectors = job->block_size / dev->sector_size;
+    uint64_t span = job->size ? job->size / dev->sector_size : dev->sector_count;
+    static uint64_t started[DISKBENCH_MAX_QD];
+
+    if (job->block_size % dev->sector_size) {
+        printk("diskbench: block size must be a multiple of %d\n", dev->sector_size);
+        return false;
+    }
+    if (span > dev->sector_count) {
+        span = dev->sector_count;
+    }
+    uint64_t blocks = span / sectors;
+    if (blocks == 0) {
+        printk("diskbench: %s is smaller than one block\n", dev->name);
+        return false;
+    }
+    if (job->write && vfs_dev_mounted(dev)) {
+        printk("diskbench: %s is mounted, not writing to it\n", dev->name);
+        return false;
+    }
+
+    uint32_t buffer_pages = ((uint64_t)job->block_size * job->queue_depth + 4095) / 4096;
+    if ((uint64_t)job->block_size * job->queue_depth > DISKBENCH_MAX_BUFFER) {
+        printk("diskbench: block size times queue depth is over 4 MiB\n");
+        return false;
+    }
+    uint8_t *buffers = alloc_pages(buffer_pages);
+    if (buffers == NULL) {
+        printk("diskbench: out of memory\n");
+        return false;
+    }
+    ioring_t *ring = ioring_create(job->queue_depth);
+    if (ring == NULL) {
+        free_pages(buffers, buffer_pages);
+        return false;
+    }
+    if (job->write) {
+        for (uint32_t i = 0; i < buffer_pages * 4096; i++) {
+            buffers[i] = i * 31 + 7;
+        }
+    }
+
+    printk("diskbench %s: %s%s, bs %d, qd %d, %d s over %d MiB\n", dev->name,
+           job->random ? "rand" : "", job->write ? "write" : "read",
+           (int)job->block_size, (int)job->queue_depth, (int)job->seconds,
+           (int)(blocks * sectors * dev->sector_size >> 20));
+
+    diskbench_hist_t *h = &diskbench_hist;
+    memset(h, 0, sizeof(diskbench_hist_t));
+    uint32_t seed = (uint32_t)rdtsc() | 1;
+    uint64_t next_block = 0;
+    uint64_t bytes = 0;
+    uint32_t errors = 0;
+    uint64_t begin = time_now_us();
+    uint64_t end = begin + (uint64_t)job->seconds * 1000000;
+    uint32_t slots_free[DISKBENCH_MAX_QD];
+    uint32_t free_count = job->queue_depth;
+    for (uint32_t i = 0; i < job->queue_depth; i++) {
+        slots_free[i] = i;
+    }
+
+    bool ok = true;
+    while (true) {
+        // Refill every free slot, then hand them over together
+        uint64_t now = time_now_us();
+        while (now < end && free_count > 0) {
+            uint32_t slot = slots_free[--free_count];
+            uint64_t block;
+            if (job->random) {
+                block = (((uint64_t)diskbench_random(&seed) << 32) | diskbench_random(&seed)) % blocks;
+            } else {
+                block = next_block;
+                next_block = (next_block + 1) % blocks;
+            }
+            ioring_sqe_t *sqe = ioring_get_sqe(ring);
+            uint8_t *buf = buffers + slot * job->block_size;
+            if (job->write) {
+                ioring_prep_write(sqe, dev, block * sectors, sectors, buf, slot);
+            } else {
+                ioring_prep_read(sqe, dev, block * sectors, sectors, buf, slot);
+            }
+            started[slot] = time_now_us();
+        }
+        ioring_submit(ring);
+
+        if (ring->inflight == 0 && ioring_cq_ready(ring) == 0) {
+            break;
+        }
+        ioring_cqe_t *cqe = ioring_wait_cqe(ring);
+        if (cqe == NULL) {
+            ok = false;
+            break;
+        }
+        now = time_now_us();
+        while (cqe) {
+            uint32_t slot = cqe->user_data;
+            diskbench_record(h, now - started[slot]);
+            if (cqe->res < 0) {
+                errors++;
+            } else {
+                bytes += cqe->res;
+            }
+            slots_free[free_count++] = slot;
+            ioring_cqe_seen(ring);
+            cqe = ioring_cq_ready(ring) ? ioring_peek_cqe(ring) : NULL;
+        }
+    }
+    uint64_t elapsed = time_now_us() - begin;
+
+    ioring_destroy(ring);
+    free_pages(buffers, buffer_pages);
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+
+    printk("  %d requests in %d ms, %d errors\n", (int)h->total, (int)(elapsed / 1000), (int)errors);
+    uint64_t mb_tenths = bytes * 10 / elapsed;     // Bytes per microsecond are MB/s
+    printk("  IOPS %d, %d.%d MB/s\n", (int)(h->total * 1000000 / elapsed), (int)(mb_tenths / 10), (int)(mb_tenths % 10));
+    if (h->total > 0) {
+        printk("  latency us: min %d, avg %d, max %d\n", (int)h->min, (int)(h->sum / h->total), (int)h->max);
+        printk("  p50 %d, p90 %d, p99 %d, p99.9 %d\n",
+               (int)diskbench_percentile(h, 500), (int)diskbench_percentile(h, 900),
+               (int)diskbench_percentile(h, 990), (int)diskbench_percentile(h, 999));
+    }
+    return ok && errors == 0;
+}
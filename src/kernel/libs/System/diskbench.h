@@ -0,0 +1,36 @@
+#ifndef DISKBENCH_H
+#define DISKBENCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../Drivers/block.h"
+
+#define DISKBENCH_MAX_QD       64
+#define DISKBENCH_MAX_BUFFER   (4 * 1024 * 1024)   // Block size times queue depth
+#define DISKBENCH_SUB_BITS     5                   // 32 histogram buckets per power of two, about 3% resolution
+#define DISKBENCH_BUCKETS      ((1 << (DISKBENCH_SUB_BITS + 1)) + (32 - DISKBENCH_SUB_BITS - 1) * (1 << DISKBENCH_SUB_BITS))
+
+// One fio-like job against a block device
+typedef struct {
+    block_device_t *dev;
+    bool write;
+    bool random;
+    uint32_t block_size;            // Bytes, a multiple of the sector size
+    uint32_t queue_depth;
+    uint32_t seconds;
+    uint64_t size;                  // Bytes of the device to use, 0 for all of it
+} diskbench_job_t;
+
+// Latency histogram in microseconds: exact below 64, then log-linear
+typedef struct {
+    uint32_t counts[DISKBENCH_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} diskbench_hist_t;
+
+bool diskbench_parse(diskbench_job_t *job, int argc, char **argv);
+bool diskbench_run(const diskbench_job_t *job);
+
+#endif // DISKBENCH_H
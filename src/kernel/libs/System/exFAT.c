@@ -0,0 +1,1764 @@
+#include "exFAT.h"
+#include "vfs.h"
+#include "system.h"
+#include "../Drivers/block.h"
+#include "../Drivers/kernel.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// exFAT
+//
+// Every open file carries its cluster chain as a list of extents (runs of
+// consecutive clusters). Files with the NoFatChain flag are one extent by
+// definition and never touch the FAT; the others are walked once, on first
+// access, and coalesced. A read then turns into one block request per
+// extent it covers instead of a FAT lookup and a request per cluster.
+//
+// Writing keeps it that way. The allocator looks for one free run big enough
+// for the whole request before settling for pieces, grows files in place
+// whenever the clusters behind them are free, and holds a window of free
+// clusters back behind every file being appended to so that interleaved
+// writers do not chop each other up. A file stays NoFatChain until it
+// really has to be split.
+
+#define EXFAT_ENTRY_SIZE 32
+#define EXFAT_MAX_SET    19         // File entry, stream extension and 17 name entries
+#define EXFAT_PAGE_SIZE  4096
+#define EXFAT_TIMESTAMP_EPOCH 0x00210000    // 1980-01-01 00:00:00, there is no clock to ask
+#define EXFAT_PAGE_BATCH 32         // Page reads in flight at once
+
+static exfat_volume_t exfat_volumes[EXFAT_MAX_VOLUMES];
+
+// Low level access ======================================================
+
+static bool exfat_read_sectors(exfat_volume_t *vol, uint64_t sector, uint32_t count, void *buf) {
+    return block_read(vol->dev, vol->part_lba + sector * vol->dev_per_sector, count * vol->dev_per_sector, buf);
+}
+
+static uint64_t exfat_cluster_sector(exfat_volume_t *vol, uint32_t cluster) {
+    return vol->heap_offset + ((uint64_t)(cluster - EXFAT_FIRST_CLUSTER) << (vol->cluster_shift - vol->sector_shift));
+}
+
+static bool exfat_valid_cluster(exfat_volume_t *vol, uint32_t cluster) {
+    return cluster >= EXFAT_FIRST_CLUSTER && cluster < vol->cluster_count + EXFAT_FIRST_CLUSTER;
+}
+
+static bool exfat_write_sectors(exfat_volume_t *vol, uint64_t sector, uint32_t count, const void *buf) {
+    return block_write(vol->dev, vol->part_lba + sector * vol->dev_per_sector, count * vol->dev_per_sector, buf);
+}
+
+// Read or write len bytes at byte offset pos of the volume. Whole device
+// sectors go straight to or from buf, partial ones at either end through the
+// bounce buffer (read-modify-write when writing).
+static bool exfat_io_bytes(exfat_volume_t *vol, uint64_t pos, uint8_t *buf, uint32_t len, bool write) {
+    uint32_t dev_sector = vol->dev->sector_size;
+    uint64_t lba = vol->part_lba + pos / dev_sector;
+    uint32_t skip = pos % dev_sector;
+
+    while (len > 0) {
+        if (skip == 0 && len >= dev_sector) {
+            uint32_t count = len / dev_sector;
+            bool ok = write ? block_write(vol->dev, lba, count, buf) : block_read(vol->dev, lba, count, buf);
+            if (!ok) {
+                return false;
+            }
+            buf += count * dev_sector;
+            len -= count * dev_sector;
+            lba += count;
+            continue;
+        }
+
+        uint32_t n = dev_sector - skip < len ? dev_sector - skip : len;
+        if (!block_read(vol->dev, lba, 1, vol->buf)) {
+            return false;
+        }
+        if (write) {
+            memcpy(vol->buf + skip, buf, n);
+            if (!block_write(vol->dev, lba, 1, vol->buf)) {
+                return false;
+            }
+        } else {
+            memcpy(buf, vol->buf + skip, n);
+        }
+        buf += n;
+        len -= n;
+        lba++;
+        skip = 0;
+    }
+    return true;
+}
+
+// FAT ===================================================================
+
+static int exfat_fat_slots(exfat_volume_t *vol) {
+    return EXFAT_PAGE_SIZE / vol->sector_size;
+}
+
+static bool exfat_fat_flush_slot(exfat_volume_t *vol, int slot) {
+    if (!(vol->fat_dirty & (1 << slot))) {
+        return true;
+    }
+    if (!exfat_write_sectors(vol, vol->fat_tags[slot], 1, vol->fat_buf + slot * vol->sector_size)) {
+        return false;
+    }
+    vol->fat_dirty &= ~(1 << slot);
+    return true;
+}
+
+// Pointer to the FAT entry of cluster, loading its sector into the cache
+static uint32_t *exfat_fat_entry(exfat_volume_t *vol, uint32_t cluster) {
+    uint32_t sector = vol->fat_offset + (cluster * 4) / vol->sector_size;
+    int slot = sector % exfat_fat_slots(vol);
+    uint8_t *data = vol->fat_buf + slot * vol->sector_size;
+
+    if (vol->fat_tags[slot] != sector) {
+        if (!exfat_fat_flush_slot(vol, slot)) {
+            return NULL;
+        }
+        vol->fat_tags[slot] = 0;
+        if (!exfat_read_sectors(vol, sector, 1, data)) {
+            return NULL;
+        }
+        vol->fat_tags[slot] = sector;
+    }
+    return (uint32_t *)(data + (cluster * 4) % vol->sector_size);
+}
+
+static bool exfat_fat_get(exfat_volume_t *vol, uint32_t cluster, uint32_t *next) {
+    uint32_t *entry = exfat_fat_entry(vol, cluster);
+    if (entry == NULL) {
+        return false;
+    }
+    *next = *entry;
+    return true;
+}
+
+static bool exfat_fat_set(exfat_volume_t *vol, uint32_t cluster, uint32_t next) {
+    uint32_t *entry = exfat_fat_entry(vol, cluster);
+    if (entry == NULL) {
+        return false;
+    }
+    *entry = next;
+    vol->fat_dirty |= 1 << ((vol->fat_offset + (cluster * 4) / vol->sector_size) % exfat_fat_slots(vol));
+    return true;
+}
+
+// Allocation bitmap =====================================================
+
+#define EXFAT_BITMAP_PAGE_BITS (EXFAT_PAGE_SIZE * 8)
+
+static bool exfat_bitmap_test(exfat_volume_t *vol, uint32_t cluster) {
+    uint32_t bit = cluster - EXFAT_FIRST_CLUSTER;
+    return vol->bitmap[bit / EXFAT_BITMAP_PAGE_BITS][(bit % EXFAT_BITMAP_PAGE_BITS) / 8] & (1 << (bit % 8));
+}
+
+static void exfat_bitmap_set(exfat_volume_t *vol, uint32_t cluster, bool used) {
+    uint32_t bit = cluster - EXFAT_FIRST_CLUSTER;
+    uint32_t page = bit / EXFAT_BITMAP_PAGE_BITS;
+    uint32_t byte = (bit % EXFAT_BITMAP_PAGE_BITS) / 8;
+
+    if (used) {
+        vol->bitmap[page][byte] |= 1 << (bit % 8);
+        vol->free_clusters--;
+    } else {
+        vol->bitmap[page][byte] &= ~(1 << (bit % 8));
+        vol->free_clusters++;
+    }
+    vol->bitmap_dirty[page] |= 1 << (byte / vol->sector_size);
+}
+
+// Free and not held back for another file
+static bool exfat_cluster_available(exfat_volume_t *vol, uint32_t cluster, int own) {
+    if (exfat_bitmap_test(vol, cluster)) {
+        return false;
+    }
+    for (int i = 0; i < EXFAT_MAX_RESERVATIONS; i++) {
+        exfat_reservation_t *r = &vol->reservations[i];
+        if (r->in_use && i + 1 != own && cluster >= r->start && cluster < r->start + r->length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Cluster chains ========================================================
+
+static exfat_extent_t *exfat_extent(exfat_file_t *file, uint32_t index) {
+    return file->extents ? &file->extents[index] : &file->inline_extent;
+}
+
+static uint32_t exfat_cluster_count_for(exfat_volume_t *vol, uint64_t bytes) {
+    return (bytes + vol->cluster_size - 1) >> vol->cluster_shift;
+}
+
+// Build the extent list, walking the FAT unless the file is contiguous
+static bool exfat_load_chain(exfat_file_t *file) {
+    exfat_volume_t *vol = file->vol;
+
+    if (file->chain_loaded) {
+        return true;
+    }
+    file->extent_count = 0;
+    file->chain_complete = true;
+
+    if (!exfat_valid_cluster(vol, file->first_cluster)) {
+        file->chain_loaded = true;      // Empty file
+        return true;
+    }
+
+    if (file->flags & EXFAT_FLAG_NO_FAT_CHAIN) {
+        file->inline_extent.file_cluster = 0;
+        file->inline_extent.disk_cluster = file->first_cluster;
+        file->inline_extent.length = exfat_cluster_count_for(vol, file->size);
+        file->extent_count = file->inline_extent.length ? 1 : 0;
+        file->chain_loaded = true;
+        return true;
+    }
+
+    if (file->extents == NULL) {
+        file->extents = alloc_page();
+        if (file->extents == NULL) {
+            printk("exFAT: out of pages for cluster chain\n");
+            return false;
+        }
+    }
+
+    uint32_t cluster = file->first_cluster;
+    uint32_t file_cluster = 0;
+    while (exfat_valid_cluster(vol, cluster)) {
+        exfat_extent_t *last = file->extent_count ? &file->extents[file->extent_count - 1] : NULL;
+        if (last && last->disk_cluster + last->length == cluster) {
+            last->length++;
+        } else if (file->extent_count < EXFAT_EXTENTS_PER_PAGE) {
+            exfat_extent_t *e = &file->extents[file->extent_count++];
+            e->file_cluster = file_cluster;
+            e->disk_cluster = cluster;
+            e->length = 1;
+        } else {
+            file->chain_complete = false;   // The rest is walked on demand
+            break;
+        }
+
+        file_cluster++;
+        if (file_cluster > vol->cluster_count) {
+            printk("exFAT: cluster chain loops\n");
+            return false;
+        }
+        if (!exfat_fat_get(vol, cluster, &cluster)) {
+            return false;
+        }
+    }
+    file->chain_loaded = true;
+    return true;
+}
+
+// Find where file_cluster lives and how many clusters follow it contiguously
+static bool exfat_map(exfat_file_t *file, uint32_t file_cluster, uint32_t *disk_cluster, uint32_t *run) {
+    if (!exfat_load_chain(file)) {
+        return false;
+    }
+
+    // Binary search, extents are sorted by file_cluster
+    int lo = 0, hi = (int)file->extent_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        exfat_extent_t *e = exfat_extent(file, mid);
+        if (file_cluster < e->file_cluster) {
+            hi = mid - 1;
+        } else if (file_cluster >= e->file_cluster + e->length) {
+            lo = mid + 1;
+        } else {
+            *disk_cluster = e->disk_cluster + (file_cluster - e->file_cluster);
+            *run = e->length - (file_cluster - e->file_cluster);
+            return true;
+        }
+    }
+
+    if (file->chain_complete || file->extent_count == 0) {
+        return false;
+    }
+
+    // Past the cached extents: follow the FAT from the last one
+    exfat_extent_t *last = exfat_extent(file, file->extent_count - 1);
+    uint32_t cluster = last->disk_cluster + last->length - 1;
+    for (uint32_t i = last->file_cluster + last->length - 1; i < file_cluster; i++) {
+        if (!exfat_fat_get(file->vol, cluster, &cluster) || !exfat_valid_cluster(file->vol, cluster)) {
+            return false;
+        }
+    }
+    *disk_cluster = cluster;
+    *run = 1;
+    return true;
+}
+
+// File data =============================================================
+
+// Move len bytes between buf and the file at offset, which must lie within
+// the clusters the file owns. One block request per extent covered.
+static bool exfat_io_mapped(exfat_file_t *file, uint64_t offset, uint8_t *buf, uint32_t len, bool write) {
+    exfat_volume_t *vol = file->vol;
+    uint32_t done = 0;
+
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint32_t in_cluster = pos & (vol->cluster_size - 1);
+        uint32_t disk_cluster, run;
+        if (!exfat_map(file, pos >> vol->cluster_shift, &disk_cluster, &run)) {
+            printk("exFAT: cluster chain too short\n");
+            return false;
+        }
+
+        uint64_t avail = ((uint64_t)run << vol->cluster_shift) - in_cluster;
+        uint32_t chunk = len - done < avail ? len - done : avail;
+        uint64_t disk_pos = (exfat_cluster_sector(vol, disk_cluster) << vol->sector_shift) + in_cluster;
+        if (!exfat_io_bytes(vol, disk_pos, buf + done, chunk, write)) {
+            return false;
+        }
+        done += chunk;
+    }
+
+    if (write && (file->attributes & EXFAT_ATTR_DIRECTORY) && vol->dir_buf_cluster == file->first_cluster) {
+        vol->dir_buf_cluster = 0;
+    }
+    return true;
+}
+
+// Read up to len bytes at offset, returns the number of bytes read or -1
+int exfat_read(exfat_file_t *file, uint64_t offset, void *buf, uint32_t len) {
+    uint8_t *dst = buf;
+
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (len > file->size - offset) {
+        len = file->size - offset;
+    }
+
+    // Bytes past ValidDataLength were never written and read as zero
+    uint32_t readable = 0;
+    if (offset < file->valid_size) {
+        readable = file->valid_size - offset < len ? file->valid_size - offset : len;
+    }
+    if (readable && !exfat_io_mapped(file, offset, dst, readable, false)) {
+        return -1;
+    }
+    if (len > readable) {
+        memset(dst + readable, 0, len - readable);
+    }
+    return len;
+}
+
+// Fill count whole pages of the file starting at page first, zero past the
+// end. Pages that lie inside one extent and below ValidDataLength go to the
+// block layer together as one request each, so the scheduler can merge them
+// into a single command; the rest take the exfat_read() path.
+bool exfat_read_pages(exfat_file_t *file, uint32_t first, uint8_t **pages, int count) {
+    static io_request_t reqs[EXFAT_PAGE_BATCH];
+    exfat_volume_t *vol = file->vol;
+    uint32_t dev_sector = vol->dev->sector_size;
+    bool ok = true;
+
+    for (int base = 0; base < count; base += EXFAT_PAGE_BATCH) {
+        int batch = count - base < EXFAT_PAGE_BATCH ? count - base : EXFAT_PAGE_BATCH;
+        int queued = 0;
+
+        for (int i = 0; i < batch; i++) {
+            uint8_t *page = pages[base + i];
+            uint64_t pos = (uint64_t)(first + base + i) * EXFAT_PAGE_SIZE;
+            uint32_t in_cluster = pos & (vol->cluster_size - 1);
+            uint32_t disk_cluster, run;
+
+            if (pos + EXFAT_PAGE_SIZE <= file->valid_size && dev_sector <= EXFAT_PAGE_SIZE &&
+                exfat_map(file, pos >> vol->cluster_shift, &disk_cluster, &run) &&
+                ((uint64_t)run << vol->cluster_shift) - in_cluster >= EXFAT_PAGE_SIZE) {
+                uint64_t disk_pos = (exfat_cluster_sector(vol, disk_cluster) << vol->sector_shift) + in_cluster;
+                io_request_t *req = &reqs[queued++];
+                memset(req, 0, sizeof(io_request_t));
+                req->lba = vol->part_lba + disk_pos / dev_sector;
+                req->count = EXFAT_PAGE_SIZE / dev_sector;
+                req->buf = page;
+                block_submit(vol->dev, req);
+                continue;
+            }
+
+            int n = exfat_read(file, pos, page, EXFAT_PAGE_SIZE);
+            if (n < 0) {
+                ok = false;
+                n = 0;
+            }
+            memset(page + n, 0, EXFAT_PAGE_SIZE - n);
+        }
+
+        block_run(vol->dev);
+        for (int i = 0; i < queued; i++) {
+            if (!block_wait(vol->dev, &reqs[i])) {
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+// The page at index of the file in the device's own memory, if the device
+// has it there and the page lies inside one extent and below
+// ValidDataLength. Writes to the file go to the same memory, so the
+// pointer stays good as long as the file keeps its clusters.
+void *exfat_direct_page(exfat_file_t *file, uint32_t index) {
+    exfat_volume_t *vol = file->vol;
+    uint32_t dev_sector = vol->dev->sector_size;
+    uint64_t pos = (uint64_t)index * EXFAT_PAGE_SIZE;
+    uint32_t in_cluster = pos & (vol->cluster_size - 1);
+    uint32_t disk_cluster, run;
+
+    if (pos + EXFAT_PAGE_SIZE > file->valid_size || dev_sector > EXFAT_PAGE_SIZE ||
+        !exfat_map(file, pos >> vol->cluster_shift, &disk_cluster, &run) ||
+        ((uint64_t)run << vol->cluster_shift) - in_cluster < EXFAT_PAGE_SIZE) {
+        return NULL;
+    }
+    uint64_t disk_pos = (exfat_cluster_sector(vol, disk_cluster) << vol->sector_shift) + in_cluster;
+    return block_direct_access(vol->dev, vol->part_lba + disk_pos / dev_sector, EXFAT_PAGE_SIZE / dev_sector);
+}
+
+// Directories ===========================================================
+
+static uint16_t exfat_upcase(exfat_volume_t *vol, uint16_t c) {
+    if (!vol->have_upcase) {
+        return (c >= 'a' && c <= 'z') ? c - 32 : c;
+    }
+    uint16_t *page = vol->upcase[c >> 11];
+    return page ? page[c & 2047] : c;
+}
+
+static uint16_t exfat_name_hash(exfat_volume_t *vol, const uint16_t *name, int len) {
+    uint16_t hash = 0;
+    for (int i = 0; i < len; i++) {
+        uint16_t c = exfat_upcase(vol, name[i]);
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c & 0xFF);
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c >> 8);
+    }
+    return hash;
+}
+
+static uint16_t exfat_set_checksum(const uint8_t *set, int count) {
+    uint16_t sum = 0;
+    for (int i = 0; i < count * EXFAT_ENTRY_SIZE; i++) {
+        if (i == 2 || i == 3) {
+            continue;   // The checksum itself
+        }
+        sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + set[i];
+    }
+    return sum;
+}
+
+// Pointer to directory entry index, through the one page directory cache
+static uint8_t *exfat_dir_entry(exfat_file_t *dir, uint32_t index) {
+    exfat_volume_t *vol = dir->vol;
+    uint64_t offset = (uint64_t)index * EXFAT_ENTRY_SIZE;
+    if (offset >= dir->size) {
+        return NULL;
+    }
+
+    uint32_t base = offset & ~(uint64_t)(EXFAT_PAGE_SIZE - 1);
+    if (vol->dir_buf_cluster != dir->first_cluster || vol->dir_buf_offset != base) {
+        uint32_t len = dir->size - base < EXFAT_PAGE_SIZE ? dir->size - base : EXFAT_PAGE_SIZE;
+        vol->dir_buf_cluster = 0;
+        if (exfat_read(dir, base, vol->dir_buf, len) != (int)len) {
+            return NULL;
+        }
+        vol->dir_buf_cluster = dir->first_cluster;
+        vol->dir_buf_offset = base;
+    }
+    return vol->dir_buf + (offset - base);
+}
+
+static int exfat_utf16_to_utf8(const uint16_t *in, int len, char *out) {
+    int o = 0;
+    for (int i = 0; i < len; i++) {
+        uint32_t c = in[i];
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < len && in[i + 1] >= 0xDC00 && in[i + 1] < 0xE000) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (in[++i] - 0xDC00);
+        }
+        if (c < 0x80) {
+            out[o++] = c;
+        } else if (c < 0x800) {
+            out[o++] = 0xC0 | (c >> 6);
+            out[o++] = 0x80 | (c & 0x3F);
+        } else if (c < 0x10000) {
+            out[o++] = 0xE0 | (c >> 12);
+            out[o++] = 0x80 | ((c >> 6) & 0x3F);
+            out[o++] = 0x80 | (c & 0x3F);
+        } else {
+            out[o++] = 0xF0 | (c >> 18);
+            out[o++] = 0x80 | ((c >> 12) & 0x3F);
+            out[o++] = 0x80 | ((c >> 6) & 0x3F);
+            out[o++] = 0x80 | (c & 0x3F);
+        }
+    }
+    out[o] = '\0';
+    return o;
+}
+
+// Decode a UTF-8 name (up to a '/' or the end), returns its UTF-16 length or -1
+static int exfat_utf8_to_utf16(const char *in, uint16_t *out, int max) {
+    const uint8_t *s = (const uint8_t *)in;
+    int o = 0;
+    while (*s && *s != '/') {
+        uint32_t c;
+        if (*s < 0x80) {
+            c = *s++;
+        } else if ((*s & 0xE0) == 0xC0 && s[1]) {
+            c = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+            s += 2;
+        } else if ((*s & 0xF0) == 0xE0 && s[1] && s[2]) {
+            c = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+            s += 3;
+        } else if ((*s & 0xF8) == 0xF0 && s[1] && s[2] && s[3]) {
+            c = ((s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+            s += 4;
+        } else {
+            return -1;
+        }
+
+        if (c >= 0x10000) {
+            if (o + 2 > max) return -1;
+            c -= 0x10000;
+            out[o++] = 0xD800 + (c >> 10);
+            out[o++] = 0xDC00 + (c & 0x3FF);
+        } else {
+            if (o + 1 > max) return -1;
+            out[o++] = c;
+        }
+    }
+    return o;
+}
+
+// Read the next file entry set at or after *pos. name gets the raw UTF-16 name.
+static bool exfat_next_set(exfat_file_t *dir, uint32_t *pos, exfat_dirent_t *out, uint16_t *name, int *name_len) {
+    uint8_t set[EXFAT_MAX_SET * EXFAT_ENTRY_SIZE];
+
+    for (;;) {
+        uint8_t *e = exfat_dir_entry(dir, *pos);
+        if (e == NULL || e[0] == EXFAT_ENTRY_END) {
+            return false;
+        }
+        if (e[0] != EXFAT_ENTRY_FILE || e[1] < 2 || e[1] >= EXFAT_MAX_SET) {
+            (*pos)++;
+            continue;
+        }
+
+        // Copy the set out, it may cross a page of the directory cache
+        int count = e[1] + 1;
+        uint32_t start = *pos;
+        bool ok = true;
+        for (int i = 0; i < count; i++) {
+            uint8_t *entry = exfat_dir_entry(dir, start + i);
+            if (entry == NULL) {
+                return false;
+            }
+            memcpy(set + i * EXFAT_ENTRY_SIZE, entry, EXFAT_ENTRY_SIZE);
+        }
+        *pos = start + 1;
+
+        uint8_t *stream = set + EXFAT_ENTRY_SIZE;
+        if (stream[0] != EXFAT_ENTRY_STREAM || *(uint16_t *)(set + 2) != exfat_set_checksum(set, count)) {
+            continue;       // Broken or half written set, skip just the file entry
+        }
+
+        int len = stream[3];
+        if (len == 0 || (len + 14) / 15 > count - 2) {
+            continue;
+        }
+        for (int i = 0; i < len && ok; i++) {
+            uint8_t *n = set + (2 + i / 15) * EXFAT_ENTRY_SIZE;
+            if (n[0] != EXFAT_ENTRY_NAME) {
+                ok = false;
+            } else {
+                name[i] = *(uint16_t *)(n + 2 + (i % 15) * 2);
+            }
+        }
+        if (!ok) {
+            continue;
+        }
+
+        *name_len = len;
+        out->attributes = *(uint16_t *)(set + 4);
+        out->flags = stream[1];
+        out->name_hash = *(uint16_t *)(stream + 4);
+        out->valid_size = *(uint64_t *)(stream + 8);
+        out->first_cluster = *(uint32_t *)(stream + 20);
+        out->size = *(uint64_t *)(stream + 24);
+        out->entry = start;
+        out->entry_count = count;
+        *pos = start + count;
+        return true;
+    }
+}
+
+// Next entry of dir, starting from *pos (0 for the first one)
+bool exfat_readdir(exfat_file_t *dir, uint32_t *pos, exfat_dirent_t *out) {
+    uint16_t name[EXFAT_NAME_MAX];
+    int len;
+    if (!exfat_next_set(dir, pos, out, name, &len)) {
+        return false;
+    }
+    exfat_utf16_to_utf8(name, len, out->name);
+    return true;
+}
+
+// Find name in dir, case insensitively as exFAT requires
+bool exfat_lookup(exfat_file_t *dir, const char *name, exfat_dirent_t *out) {
+    exfat_volume_t *vol = dir->vol;
+    uint16_t want[EXFAT_NAME_MAX], have[EXFAT_NAME_MAX];
+    int want_len = exfat_utf8_to_utf16(name, want, EXFAT_NAME_MAX);
+    if (want_len <= 0) {
+        return false;
+    }
+    uint16_t hash = exfat_name_hash(vol, want, want_len);
+
+    uint32_t pos = 0;
+    int have_len;
+    while (exfat_next_set(dir, &pos, out, have, &have_len)) {
+        if (out->name_hash != hash || have_len != want_len) {
+            continue;
+        }
+        int i = 0;
+        while (i < want_len && exfat_upcase(vol, have[i]) == exfat_upcase(vol, want[i])) {
+            i++;
+        }
+        if (i == want_len) {
+            exfat_utf16_to_utf8(have, have_len, out->name);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Opening files =========================================================
+
+static void exfat_file_init(exfat_volume_t *vol, exfat_file_t *file) {
+    memset(file, 0, sizeof(exfat_file_t));
+    file->vol = vol;
+}
+
+bool exfat_open_root(exfat_volume_t *vol, exfat_file_t *file) {
+    exfat_file_init(vol, file);
+    file->attributes = EXFAT_ATTR_DIRECTORY;
+    file->first_cluster = vol->root_cluster;
+    file->size = (uint64_t)vol->cluster_count << vol->cluster_shift;   // Until the chain says otherwise
+    if (!exfat_load_chain(file)) {
+        exfat_close(file);
+        return false;
+    }
+
+    // The root directory has no stream extension, its size is its chain
+    uint32_t clusters = 0;
+    for (uint32_t i = 0; i < file->extent_count; i++) {
+        clusters += exfat_extent(file, i)->length;
+    }
+    if (!file->chain_complete) {
+        printk("exFAT: root directory is too fragmented\n");
+    }
+    file->size = (uint64_t)clusters << vol->cluster_shift;
+    file->valid_size = file->size;
+    return true;
+}
+
+static void exfat_file_from_dirent(exfat_file_t *dir, exfat_dirent_t *d, exfat_file_t *file) {
+    exfat_file_init(dir->vol, file);
+    file->attributes = d->attributes;
+    file->flags = d->flags;
+    file->first_cluster = d->first_cluster;
+    file->size = d->size;
+    file->valid_size = d->valid_size < d->size ? d->valid_size : d->size;
+    file->dir_cluster = dir->first_cluster;
+    file->dir_flags = dir->flags;
+    file->dir_size = dir->size;
+    file->dir_entry = d->entry;
+    file->entry_count = d->entry_count;
+}
+
+// Open the entry name (up to a '/') of directory dir
+bool exfat_open_at(exfat_file_t *dir, const char *name, exfat_file_t *file) {
+    exfat_dirent_t d;
+    if (!(dir->attributes & EXFAT_ATTR_DIRECTORY) || !exfat_lookup(dir, name, &d)) {
+        return false;
+    }
+    exfat_file_from_dirent(dir, &d, file);
+    return true;
+}
+
+// Open an absolute path, "/" is the root directory
+bool exfat_open(exfat_volume_t *vol, const char *path, exfat_file_t *file) {
+    exfat_file_t dir;
+
+    if (!exfat_open_root(vol, &dir)) {
+        return false;
+    }
+    while (*path == '/') {
+        path++;
+    }
+
+    while (*path) {
+        exfat_file_t next;
+        if (!exfat_open_at(&dir, path, &next)) {
+            exfat_close(&dir);
+            return false;
+        }
+        exfat_close(&dir);
+        dir = next;
+
+        while (*path && *path != '/') {
+            path++;
+        }
+        while (*path == '/') {
+            path++;
+        }
+    }
+
+    *file = dir;
+    return true;
+}
+
+// Give back the file's reservation window, it is done growing for now
+void exfat_release(exfat_file_t *file) {
+    if (file->reservation) {
+        file->vol->reservations[file->reservation - 1].in_use = false;
+        file->reservation = 0;
+    }
+}
+
+void exfat_close(exfat_file_t *file) {
+    exfat_release(file);
+    if (file->extents) {
+        free_page(file->extents);
+        file->extents = NULL;
+    }
+    file->chain_loaded = false;
+}
+
+// Allocation ============================================================
+
+// Number of available clusters starting at cluster, up to max
+static uint32_t exfat_run_at(exfat_volume_t *vol, uint32_t cluster, uint32_t max, int own) {
+    uint32_t n = 0;
+    while (n < max && exfat_valid_cluster(vol, cluster + n) && exfat_cluster_available(vol, cluster + n, own)) {
+        n++;
+    }
+    return n;
+}
+
+// Find clusters for want more clusters of a file, searching from the hint.
+// The first run with room for want plus a reservation window wins, then the
+// first run of want, and only if there is none the longest run there is.
+static bool exfat_find_run(exfat_volume_t *vol, uint32_t want, int own, uint32_t *start, uint32_t *len) {
+    uint32_t goal = want + EXFAT_RESERVE_CLUSTERS;
+    uint32_t fit_start = 0, best_start = 0, best_len = 0;
+    uint32_t run_start = 0, run_len = 0;
+    uint32_t hint = exfat_valid_cluster(vol, vol->alloc_hint) ? vol->alloc_hint : EXFAT_FIRST_CLUSTER;
+
+    for (uint32_t i = 0; i <= vol->cluster_count; i++) {
+        uint32_t cluster = EXFAT_FIRST_CLUSTER + (hint - EXFAT_FIRST_CLUSTER + i) % vol->cluster_count;
+        bool wrapped = i > 0 && cluster == EXFAT_FIRST_CLUSTER;
+        bool free = i < vol->cluster_count && !wrapped && exfat_cluster_available(vol, cluster, own);
+
+        if (free) {
+            if (run_len == 0) {
+                run_start = cluster;
+            }
+            if (++run_len >= goal) {
+                break;
+            }
+            continue;
+        }
+
+        if (run_len >= want && fit_start == 0) {
+            fit_start = run_start;
+        }
+        if (run_len > best_len) {
+            best_start = run_start;
+            best_len = run_len;
+        }
+        run_len = 0;
+        if (wrapped && exfat_cluster_available(vol, cluster, own)) {
+            run_start = cluster;
+            run_len = 1;
+        }
+    }
+
+    if (run_len >= goal) {
+        *start = run_start;
+        *len = want;
+    } else if (fit_start) {
+        *start = fit_start;
+        *len = want;
+    } else if (best_len) {
+        *start = best_start;
+        *len = best_len;
+    } else {
+        return false;
+    }
+    vol->alloc_hint = *start + *len;
+    return true;
+}
+
+// Hold back the free clusters behind end for the file's next extension
+static void exfat_reserve_after(exfat_file_t *file, uint32_t end) {
+    exfat_volume_t *vol = file->vol;
+    if (file->reservation == 0) {
+        for (int i = 0; i < EXFAT_MAX_RESERVATIONS; i++) {
+            if (!vol->reservations[i].in_use) {
+                vol->reservations[i].in_use = true;
+                file->reservation = i + 1;
+                break;
+            }
+        }
+        if (file->reservation == 0) {
+            return;     // All windows taken, growing in place still works when it can
+        }
+    }
+    exfat_reservation_t *r = &vol->reservations[file->reservation - 1];
+    r->start = end;
+    r->length = exfat_run_at(vol, end, EXFAT_RESERVE_CLUSTERS, file->reservation);
+}
+
+static uint32_t exfat_file_clusters(exfat_file_t *file) {
+    if (file->extent_count == 0) {
+        return 0;
+    }
+    exfat_extent_t *last = exfat_extent(file, file->extent_count - 1);
+    return last->file_cluster + last->length;
+}
+
+// Write a FAT chain for a file that so far relied on NoFatChain
+static bool exfat_to_fat_chain(exfat_file_t *file) {
+    exfat_extent_t *e = exfat_extent(file, 0);
+    for (uint32_t i = 0; i < e->length; i++) {
+        uint32_t next = i + 1 < e->length ? e->disk_cluster + i + 1 : EXFAT_END_OF_CHAIN;
+        if (!exfat_fat_set(file->vol, e->disk_cluster + i, next)) {
+            return false;
+        }
+    }
+    file->flags &= ~EXFAT_FLAG_NO_FAT_CHAIN;
+    return true;
+}
+
+// Give the file at least clusters clusters. Extends the last extent in place
+// whenever the clusters behind it are free, so a file stays NoFatChain for as
+// long as possible.
+static bool exfat_grow(exfat_file_t *file, uint32_t clusters) {
+    exfat_volume_t *vol = file->vol;
+
+    if (!exfat_load_chain(file)) {
+        return false;
+    }
+    if (!file->chain_complete) {
+        printk("exFAT: file is too fragmented to extend\n");
+        return false;
+    }
+
+    uint32_t have = exfat_file_clusters(file);
+    while (have < clusters) {
+        uint32_t need = clusters - have;
+        exfat_extent_t *last = file->extent_count ? exfat_extent(file, file->extent_count - 1) : NULL;
+        uint32_t start = 0, n = 0;
+
+        if (last) {
+            start = last->disk_cluster + last->length;
+            n = exfat_run_at(vol, start, need, file->reservation);
+        }
+        if (n == 0) {
+            if (!exfat_find_run(vol, need, file->reservation, &start, &n)) {
+                printk("exFAT: volume is full\n");
+                return false;
+            }
+            if (last && (file->flags & EXFAT_FLAG_NO_FAT_CHAIN) && !exfat_to_fat_chain(file)) {
+                return false;
+            }
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            exfat_bitmap_set(vol, start + i, true);
+        }
+
+        if (last == NULL) {
+            file->first_cluster = start;
+            file->flags |= EXFAT_FLAG_ALLOC_POSSIBLE | EXFAT_FLAG_NO_FAT_CHAIN;
+        }
+        if (!(file->flags & EXFAT_FLAG_NO_FAT_CHAIN)) {
+            if (last && !exfat_fat_set(vol, last->disk_cluster + last->length - 1, start)) {
+                return false;
+            }
+            for (uint32_t i = 0; i < n; i++) {
+                if (!exfat_fat_set(vol, start + i, i + 1 < n ? start + i + 1 : EXFAT_END_OF_CHAIN)) {
+                    return false;
+                }
+            }
+        }
+
+        // Record the clusters as an extent
+        if (last && last->disk_cluster + last->length == start) {
+            last->length += n;
+        } else {
+            if (file->extent_count == 1 && file->extents == NULL) {
+                file->extents = alloc_page();
+                if (file->extents == NULL) {
+                    return false;
+                }
+                file->extents[0] = file->inline_extent;
+            }
+            if (file->extent_count >= EXFAT_EXTENTS_PER_PAGE) {
+                printk("exFAT: file is too fragmented to extend\n");
+                return false;
+            }
+            exfat_extent_t *e = exfat_extent(file, file->extent_count++);
+            e->file_cluster = have;
+            e->disk_cluster = start;
+            e->length = n;
+        }
+
+        have += n;
+        exfat_reserve_after(file, start + n);
+    }
+    return true;
+}
+
+// Give back every cluster past the first clusters ones
+static bool exfat_shrink(exfat_file_t *file, uint32_t clusters) {
+    exfat_volume_t *vol = file->vol;
+
+    if (!exfat_load_chain(file)) {
+        return false;
+    }
+    if (!file->chain_complete) {
+        printk("exFAT: file is too fragmented to truncate\n");
+        return false;
+    }
+
+    while (file->extent_count > 0) {
+        exfat_extent_t *e = exfat_extent(file, file->extent_count - 1);
+        if (e->file_cluster + e->length <= clusters) {
+            break;
+        }
+        uint32_t keep = e->file_cluster < clusters ? clusters - e->file_cluster : 0;
+        for (uint32_t i = keep; i < e->length; i++) {
+            exfat_bitmap_set(vol, e->disk_cluster + i, false);
+        }
+        e->length = keep;
+        if (keep) {
+            break;
+        }
+        file->extent_count--;
+    }
+
+    if (file->extent_count == 0) {
+        file->first_cluster = 0;
+        file->flags &= ~EXFAT_FLAG_NO_FAT_CHAIN;
+    } else if (!(file->flags & EXFAT_FLAG_NO_FAT_CHAIN)) {
+        exfat_extent_t *e = exfat_extent(file, file->extent_count - 1);
+        if (!exfat_fat_set(vol, e->disk_cluster + e->length - 1, EXFAT_END_OF_CHAIN)) {
+            return false;
+        }
+    }
+    exfat_release(file);
+    return true;
+}
+
+// Transactions ==========================================================
+
+static bool exfat_set_volume_flags(exfat_volume_t *vol, uint16_t flags) {
+    uint8_t percent = vol->cluster_count ? (uint64_t)(vol->cluster_count - vol->free_clusters) * 100 / vol->cluster_count : 0;
+    return exfat_io_bytes(vol, 106, (uint8_t *)&flags, 2, true) &&
+           exfat_io_bytes(vol, 112, &percent, 1, true);
+}
+
+// Start modifying the volume: the first change after a sync sets VolumeDirty
+static bool exfat_begin(exfat_volume_t *vol) {
+    if (vol->read_only) {
+        printk("%s: volume is read-only\n", vol->dev->name);
+        return false;
+    }
+    if (!vol->dirty) {
+        if (!exfat_set_volume_flags(vol, vol->volume_flags | EXFAT_VOLUME_DIRTY)) {
+            return false;
+        }
+        vol->dirty = true;
+    }
+    return true;
+}
+
+// Write out the FAT and bitmap sectors the transaction dirtied, runs of
+// neighbouring bitmap sectors as one request
+static bool exfat_end(exfat_volume_t *vol) {
+    bool ok = true;
+
+    for (int slot = 0; slot < exfat_fat_slots(vol); slot++) {
+        ok = exfat_fat_flush_slot(vol, slot) && ok;
+    }
+
+    uint32_t per_page = EXFAT_PAGE_SIZE / vol->sector_size;
+    uint64_t bitmap_sector = exfat_cluster_sector(vol, vol->bitmap_cluster);
+    for (int p = 0; p < EXFAT_BITMAP_PAGES; p++) {
+        uint32_t k = 0;
+        while (vol->bitmap_dirty[p] && k < per_page) {
+            if (!(vol->bitmap_dirty[p] & (1 << k))) {
+                k++;
+                continue;
+            }
+            uint32_t n = 1;
+            while (k + n < per_page && (vol->bitmap_dirty[p] & (1 << (k + n)))) {
+                n++;
+            }
+            ok = exfat_write_sectors(vol, bitmap_sector + p * per_page + k, n,
+                                     vol->bitmap[p] + k * vol->sector_size) && ok;
+            for (uint32_t i = 0; i < n; i++) {
+                vol->bitmap_dirty[p] &= ~(1 << (k + i));
+            }
+            k += n;
+        }
+    }
+    return ok;
+}
+
+// Everything on disk, then clear VolumeDirty
+bool exfat_sync(exfat_volume_t *vol) {
+    if (!vol->dirty) {
+        return true;
+    }
+    if (!exfat_end(vol) || !block_flush(vol->dev)) {
+        return false;
+    }
+    if (!exfat_set_volume_flags(vol, vol->volume_flags & ~EXFAT_VOLUME_DIRTY) || !block_flush(vol->dev)) {
+        return false;
+    }
+    vol->dirty = false;
+    return true;
+}
+
+// Writing ===============================================================
+
+static bool exfat_open_parent(exfat_file_t *file, exfat_file_t *dir) {
+    exfat_volume_t *vol = file->vol;
+    if (file->dir_cluster == vol->root_cluster) {
+        return exfat_open_root(vol, dir);
+    }
+    exfat_file_init(vol, dir);
+    dir->attributes = EXFAT_ATTR_DIRECTORY;
+    dir->first_cluster = file->dir_cluster;
+    dir->flags = file->dir_flags;
+    dir->size = file->dir_size;
+    dir->valid_size = file->dir_size;
+    return true;
+}
+
+// Rewrite the stream extension of the file's entry set from the in-memory
+// state and fix up the set checksum. With clear_in_use the set is deleted.
+static bool exfat_store_entry(exfat_file_t *file, bool clear_in_use) {
+    uint8_t set[EXFAT_MAX_SET * EXFAT_ENTRY_SIZE];
+    uint32_t len = file->entry_count * EXFAT_ENTRY_SIZE;
+    exfat_file_t dir;
+
+    if (file->entry_count < 2 || file->entry_count > EXFAT_MAX_SET || !exfat_open_parent(file, &dir)) {
+        return false;
+    }
+    bool ok = exfat_io_mapped(&dir, (uint64_t)file->dir_entry * EXFAT_ENTRY_SIZE, set, len, false);
+    if (ok && (set[0] != EXFAT_ENTRY_FILE || set[EXFAT_ENTRY_SIZE] != EXFAT_ENTRY_STREAM)) {
+        printk("exFAT: directory entry set moved\n");
+        ok = false;
+    }
+
+    if (ok) {
+        uint8_t *stream = set + EXFAT_ENTRY_SIZE;
+        *(uint16_t *)(set + 4) = file->attributes;
+        stream[1] = file->flags;
+        *(uint64_t *)(stream + 8) = file->valid_size;
+        *(uint32_t *)(stream + 20) = file->first_cluster;
+        *(uint64_t *)(stream + 24) = file->size;
+        *(uint16_t *)(set + 2) = exfat_set_checksum(set, file->entry_count);
+        if (clear_in_use) {
+            for (int i = 0; i < file->entry_count; i++) {
+                set[i * EXFAT_ENTRY_SIZE] &= ~EXFAT_ENTRY_IN_USE;
+            }
+        }
+        ok = exfat_io_mapped(&dir, (uint64_t)file->dir_entry * EXFAT_ENTRY_SIZE, set, len, true);
+    }
+    exfat_close(&dir);
+    return ok;
+}
+
+// Write zeroes over [offset, offset + len) of the file's clusters
+static bool exfat_zero(exfat_file_t *file, uint64_t offset, uint64_t len) {
+    uint8_t *zero = alloc_page();
+    bool ok = zero != NULL;
+    if (ok) {
+        memset(zero, 0, EXFAT_PAGE_SIZE);
+    }
+    while (ok && len > 0) {
+        uint32_t n = len < EXFAT_PAGE_SIZE ? len : EXFAT_PAGE_SIZE;
+        ok = exfat_io_mapped(file, offset, zero, n, true);
+        offset += n;
+        len -= n;
+    }
+    if (zero) {
+        free_page(zero);
+    }
+    return ok;
+}
+
+// Write len bytes at offset, growing the file as needed. Returns len or -1.
+int exfat_write(exfat_file_t *file, uint64_t offset, const void *buf, uint32_t len) {
+    exfat_volume_t *vol = file->vol;
+    uint64_t end = offset + len;
+
+    if (file->attributes & EXFAT_ATTR_DIRECTORY) {
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (!exfat_begin(vol)) {
+        return -1;
+    }
+
+    bool ok = true;
+    if (end > file->size) {
+        ok = exfat_grow(file, exfat_cluster_count_for(vol, end));
+        if (ok) {
+            file->size = end;
+        }
+    }
+    // Whatever lies between the old end of valid data and offset becomes valid, so it must read as zero
+    if (ok && offset > file->valid_size) {
+        ok = exfat_zero(file, file->valid_size, offset - file->valid_size);
+    }
+    ok = ok && exfat_io_mapped(file, offset, (uint8_t *)buf, len, true);
+    if (ok && end > file->valid_size) {
+        file->valid_size = end;
+    }
+
+    ok = exfat_end(vol) && ok;
+    ok = ok && exfat_store_entry(file, false);
+    return ok ? (int)len : -1;
+}
+
+// Set the file's size. Growing allocates clusters that read as zero.
+bool exfat_truncate(exfat_file_t *file, uint64_t size) {
+    exfat_volume_t *vol = file->vol;
+
+    if (file->attributes & EXFAT_ATTR_DIRECTORY) {
+        return false;
+    }
+    if (!exfat_begin(vol)) {
+        return false;
+    }
+
+    uint32_t clusters = exfat_cluster_count_for(vol, size);
+    bool ok = size < file->size ? exfat_shrink(file, clusters) : exfat_grow(file, clusters);
+    if (ok) {
+        file->size = size;
+        if (file->valid_size > size) {
+            file->valid_size = size;
+        }
+    }
+
+    ok = exfat_end(vol) && ok;
+    return ok && exfat_store_entry(file, false);
+}
+
+// Find count consecutive unused entries in dir, adding a cluster if needed
+static bool exfat_find_free_entries(exfat_file_t *dir, int count, uint32_t *index) {
+    exfat_volume_t *vol = dir->vol;
+    uint32_t total = dir->size / EXFAT_ENTRY_SIZE;
+    uint32_t run = 0;
+
+    for (uint32_t i = 0; i < total; i++) {
+        uint8_t *e = exfat_dir_entry(dir, i);
+        if (e == NULL) {
+            return false;
+        }
+        if (e[0] == EXFAT_ENTRY_END) {
+            // Everything from here on is unused
+            if (total - i + run >= (uint32_t)count) {
+                *index = i - run;
+                return true;
+            }
+            break;
+        }
+        run = (e[0] & EXFAT_ENTRY_IN_USE) ? 0 : run + 1;
+        if (run == (uint32_t)count) {
+            *index = i + 1 - run;
+            return true;
+        }
+    }
+
+    // Directory is full, append a zeroed (all END entries) cluster
+    uint64_t old_size = dir->size;
+    if (!exfat_grow(dir, exfat_file_clusters(dir) + 1)) {
+        return false;
+    }
+    exfat_release(dir);
+    dir->size += vol->cluster_size;
+    dir->valid_size = dir->size;
+    if (!exfat_zero(dir, old_size, vol->cluster_size)) {
+        return false;
+    }
+    if (dir->first_cluster != vol->root_cluster && !exfat_store_entry(dir, false)) {
+        return false;
+    }
+    return exfat_find_free_entries(dir, count, index);
+}
+
+static bool exfat_valid_name(const uint16_t *name, int len) {
+    if (len <= 0 || len > EXFAT_NAME_MAX) {
+        return false;
+    }
+    for (int i = 0; i < len; i++) {
+        uint16_t c = name[i];
+        if (c < 0x20 || c == '"' || c == '*' || c == '/' || c == ':' || c == '<' ||
+            c == '>' || c == '?' || c == '\\' || c == '|') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Create name in the open directory dir: an empty file, or a directory with
+// one cluster of END entries. dir is updated if it has to grow.
+bool exfat_create_at(exfat_file_t *dir, const char *name, bool directory, exfat_file_t *file) {
+    exfat_volume_t *vol = dir->vol;
+    uint16_t name16[EXFAT_NAME_MAX];
+    uint8_t set[EXFAT_MAX_SET * EXFAT_ENTRY_SIZE];
+    exfat_dirent_t d;
+
+    int len = exfat_utf8_to_utf16(name, name16, EXFAT_NAME_MAX);
+    if (!exfat_valid_name(name16, len)) {
+        printk("exFAT: invalid name '%s'\n", name);
+        return false;
+    }
+    if (!(dir->attributes & EXFAT_ATTR_DIRECTORY)) {
+        return false;
+    }
+    if (exfat_lookup(dir, name, &d)) {
+        printk("exFAT: '%s' already exists\n", name);
+        return false;
+    }
+    if (!exfat_begin(vol)) {
+        return false;
+    }
+
+    int count = 2 + (len + 14) / 15;
+    uint32_t index = 0;
+    bool ok = exfat_find_free_entries(dir, count, &index);
+
+    // A new directory gets its first cluster before the entry points at it
+    memset(&d, 0, sizeof(d));
+    d.attributes = directory ? EXFAT_ATTR_DIRECTORY : EXFAT_ATTR_ARCHIVE;
+    d.flags = EXFAT_FLAG_ALLOC_POSSIBLE;
+    d.entry = index;
+    d.entry_count = count;
+    exfat_file_from_dirent(dir, &d, file);
+    if (ok && directory) {
+        ok = exfat_grow(file, 1) && exfat_zero(file, 0, vol->cluster_size);
+        exfat_release(file);
+        file->size = vol->cluster_size;
+        file->valid_size = file->size;
+    }
+
+    if (ok) {
+        memset(set, 0, sizeof(set));
+        set[0] = EXFAT_ENTRY_FILE;
+        set[1] = count - 1;
+        *(uint16_t *)(set + 4) = file->attributes;
+        for (int t = 8; t < 20; t += 4) {
+            *(uint32_t *)(set + t) = EXFAT_TIMESTAMP_EPOCH;     // Created, modified, accessed
+        }
+        uint8_t *stream = set + EXFAT_ENTRY_SIZE;
+        stream[0] = EXFAT_ENTRY_STREAM;
+        stream[1] = file->flags;
+        stream[3] = len;
+        *(uint16_t *)(stream + 4) = exfat_name_hash(vol, name16, len);
+        *(uint64_t *)(stream + 8) = file->valid_size;
+        *(uint32_t *)(stream + 20) = file->first_cluster;
+        *(uint64_t *)(stream + 24) = file->size;
+        for (int i = 0; i < len; i++) {
+            uint8_t *n = set + (2 + i / 15) * EXFAT_ENTRY_SIZE;
+            n[0] = EXFAT_ENTRY_NAME;
+            *(uint16_t *)(n + 2 + (i % 15) * 2) = name16[i];
+        }
+        for (int i = 2; i < count; i++) {
+            set[i * EXFAT_ENTRY_SIZE] = EXFAT_ENTRY_NAME;
+        }
+        *(uint16_t *)(set + 2) = exfat_set_checksum(set, count);
+    }
+
+    // Bitmap and FAT first, then the entry set that makes the file visible
+    ok = exfat_end(vol) && ok;
+    ok = ok && exfat_io_mapped(dir, (uint64_t)index * EXFAT_ENTRY_SIZE, set, count * EXFAT_ENTRY_SIZE, true);
+    file->dir_size = dir->size;
+    if (!ok) {
+        exfat_close(file);
+    }
+    return ok;
+}
+
+// Create the file or directory at path
+bool exfat_create(exfat_volume_t *vol, const char *path, bool directory, exfat_file_t *file) {
+    char parent_path[256];
+    exfat_file_t dir;
+
+    const char *slash = NULL;
+    for (const char *p = path; *p; p++) {
+        if (*p == '/') {
+            slash = p;
+        }
+    }
+    size_t parent_len = slash ? (size_t)(slash - path) : 0;
+    if (parent_len >= sizeof(parent_path)) {
+        return false;
+    }
+    memcpy(parent_path, path, parent_len);
+    parent_path[parent_len] = '\0';
+
+    if (!exfat_open(vol, parent_path, &dir)) {
+        return false;
+    }
+    bool ok = exfat_create_at(&dir, slash ? slash + 1 : path, directory, file);
+    exfat_close(&dir);
+    return ok;
+}
+
+// Delete an open file or empty directory. The handle stays open, with no
+// clusters, until it is closed.
+bool exfat_remove(exfat_file_t *file) {
+    exfat_dirent_t d;
+    uint32_t pos = 0;
+
+    if (file->entry_count == 0 || ((file->attributes & EXFAT_ATTR_DIRECTORY) && exfat_readdir(file, &pos, &d))) {
+        return false;       // The root directory, or not empty
+    }
+    if (!exfat_begin(file->vol)) {
+        return false;
+    }
+
+    // Entry set first, so a crash leaks clusters instead of cross-linking them
+    bool ok = exfat_store_entry(file, true) && exfat_shrink(file, 0);
+    ok = exfat_end(file->vol) && ok;
+    if (ok) {
+        file->size = 0;
+        file->valid_size = 0;
+    }
+    return ok;
+}
+
+// Delete a file or an empty directory
+bool exfat_unlink(exfat_volume_t *vol, const char *path) {
+    exfat_file_t file;
+
+    if (!exfat_open(vol, path, &file)) {
+        return false;
+    }
+    bool ok = exfat_remove(&file);
+    exfat_close(&file);
+    return ok;
+}
+
+// Mounting ==============================================================
+
+// Read a whole metadata file (up-case table, bitmap) a page at a time
+static bool exfat_load_meta(exfat_volume_t *vol, uint32_t cluster, uint64_t size,
+                            bool (*fn)(exfat_volume_t *vol, const uint8_t *data, uint32_t len, uint64_t offset, void *ctx),
+                            void *ctx) {
+    exfat_file_t file;
+    exfat_file_init(vol, &file);
+    file.first_cluster = cluster;
+    file.size = size;
+    file.valid_size = size;
+
+    uint8_t *page = alloc_page();
+    if (page == NULL) {
+        return false;
+    }
+    bool ok = true;
+    for (uint64_t off = 0; off < size && ok; off += EXFAT_PAGE_SIZE) {
+        uint32_t len = size - off < EXFAT_PAGE_SIZE ? size - off : EXFAT_PAGE_SIZE;
+        ok = exfat_read(&file, off, page, len) == (int)len && fn(vol, page, len, off, ctx);
+    }
+    free_page(page);
+    exfat_close(&file);
+    return ok;
+}
+
+typedef struct {
+    uint32_t checksum;
+    uint32_t next_char;
+    bool run;           // Previous value was 0xFFFF, this one is a run length
+} exfat_upcase_ctx_t;
+
+static bool exfat_upcase_chunk(exfat_volume_t *vol, const uint8_t *data, uint32_t len, uint64_t offset, void *ctx) {
+    exfat_upcase_ctx_t *u = ctx;
+    (void)offset;
+
+    for (uint32_t i = 0; i < len; i++) {
+        u->checksum = ((u->checksum & 1) ? 0x80000000 : 0) + (u->checksum >> 1) + data[i];
+    }
+
+    // The table is compressed: 0xFFFF n means the next n characters map to themselves
+    for (uint32_t i = 0; i + 1 < len; i += 2) {
+        uint16_t value = data[i] | (data[i + 1] << 8);
+        if (u->run) {
+            u->next_char += value;
+            u->run = false;
+        } else if (value == 0xFFFF) {
+            u->run = true;
+        } else {
+            if (u->next_char < 0x10000 && value != u->next_char) {
+                uint16_t **page = &vol->upcase[u->next_char >> 11];
+                if (*page == NULL) {
+                    *page = alloc_page();
+                    if (*page == NULL) {
+                        return false;
+                    }
+                    for (int c = 0; c < 2048; c++) {
+                        (*page)[c] = (u->next_char & ~2047) + c;
+                    }
+                }
+                (*page)[u->next_char & 2047] = value;
+            }
+            u->next_char++;
+        }
+    }
+    return true;
+}
+
+// Count used clusters, and keep a copy of the bitmap when it fits in memory
+static bool exfat_bitmap_chunk(exfat_volume_t *vol, const uint8_t *data, uint32_t len, uint64_t offset, void *ctx) {
+    uint32_t *used = ctx;
+    if (!vol->read_only) {
+        memcpy(vol->bitmap[offset / EXFAT_PAGE_SIZE], data, len);
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        uint64_t first = (offset + i) * 8;
+        uint8_t byte = data[i];
+        if (first >= vol->cluster_count) {
+            break;
+        }
+        if (vol->cluster_count - first < 8) {
+            byte &= (1 << (vol->cluster_count - first)) - 1;   // Bits past the last cluster
+        }
+        while (byte) {
+            byte &= byte - 1;
+            (*used)++;
+        }
+    }
+    return true;
+}
+
+static bool exfat_bitmap_contiguous(exfat_volume_t *vol) {
+    exfat_file_t file;
+    exfat_file_init(vol, &file);
+    file.first_cluster = vol->bitmap_cluster;
+    file.size = vol->bitmap_length;
+    bool ok = exfat_load_chain(&file) && file.chain_complete && file.extent_count == 1 &&
+              exfat_extent(&file, 0)->length >= exfat_cluster_count_for(vol, vol->bitmap_length);
+    exfat_close(&file);
+    return ok;
+}
+
+// Find the boot sector, either at the start of dev or in an MBR partition
+static bool exfat_find_volume(exfat_volume_t *vol, exfat_boot_sector_t *boot) {
+    if (!block_read(vol->dev, 0, 1, boot)) {
+        return false;
+    }
+    if (memcmp(boot->fs_name, "EXFAT   ", 8) == 0) {
+        vol->part_lba = 0;
+        return true;
+    }
+    if (boot->signature != 0xAA55) {
+        return false;
+    }
+
+    uint8_t mbr[64];
+    memcpy(mbr, (uint8_t *)boot + 446, 64);
+    for (int i = 0; i < 4; i++) {
+        uint8_t *part = mbr + i * 16;
+        uint32_t start = *(uint32_t *)(part + 8);
+        if (part[4] != EXFAT_MBR_TYPE || start == 0) {
+            continue;
+        }
+        if (block_read(vol->dev, start, 1, boot) && memcmp(boot->fs_name, "EXFAT   ", 8) == 0) {
+            vol->part_lba = start;
+            return true;
+        }
+    }
+    return false;
+}
+
+exfat_volume_t *exfat_mount(block_device_t *dev) {
+    exfat_volume_t *vol = NULL;
+    for (int i = 0; i < EXFAT_MAX_VOLUMES; i++) {
+        if (!exfat_volumes[i].mounted) {
+            vol = &exfat_volumes[i];
+            break;
+        }
+    }
+    if (vol == NULL) {
+        printk("exFAT: too many mounted volumes\n");
+        return NULL;
+    }
+    memset(vol, 0, sizeof(exfat_volume_t));
+    vol->dev = dev;
+
+    vol->buf = alloc_page();
+    vol->dir_buf = alloc_page();
+    vol->fat_buf = alloc_page();
+    if (vol->buf == NULL || vol->dir_buf == NULL || vol->fat_buf == NULL || dev->sector_size > EXFAT_PAGE_SIZE) {
+        exfat_unmount(vol);
+        return NULL;
+    }
+
+    exfat_boot_sector_t *boot = (exfat_boot_sector_t *)vol->buf;
+    if (!exfat_find_volume(vol, boot)) {
+        printk("%s: no exFAT file system found\n", dev->name);
+        exfat_unmount(vol);
+        return NULL;
+    }
+
+    if (boot->bytes_per_sector_shift < 9 || boot->bytes_per_sector_shift > 12 ||
+        boot->sectors_per_cluster_shift > 25 - boot->bytes_per_sector_shift ||
+        (1u << boot->bytes_per_sector_shift) < dev->sector_size ||
+        boot->number_of_fats == 0 || boot->number_of_fats > 2) {
+        printk("%s: unsupported exFAT geometry\n", dev->name);
+        exfat_unmount(vol);
+        return NULL;
+    }
+
+    vol->sector_shift = boot->bytes_per_sector_shift;
+    vol->sector_size = 1 << vol->sector_shift;
+    vol->dev_per_sector = vol->sector_size / dev->sector_size;
+    vol->cluster_shift = vol->sector_shift + boot->sectors_per_cluster_shift;
+    vol->cluster_size = 1 << vol->cluster_shift;
+    vol->fat_offset = boot->fat_offset;
+    vol->fat_length = boot->fat_length;
+    if (boot->number_of_fats == 2 && (boot->volume_flags & 1)) {
+        vol->fat_offset += vol->fat_length;     // The second FAT is the active one
+    }
+    vol->heap_offset = boot->cluster_heap_offset;
+    vol->cluster_count = boot->cluster_count;
+    vol->root_cluster = boot->root_cluster;
+    bool second_bitmap = boot->number_of_fats == 2 && (boot->volume_flags & 1);
+    bool one_fat = boot->number_of_fats == 1;
+    vol->volume_flags = boot->volume_flags & ~EXFAT_VOLUME_DIRTY;
+    if (boot->volume_flags & EXFAT_VOLUME_DIRTY) {
+        printk("%s: volume was not cleanly unmounted\n", dev->name);
+    }
+
+    // The root directory holds the bitmap, up-case table and label entries
+    exfat_file_t root;
+    if (!exfat_open_root(vol, &root)) {
+        exfat_unmount(vol);
+        return NULL;
+    }
+    uint32_t upcase_cluster = 0, upcase_checksum = 0;
+    uint64_t upcase_length = 0;
+    uint8_t *e;
+    for (uint32_t i = 0; (e = exfat_dir_entry(&root, i)) != NULL && e[0] != EXFAT_ENTRY_END; i++) {
+        if (e[0] == EXFAT_ENTRY_BITMAP && (bool)(e[1] & 1) == second_bitmap) {
+            vol->bitmap_cluster = *(uint32_t *)(e + 20);
+            vol->bitmap_length = *(uint64_t *)(e + 24);
+        } else if (e[0] == EXFAT_ENTRY_UPCASE) {
+            upcase_checksum = *(uint32_t *)(e + 4);
+            upcase_cluster = *(uint32_t *)(e + 20);
+            upcase_length = *(uint64_t *)(e + 24);
+        } else if (e[0] == EXFAT_ENTRY_LABEL) {
+            vol->label_length = e[1] <= 11 ? e[1] : 11;
+            memcpy(vol->label, e + 2, vol->label_length * 2);
+        }
+    }
+    exfat_close(&root);
+
+    if (upcase_cluster) {
+        exfat_upcase_ctx_t u;
+        memset(&u, 0, sizeof(u));
+        vol->have_upcase = exfat_load_meta(vol, upcase_cluster, upcase_length, exfat_upcase_chunk, &u) &&
+                           u.checksum == upcase_checksum;
+        if (!vol->have_upcase) {
+            printk("%s: bad up-case table, falling back to ASCII\n", dev->name);
+        }
+    }
+
+    if (vol->bitmap_cluster == 0 || vol->bitmap_length * 8 < vol->cluster_count) {
+        printk("%s: missing allocation bitmap\n", dev->name);
+        exfat_unmount(vol);
+        return NULL;
+    }
+
+    // Writing needs the whole bitmap in memory, in one run of clusters on
+    // disk, and only one FAT to keep up to date
+    vol->read_only = !one_fat || vol->bitmap_length > (uint64_t)EXFAT_BITMAP_PAGES * EXFAT_PAGE_SIZE ||
+                     !exfat_bitmap_contiguous(vol);
+    for (uint32_t i = 0; !vol->read_only && i * EXFAT_PAGE_SIZE < vol->bitmap_length; i++) {
+        vol->bitmap[i] = alloc_page();
+        if (vol->bitmap[i] == NULL) {
+            vol->read_only = true;
+        }
+    }
+
+    uint32_t used = 0;
+    if (!exfat_load_meta(vol, vol->bitmap_cluster, vol->bitmap_length, exfat_bitmap_chunk, &used)) {
+        printk("%s: missing allocation bitmap\n", dev->name);
+        exfat_unmount(vol);
+        return NULL;
+    }
+    vol->free_clusters = vol->cluster_count - used;
+    vol->alloc_hint = EXFAT_FIRST_CLUSTER;
+    vol->mounted = true;
+
+    char label[34];
+    exfat_utf16_to_utf8(vol->label, vol->label_length, label);
+    printk("%s: exFAT '%s', %d KiB clusters, %d MiB free\n", dev->name, label, vol->cluster_size / 1024,
+           (int)(((uint64_t)vol->free_clusters << vol->cluster_shift) >> 20));
+    if (vol->read_only) {
+        printk("%s: mounted read-only\n", dev->name);
+    }
+    return vol;
+}
+
+void exfat_unmount(exfat_volume_t *vol) {
+    if (vol->mounted && vol->dirty) {
+        exfat_sync(vol);
+    }
+    for (int i = 0; i < EXFAT_BITMAP_PAGES; i++) {
+        if (vol->bitmap[i]) {
+            free_page(vol->bitmap[i]);
+            vol->bitmap[i] = NULL;
+        }
+    }
+    for (int i = 0; i < EXFAT_UPCASE_PAGES; i++) {
+        if (vol->upcase[i]) {
+            free_page(vol->upcase[i]);
+            vol->upcase[i] = NULL;
+        }
+    }
+    if (vol->buf) free_page(vol->buf);
+    if (vol->dir_buf) free_page(vol->dir_buf);
+    if (vol->fat_buf) free_page(vol->fat_buf);
+    vol->buf = vol->dir_buf = vol->fat_buf = NULL;
+    vol->mounted = false;
+}
+
+// VFS glue ==============================================================
+
+// An entry set never moves, so its position names the file
+static void exfat_vfs_fill(vfs_inode_t *inode) {
+    exfat_file_t *file = &inode->u.exfat;
+    inode->ino = ((uint64_t)file->dir_cluster << 32) | file->dir_entry;
+    inode->directory = (file->attributes & EXFAT_ATTR_DIRECTORY) != 0;
+    inode->size = file->size;
+}
+
+static bool exfat_vfs_mount(vfs_mount_t *mnt, block_device_t *dev, vfs_inode_t *root) {
+    exfat_volume_t *vol = exfat_mount(dev);
+    if (vol == NULL) {
+        return false;
+    }
+    if (!exfat_open_root(vol, &root->u.exfat)) {
+        exfat_unmount(vol);
+        return false;
+    }
+    mnt->fs_data = vol;
+    exfat_vfs_fill(root);
+    return true;
+}
+
+static void exfat_vfs_unmount(vfs_mount_t *mnt) {
+    exfat_unmount(mnt->fs_data);
+}
+
+static bool exfat_vfs_sync(vfs_mount_t *mnt) {
+    return exfat_sync(mnt->fs_data);
+}
+
+static bool exfat_vfs_lookup(vfs_inode_t *dir, const char *name, vfs_inode_t *out) {
+    if (!exfat_open_at(&dir->u.exfat, name, &out->u.exfat)) {
+        return false;
+    }
+    exfat_vfs_fill(out);
+    return true;
+}
+
+static bool exfat_vfs_readdir(vfs_inode_t *dir, uint32_t *pos, vfs_dirent_t *out) {
+    exfat_dirent_t d;
+    if (!exfat_readdir(&dir->u.exfat, pos, &d)) {
+        return false;
+    }
+    strcpy(out->name, d.name);
+    out->directory = (d.attributes & EXFAT_ATTR_DIRECTORY) != 0;
+    out->size = d.size;
+    return true;
+}
+
+static int exfat_vfs_read(vfs_inode_t *inode, uint64_t offset, void *buf, uint32_t len) {
+    return exfat_read(&inode->u.exfat, offset, buf, len);
+}
+
+static bool exfat_vfs_readpages(vfs_inode_t *inode, uint32_t first, uint8_t **pages, int count) {
+    return exfat_read_pages(&inode->u.exfat, first, pages, count);
+}
+
+static void *exfat_vfs_direct_page(vfs_inode_t *inode, uint32_t index) {
+    return exfat_direct_page(&inode->u.exfat, index);
+}
+
+static int exfat_vfs_write(vfs_inode_t *inode, uint64_t offset, const void *buf, uint32_t len) {
+    int n = exfat_write(&inode->u.exfat, offset, buf, len);
+    inode->size = inode->u.exfat.size;
+    return n;
+}
+
+static bool exfat_vfs_truncate(vfs_inode_t *inode, uint64_t size) {
+    bool ok = exfat_truncate(&inode->u.exfat, size);
+    inode->size = inode->u.exfat.size;
+    return ok;
+}
+
+static bool exfat_vfs_create(vfs_inode_t *dir, const char *name, bool directory, vfs_inode_t *out) {
+    bool ok = exfat_create_at(&dir->u.exfat, name, directory, &out->u.exfat);
+    dir->size = dir->u.exfat.size;
+    if (ok) {
+        exfat_vfs_fill(out);
+    }
+    return ok;
+}
+
+static bool exfat_vfs_remove(vfs_inode_t *dir, vfs_inode_t *inode) {
+    (void)dir;
+    return exfat_remove(&inode->u.exfat);
+}
+
+static void exfat_vfs_release(vfs_inode_t *inode) {
+    exfat_release(&inode->u.exfat);
+}
+
+static void exfat_vfs_evict(vfs_inode_t *inode) {
+    exfat_close(&inode->u.exfat);
+}
+
+const vfs_fs_ops_t exfat_vfs_ops = {
+    .name = "exfat",
+    .case_fold = true,
+    .page_cache = true,
+    .mount = exfat_vfs_mount,
+    .unmount = exfat_vfs_unmount,
+    .sync = exfat_vfs_sync,
+    .lookup = exfat_vfs_lookup,
+    .readdir = exfat_vfs_readdir,
+    .read = exfat_vfs_read,
+    .readpages = exfat_vfs_readpages,
+    .direct_page = exfat_vfs_direct_page,
+    .write = exfat_vfs_write,
+    .truncate = exfat_vfs_truncate,
+    .create = exfat_vfs_create,
+    .remove = exfat_vfs_remove,
+    .release = exfat_vfs_release,
+    .evict = exfat_vfs_evict,
+};
@@ -3,5 +3,194 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+#include "../Drivers/block.h"
+
+#define EXFAT_MAX_VOLUMES   4
+#define EXFAT_NAME_MAX      255     // UTF-16 code units
+#define EXFAT_UPCASE_PAGES  32      // 64K entries, 2048 per page
+#define EXFAT_BITMAP_PAGES  64      // In-memory allocation bitmap, 2M clusters. Bigger volumes mount read-only.
+#define EXFAT_MAX_RESERVATIONS 8
+#define EXFAT_RESERVE_CLUSTERS 64   // Free clusters held back behind a file that is being written
+#define EXFAT_MBR_TYPE      0x07
+
+// Cluster values in the FAT
+#define EXFAT_FIRST_CLUSTER 2
+#define EXFAT_BAD_CLUSTER   0xFFFFFFF7
+#define EXFAT_END_OF_CHAIN  0xFFFFFFFF
+
+// Directory entry types
+#define EXFAT_ENTRY_END       0x00
+#define EXFAT_ENTRY_BITMAP    0x81
+#define EXFAT_ENTRY_UPCASE    0x82
+#define EXFAT_ENTRY_LABEL     0x83
+#define EXFAT_ENTRY_FILE      0x85
+#define EXFAT_ENTRY_STREAM    0xC0
+#define EXFAT_ENTRY_NAME      0xC1
+#define EXFAT_ENTRY_IN_USE    0x80
+
+#define EXFAT_VOLUME_DIRTY  0x0002  // VolumeFlags
+
+// Stream extension flags
+#define EXFAT_FLAG_ALLOC_POSSIBLE 0x01
+#define EXFAT_FLAG_NO_FAT_CHAIN   0x02
+
+// File attributes
+#define EXFAT_ATTR_READ_ONLY 0x01
+#define EXFAT_ATTR_HIDDEN    0x02
+#define EXFAT_ATTR_SYSTEM    0x04
+#define EXFAT_ATTR_DIRECTORY 0x10
+#define EXFAT_ATTR_ARCHIVE   0x20
+
+typedef struct {
+    uint8_t  jump_boot[3];
+    char     fs_name[8];            // "EXFAT   "
+    uint8_t  zero[53];
+    uint64_t partition_offset;
+    uint64_t volume_length;
+    uint32_t fat_offset;            // Sectors, relative to the volume
+    uint32_t fat_length;
+    uint32_t cluster_heap_offset;
+    uint32_t cluster_count;
+    uint32_t root_cluster;
+    uint32_t serial;
+    uint16_t revision;
+    uint16_t volume_flags;
+    uint8_t  bytes_per_sector_shift;
+    uint8_t  sectors_per_cluster_shift;
+    uint8_t  number_of_fats;
+    uint8_t  drive_select;
+    uint8_t  percent_in_use;
+    uint8_t  reserved[7];
+    uint8_t  boot_code[390];
+    uint16_t signature;             // 0xAA55
+} __attribute__((packed)) exfat_boot_sector_t;
+
+// One run of clusters: file clusters [file_cluster, file_cluster + length)
+// live at disk clusters [disk_cluster, disk_cluster + length)
+typedef struct {
+    uint32_t file_cluster;
+    uint32_t disk_cluster;
+    uint32_t length;
+} exfat_extent_t;
+
+#define EXFAT_EXTENTS_PER_PAGE (4096 / sizeof(exfat_extent_t))
+
+// Free clusters right behind a file that is being appended to, kept away
+// from other allocations (in memory only) so the file can keep growing in place
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+    bool in_use;
+} exfat_reservation_t;
+
+typedef struct {
+    block_device_t *dev;
+    uint64_t part_lba;              // Device sector of the volume's sector 0
+    uint32_t sector_size;           // Volume sector size
+    uint32_t dev_per_sector;        // Device sectors per volume sector
+    uint32_t sector_shift;
+    uint32_t cluster_size;          // Bytes
+    uint32_t cluster_shift;         // log2(cluster_size)
+    uint32_t fat_offset;
+    uint32_t fat_length;
+    uint32_t heap_offset;
+    uint32_t cluster_count;
+    uint32_t root_cluster;
+    uint32_t bitmap_cluster;
+    uint64_t bitmap_length;
+    uint32_t free_clusters;
+    uint16_t volume_flags;          // As read at mount, without our dirty bit
+    uint16_t label[11];
+    int label_length;
+    bool read_only;
+    bool dirty;                     // VolumeDirty is set on disk
+
+    // Allocation bitmap, with a dirty bit per volume sector of every page
+    uint8_t *bitmap[EXFAT_BITMAP_PAGES];
+    uint8_t bitmap_dirty[EXFAT_BITMAP_PAGES];
+    uint32_t alloc_hint;            // Where the next free run search starts
+    exfat_reservation_t reservations[EXFAT_MAX_RESERVATIONS];
+
+    uint16_t *upcase[EXFAT_UPCASE_PAGES];   // NULL pages map every character to itself
+    bool have_upcase;
+
+    // Write-back FAT cache, one page of volume sectors mapped by sector number
+    uint8_t *fat_buf;
+    uint32_t fat_tags[8];           // Cached sector per slot, 0 when empty (sector 0 is the boot sector)
+    uint8_t fat_dirty;              // Bit per slot
+
+    // Bounce buffer for unaligned file data, one page
+    uint8_t *buf;
+
+    // Directory cache: one page of the directory starting at dir_buf_offset
+    uint8_t *dir_buf;
+    uint32_t dir_buf_cluster;       // First cluster of the cached directory, 0 if empty
+    uint32_t dir_buf_offset;
+    bool mounted;
+} exfat_volume_t;
+
+typedef struct {
+    exfat_volume_t *vol;
+    uint16_t attributes;
+    uint8_t flags;                  // Stream extension GeneralSecondaryFlags
+    uint32_t first_cluster;
+    uint64_t size;                  // DataLength, bytes allocated to the file
+    uint64_t valid_size;            // ValidDataLength, bytes past this read as zero
+
+    // Where the directory entry set lives, for writing it back
+    uint32_t dir_cluster;           // Parent's first cluster
+    uint8_t dir_flags;              // Parent's stream flags
+    uint64_t dir_size;
+    uint32_t dir_entry;             // Index of the file entry in the parent
+    int entry_count;
+
+    // Cluster chain cache. Contiguous (NoFatChain) files use the inline
+    // extent and never touch the FAT, others get a page of extents.
+    exfat_extent_t *extents;
+    exfat_extent_t inline_extent;
+    uint32_t extent_count;
+    bool chain_loaded;
+    bool chain_complete;            // All clusters of the file are in extents
+    int reservation;                // Slot in vol->reservations plus one, 0 if none
+} exfat_file_t;
+
+typedef struct {
+    char name[EXFAT_NAME_MAX * 3 + 1];  // UTF-8
+    uint16_t attributes;
+    uint8_t flags;
+    uint32_t first_cluster;
+    uint64_t size;
+    uint64_t valid_size;
+    uint16_t name_hash;
+    uint32_t entry;                 // Index of the file entry in the directory
+    int entry_count;                // File entry plus secondary entries
+} exfat_dirent_t;
+
+// Volumes
+exfat_volume_t *exfat_mount(block_device_t *dev);
+void exfat_unmount(exfat_volume_t *vol);
+
+// Files and directories
+bool exfat_open_root(exfat_volume_t *vol, exfat_file_t *file);
+bool exfat_open(exfat_volume_t *vol, const char *path, exfat_file_t *file);
+bool exfat_open_at(exfat_file_t *dir, const char *name, exfat_file_t *file);
+void exfat_close(exfat_file_t *file);
+bool exfat_readdir(exfat_file_t *dir, uint32_t *pos, exfat_dirent_t *out);
+bool exfat_lookup(exfat_file_t *dir, const char *name, exfat_dirent_t *out);
+int exfat_read(exfat_file_t *file, uint64_t offset, void *buf, uint32_t len);
+bool exfat_read_pages(exfat_file_t *file, uint32_t first, uint8_t **pages, int count);
+void *exfat_direct_page(exfat_file_t *file, uint32_t index);
+
+// Writing. Every call is one transaction: file data first, then the FAT and
+// bitmap sectors it dirtied, then the directory entry set.
+bool exfat_create(exfat_volume_t *vol, const char *path, bool directory, exfat_file_t *file);
+bool exfat_create_at(exfat_file_t *dir, const char *name, bool directory, exfat_file_t *file);
+int exfat_write(exfat_file_t *file, uint64_t offset, const void *buf, uint32_t len);
+bool exfat_truncate(exfat_file_t *file, uint64_t size);
+void exfat_release(exfat_file_t *file);
+bool exfat_unlink(exfat_volume_t *vol, const char *path);
+bool exfat_remove(exfat_file_t *file);
+bool exfat_sync(exfat_volume_t *vol);
 
 #endif // EXFAT_H
@@ -0,0 +1,202 @@
+#include "init.h"
+#include "time.h"
+#include "system.h"
+#include "../Drivers/kernel.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Boot initialization
+//
+// Subsystems are tasks with named dependencies. A task's step function is
+// called once its dependencies have finished, and again for as long as it
+// returns INIT_PENDING, so a driver waiting on hardware (a link coming up,
+// a drive spinning up) gives the other tasks their turn instead of holding
+// up the boot. There are no threads or interrupts: the tasks are stepped
+// round robin by init_run_until() during boot and by init_poll() from the
+// shell's idle loop afterwards. Boot only runs what the shell depends on;
+// everything else finishes while the prompt is already up.
+
+static init_task_t *init_tasks[INIT_MAX_TASKS];
+static int init_count = 0;
+static int init_left = 0;           // Tasks not finished, failed or skipped
+static uint64_t init_start = 0;
+static uint64_t init_shell_us = 0;  // When init_run_until() returned
+static bool init_reported = false;
+
+bool init_add(init_task_t *task) {
+    if (init_count >= INIT_MAX_TASKS) {
+        printk("init: too many tasks, %s dropped\n", task->name);
+        return false;
+    }
+    task->state = INIT_WAITING;
+    task->needed = false;
+    task->steps = 0;
+    task->busy_us = 0;
+    init_tasks[init_count++] = task;
+    init_left++;
+    return true;
+}
+
+static init_task_t *init_find(const char *name) {
+    for (int i = 0; i < init_count; i++) {
+        if (strcmp(init_tasks[i]->name, name) == 0) {
+            return init_tasks[i];
+        }
+    }
+    return NULL;
+}
+
+static bool init_over(init_task_t *t) {
+    return t->state == INIT_FINISHED || t->state == INIT_ERROR || t->state == INIT_SKIPPED;
+}
+
+static void init_end(init_task_t *t, int state) {
+    t->state = state;
+    t->end_us = time_now_us() - init_start;
+    init_left--;
+}
+
+// INIT_FINISHED when every dependency has finished, INIT_ERROR when one
+// failed or does not exist, INIT_WAITING otherwise
+static int init_deps(init_task_t *t) {
+    for (int i = 0; i < INIT_MAX_DEPS && t->deps[i]; i++) {
+        init_task_t *dep = init_find(t->deps[i]);
+        if (dep == NULL) {
+            printk("init: %s needs %s, which does not exist\n", t->name, t->deps[i]);
+            return INIT_ERROR;
+        }
+        if (dep->state == INIT_ERROR || dep->state == INIT_SKIPPED) {
+            return INIT_ERROR;
+        }
+        if (dep->state != INIT_FINISHED) {
+            return INIT_WAITING;
+        }
+    }
+    return INIT_FINISHED;
+}
+
+// Step every task that can run, or only the needed ones. Returns whether
+// any task did something.
+static bool init_pass(bool needed_only) {
+    bool progress = false;
+
+    for (int i = 0; i < init_count; i++) {
+        init_task_t *t = init_tasks[i];
+        if (init_over(t) || (needed_only && !t->needed)) {
+            continue;
+        }
+        if (t->state == INIT_WAITING) {
+            int deps = init_deps(t);
+            if (deps == INIT_ERROR) {
+                init_end(t, INIT_SKIPPED);
+                progress = true;
+                continue;
+            }
+            if (deps == INIT_WAITING) {
+                continue;
+            }
+            t->state = INIT_RUNNING;
+            t->start_us = time_now_us() - init_start;
+        }
+
+        uint64_t before = time_now_us();
+        int result = t->step();
+        t->busy_us += time_now_us() - before;
+        t->steps++;
+        progress = true;
+        if (result == INIT_DONE) {
+            init_end(t, INIT_FINISHED);
+        } else if (result == INIT_FAILED) {
+            printk("init: %s failed\n", t->name);
+            init_end(t, INIT_ERROR);
+        }
+    }
+    return progress;
+}
+
+static void init_mark_needed(init_task_t *t, int depth) {
+    // Deeper than there are tasks means the dependencies go round in a circle
+    if (t->needed || depth > init_count) {
+        return;
+    }
+    t->needed = true;
+    for (int i = 0; i < INIT_MAX_DEPS && t->deps[i]; i++) {
+        init_task_t *dep = init_find(t->deps[i]);
+        if (dep) {
+            init_mark_needed(dep, depth + 1);
+        }
+    }
+}
+
+// Run name and whatever it depends on, leaving every other task for
+// init_poll(). Returns whether name finished.
+bool init_run_until(const char *name) {
+    init_task_t *target = init_find(name);
+    if (target == NULL) {
+        return false;
+    }
+    if (init_start == 0) {
+        init_start = time_now_us();
+    }
+    init_mark_needed(target, 0);
+
+    while (!init_over(target)) {
+        if (!init_pass(true)) {
+            printk("init: dependencies of %s go round in a circle\n", name);
+            break;
+        }
+    }
+    init_shell_us = time_now_us() - init_start;
+    return target->state == INIT_FINISHED;
+}
+
+// Give every unfinished task a step, for idle loops. Returns whether any
+// task is left. The report is printed once the last one is done.
+bool init_poll() {
+    if (init_left == 0) {
+        return false;
+    }
+    if (!init_pass(false)) {
+        // Nothing can run any more: what is left waits on a circle
+        for (int i = 0; i < init_count; i++) {
+            if (!init_over(init_tasks[i])) {
+                printk("init: %s waits on itself, skipped\n", init_tasks[i]->name);
+                init_end(init_tasks[i], INIT_SKIPPED);
+            }
+        }
+    }
+    if (init_left == 0 && !init_reported) {
+        init_reported = true;
+        init_print_report();
+    }
+    return init_left > 0;
+}
+
+void init_print_report() {
+    static const char *states[] = { "waiting", "running", "ok", "failed", "skipped" };
+    uint64_t last = 0;
+
+    for (int i = 0; i < init_count; i++) {
+        if (init_over(init_tasks[i]) && init_tasks[i]->end_us > last) {
+            last = init_tasks[i]->end_us;
+        }
+    }
+    printk("\nInit: shell up after %d ms, ", (int)(init_shell_us / 1000));
+    if (init_left > 0) {
+        printk("%d tasks still running\n", init_left);
+    } else {
+        printk("everything up after %d ms\n", (int)(last / 1000));
+    }
+
+    for (int i = 0; i < init_count; i++) {
+        init_task_t *t = init_tasks[i];
+        if (t->state == INIT_WAITING || t->state == INIT_SKIPPED) {
+            printk("  %s: %s\n", t->name, states[t->state]);
+            continue;
+        }
+        uint64_t end = init_over(t) ? t->end_us : time_now_us() - init_start;
+        printk("  %s: %s, at %d ms, took %d ms, %d ms busy in %d steps\n", t->name, states[t->state],
+               (int)(t->start_us / 1000), (int)((end - t->start_us) / 1000), (int)(t->busy_us / 1000), t->steps);
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef INIT_H
+#define INIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define INIT_MAX_TASKS  16
+#define INIT_MAX_DEPS   4
+
+// What a step function returns
+#define INIT_DONE       0
+#define INIT_PENDING    1   // Waiting on hardware, step again later
+#define INIT_FAILED     2
+
+// Task states
+#define INIT_WAITING    0   // Not started, dependencies still running
+#define INIT_RUNNING    1   // Stepped at least once, returned INIT_PENDING
+#define INIT_FINISHED   2
+#define INIT_ERROR      3
+#define INIT_SKIPPED    4   // A dependency failed
+
+typedef struct {
+    const char *name;
+    const char *deps[INIT_MAX_DEPS];    // Tasks that must finish first, NULL after the last
+    int (*step)(void);                  // Called until it stops returning INIT_PENDING
+    int state;
+    bool needed;            // On the path to the task being waited for
+    uint64_t start_us;      // First step, from the start of boot
+    uint64_t end_us;
+    uint64_t busy_us;       // Time spent in step; the rest overlapped with other tasks
+    uint32_t steps;
+} init_task_t;
+
+bool init_add(init_task_t *task);
+bool init_run_until(const char *name);
+bool init_poll();
+void init_print_report();
+
+#endif // INIT_H
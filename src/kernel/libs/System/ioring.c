@@ -0,0 +1,344 @@
+#include "ioring.h"
+#include "vfs.h"
+#include "system.h"
+#include "../Drivers/block.h"
+#include "../Drivers/kernel.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Submission and completion rings
+//
+// A caller queues any number of operations in the submission ring and hands
+// them over with one ioring_submit(). Device reads and writes become block
+// requests that all reach the scheduler before any device is started, so a
+// batch is merged and queued as deep as the drivers go. Their completions
+// land in the completion ring from the block layer's end_io callbacks and
+// are picked up by polling (ioring_peek_cqe) or waiting (ioring_wait_cqe).
+//
+// There are no interrupts, so nothing makes progress unless someone polls:
+// peeking and waiting drive every device the ring has used.
+//
+// ioring_submit() never takes more than the completion ring can hold, so a
+// completion always has a slot and nothing overflows.
+
+static ioring_t ioring_rings[IORING_MAX_RINGS];
+
+static uint32_t ioring_cq_size(ioring_t *ring) {
+    return ring->entries * 2;
+}
+
+uint32_t ioring_cq_ready(ioring_t *ring) {
+    return ring->cq_tail - ring->cq_head;
+}
+
+static void ioring_post(ioring_t *ring, uint64_t user_data, int32_t res) {
+    ioring_cqe_t *cqe = &ring->cqes[ring->cq_tail & (ioring_cq_size(ring) - 1)];
+    cqe->user_data = user_data;
+    cqe->res = res;
+    ring->cq_tail++;
+    ring->stats.completed++;
+    if (res < 0) {
+        ring->stats.errors++;
+    }
+}
+
+ioring_t *ioring_create(uint32_t entries) {
+    uint32_t size = 1;
+    while (size < entries) {
+        size <<= 1;
+    }
+    if (entries == 0 || size > IORING_MAX_ENTRIES) {
+        printk("ioring: %d entries, at most %d\n", entries, IORING_MAX_ENTRIES);
+        return NULL;
+    }
+
+    for (int i = 0; i < IORING_MAX_RINGS; i++) {
+        ioring_t *ring = &ioring_rings[i];
+        if (!ring->in_use) {
+            memset(ring, 0, sizeof(ioring_t));
+            ring->entries = size;
+            for (uint32_t r = 0; r < IORING_MAX_PARTS; r++) {
+                ring->free_reqs[r] = r;
+            }
+            ring->free_count = IORING_MAX_PARTS;
+            ring->in_use = true;
+            return ring;
+        }
+    }
+    printk("ioring: out of rings\n");
+    return NULL;
+}
+
+// Waits for everything in flight, the block layer still points into the ring
+void ioring_destroy(ioring_t *ring) {
+    while (ring->inflight > 0 && ioring_wait_cqe(ring)) {
+        ioring_cqe_seen(ring);
+    }
+    ring->in_use = false;
+}
+
+// Submission ============================================================
+
+// The next free submission slot, NULL if the queue is full
+ioring_sqe_t *ioring_get_sqe(ioring_t *ring) {
+    if (ring->sq_tail - ring->sq_head >= ring->entries) {
+        return NULL;
+    }
+    ioring_sqe_t *sqe = &ring->sqes[ring->sq_tail & (ring->entries - 1)];
+    memset(sqe, 0, sizeof(ioring_sqe_t));
+    ring->sq_tail++;
+    return sqe;
+}
+
+static void ioring_prep(ioring_sqe_t *sqe, uint8_t opcode, block_device_t *dev, vfs_file_t *file,
+                        uint64_t offset, uint32_t len, void *buf, uint64_t user_data) {
+    sqe->opcode = opcode;
+    sqe->dev = dev;
+    sqe->file = file;
+    sqe->offset = offset;
+    sqe->len = len;
+    sqe->buf = buf;
+    sqe->user_data = user_data;
+}
+
+void ioring_prep_read(ioring_sqe_t *sqe, block_device_t *dev, uint64_t lba, uint32_t count, void *buf, uint64_t user_data) {
+    ioring_prep(sqe, IORING_OP_READ, dev, NULL, lba, count, buf, user_data);
+}
+
+void ioring_prep_write(ioring_sqe_t *sqe, block_device_t *dev, uint64_t lba, uint32_t count, const void *buf, uint64_t user_data) {
+    ioring_prep(sqe, IORING_OP_WRITE, dev, NULL, lba, count, (void *)buf, user_data);
+}
+
+void ioring_prep_flush(ioring_sqe_t *sqe, block_device_t *dev, uint64_t user_data) {
+    ioring_prep(sqe, IORING_OP_FLUSH, dev, NULL, 0, 0, NULL, user_data);
+}
+
+void ioring_prep_file_read(ioring_sqe_t *sqe, vfs_file_t *file, uint64_t offset, uint32_t len, void *buf, uint64_t user_data) {
+    ioring_prep(sqe, IORING_OP_READ, NULL, file, offset, len, buf, user_data);
+}
+
+void ioring_prep_file_write(ioring_sqe_t *sqe, vfs_file_t *file, uint64_t offset, uint32_t len, const void *buf, uint64_t user_data) {
+    ioring_prep(sqe, IORING_OP_WRITE, NULL, file, offset, len, (void *)buf, user_data);
+}
+
+void ioring_prep_fsync(ioring_sqe_t *sqe, vfs_file_t *file, uint64_t user_data) {
+    ioring_prep(sqe, IORING_OP_FSYNC, NULL, file, 0, 0, NULL, user_data);
+}
+
+// Block layer completion of one part of an operation
+static void ioring_end_io(io_request_t *req) {
+    ioring_op_t *op = req->private_data;
+    ioring_t *ring = op->ring;
+
+    if (req->status != IO_DONE) {
+        op->failed = true;
+    }
+    ring->free_reqs[ring->free_count++] = req - ring->reqs;
+    if (--op->parts == 0) {
+        ioring_post(ring, op->user_data, op->failed ? IORING_EIO : (int32_t)op->bytes);
+        op->in_use = false;
+        ring->inflight--;
+    }
+}
+
+static void ioring_add_dev(ioring_t *ring, block_device_t *dev) {
+    for (int i = 0; i < ring->dev_count; i++) {
+        if (ring->devs[i] == dev) {
+            return;
+        }
+    }
+    if (ring->dev_count < MAX_BLOCK_DEVICES) {
+        ring->devs[ring->dev_count++] = dev;
+    }
+}
+
+// Queue the device I/O of sqe, false if the ring is out of block requests
+static bool ioring_queue_block(ioring_t *ring, ioring_sqe_t *sqe) {
+    block_device_t *dev = sqe->dev;
+    uint32_t parts = (sqe->len + dev->max_sectors - 1) / dev->max_sectors;
+    if (parts > ring->free_count) {
+        return false;
+    }
+
+    ioring_op_t *op = NULL;
+    for (uint32_t i = 0; i < ring->entries; i++) {
+        if (!ring->ops[i].in_use) {
+            op = &ring->ops[i];
+            break;
+        }
+    }
+    op->ring = ring;
+    op->user_data = sqe->user_data;
+    op->bytes = sqe->len * dev->sector_size;
+    op->parts = parts;
+    op->failed = false;
+    op->in_use = true;
+    ring->inflight++;
+    ioring_add_dev(ring, dev);
+
+    uint64_t lba = sqe->offset;
+    uint8_t *buf = sqe->buf;
+    for (uint32_t left = sqe->len; left > 0;) {
+        uint32_t count = left < dev->max_sectors ? left : dev->max_sectors;
+        io_request_t *req = &ring->reqs[ring->free_reqs[--ring->free_count]];
+        memset(req, 0, sizeof(io_request_t));
+        req->lba = lba;
+        req->count = count;
+        req->buf = buf;
+        req->write = sqe->opcode == IORING_OP_WRITE;
+        req->end_io = ioring_end_io;
+        req->private_data = op;
+        block_submit(dev, req);
+        ring->stats.requests++;
+
+        lba += count;
+        buf += count * dev->sector_size;
+        left -= count;
+    }
+    return true;
+}
+
+// Start one submission, false if it has to wait for resources
+static bool ioring_issue(ioring_t *ring, ioring_sqe_t *sqe) {
+    block_device_t *dev = sqe->dev;
+    vfs_file_t *file = sqe->file;
+    int n;
+
+    switch (sqe->opcode) {
+    case IORING_OP_NOP:
+        ioring_post(ring, sqe->user_data, 0);
+        return true;
+
+    case IORING_OP_READ:
+    case IORING_OP_WRITE:
+        if (dev) {
+            if (sqe->len == 0 || sqe->buf == NULL || sqe->offset + sqe->len > dev->sector_count ||
+                (sqe->len + dev->max_sectors - 1) / dev->max_sectors > IORING_MAX_PARTS) {
+                break;
+            }
+            return ioring_queue_block(ring, sqe);
+        }
+        if (file == NULL || !vfs_seek(file, sqe->offset)) {
+            break;
+        }
+        if (sqe->opcode == IORING_OP_READ) {
+            n = vfs_read(file, sqe->buf, sqe->len);
+        } else {
+            n = vfs_write(file, sqe->buf, sqe->len);
+        }
+        ioring_post(ring, sqe->user_data, n < 0 ? IORING_EIO : n);
+        return true;
+
+    case IORING_OP_FLUSH:
+        if (dev == NULL) {
+            break;
+        }
+        // block_flush() drains the device queue first, so the flush covers
+        // every write submitted ahead of it
+        ioring_post(ring, sqe->user_data, block_flush(dev) ? 0 : IORING_EIO);
+        return true;
+
+    case IORING_OP_FSYNC:
+        if (file == NULL) {
+            break;
+        }
+        ioring_post(ring, sqe->user_data, vfs_fsync(file) ? 0 : IORING_EIO);
+        return true;
+    }
+
+    ioring_post(ring, sqe->user_data, IORING_EINVAL);
+    return true;
+}
+
+// Hand every queued submission to the devices in one go. Returns how many
+// were taken; the rest stay queued while the completion ring or the block
+// requests are exhausted.
+int ioring_submit(ioring_t *ring) {
+    int taken = 0;
+
+    while (ring->sq_head != ring->sq_tail &&
+           ring->inflight < ring->entries &&
+           ioring_cq_ready(ring) + ring->inflight < ioring_cq_size(ring)) {
+        if (!ioring_issue(ring, &ring->sqes[ring->sq_head & (ring->entries - 1)])) {
+            break;
+        }
+        ring->sq_head++;
+        taken++;
+    }
+
+    if (taken > 0) {
+        ring->stats.submitted += taken;
+        ring->stats.batches++;
+        for (int i = 0; i < ring->dev_count; i++) {
+            block_poll(ring->devs[i]);
+        }
+    }
+    return taken;
+}
+
+// Drive the devices once, true while any of them still has work
+static bool ioring_poll(ioring_t *ring) {
+    bool busy = false;
+    for (int i = 0; i < ring->dev_count; i++) {
+        if (block_poll(ring->devs[i])) {
+            busy = true;
+        }
+    }
+    return busy;
+}
+
+// Submit, then wait until at least wait_nr completions are ready
+int ioring_submit_and_wait(ioring_t *ring, uint32_t wait_nr) {
+    int taken = ioring_submit(ring);
+
+    while (ioring_cq_ready(ring) < wait_nr) {
+        if (ring->inflight == 0) {
+            int more = ioring_submit(ring);
+            if (more == 0) {
+                break;
+            }
+            taken += more;
+        } else if (!ioring_poll(ring) && ring->inflight > 0) {
+            printk("ioring: %d operations lost by the devices\n", ring->inflight);
+            break;
+        } else {
+            taken += ioring_submit(ring);   // Completions made room for held-back entries
+        }
+    }
+    return taken;
+}
+
+// Completion ============================================================
+
+// The oldest completion, NULL if there is none yet
+ioring_cqe_t *ioring_peek_cqe(ioring_t *ring) {
+    if (ioring_cq_ready(ring) == 0 && ring->inflight > 0) {
+        ioring_poll(ring);
+    }
+    if (ioring_cq_ready(ring) == 0) {
+        return NULL;
+    }
+    return &ring->cqes[ring->cq_head & (ioring_cq_size(ring) - 1)];
+}
+
+// Wait for a completion. NULL if nothing is in flight that could produce one.
+ioring_cqe_t *ioring_wait_cqe(ioring_t *ring) {
+    while (ioring_cq_ready(ring) == 0) {
+        if (ring->inflight == 0) {
+            return NULL;
+        }
+        if (!ioring_poll(ring) && ioring_cq_ready(ring) == 0) {
+            printk("ioring: %d operations lost by the devices\n", ring->inflight);
+            return NULL;
+        }
+    }
+    return &ring->cqes[ring->cq_head & (ioring_cq_size(ring) - 1)];
+}
+
+// Done with the completion returned by peek or wait
+void ioring_cqe_seen(ioring_t *ring) {
+    if (ioring_cq_ready(ring) > 0) {
+        ring->cq_head++;
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef IORING_H
+#define IORING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../Drivers/block.h"
+#include "vfs.h"
+
+#define IORING_MAX_RINGS    4
+#define IORING_MAX_ENTRIES  128     // Submission queue entries, the completion queue is twice as deep
+#define IORING_MAX_PARTS    256     // Block requests in flight per ring, large I/O is split at max_sectors
+
+// Operations
+#define IORING_OP_NOP    0
+#define IORING_OP_READ   1          // Sectors of a block device, or bytes of a file
+#define IORING_OP_WRITE  2
+#define IORING_OP_FLUSH  3          // A block device's write cache, after everything queued before it
+#define IORING_OP_FSYNC  4          // Everything the file's file system holds back
+
+// Negative completion results
+#define IORING_EIO    -5
+#define IORING_EINVAL -22
+
+// One operation. Device I/O is asynchronous; file operations go through
+// the VFS, which is synchronous, and complete during ioring_submit().
+typedef struct {
+    uint8_t opcode;
+    block_device_t *dev;            // Device operations
+    vfs_file_t *file;               // File operations, dev is NULL
+    uint64_t offset;                // First sector for a device, byte offset for a file
+    uint32_t len;                   // Sectors for a device, bytes for a file
+    void *buf;
+    uint64_t user_data;             // Handed back in the completion
+} ioring_sqe_t;
+
+typedef struct {
+    uint64_t user_data;
+    int32_t res;                    // Bytes transferred (0 for flush and fsync) or IORING_E*
+} ioring_cqe_t;
+
+// An operation between submission and completion
+typedef struct ioring_op {
+    struct ioring *ring;
+    uint64_t user_data;
+    uint32_t bytes;
+    uint32_t parts;                 // Block requests not finished yet
+    bool failed;
+    bool in_use;
+} ioring_op_t;
+
+typedef struct {
+    uint32_t submitted;
+    uint32_t completed;
+    uint32_t batches;               // ioring_submit() calls that queued something
+    uint32_t requests;              // Block requests handed to the scheduler
+    uint32_t errors;
+} ioring_stats_t;
+
+// Both queues live in the ring, which is all the caller and the kernel
+// share. The caller produces submissions at sq_tail and consumes
+// completions at cq_head; ioring_submit() consumes submissions at sq_head
+// and completions are produced at cq_tail. Indexes only ever grow and are
+// masked on use.
+typedef struct ioring {
+    ioring_sqe_t sqes[IORING_MAX_ENTRIES];
+    uint32_t sq_head, sq_tail;
+    ioring_cqe_t cqes[IORING_MAX_ENTRIES * 2];
+    uint32_t cq_head, cq_tail;
+    uint32_t entries;               // Submission queue size, a power of two
+    uint32_t inflight;              // Submitted, not completed yet
+
+    ioring_op_t ops[IORING_MAX_ENTRIES];
+    io_request_t reqs[IORING_MAX_PARTS];
+    uint32_t free_reqs[IORING_MAX_PARTS];   // Stack of unused reqs[] slots
+    uint32_t free_count;
+    block_device_t *devs[MAX_BLOCK_DEVICES];    // Devices the ring has used
+    int dev_count;
+    ioring_stats_t stats;
+    bool in_use;
+} ioring_t;
+
+ioring_t *ioring_create(uint32_t entries);
+void ioring_destroy(ioring_t *ring);
+
+// Submission
+ioring_sqe_t *ioring_get_sqe(ioring_t *ring);
+void ioring_prep_read(ioring_sqe_t *sqe, block_device_t *dev, uint64_t lba, uint32_t count, void *buf, uint64_t user_data);
+void ioring_prep_write(ioring_sqe_t *sqe, block_device_t *dev, uint64_t lba, uint32_t count, const void *buf, uint64_t user_data);
+void ioring_prep_flush(ioring_sqe_t *sqe, block_device_t *dev, uint64_t user_data);
+void ioring_prep_file_read(ioring_sqe_t *sqe, vfs_file_t *file, uint64_t offset, uint32_t len, void *buf, uint64_t user_data);
+void ioring_prep_file_write(ioring_sqe_t *sqe, vfs_file_t *file, uint64_t offset, uint32_t len, const void *buf, uint64_t user_data);
+void ioring_prep_fsync(ioring_sqe_t *sqe, vfs_file_t *file, uint64_t user_data);
+int ioring_submit(ioring_t *ring);
+int ioring_submit_and_wait(ioring_t *ring, uint32_t wait_nr);
+
+// Completion
+ioring_cqe_t *ioring_peek_cqe(ioring_t *ring);
+ioring_cqe_t *ioring_wait_cqe(ioring_t *ring);
+void ioring_cqe_seen(ioring_t *ring);
+uint32_t ioring_cq_ready(ioring_t *ring);
+
+#endif // IORING_H
@@ -0,0 +1,173 @@
+#include "lz4.h"
+#include "system.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Greedy single pass LZ4 compressor with a 4K entry hash table, and a
+// bounds checked decompressor.
+
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5     // The last 5 bytes are always literals
+#define LZ4_MF_LIMIT      12    // No match may start in the last 12 bytes
+#define LZ4_HASH_LOG      12
+#define LZ4_MAX_OFFSET    65535
+
+// Positions of recently seen 4 byte sequences. Static to keep it off the
+// 16 KiB boot stack; compression is never reentered.
+static uint16_t lz4_table[1 << LZ4_HASH_LOG];
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Write a length continuation: runs of 255 followed by the remainder
+static int lz4_put_length(uint8_t *dst, int op, int dst_cap, uint32_t len) {
+    while (len >= 255) {
+        if (op >= dst_cap) return -1;
+        dst[op++] = 255;
+        len -= 255;
+    }
+    if (op >= dst_cap) return -1;
+    dst[op++] = (uint8_t)len;
+    return op;
+}
+
+// Emit one sequence: literals src[anchor..anchor+lit), then a match of
+// match_len at offset, or no match at all when match_len is 0 (the last one)
+static int lz4_emit(const uint8_t *src, int anchor, int lit, uint8_t *dst, int op, int dst_cap,
+                    int offset, int match_len) {
+    if (op >= dst_cap) return -1;
+    int token = op++;
+    uint8_t lit_code = lit >= 15 ? 15 : lit;
+    uint8_t match_code = 0;
+
+    if (lit >= 15 && (op = lz4_put_length(dst, op, dst_cap, lit - 15)) < 0) {
+        return -1;
+    }
+    if (op + lit > dst_cap) return -1;
+    memcpy(dst + op, src + anchor, lit);
+    op += lit;
+
+    if (match_len) {
+        if (op + 2 > dst_cap) return -1;
+        dst[op++] = offset & 0xFF;
+        dst[op++] = offset >> 8;
+        uint32_t ml = match_len - LZ4_MIN_MATCH;
+        match_code = ml >= 15 ? 15 : ml;
+        if (ml >= 15 && (op = lz4_put_length(dst, op, dst_cap, ml - 15)) < 0) {
+            return -1;
+        }
+    }
+    dst[token] = (lit_code << 4) | match_code;
+    return op;
+}
+
+int lz4_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap) {
+    int ip = 0, anchor = 0, op = 0;
+
+    if (src_len < 0 || src_len > LZ4_MAX_INPUT) {
+        return -1;
+    }
+
+    if (src_len > LZ4_MF_LIMIT) {
+        int mf_limit = src_len - LZ4_MF_LIMIT;
+        int match_limit = src_len - LZ4_LAST_LITERALS;
+        memset(lz4_table, 0, sizeof(lz4_table));
+
+        ip = 1;
+        while (ip < mf_limit) {
+            uint32_t seq = lz4_read32(src + ip);
+            uint32_t h = lz4_hash(seq);
+            int ref = lz4_table[h];
+            lz4_table[h] = ip;
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(src + ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            // Extend backwards over literals, then forwards
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            int len = LZ4_MIN_MATCH;
+            while (ip + len < match_limit && src[ref + len] == src[ip + len]) {
+                len++;
+            }
+
+            op = lz4_emit(src, anchor, ip - anchor, dst, op, dst_cap, ip - ref, len);
+            if (op < 0) {
+                return -1;
+            }
+            ip += len;
+            anchor = ip;
+            if (ip - 2 < mf_limit) {
+                lz4_table[lz4_hash(lz4_read32(src + ip - 2))] = ip - 2;
+            }
+        }
+    }
+
+    return lz4_emit(src, anchor, src_len - anchor, dst, op, dst_cap, 0, 0);
+}
+
+int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap) {
+    int ip = 0, op = 0;
+
+    while (ip < src_len) {
+        uint8_t token = src[ip++];
+        uint32_t b;
+
+        uint32_t lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= src_len) return -1;
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (uint32_t)(src_len - ip) || lit > (uint32_t)(dst_cap - op)) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+
+        if (ip == src_len) {
+            break;      // The last sequence has no match
+        }
+        if (ip + 2 > src_len) return -1;
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+
+        uint32_t len = token & 15;
+        if (len == 15) {
+            do {
+                if (ip >= src_len) return -1;
+                b = src[ip++];
+                len += b;
+            } while (b == 255);
+        }
+        len += LZ4_MIN_MATCH;
+        if (len > (uint32_t)(dst_cap - op)) {
+            return -1;
+        }
+
+        // Byte by byte, the match may overlap what it is producing
+        const uint8_t *match = dst + op - offset;
+        for (uint32_t i = 0; i < len; i++) {
+            dst[op + i] = match[i];
+        }
+        op += len;
+    }
+    return op;
+}
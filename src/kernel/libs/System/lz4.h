@@ -0,0 +1,16 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+
+// LZ4 block format (no frame header). Inputs are limited to 64 KiB, which
+// covers everything the kernel compresses (single pages).
+#define LZ4_MAX_INPUT 65535
+#define LZ4_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Both return the number of bytes written to dst, or -1 if dst is too
+// small (compress) or src is malformed (decompress).
+int lz4_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap);
+int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap);
+
+#endif // LZ4_H
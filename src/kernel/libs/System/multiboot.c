@@ -0,0 +1,48 @@
+#include "multiboot.h"
+#include "system.h"
+#include "../Drivers/kernel.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Boot information handed over by GRUB in eax/ebx. Memory is identity
+// mapped, so the physical addresses in it can be used as pointers directly.
+static multiboot_info_t *boot_info = NULL;
+
+bool multiboot_init(uint32_t magic, uint32_t info) {
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC || info == 0) {
+        printk("Not booted by a multiboot loader, no modules available.\n");
+        return false;
+    }
+    boot_info = (multiboot_info_t *)info;
+    return true;
+}
+
+int multiboot_module_count() {
+    if (boot_info == NULL || !(boot_info->flags & MULTIBOOT_INFO_MODS)) {
+        return 0;
+    }
+    return boot_info->mods_count;
+}
+
+multiboot_module_t *multiboot_module(int index) {
+    if (index < 0 || index >= multiboot_module_count()) {
+        return NULL;
+    }
+    return &((multiboot_module_t *)boot_info->mods_addr)[index];
+}
+
+// Last word of the module's command line, "initrd" for "module /boot/initrd.img initrd".
+// GRUB puts the file name first, so a module without arguments is named after its path.
+const char *multiboot_module_name(multiboot_module_t *mod) {
+    if (mod->cmdline == 0) {
+        return "";
+    }
+    const char *name = (const char *)mod->cmdline;
+    for (const char *p = name; *p; p++) {
+        if (*p == ' ' && p[1] != '\0' && p[1] != ' ') {
+            name = p + 1;
+        }
+    }
+    return name;
+}
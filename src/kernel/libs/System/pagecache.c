@@ -0,0 +1,586 @@
+#include "pagecache.h"
+#include "vfs.h"
+#include "system.h"
+#include "../Drivers/kernel.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Page cache
+//
+// File data of file systems that ask for it is kept in whole pages keyed by
+// (inode, page index). read() copies out of the cache and fills misses a
+// window at a time through the file system's readpages(), so the block
+// layer sees one batch of requests it can merge instead of a small read per
+// call. The window starts small and doubles while a file is read
+// sequentially. Writes go through to the file system as before and then
+// patch whatever pages are cached, so the cache never holds dirty data of
+// its own.
+//
+// There is no paging, so mmap() cannot map cache pages into an address
+// space. Instead a mapping is a run of physically contiguous pages, and the
+// cache entries for the mapped range move into it: pages that were cached
+// are copied over once, missing ones are read straight into the mapping.
+// From then on read() and the mapping share one copy of the data. Shared
+// writable mappings are written back by msync() and munmap(); private
+// writable ones, and files without a page cache, get a copy of their own.
+//
+// On devices that live in memory (RAM disks, boot modules) the file system
+// can point at a page where it already sits. Such a page is borrowed
+// rather than read: nothing is copied into the cache, writes land in it
+// through the device, and it is dropped rather than zeroed or freed.
+
+static pcache_page_t pcache_pages[PCACHE_PAGES];
+static pcache_page_t *pcache_hash[PCACHE_HASH];
+static pcache_page_t *pcache_lru_head, *pcache_lru_tail;
+static pcache_map_t pcache_maps[PCACHE_MAX_MAPS];
+static pcache_stats_t pcache_stats;
+
+static uint32_t pcache_hash_of(vfs_inode_t *inode, uint32_t index) {
+    return ((uint32_t)(uintptr_t)inode / sizeof(vfs_inode_t) * 31 + index) % PCACHE_HASH;
+}
+
+static uint32_t pcache_file_pages(vfs_inode_t *inode) {
+    return (inode->size + PCACHE_PAGE_SIZE - 1) / PCACHE_PAGE_SIZE;
+}
+
+// Entries ===============================================================
+
+static void pcache_lru_remove(pcache_page_t *p) {
+    if (p->lru_prev) {
+        p->lru_prev->lru_next = p->lru_next;
+    } else {
+        pcache_lru_head = p->lru_next;
+    }
+    if (p->lru_next) {
+        p->lru_next->lru_prev = p->lru_prev;
+    } else {
+        pcache_lru_tail = p->lru_prev;
+    }
+    p->lru_prev = p->lru_next = NULL;
+}
+
+static void pcache_lru_add(pcache_page_t *p) {
+    p->lru_prev = pcache_lru_tail;
+    p->lru_next = NULL;
+    if (pcache_lru_tail) {
+        pcache_lru_tail->lru_next = p;
+    } else {
+        pcache_lru_head = p;
+    }
+    pcache_lru_tail = p;
+}
+
+static pcache_page_t *pcache_find(vfs_inode_t *inode, uint32_t index) {
+    for (pcache_page_t *p = pcache_hash[pcache_hash_of(inode, index)]; p; p = p->hash_next) {
+        if (p->inode == inode && p->index == index) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void pcache_insert(pcache_page_t *p) {
+    uint32_t h = pcache_hash_of(p->inode, p->index);
+    p->hash_next = pcache_hash[h];
+    pcache_hash[h] = p;
+    if (p->pins == 0) {
+        pcache_lru_add(p);
+    }
+}
+
+// Forget an entry. The data page is freed unless a mapping owns it.
+static void pcache_remove(pcache_page_t *p) {
+    for (pcache_page_t **link = &pcache_hash[pcache_hash_of(p->inode, p->index)]; *link; link = &(*link)->hash_next) {
+        if (*link == p) {
+            *link = p->hash_next;
+            break;
+        }
+    }
+    if (p->pins == 0) {
+        pcache_lru_remove(p);
+        if (!p->borrowed) {
+            free_page(p->data);
+        }
+    }
+    p->in_use = false;
+}
+
+// Drop the least recently used page that no mapping holds
+static bool pcache_evict_one() {
+    if (pcache_lru_head == NULL) {
+        return false;
+    }
+    pcache_remove(pcache_lru_head);
+    pcache_stats.evictions++;
+    return true;
+}
+
+// A blank entry, not yet hashed
+static pcache_page_t *pcache_entry_alloc(vfs_inode_t *inode, uint32_t index) {
+    do {
+        for (int i = 0; i < PCACHE_PAGES; i++) {
+            pcache_page_t *p = &pcache_pages[i];
+            if (!p->in_use) {
+                memset(p, 0, sizeof(pcache_page_t));
+                p->inode = inode;
+                p->index = index;
+                p->in_use = true;
+                return p;
+            }
+        }
+    } while (pcache_evict_one());
+    return NULL;
+}
+
+// A data page, taken from the cache itself when memory runs out
+static uint8_t *pcache_data_alloc() {
+    uint8_t *data;
+    while ((data = alloc_page()) == NULL) {
+        if (!pcache_evict_one()) {
+            return NULL;
+        }
+    }
+    return data;
+}
+
+// Read count pages of the file starting at first into pages[], zeroing
+// whatever lies past the end of the file
+static bool pcache_read_pages(vfs_inode_t *inode, uint32_t first, uint8_t **pages, int count) {
+    const vfs_fs_ops_t *ops = inode->mnt->ops;
+
+    if (ops->readpages) {
+        return ops->readpages(inode, first, pages, count);
+    }
+    for (int i = 0; i < count; i++) {
+        int n = ops->read(inode, (uint64_t)(first + i) * PCACHE_PAGE_SIZE, pages[i], PCACHE_PAGE_SIZE);
+        if (n < 0) {
+            return false;
+        }
+        memset(pages[i] + n, 0, PCACHE_PAGE_SIZE - n);
+    }
+    return true;
+}
+
+// Cache the run of pages from first on the file system can hand out in
+// place, stopping at the first page that is already there. Returns how
+// many were added.
+static int pcache_borrow(vfs_inode_t *inode, uint32_t first, int count) {
+    const vfs_fs_ops_t *ops = inode->mnt->ops;
+    int n = 0;
+
+    if (ops->direct_page == NULL) {
+        return 0;
+    }
+    while (n < count && n < PCACHE_READAHEAD && (n == 0 || !pcache_find(inode, first + n))) {
+        uint8_t *data = ops->direct_page(inode, first + n);
+        if (data == NULL) {
+            break;
+        }
+        pcache_page_t *p = pcache_entry_alloc(inode, first + n);
+        if (p == NULL) {
+            break;
+        }
+        p->data = data;
+        p->borrowed = true;
+        pcache_insert(p);
+        pcache_stats.borrowed++;
+        n++;
+    }
+    return n;
+}
+
+// Bring up to count pages from first on into the cache, stopping at the
+// first page that is already there. Returns how many were added.
+static int pcache_fill(vfs_inode_t *inode, uint32_t first, int count) {
+    static pcache_page_t *entries[PCACHE_READAHEAD];
+    static uint8_t *data[PCACHE_READAHEAD];
+    int n = pcache_borrow(inode, first, count);
+
+    if (n > 0) {
+        return n;
+    }
+    while (n < count && n < PCACHE_READAHEAD && (n == 0 || !pcache_find(inode, first + n))) {
+        entries[n] = pcache_entry_alloc(inode, first + n);
+        if (entries[n] == NULL) {
+            break;
+        }
+        data[n] = pcache_data_alloc();
+        if (data[n] == NULL) {
+            entries[n]->in_use = false;
+            break;
+        }
+        entries[n]->data = data[n];
+        n++;
+    }
+    if (n == 0) {
+        printk("pagecache: out of memory\n");
+        return -1;
+    }
+
+    if (!pcache_read_pages(inode, first, data, n)) {
+        for (int i = 0; i < n; i++) {
+            free_page(data[i]);
+            entries[i]->in_use = false;
+        }
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        pcache_insert(entries[i]);
+    }
+    return n;
+}
+
+// Reading ===============================================================
+
+// Read len bytes at offset through the cache, returns the number of bytes
+// read or -1
+int pcache_read(vfs_file_t *file, uint64_t offset, void *buf, uint32_t len) {
+    vfs_inode_t *inode = file->dentry->inode;
+    uint8_t *dst = buf;
+    uint32_t done = 0;
+
+    if (offset >= inode->size) {
+        return 0;
+    }
+    if (len > inode->size - offset) {
+        len = inode->size - offset;
+    }
+
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint32_t index = pos / PCACHE_PAGE_SIZE;
+        uint32_t in_page = pos % PCACHE_PAGE_SIZE;
+        uint32_t n = PCACHE_PAGE_SIZE - in_page < len - done ? PCACHE_PAGE_SIZE - in_page : len - done;
+
+        pcache_page_t *p = pcache_find(inode, index);
+        if (p) {
+            pcache_stats.hits++;
+        } else {
+            pcache_stats.misses++;
+
+            // Sequential readers get a window that doubles up to the limit,
+            // others just the pages this call needs
+            uint32_t want = (offset + len - 1) / PCACHE_PAGE_SIZE - index + 1;
+            uint32_t window = 0;
+            if (index == file->ra_next) {
+                window = file->ra_pages ? file->ra_pages * 2 : 4;
+                if (window > PCACHE_READAHEAD) {
+                    window = PCACHE_READAHEAD;
+                }
+            }
+            file->ra_pages = window;
+
+            uint32_t count = want > window ? want : window;
+            if (count > pcache_file_pages(inode) - index) {
+                count = pcache_file_pages(inode) - index;
+            }
+            int added = pcache_fill(inode, index, count);
+            if (added < 0) {
+                return done ? (int)done : -1;
+            }
+            if ((uint32_t)added > want) {
+                pcache_stats.readahead += added - want;
+            }
+            p = pcache_find(inode, index);
+        }
+
+        if (p->pins == 0) {
+            pcache_lru_remove(p);
+            pcache_lru_add(p);
+        }
+        memcpy(dst + done, p->data + in_page, n);
+        done += n;
+        file->ra_next = index + 1;
+    }
+    return len;
+}
+
+// Writing ===============================================================
+
+// The file system took len bytes at offset, bring cached pages up to date
+void pcache_update(vfs_inode_t *inode, uint64_t offset, const void *buf, uint32_t len) {
+    const uint8_t *src = buf;
+
+    for (uint32_t done = 0; done < len;) {
+        uint64_t pos = offset + done;
+        uint32_t in_page = pos % PCACHE_PAGE_SIZE;
+        uint32_t n = PCACHE_PAGE_SIZE - in_page < len - done ? PCACHE_PAGE_SIZE - in_page : len - done;
+        pcache_page_t *p = pcache_find(inode, pos / PCACHE_PAGE_SIZE);
+        // msync() writes a mapping from the very pages the cache holds, and
+        // the write already went into borrowed pages through the device
+        if (p && !p->borrowed && p->data + in_page != src + done) {
+            memcpy(p->data + in_page, src + done, n);
+        }
+        done += n;
+    }
+}
+
+// The file is now size bytes long
+void pcache_truncate(vfs_inode_t *inode, uint64_t size) {
+    uint32_t keep = (size + PCACHE_PAGE_SIZE - 1) / PCACHE_PAGE_SIZE;
+
+    for (int i = 0; i < PCACHE_PAGES; i++) {
+        pcache_page_t *p = &pcache_pages[i];
+        if (!p->in_use || p->inode != inode) {
+            continue;
+        }
+        if (p->index >= keep) {
+            pcache_remove(p);
+        } else if (p->index == keep - 1 && size % PCACHE_PAGE_SIZE) {
+            if (p->borrowed) {
+                pcache_remove(p);   // The rest of the page is not the file's any more
+                continue;
+            }
+            // Past the end reads as zero, also if the file grows again
+            memset(p->data + size % PCACHE_PAGE_SIZE, 0, PCACHE_PAGE_SIZE - size % PCACHE_PAGE_SIZE);
+        }
+    }
+}
+
+// The inode leaves the VFS, its pages go with it
+void pcache_drop_inode(vfs_inode_t *inode) {
+    for (int i = 0; i < PCACHE_PAGES; i++) {
+        if (pcache_pages[i].in_use && pcache_pages[i].inode == inode) {
+            pcache_remove(&pcache_pages[i]);
+        }
+    }
+}
+
+// Mappings ==============================================================
+
+static pcache_map_t *pcache_map_at(void *addr) {
+    uint8_t *a = addr;
+    for (int i = 0; i < PCACHE_MAX_MAPS; i++) {
+        pcache_map_t *map = &pcache_maps[i];
+        if (map->in_use && a >= map->addr && a < map->addr + map->pages * PCACHE_PAGE_SIZE) {
+            return map;
+        }
+    }
+    return NULL;
+}
+
+// Make the cache use the mapping's pages for the mapped range
+static bool pcache_share(pcache_map_t *map) {
+    static uint8_t *data[PCACHE_READAHEAD];
+    vfs_inode_t *inode = map->file->dentry->inode;
+    uint32_t first = map->offset / PCACHE_PAGE_SIZE;
+    uint32_t file_pages = pcache_file_pages(inode);
+    uint32_t i = 0;
+
+    while (i < map->pages) {
+        uint8_t *dst = map->addr + i * PCACHE_PAGE_SIZE;
+        uint32_t index = first + i;
+
+        if (index >= file_pages) {
+            memset(dst, 0, PCACHE_PAGE_SIZE);
+            i++;
+            continue;
+        }
+
+        pcache_page_t *p = pcache_find(inode, index);
+        if (p) {
+            memcpy(dst, p->data, PCACHE_PAGE_SIZE);
+            // Another mapping already holds this page, or the device does,
+            // ours stays a copy
+            if (p->pins == 0 && !p->borrowed) {
+                pcache_lru_remove(p);
+                free_page(p->data);
+                p->data = dst;
+                p->pins = 1;
+                pcache_stats.mapped++;
+            }
+            i++;
+            continue;
+        }
+
+        // A run of missing pages is read in one go, straight into the mapping
+        int n = 0;
+        while (n < PCACHE_READAHEAD && i + n < map->pages && index + n < file_pages &&
+               !pcache_find(inode, index + n)) {
+            data[n] = dst + n * PCACHE_PAGE_SIZE;
+            n++;
+        }
+        if (!pcache_read_pages(inode, index, data, n)) {
+            return false;
+        }
+        for (int k = 0; k < n; k++) {
+            pcache_page_t *entry = pcache_entry_alloc(inode, index + k);
+            if (entry == NULL) {
+                break;      // Still mapped, just not shared with read()
+            }
+            entry->data = data[k];
+            entry->pins = 1;
+            pcache_insert(entry);
+            pcache_stats.mapped++;
+        }
+        i += n;
+    }
+    return true;
+}
+
+// Give the cache its pages back before the mapping goes away
+static void pcache_unshare(pcache_map_t *map) {
+    vfs_inode_t *inode = map->file->dentry->inode;
+    uint32_t first = map->offset / PCACHE_PAGE_SIZE;
+
+    for (uint32_t i = 0; i < map->pages; i++) {
+        uint8_t *page = map->addr + i * PCACHE_PAGE_SIZE;
+        pcache_page_t *p = pcache_find(inode, first + i);
+        if (p == NULL || p->data != page) {
+            continue;
+        }
+        uint8_t *copy = alloc_page();
+        if (copy == NULL) {
+            pcache_remove(p);
+            continue;
+        }
+        memcpy(copy, page, PCACHE_PAGE_SIZE);
+        p->data = copy;
+        p->pins = 0;
+        pcache_lru_add(p);
+    }
+}
+
+static void pcache_map_free(pcache_map_t *map) {
+    pcache_unshare(map);
+    free_pages(map->addr, map->pages);
+    vfs_close(map->file);
+    map->in_use = false;
+}
+
+// Map length bytes of file from offset, which must be page aligned.
+// Returns MAP_FAILED on error.
+void *pcache_mmap(vfs_file_t *file, uint64_t offset, size_t length, int prot, int flags) {
+    vfs_inode_t *inode = file->dentry->inode;
+    pcache_map_t *map = NULL;
+
+    if (length == 0 || offset % PCACHE_PAGE_SIZE || inode->directory) {
+        return MAP_FAILED;
+    }
+    for (int i = 0; i < PCACHE_MAX_MAPS; i++) {
+        if (!pcache_maps[i].in_use) {
+            map = &pcache_maps[i];
+            break;
+        }
+    }
+    if (map == NULL) {
+        printk("pagecache: too many mappings\n");
+        return MAP_FAILED;
+    }
+
+    memset(map, 0, sizeof(pcache_map_t));
+    map->pages = (length + PCACHE_PAGE_SIZE - 1) / PCACHE_PAGE_SIZE;
+    map->offset = offset;
+    map->prot = prot;
+    map->flags = flags;
+    while ((map->addr = alloc_pages(map->pages)) == NULL) {
+        if (!pcache_evict_one()) {
+            printk("pagecache: no room for a %d page mapping\n", map->pages);
+            return MAP_FAILED;
+        }
+    }
+    map->file = vfs_dup(file);
+    if (map->file == NULL) {
+        free_pages(map->addr, map->pages);
+        return MAP_FAILED;
+    }
+    map->in_use = true;
+
+    bool shared = inode->mnt->ops->page_cache && (!(prot & PROT_WRITE) || (flags & MAP_SHARED));
+    bool ok;
+    if (shared) {
+        ok = pcache_share(map);
+    } else {
+        // A private copy, written to by nobody else
+        uint32_t bytes = map->pages * PCACHE_PAGE_SIZE;
+        int n = 0;
+        if (vfs_seek(map->file, offset)) {
+            n = vfs_read(map->file, map->addr, bytes);
+        }
+        ok = n >= 0;
+        if (ok) {
+            memset(map->addr + n, 0, bytes - n);
+        }
+    }
+    if (!ok) {
+        pcache_map_free(map);
+        return MAP_FAILED;
+    }
+    return map->addr;
+}
+
+// Write the part of a shared writable mapping at addr back to the file
+bool pcache_msync(void *addr, size_t length) {
+    pcache_map_t *map = pcache_map_at(addr);
+    if (map == NULL) {
+        return false;
+    }
+    vfs_inode_t *inode = map->file->dentry->inode;
+    if (!(map->prot & PROT_WRITE) || !(map->flags & MAP_SHARED) || inode->mnt->ops->write == NULL) {
+        return true;
+    }
+
+    // No page tables means no dirty bits: the whole range goes out
+    uint8_t *start = addr;
+    uint8_t *end = map->addr + map->pages * PCACHE_PAGE_SIZE;
+    if (length < (size_t)(end - start)) {
+        end = start + length;
+    }
+    uint64_t pos = map->offset + (start - map->addr);
+    if (pos >= inode->size) {
+        return true;
+    }
+    uint32_t len = end - start;
+    if (len > inode->size - pos) {
+        len = inode->size - pos;
+    }
+    int n = inode->mnt->ops->write(inode, pos, start, len);
+    if (n != (int)len) {
+        printk("pagecache: write back of mapping failed\n");
+        return false;
+    }
+    pcache_update(inode, pos, start, len);
+    return true;
+}
+
+// Unmap the mapping that starts at addr. Mappings go away whole; returns
+// false if addr is not one of ours.
+bool pcache_munmap(void *addr, size_t length) {
+    (void)length;
+    pcache_map_t *map = NULL;
+    for (int i = 0; i < PCACHE_MAX_MAPS; i++) {
+        if (pcache_maps[i].in_use && pcache_maps[i].addr == addr) {
+            map = &pcache_maps[i];
+            break;
+        }
+    }
+    if (map == NULL) {
+        return false;
+    }
+
+    pcache_msync(map->addr, map->pages * PCACHE_PAGE_SIZE);
+    pcache_map_free(map);
+    return true;
+}
+
+void pcache_print_stats() {
+    int cached = 0, mapped = 0, maps = 0;
+    for (int i = 0; i < PCACHE_PAGES; i++) {
+        if (pcache_pages[i].in_use) {
+            cached++;
+            if (pcache_pages[i].pins) {
+                mapped++;
+            }
+        }
+    }
+    for (int i = 0; i < PCACHE_MAX_MAPS; i++) {
+        if (pcache_maps[i].in_use) {
+            maps++;
+        }
+    }
+    printk("Page cache: %d pages, %d in %d mappings\n", cached, mapped, maps);
+    printk("  hits %d, misses %d, read ahead %d\n", pcache_stats.hits, pcache_stats.misses, pcache_stats.readahead);
+    printk("  evictions %d, pages mapped without a copy %d\n", pcache_stats.evictions, pcache_stats.mapped);
+    printk("  pages used in place on the device %d\n", pcache_stats.borrowed);
+}
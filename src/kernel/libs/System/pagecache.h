@@ -0,0 +1,60 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "vfs.h"
+
+#define PCACHE_PAGE_SIZE  4096
+#define PCACHE_PAGES      512       // Entries, 2 MiB of cached file data
+#define PCACHE_HASH       256
+#define PCACHE_READAHEAD  32        // Largest readahead window, pages
+#define PCACHE_MAX_MAPS   16
+
+// One cached page of a file
+typedef struct pcache_page {
+    vfs_inode_t *inode;
+    uint32_t index;                 // Page of the file
+    uint8_t *data;
+    int pins;                       // Set while data is part of a file mapping
+    bool borrowed;                  // data is the device's own memory, not a page of ours
+    bool in_use;
+    struct pcache_page *hash_next;
+    struct pcache_page *lru_prev, *lru_next;    // Unpinned pages, least recently used first
+} pcache_page_t;
+
+// A file mapped with mmap(). There is no paging, so a mapping is a run of
+// physically contiguous pages; for shared and read-only mappings those
+// pages are the page cache's own copy of the file.
+typedef struct {
+    uint8_t *addr;
+    uint32_t pages;
+    vfs_file_t *file;               // Our own handle, the caller may close theirs
+    uint64_t offset;
+    int prot;
+    int flags;
+    bool in_use;
+} pcache_map_t;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t readahead;             // Pages read ahead of the reader
+    uint32_t evictions;
+    uint32_t mapped;                // Pages handed to a mapping without a copy
+    uint32_t borrowed;              // Pages used in place on a memory backed device
+} pcache_stats_t;
+
+int pcache_read(vfs_file_t *file, uint64_t offset, void *buf, uint32_t len);
+void pcache_update(vfs_inode_t *inode, uint64_t offset, const void *buf, uint32_t len);
+void pcache_truncate(vfs_inode_t *inode, uint64_t size);
+void pcache_drop_inode(vfs_inode_t *inode);
+
+void *pcache_mmap(vfs_file_t *file, uint64_t offset, size_t length, int prot, int flags);
+bool pcache_munmap(void *addr, size_t length);
+bool pcache_msync(void *addr, size_t length);
+
+void pcache_print_stats();
+
+#endif // PAGECACHE_H
@@ -0,0 +1,238 @@
+#include "ramfs.h"
+#include "vfs.h"
+#include "system.h"
+#include "../Drivers/kernel.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// RAM file system
+//
+// Lives only in memory and only through the VFS: "/" is one, so there is
+// somewhere to mount other file systems before any disk shows up. Nodes come
+// from a fixed pool since malloc() never frees, file data from alloc_page().
+
+#define RAMFS_PAGE_SIZE 4096
+
+static ramfs_node_t ramfs_nodes[RAMFS_MAX_NODES];
+
+static ramfs_node_t *ramfs_node_alloc(const char *name, bool directory) {
+    for (int i = 0; i < RAMFS_MAX_NODES; i++) {
+        ramfs_node_t *node = &ramfs_nodes[i];
+        if (!node->in_use) {
+            memset(node, 0, sizeof(ramfs_node_t));
+            strncpy(node->name, name, RAMFS_NAME_MAX);
+            node->directory = directory;
+            node->in_use = true;
+            return node;
+        }
+    }
+    printk("ramfs: out of nodes\n");
+    return NULL;
+}
+
+// Free the data pages from page first on
+static void ramfs_free_pages(ramfs_node_t *node, uint32_t first) {
+    if (node->pages == NULL) {
+        return;
+    }
+    for (uint32_t i = first; i < RAMFS_MAX_PAGES; i++) {
+        if (node->pages[i]) {
+            free_page(node->pages[i]);
+            node->pages[i] = NULL;
+        }
+    }
+    if (first == 0) {
+        free_page(node->pages);
+        node->pages = NULL;
+    }
+}
+
+static void ramfs_node_free(ramfs_node_t *node) {
+    while (node->children) {
+        ramfs_node_t *child = node->children;
+        node->children = child->next;
+        ramfs_node_free(child);
+    }
+    ramfs_free_pages(node, 0);
+    node->in_use = false;
+}
+
+static void ramfs_fill(vfs_inode_t *inode, ramfs_node_t *node) {
+    inode->u.ram = node;
+    inode->ino = node - ramfs_nodes;
+    inode->directory = node->directory;
+    inode->size = node->size;
+}
+
+// VFS operations ========================================================
+
+static bool ramfs_mount(vfs_mount_t *mnt, block_device_t *dev, vfs_inode_t *root) {
+    (void)dev;
+    ramfs_node_t *node = ramfs_node_alloc("", true);
+    if (node == NULL) {
+        return false;
+    }
+    mnt->fs_data = node;
+    ramfs_fill(root, node);
+    return true;
+}
+
+static void ramfs_unmount(vfs_mount_t *mnt) {
+    ramfs_node_free(mnt->fs_data);
+}
+
+static bool ramfs_lookup(vfs_inode_t *dir, const char *name, vfs_inode_t *out) {
+    for (ramfs_node_t *node = dir->u.ram->children; node; node = node->next) {
+        if (strcmp(node->name, name) == 0) {
+            ramfs_fill(out, node);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ramfs_readdir(vfs_inode_t *dir, uint32_t *pos, vfs_dirent_t *out) {
+    ramfs_node_t *node = dir->u.ram->children;
+    for (uint32_t i = 0; node && i < *pos; i++) {
+        node = node->next;
+    }
+    if (node == NULL) {
+        return false;
+    }
+    strcpy(out->name, node->name);
+    out->directory = node->directory;
+    out->size = node->size;
+    (*pos)++;
+    return true;
+}
+
+static int ramfs_read(vfs_inode_t *inode, uint64_t offset, void *buf, uint32_t len) {
+    ramfs_node_t *node = inode->u.ram;
+    uint8_t *dst = buf;
+
+    if (offset >= node->size) {
+        return 0;
+    }
+    if (len > node->size - offset) {
+        len = node->size - offset;
+    }
+    for (uint32_t done = 0; done < len;) {
+        uint64_t pos = offset + done;
+        uint32_t in_page = pos % RAMFS_PAGE_SIZE;
+        uint32_t n = RAMFS_PAGE_SIZE - in_page < len - done ? RAMFS_PAGE_SIZE - in_page : len - done;
+        uint8_t *page = node->pages ? node->pages[pos / RAMFS_PAGE_SIZE] : NULL;
+        if (page) {
+            memcpy(dst + done, page + in_page, n);
+        } else {
+            memset(dst + done, 0, n);
+        }
+        done += n;
+    }
+    return len;
+}
+
+static int ramfs_write(vfs_inode_t *inode, uint64_t offset, const void *buf, uint32_t len) {
+    ramfs_node_t *node = inode->u.ram;
+    const uint8_t *src = buf;
+
+    if (offset + len > (uint64_t)RAMFS_MAX_PAGES * RAMFS_PAGE_SIZE) {
+        printk("ramfs: file too large\n");
+        return -1;
+    }
+    if (node->pages == NULL) {
+        node->pages = alloc_page();
+        if (node->pages == NULL) {
+            return -1;
+        }
+        memset(node->pages, 0, RAMFS_PAGE_SIZE);
+    }
+
+    for (uint32_t done = 0; done < len;) {
+        uint64_t pos = offset + done;
+        uint32_t in_page = pos % RAMFS_PAGE_SIZE;
+        uint32_t n = RAMFS_PAGE_SIZE - in_page < len - done ? RAMFS_PAGE_SIZE - in_page : len - done;
+        uint8_t **page = &node->pages[pos / RAMFS_PAGE_SIZE];
+        if (*page == NULL) {
+            *page = alloc_page();
+            if (*page == NULL) {
+                return done ? (int)done : -1;
+            }
+            memset(*page, 0, RAMFS_PAGE_SIZE);
+        }
+        memcpy(*page + in_page, src + done, n);
+        done += n;
+        if (pos + n > node->size) {
+            node->size = pos + n;
+        }
+    }
+    inode->size = node->size;
+    return len;
+}
+
+static bool ramfs_truncate(vfs_inode_t *inode, uint64_t size) {
+    ramfs_node_t *node = inode->u.ram;
+
+    if (size > (uint64_t)RAMFS_MAX_PAGES * RAMFS_PAGE_SIZE) {
+        return false;
+    }
+    if (size < node->size) {
+        ramfs_free_pages(node, (size + RAMFS_PAGE_SIZE - 1) / RAMFS_PAGE_SIZE);
+        // The kept part of the last page must read as zero if the file grows again
+        uint8_t *last = node->pages ? node->pages[size / RAMFS_PAGE_SIZE] : NULL;
+        if (last && size % RAMFS_PAGE_SIZE) {
+            memset(last + size % RAMFS_PAGE_SIZE, 0, RAMFS_PAGE_SIZE - size % RAMFS_PAGE_SIZE);
+        }
+    }
+    node->size = size;
+    inode->size = size;
+    return true;
+}
+
+static bool ramfs_create(vfs_inode_t *dir, const char *name, bool directory, vfs_inode_t *out) {
+    ramfs_node_t *parent = dir->u.ram;
+
+    if (strlen(name) > RAMFS_NAME_MAX) {
+        printk("ramfs: name too long\n");
+        return false;
+    }
+    ramfs_node_t *node = ramfs_node_alloc(name, directory);
+    if (node == NULL) {
+        return false;
+    }
+    node->parent = parent;
+    node->next = parent->children;
+    parent->children = node;
+    ramfs_fill(out, node);
+    return true;
+}
+
+static bool ramfs_remove(vfs_inode_t *dir, vfs_inode_t *inode) {
+    ramfs_node_t *node = inode->u.ram;
+
+    if (node->children) {
+        return false;
+    }
+    for (ramfs_node_t **link = &dir->u.ram->children; *link; link = &(*link)->next) {
+        if (*link == node) {
+            *link = node->next;
+            ramfs_node_free(node);
+            return true;
+        }
+    }
+    return false;
+}
+
+const vfs_fs_ops_t ramfs_vfs_ops = {
+    .name = "ramfs",
+    .case_fold = false,
+    .mount = ramfs_mount,
+    .unmount = ramfs_unmount,
+    .lookup = ramfs_lookup,
+    .readdir = ramfs_readdir,
+    .read = ramfs_read,
+    .write = ramfs_write,
+    .truncate = ramfs_truncate,
+    .create = ramfs_create,
+    .remove = ramfs_remove,
+};
@@ -0,0 +1,25 @@
+#ifndef RAMFS_H
+#define RAMFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define RAMFS_MAX_NODES 256
+#define RAMFS_NAME_MAX  63
+#define RAMFS_MAX_PAGES (4096 / sizeof(uint8_t *))     // One index page, 4 MiB per file
+
+// A file or directory of a RAM file system. Data lives in whole pages,
+// found through an index page; holes read as zero.
+typedef struct ramfs_node {
+    char name[RAMFS_NAME_MAX + 1];
+    bool directory;
+    bool in_use;
+    uint64_t size;
+    uint8_t **pages;                // NULL until the first write
+    struct ramfs_node *parent;
+    struct ramfs_node *children;
+    struct ramfs_node *next;        // Next entry of the parent directory
+} ramfs_node_t;
+
+#endif // RAMFS_H
@@ -2,6 +2,8 @@
 #include "system.h"
 #include "../Drivers/kernel.h"
 #include "time.h"
+#include "vfs.h"
+#include "pagecache.h"
 
 #define HEAP_SIZE 0x100000
 static uint8_t heap[HEAP_SIZE];
@@ -11,7 +13,8 @@ static size_t heap_index = 0;
 #define PHYS_MEM_SIZE 0x1000000  // 16 MB
 #define MAX_PAGES (PHYS_MEM_SIZE / PAGE_SIZE)
 
-static uint8_t physical_memory[PHYS_MEM_SIZE];
+// Page aligned so pages can be handed to DMA engines directly
+static uint8_t physical_memory[PHYS_MEM_SIZE] __attribute__((aligned(PAGE_SIZE)));
 static uint8_t page_bitmap[MAX_PAGES];  // 0 = free, 1 = used
 
 void* alloc_page() {
@@ -34,6 +37,26 @@ void free_page(void* ptr) {
     }
 }
 
+// count physically contiguous pages, for buffers that must be one piece
+void* alloc_pages(size_t count) {
+    size_t run = 0;
+    for (size_t i = 0; i < MAX_PAGES && count > 0; i++) {
+        run = page_bitmap[i] ? 0 : run + 1;
+        if (run == count) {
+            size_t first = i + 1 - count;
+            memset(&page_bitmap[first], 1, count);
+            return &physical_memory[first * PAGE_SIZE];
+        }
+    }
+    return NULL;
+}
+
+void free_pages(void* ptr, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free_page((uint8_t *)ptr + i * PAGE_SIZE);
+    }
+}
+
 size_t strlen(const char* str) {
     size_t len = 0;
     while (str[len] != '\0') {
@@ -258,6 +281,15 @@ char* strcat(char* dest, const char* src) {
     return original_dest;
 }
 
+// Lower case hex with exactly digits digits, printk has no %x
+void hex_format(char *out, uint32_t value, int digits) {
+    for (int i = digits - 1; i >= 0; i--) {
+        out[i] = "0123456789abcdef"[value & 0xF];
+        value >>= 4;
+    }
+    out[digits] = '\0';
+}
+
 // String comparison (first n characters)
 int strncmp(const char* s1, const char* s2, size_t n) {
     for (size_t i = 0; i < n; i++) {
@@ -333,8 +365,17 @@ static MemoryMapping mappings[MAX_MAPPINGS];
 static size_t next_mapping = 0;
 
 void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
-    (void)fd; (void)offset;
-    
+    (void)addr;
+
+    // Files are mapped by the page cache, fd is a VFS file descriptor
+    if (!(flags & MAP_ANONYMOUS)) {
+        vfs_file_t *file = vfs_fd_file(fd);
+        if (file == NULL || offset < 0) {
+            return MAP_FAILED;
+        }
+        return pcache_mmap(file, offset, length, prot, flags);
+    }
+
     if (next_mapping >= MAX_MAPPINGS) {
         return MAP_FAILED;
     }
@@ -357,8 +398,10 @@ void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
 }
 
 int munmap(void* addr, size_t length) {
-    (void)length; // Simple implementation ignores length
-    
+    if (pcache_munmap(addr, length)) {
+        return 0;
+    }
+
     for (size_t i = 0; i < next_mapping; i++) {
         if (mappings[i].addr == addr && mappings[i].allocated) {
             free(addr);
@@ -369,6 +412,127 @@ int munmap(void* addr, size_t length) {
     return -1; // Failed to find mapping
 }
 
+// Write a shared file mapping back to its file
+int msync(void* addr, size_t length, int flags) {
+    (void)flags;    // Always synchronous
+    return pcache_msync(addr, length) ? 0 : -1;
+}
+
 void wrstr(const char *str) {
     printk(str);  // Use printk to write the entire string
-}
\ No newline at end of file
+}
+
+// CPU topology ========================================================
+
+static void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    __asm__ volatile ("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+// Logical processors in the package as reported by CPUID
+int cpu_count() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 28))) {  // HTT: the count field is only valid with this bit set
+        return 1;
+    }
+    int count = (ebx >> 16) & 0xFF;
+    return count > 0 ? count : 1;
+}
+
+// Initial local APIC ID of the CPU running this code
+int cpu_current() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return ebx >> 24;
+}
+
+// Memory types ========================================================
+//
+// Paging is off, so PAT never applies and the memory type of an address
+// comes from the MTRRs alone. Write combining is set up with a variable
+// range MTRR, which covers a naturally aligned power of two.
+
+#define MSR_MTRRCAP        0xFE
+#define MSR_MTRR_DEF_TYPE  0x2FF
+#define MSR_MTRR_PHYSBASE0 0x200
+#define MTRRCAP_VCNT       0xFF
+#define MTRRCAP_WC         (1 << 10)
+#define MTRR_DEF_ENABLE    (1 << 11)
+#define MTRR_VALID         (1 << 11)
+#define MTRR_TYPE_UC       0
+#define MTRR_TYPE_WC       1
+
+static uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile ("wrmsr" :: "a"((uint32_t)value), "d"((uint32_t)(value >> 32)), "c"(msr));
+}
+
+static uint64_t cpu_phys_mask() {
+    uint32_t eax, ebx, ecx, edx;
+    int bits = 36;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000008) {
+        cpuid(0x80000008, &eax, &ebx, &ecx, &edx);
+        bits = eax & 0xFF;
+    }
+    return (bits >= 64 ? 0 : 1ULL << bits) - 1;
+}
+
+// Map [base, base + size) write combining. size must be a power of two of
+// at least 4K and base a multiple of it. Fails without a free variable MTRR,
+// or where another range already gives the memory a type.
+bool cpu_set_write_combining(uint64_t base, uint64_t size) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 12)) || size < 4096 || (size & (size - 1)) || (base & (size - 1))) {
+        return false;
+    }
+    uint64_t cap = rdmsr(MSR_MTRRCAP);
+    if (!(cap & MTRRCAP_WC)) {
+        return false;
+    }
+
+    uint64_t phys = cpu_phys_mask();
+    uint64_t mask = ~(size - 1) & phys & ~0xFFFULL;
+    int free_reg = -1;
+    for (int i = 0; i < (int)(cap & MTRRCAP_VCNT); i++) {
+        uint64_t other_base = rdmsr(MSR_MTRR_PHYSBASE0 + 2 * i);
+        uint64_t other_mask = rdmsr(MSR_MTRR_PHYSBASE0 + 2 * i + 1);
+        if (!(other_mask & MTRR_VALID)) {
+            if (free_reg < 0) {
+                free_reg = i;
+            }
+            continue;
+        }
+        other_mask &= phys & ~0xFFFULL;
+        other_base &= phys & ~0xFFFULL;
+        // Aligned power of two ranges overlap only by one containing the other's base
+        if ((base & other_mask) == other_base || (other_base & mask) == base) {
+            return (rdmsr(MSR_MTRR_PHYSBASE0 + 2 * i) & 0xFF) == MTRR_TYPE_WC &&
+                   (base & other_mask) == other_base;
+        }
+    }
+    if (free_reg < 0) {
+        return false;
+    }
+
+    // The update sequence from the SDM: caches off and flushed, MTRRs off
+    // while the pair is written. Interrupts are never on here.
+    uint32_t cr0;
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile ("mov %0, %%cr0" :: "r"((cr0 | (1u << 30)) & ~(1u << 29)) : "memory");
+    __asm__ volatile ("wbinvd" ::: "memory");
+    uint64_t def_type = rdmsr(MSR_MTRR_DEF_TYPE);
+    wrmsr(MSR_MTRR_DEF_TYPE, def_type & ~(uint64_t)MTRR_DEF_ENABLE);
+    wrmsr(MSR_MTRR_PHYSBASE0 + 2 * free_reg, base | MTRR_TYPE_WC);
+    wrmsr(MSR_MTRR_PHYSBASE0 + 2 * free_reg + 1, mask | MTRR_VALID);
+    wrmsr(MSR_MTRR_DEF_TYPE, def_type);
+    __asm__ volatile ("wbinvd" ::: "memory");
+    __asm__ volatile ("mov %0, %%cr0" :: "r"(cr0) : "memory");
+    return true;
+}
@@ -12,9 +12,11 @@ typedef long off_t;
 #define PROT_READ       0x1
 #define PROT_WRITE      0x2
 #define PROT_EXEC       0x4
+#define MAP_SHARED      0x01
 #define MAP_PRIVATE     0x02
 #define MAP_ANONYMOUS   0x20
 #define MAP_FAILED      ((void*)-1)
+#define MS_SYNC         0x04
 
 // Character types
 bool isalpha(int c);
@@ -39,11 +41,23 @@ int atoi(const char *str);
 void* malloc(size_t size);
 void* memset(void* ptr, int value, size_t num);
 void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
+int munmap(void* addr, size_t length);
+int msync(void* addr, size_t length, int flags);
 void wrstr(const char *str);
+// Page allocator (4K pages out of physical_memory)
+void* alloc_page();
+void free_page(void* ptr);
+void* alloc_pages(size_t count);
+void free_pages(void* ptr, size_t count);
+// CPU topology
+int cpu_count();
+int cpu_current();
+bool cpu_set_write_combining(uint64_t base, uint64_t size);
 // String operations
 char* strcpy(char* dest, const char* src);
 size_t strlen(const char* str);
 char* strcat(char* dest, const char* src);
+void hex_format(char *out, uint32_t value, int digits);
 int strncmp(const char* s1, const char* s2, size_t n);
 char* strdup(const char* s);
 char *strncpy(char *dest, const char *src, size_t n);
@@ -54,4 +54,43 @@ void sleep(duration) {
     int time = get_time_in_seconds();
     while (get_time_in_seconds!=time+duration/100) {
     }
-}
\ No newline at end of file
+}
+// TSC ticks per microsecond, 0 until time_calibrate_tsc() has run
+static uint32_t tsc_per_us = 0;
+static uint64_t tsc_base = 0;
+
+uint64_t rdtsc() {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Count TSC ticks across a 10ms one-shot on PIT channel 2.
+// Channel 2 is gated through port 0x61 and its output can be polled there,
+// so this works without any interrupt handler installed.
+void time_calibrate_tsc() {
+    const uint16_t latch = 1193182 / 100;  // 10ms at the PIT input clock
+
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);  // Gate high, speaker off
+    outb(PIT_COMMAND_PORT, 0xB0);            // Channel 2, lo/hi byte, mode 0
+    outb(0x42, latch & 0xFF);
+    outb(0x42, latch >> 8);
+
+    uint64_t start = rdtsc();
+    while ((inb(0x61) & 0x20) == 0) {
+    }
+    uint64_t end = rdtsc();
+
+    tsc_per_us = (uint32_t)((end - start) / 10000);
+    if (tsc_per_us == 0) {
+        tsc_per_us = 1;  // Keep time_now_us() monotonic on broken PITs
+    }
+    tsc_base = end;
+}
+
+uint64_t time_now_us() {
+    if (tsc_per_us == 0) {
+        time_calibrate_tsc();
+    }
+    return (rdtsc() - tsc_base) / tsc_per_us;
+}
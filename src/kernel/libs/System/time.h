@@ -21,4 +21,9 @@ int get_time_in_seconds();           // Get time in seconds
 int get_time_in_minutes();           // Get time in minutes
 int syscall_handler(int syscall_number, int arg); // Handle system calls
 
+// High resolution clock (TSC calibrated against PIT channel 2)
+uint64_t rdtsc();                    // Read the CPU timestamp counter
+void time_calibrate_tsc();           // Measure TSC ticks per microsecond
+uint64_t time_now_us();              // Microseconds since calibration
+
 #endif // TIME_H
@@ -0,0 +1,791 @@
+#include "vfs.h"
+#include "pagecache.h"
+#include "system.h"
+#include "../Drivers/kernel.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Virtual file system
+//
+// Paths are resolved one component at a time through a dentry cache hashed
+// on (parent, name). A hit, positive or negative, costs one hash chain walk
+// and never reaches the file system; only misses call its lookup(). Every
+// dentry holds a reference on its parent, so unreferenced dentries can be
+// evicted from the leaves up in LRU order. Positive dentries point at
+// inodes, which are cached by (mount, inode number) so that two names for
+// the same file, and the file system state behind it (an exFAT extent list,
+// say), are shared. There is no current directory: every path starts at "/".
+
+static vfs_mount_t vfs_mounts[VFS_MAX_MOUNTS];
+static vfs_file_t vfs_files[VFS_MAX_FILES];
+
+static vfs_inode_t vfs_inodes[VFS_INODE_COUNT];
+static vfs_inode_t *vfs_inode_hash[VFS_INODE_HASH];
+static uint32_t vfs_clock = 0;
+
+static vfs_dentry_t vfs_dentries[VFS_DENTRY_COUNT];
+static vfs_dentry_t *vfs_dentry_hash[VFS_DENTRY_HASH];
+static vfs_dentry_t *vfs_lru_head = NULL, *vfs_lru_tail = NULL;
+
+static vfs_dentry_t *vfs_root = NULL;
+static vfs_stats_t vfs_stats;
+
+static const vfs_fs_ops_t *vfs_filesystems[] = { &ramfs_vfs_ops, &exfat_vfs_ops };
+
+// Inode cache ===========================================================
+
+static uint32_t vfs_inode_bucket(vfs_mount_t *mnt, uint64_t ino) {
+    uint32_t h = (uint32_t)ino ^ (uint32_t)(ino >> 32) ^ (uint32_t)(uintptr_t)mnt;
+    return (h * 2654435761u) % VFS_INODE_HASH;
+}
+
+static void vfs_inode_unhash(vfs_inode_t *inode) {
+    vfs_inode_t **link = &vfs_inode_hash[vfs_inode_bucket(inode->mnt, inode->ino)];
+    while (*link && *link != inode) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = inode->hash_next;
+    }
+}
+
+// Take an inode out of the cache for good
+static void vfs_inode_drop(vfs_inode_t *inode) {
+    vfs_inode_unhash(inode);
+    pcache_drop_inode(inode);
+    if (inode->mnt->ops->evict) {
+        inode->mnt->ops->evict(inode);
+    }
+    inode->in_use = false;
+}
+
+static void vfs_dentry_free(vfs_dentry_t *d);
+
+// Cached inode for what lookup() or create() filled into tmpl, taking a reference
+static vfs_inode_t *vfs_iget(vfs_inode_t *tmpl) {
+    const vfs_fs_ops_t *ops = tmpl->mnt->ops;
+    uint32_t bucket = vfs_inode_bucket(tmpl->mnt, tmpl->ino);
+
+    for (vfs_inode_t *inode = vfs_inode_hash[bucket]; inode; inode = inode->hash_next) {
+        if (inode->mnt == tmpl->mnt && inode->ino == tmpl->ino) {
+            if (ops->evict) {
+                ops->evict(tmpl);
+            }
+            inode->refs++;
+            inode->last_used = ++vfs_clock;
+            vfs_stats.inode_hits++;
+            return inode;
+        }
+    }
+
+    // A free slot, else the least recently used unreferenced inode. If every
+    // inode is referenced, shrink the dentry cache until one is not.
+    vfs_inode_t *slot = NULL;
+    while (slot == NULL) {
+        for (int i = 0; i < VFS_INODE_COUNT; i++) {
+            vfs_inode_t *inode = &vfs_inodes[i];
+            if (!inode->in_use) {
+                slot = inode;
+                break;
+            }
+            if (inode->refs == 0 && (slot == NULL || inode->last_used < slot->last_used)) {
+                slot = inode;
+            }
+        }
+        if (slot == NULL) {
+            if (vfs_lru_head == NULL) {
+                if (ops->evict) {
+                    ops->evict(tmpl);
+                }
+                printk("vfs: inode cache full\n");
+                return NULL;
+            }
+            vfs_dentry_free(vfs_lru_head);
+            vfs_stats.evictions++;
+        }
+    }
+    if (slot->in_use) {
+        vfs_inode_drop(slot);
+    }
+
+    *slot = *tmpl;
+    slot->refs = 1;
+    slot->open_count = 0;
+    slot->last_used = ++vfs_clock;
+    slot->in_use = true;
+    slot->hash_next = vfs_inode_hash[bucket];
+    vfs_inode_hash[bucket] = slot;
+    return slot;
+}
+
+static void vfs_iput(vfs_inode_t *inode) {
+    inode->refs--;
+}
+
+// Dentry cache ==========================================================
+
+static char vfs_fold(char c, bool fold) {
+    return (fold && c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
+
+static uint32_t vfs_name_hash(vfs_dentry_t *parent, const char *name, bool fold) {
+    uint32_t h = 2166136261u ^ (uint32_t)(uintptr_t)parent;
+    while (*name) {
+        h = (h ^ (uint8_t)vfs_fold(*name++, fold)) * 16777619u;
+    }
+    return h;
+}
+
+static bool vfs_name_equal(const char *a, const char *b, bool fold) {
+    while (*a && vfs_fold(*a, fold) == vfs_fold(*b, fold)) {
+        a++;
+        b++;
+    }
+    return *a == '\0' && *b == '\0';
+}
+
+static void vfs_lru_del(vfs_dentry_t *d) {
+    if (d->lru_prev) d->lru_prev->lru_next = d->lru_next;
+    else vfs_lru_head = d->lru_next;
+    if (d->lru_next) d->lru_next->lru_prev = d->lru_prev;
+    else vfs_lru_tail = d->lru_prev;
+    d->lru_prev = d->lru_next = NULL;
+}
+
+static void vfs_lru_add(vfs_dentry_t *d) {
+    d->lru_next = NULL;
+    d->lru_prev = vfs_lru_tail;
+    if (vfs_lru_tail) vfs_lru_tail->lru_next = d;
+    else vfs_lru_head = d;
+    vfs_lru_tail = d;
+}
+
+static void vfs_dget(vfs_dentry_t *d) {
+    if (d->refs++ == 0 && d->hashed) {
+        vfs_lru_del(d);
+    }
+}
+
+static void vfs_dput(vfs_dentry_t *d) {
+    if (--d->refs > 0) {
+        return;
+    }
+    if (d->hashed) {
+        vfs_lru_add(d);     // Stays cached until the space is needed
+    } else {
+        vfs_dentry_free(d);
+    }
+}
+
+// Forget an unreferenced dentry, dropping its references on inode and parent
+static void vfs_dentry_free(vfs_dentry_t *d) {
+    vfs_dentry_t *parent = d->parent;
+
+    if (d->hashed) {
+        vfs_dentry_t **link = &vfs_dentry_hash[d->hash % VFS_DENTRY_HASH];
+        while (*link && *link != d) {
+            link = &(*link)->hash_next;
+        }
+        if (*link) {
+            *link = d->hash_next;
+        }
+        vfs_lru_del(d);
+    }
+    if (d->inode) {
+        vfs_iput(d->inode);
+    }
+    memset(d, 0, sizeof(vfs_dentry_t));
+    if (parent) {
+        vfs_dput(parent);
+    }
+}
+
+// New dentry for name under parent, referenced once. Names too long to keep
+// inline are never hashed and go away with their last reference.
+static vfs_dentry_t *vfs_dentry_alloc(vfs_dentry_t *parent, vfs_mount_t *mnt, const char *name, uint32_t hash) {
+    vfs_dentry_t *d = NULL;
+    while (d == NULL) {
+        for (int i = 0; i < VFS_DENTRY_COUNT; i++) {
+            if (!vfs_dentries[i].in_use) {
+                d = &vfs_dentries[i];
+                break;
+            }
+        }
+        if (d == NULL) {
+            if (vfs_lru_head == NULL) {
+                printk("vfs: dentry cache full\n");
+                return NULL;
+            }
+            vfs_dentry_free(vfs_lru_head);
+            vfs_stats.evictions++;
+        }
+    }
+
+    memset(d, 0, sizeof(vfs_dentry_t));
+    d->in_use = true;
+    d->refs = 1;
+    d->mnt = mnt;
+    d->hash = hash;
+    d->parent = parent;
+    if (parent) {
+        vfs_dget(parent);
+        if (strlen(name) < VFS_DNAME_INLINE) {
+            strcpy(d->name, name);
+            d->hashed = true;
+            d->hash_next = vfs_dentry_hash[hash % VFS_DENTRY_HASH];
+            vfs_dentry_hash[hash % VFS_DENTRY_HASH] = d;
+        }
+    }
+    return d;
+}
+
+// Drop the unreferenced cached children of dir. With negatives_only, only the
+// names known not to exist.
+static void vfs_prune_children(vfs_dentry_t *dir, bool negatives_only) {
+    for (int i = 0; i < VFS_DENTRY_COUNT; i++) {
+        vfs_dentry_t *d = &vfs_dentries[i];
+        if (d->in_use && d->parent == dir && d->refs == 0 && (!negatives_only || d->inode == NULL)) {
+            vfs_dentry_free(d);
+        }
+    }
+}
+
+// Path walking ==========================================================
+
+// Step onto the root of whatever is mounted on d
+static vfs_dentry_t *vfs_follow_mounts(vfs_dentry_t *d) {
+    while (d->mounted) {
+        vfs_dentry_t *root = d->mounted->root;
+        vfs_dget(root);
+        vfs_dput(d);
+        d = root;
+    }
+    return d;
+}
+
+// Referenced dentry for name in dir, negative if it does not exist. NULL
+// on errors (dir is not a directory, out of cache entries).
+static vfs_dentry_t *vfs_lookup_child(vfs_dentry_t *dir, const char *name) {
+    if (dir->inode == NULL || !dir->inode->directory) {
+        return NULL;
+    }
+    vfs_stats.lookups++;
+
+    if (strcmp(name, ".") == 0) {
+        vfs_dget(dir);
+        return dir;
+    }
+    if (strcmp(name, "..") == 0) {
+        while (dir->parent == NULL && dir->mnt->mountpoint) {
+            dir = dir->mnt->mountpoint;
+        }
+        dir = dir->parent ? dir->parent : dir;
+        vfs_dget(dir);
+        return dir;
+    }
+
+    const vfs_fs_ops_t *ops = dir->mnt->ops;
+    uint32_t hash = vfs_name_hash(dir, name, ops->case_fold);
+    for (vfs_dentry_t *d = vfs_dentry_hash[hash % VFS_DENTRY_HASH]; d; d = d->hash_next) {
+        vfs_stats.probes++;
+        if (d->hash == hash && d->parent == dir && vfs_name_equal(d->name, name, ops->case_fold)) {
+            if (d->inode) {
+                vfs_stats.hits++;
+            } else {
+                vfs_stats.negative_hits++;
+            }
+            vfs_dget(d);
+            return vfs_follow_mounts(d);
+        }
+    }
+
+    // Miss: ask the file system, and remember the answer either way
+    vfs_stats.fs_lookups++;
+    vfs_inode_t tmpl;
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.mnt = dir->mnt;
+    bool found = ops->lookup(dir->inode, name, &tmpl);
+
+    vfs_dentry_t *d = vfs_dentry_alloc(dir, dir->mnt, name, hash);
+    if (d == NULL) {
+        if (found && ops->evict) {
+            ops->evict(&tmpl);
+        }
+        return NULL;
+    }
+    if (found) {
+        d->inode = vfs_iget(&tmpl);
+        if (d->inode == NULL) {
+            vfs_dput(d);
+            return NULL;
+        }
+    }
+    return d;
+}
+
+// Resolve path to a referenced dentry. With last set, stop at the parent of
+// the final component and copy that component to last ("" for "/").
+static vfs_dentry_t *vfs_walk(const char *path, char *last) {
+    char name[VFS_NAME_MAX + 1];
+
+    if (vfs_root == NULL) {
+        return NULL;
+    }
+    vfs_dget(vfs_root);
+    vfs_dentry_t *d = vfs_follow_mounts(vfs_root);
+    if (last) {
+        last[0] = '\0';
+    }
+
+    while (*path) {
+        while (*path == '/') {
+            path++;
+        }
+        if (*path == '\0') {
+            break;
+        }
+        size_t len = 0;
+        while (path[len] && path[len] != '/') {
+            len++;
+        }
+        if (len > VFS_NAME_MAX) {
+            vfs_dput(d);
+            return NULL;
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
+        while (*path == '/') {
+            path++;
+        }
+
+        if (last && *path == '\0') {
+            strcpy(last, name);
+            break;
+        }
+        vfs_dentry_t *next = vfs_lookup_child(d, name);
+        vfs_dput(d);
+        if (next == NULL || next->inode == NULL) {
+            if (next) {
+                vfs_dput(next);
+            }
+            return NULL;
+        }
+        d = next;
+    }
+    return d;
+}
+
+// Mounts ================================================================
+
+static const vfs_fs_ops_t *vfs_find_fs(const char *name) {
+    for (size_t i = 0; i < sizeof(vfs_filesystems) / sizeof(vfs_filesystems[0]); i++) {
+        if (strcmp(vfs_filesystems[i]->name, name) == 0) {
+            return vfs_filesystems[i];
+        }
+    }
+    return NULL;
+}
+
+// Mount file system fs from dev (NULL for ramfs) on the directory path
+bool vfs_mount(const char *fs, block_device_t *dev, const char *path) {
+    const vfs_fs_ops_t *ops = vfs_find_fs(fs);
+    vfs_mount_t *mnt = NULL;
+    vfs_dentry_t *mountpoint = NULL;
+
+    if (ops == NULL) {
+        printk("vfs: unknown file system %s\n", fs);
+        return false;
+    }
+    for (int i = 0; i < VFS_MAX_MOUNTS; i++) {
+        if (!vfs_mounts[i].in_use) {
+            mnt = &vfs_mounts[i];
+            break;
+        }
+    }
+    if (mnt == NULL) {
+        printk("vfs: too many mounts\n");
+        return false;
+    }
+    if (vfs_root) {
+        mountpoint = vfs_walk(path, NULL);
+        if (mountpoint == NULL || !mountpoint->inode->directory) {
+            printk("vfs: %s is not a directory\n", path);
+            if (mountpoint) {
+                vfs_dput(mountpoint);
+            }
+            return false;
+        }
+    }
+
+    memset(mnt, 0, sizeof(vfs_mount_t));
+    mnt->ops = ops;
+    mnt->dev = dev;
+    vfs_inode_t tmpl;
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.mnt = mnt;
+    if (!ops->mount(mnt, dev, &tmpl)) {
+        if (mountpoint) {
+            vfs_dput(mountpoint);
+        }
+        return false;
+    }
+    mnt->in_use = true;
+
+    mnt->root = vfs_dentry_alloc(NULL, mnt, "/", 0);
+    if (mnt->root) {
+        mnt->root->inode = vfs_iget(&tmpl);
+    }
+    if (mnt->root == NULL || mnt->root->inode == NULL) {
+        if (mnt->root) {
+            vfs_dput(mnt->root);
+        }
+        ops->unmount(mnt);
+        mnt->in_use = false;
+        if (mountpoint) {
+            vfs_dput(mountpoint);
+        }
+        return false;
+    }
+
+    // The mount keeps the references on its root and on the mountpoint
+    mnt->mountpoint = mountpoint;
+    if (mountpoint) {
+        mountpoint->mounted = mnt;
+    } else {
+        vfs_root = mnt->root;
+    }
+    return true;
+}
+
+// Unmount the file system whose root is at path
+bool vfs_umount(const char *path) {
+    vfs_dentry_t *d = vfs_walk(path, NULL);
+    if (d == NULL) {
+        return false;
+    }
+    vfs_mount_t *mnt = d->mnt;
+    bool is_root = d == mnt->root;
+    vfs_dput(d);
+    if (!is_root || mnt->mountpoint == NULL) {
+        printk("vfs: %s is not a mount point\n", path);
+        return false;
+    }
+
+    for (int i = 0; i < VFS_MAX_FILES; i++) {
+        if (vfs_files[i].in_use && vfs_files[i].dentry->mnt == mnt) {
+            printk("vfs: %s is busy\n", path);
+            return false;
+        }
+    }
+    for (int i = 0; i < VFS_MAX_MOUNTS; i++) {
+        if (vfs_mounts[i].in_use && vfs_mounts[i].mountpoint && vfs_mounts[i].mountpoint->mnt == mnt) {
+            printk("vfs: %s has file systems mounted below it\n", path);
+            return false;
+        }
+    }
+
+    // Every dentry of the mount is unreferenced now; free them leaves first
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (int i = 0; i < VFS_DENTRY_COUNT; i++) {
+            vfs_dentry_t *e = &vfs_dentries[i];
+            if (e->in_use && e->mnt == mnt && e->refs == 0) {
+                vfs_dentry_free(e);
+                progress = true;
+            }
+        }
+    }
+    vfs_dput(mnt->root);
+    for (int i = 0; i < VFS_INODE_COUNT; i++) {
+        if (vfs_inodes[i].in_use && vfs_inodes[i].mnt == mnt) {
+            vfs_inode_drop(&vfs_inodes[i]);
+        }
+    }
+
+    mnt->ops->unmount(mnt);
+    mnt->mountpoint->mounted = NULL;
+    vfs_dput(mnt->mountpoint);
+    mnt->in_use = false;
+    return true;
+}
+
+bool vfs_sync() {
+    bool ok = true;
+    for (int i = 0; i < VFS_MAX_MOUNTS; i++) {
+        vfs_mount_t *mnt = &vfs_mounts[i];
+        if (mnt->in_use && mnt->ops->sync) {
+            ok = mnt->ops->sync(mnt) && ok;
+        }
+    }
+    return ok;
+}
+
+// Whether a file system is mounted from dev
+bool vfs_dev_mounted(block_device_t *dev) {
+    for (int i = 0; i < VFS_MAX_MOUNTS; i++) {
+        if (vfs_mounts[i].in_use && vfs_mounts[i].dev == dev) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Files =================================================================
+
+// Turn the negative dentry d under dir into a new file or directory
+static bool vfs_create(vfs_dentry_t *dir, vfs_dentry_t *d, const char *name, bool directory) {
+    vfs_inode_t tmpl;
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.mnt = dir->mnt;
+    if (dir->mnt->ops->create == NULL || !dir->mnt->ops->create(dir->inode, name, directory, &tmpl)) {
+        return false;
+    }
+    d->inode = vfs_iget(&tmpl);
+    // Other spellings of the name may be cached as missing
+    vfs_prune_children(dir, true);
+    return d->inode != NULL;
+}
+
+vfs_file_t *vfs_open(const char *path, int flags) {
+    char name[VFS_NAME_MAX + 1];
+    vfs_file_t *file = NULL;
+
+    for (int i = 0; i < VFS_MAX_FILES; i++) {
+        if (!vfs_files[i].in_use) {
+            file = &vfs_files[i];
+            break;
+        }
+    }
+    if (file == NULL) {
+        printk("vfs: too many open files\n");
+        return NULL;
+    }
+
+    vfs_dentry_t *dir = vfs_walk(path, name);
+    if (dir == NULL) {
+        return NULL;
+    }
+    vfs_dentry_t *d = dir;
+    if (name[0]) {
+        d = vfs_lookup_child(dir, name);
+        if (d && d->inode == NULL && (!(flags & VFS_O_CREATE) || !vfs_create(dir, d, name, false))) {
+            vfs_dput(d);
+            d = NULL;
+        }
+        vfs_dput(dir);
+    }
+    if (d == NULL) {
+        return NULL;
+    }
+
+    vfs_inode_t *inode = d->inode;
+    if ((flags & VFS_O_TRUNC) && !inode->directory && inode->size) {
+        if (!inode->mnt->ops->truncate(inode, 0)) {
+            vfs_dput(d);
+            return NULL;
+        }
+        pcache_truncate(inode, 0);
+    }
+
+    memset(file, 0, sizeof(vfs_file_t));
+    file->dentry = d;
+    file->flags = flags;
+    file->in_use = true;
+    inode->open_count++;
+    return file;
+}
+
+// Second handle on the same open file, with its own offset
+vfs_file_t *vfs_dup(vfs_file_t *file) {
+    for (int i = 0; i < VFS_MAX_FILES; i++) {
+        vfs_file_t *copy = &vfs_files[i];
+        if (!copy->in_use) {
+            *copy = *file;
+            vfs_dget(copy->dentry);
+            copy->dentry->inode->open_count++;
+            return copy;
+        }
+    }
+    printk("vfs: too many open files\n");
+    return NULL;
+}
+
+// Open files double as file descriptors: their index in the table
+vfs_file_t *vfs_fd_file(int fd) {
+    if (fd < 0 || fd >= VFS_MAX_FILES || !vfs_files[fd].in_use) {
+        return NULL;
+    }
+    return &vfs_files[fd];
+}
+
+int vfs_file_fd(vfs_file_t *file) {
+    return file - vfs_files;
+}
+
+void vfs_close(vfs_file_t *file) {
+    vfs_inode_t *inode = file->dentry->inode;
+    if (--inode->open_count == 0 && inode->mnt->ops->release) {
+        inode->mnt->ops->release(inode);
+    }
+    vfs_dput(file->dentry);
+    file->in_use = false;
+}
+
+int vfs_read(vfs_file_t *file, void *buf, uint32_t len) {
+    vfs_inode_t *inode = file->dentry->inode;
+    if (inode->directory) {
+        return -1;
+    }
+    int n;
+    if (inode->mnt->ops->page_cache) {
+        n = pcache_read(file, file->offset, buf, len);
+    } else {
+        n = inode->mnt->ops->read(inode, file->offset, buf, len);
+    }
+    if (n > 0) {
+        file->offset += n;
+    }
+    return n;
+}
+
+int vfs_write(vfs_file_t *file, const void *buf, uint32_t len) {
+    vfs_inode_t *inode = file->dentry->inode;
+    if (inode->directory || inode->mnt->ops->write == NULL) {
+        return -1;
+    }
+    if (file->flags & VFS_O_APPEND) {
+        file->offset = inode->size;
+    }
+    int n = inode->mnt->ops->write(inode, file->offset, buf, len);
+    if (n > 0) {
+        pcache_update(inode, file->offset, buf, n);
+        file->offset += n;
+    }
+    return n;
+}
+
+bool vfs_seek(vfs_file_t *file, uint64_t offset) {
+    file->offset = offset;
+    return true;
+}
+
+bool vfs_truncate(vfs_file_t *file, uint64_t size) {
+    vfs_inode_t *inode = file->dentry->inode;
+    if (inode->directory || inode->mnt->ops->truncate == NULL) {
+        return false;
+    }
+    if (!inode->mnt->ops->truncate(inode, size)) {
+        return false;
+    }
+    pcache_truncate(inode, size);
+    return true;
+}
+
+// Write everything the file's file system holds back to disk
+bool vfs_fsync(vfs_file_t *file) {
+    vfs_mount_t *mnt = file->dentry->inode->mnt;
+    return mnt->ops->sync == NULL || mnt->ops->sync(mnt);
+}
+
+bool vfs_readdir(vfs_file_t *dir, vfs_dirent_t *out) {
+    vfs_inode_t *inode = dir->dentry->inode;
+    if (!inode->directory) {
+        return false;
+    }
+    return inode->mnt->ops->readdir(inode, &dir->dir_pos, out);
+}
+
+uint64_t vfs_size(vfs_file_t *file) {
+    return file->dentry->inode->size;
+}
+
+bool vfs_is_dir(vfs_file_t *file) {
+    return file->dentry->inode->directory;
+}
+
+// Names =================================================================
+
+bool vfs_mkdir(const char *path) {
+    char name[VFS_NAME_MAX + 1];
+    vfs_dentry_t *dir = vfs_walk(path, name);
+    if (dir == NULL) {
+        return false;
+    }
+    vfs_dentry_t *d = name[0] ? vfs_lookup_child(dir, name) : NULL;
+    bool ok = d && d->inode == NULL && vfs_create(dir, d, name, true);
+    if (d) {
+        vfs_dput(d);
+    }
+    vfs_dput(dir);
+    return ok;
+}
+
+bool vfs_unlink(const char *path) {
+    char name[VFS_NAME_MAX + 1];
+    vfs_dentry_t *dir = vfs_walk(path, name);
+    if (dir == NULL) {
+        return false;
+    }
+    vfs_dentry_t *d = name[0] ? vfs_lookup_child(dir, name) : NULL;
+    bool ok = false;
+
+    if (d && d->inode && d->parent == dir) {
+        vfs_inode_t *inode = d->inode;
+
+        // Names cached as missing below it, and other cached names for it,
+        // go first. A cached child that exists means it is not empty.
+        vfs_prune_children(d, true);
+        for (int i = 0; i < VFS_DENTRY_COUNT; i++) {
+            vfs_dentry_t *e = &vfs_dentries[i];
+            if (e->in_use && e != d && e->inode == inode && e->refs == 0) {
+                vfs_dentry_free(e);
+            }
+        }
+
+        if (d->refs > 1 || inode->refs > 1 || inode->open_count > 0) {
+            printk("vfs: %s is busy\n", path);
+        } else if (dir->mnt->ops->remove && dir->mnt->ops->remove(dir->inode, inode)) {
+            // The name now caches as missing
+            d->inode = NULL;
+            vfs_iput(inode);
+            vfs_inode_drop(inode);
+            ok = true;
+        }
+    }
+    if (d) {
+        vfs_dput(d);
+    }
+    vfs_dput(dir);
+    return ok;
+}
+
+void vfs_print_stats() {
+    int dentries = 0, negative = 0, unused = 0, inodes = 0;
+    for (int i = 0; i < VFS_DENTRY_COUNT; i++) {
+        if (vfs_dentries[i].in_use) {
+            dentries++;
+            negative += vfs_dentries[i].inode == NULL;
+            unused += vfs_dentries[i].refs == 0;
+        }
+    }
+    for (int i = 0; i < VFS_INODE_COUNT; i++) {
+        inodes += vfs_inodes[i].in_use;
+    }
+    printk("dentries: %d cached (%d negative, %d unused), inodes: %d cached\n", dentries, negative, unused, inodes);
+    printk("lookups: %d, dcache hits %d, negative hits %d, fs lookups %d\n",
+           vfs_stats.lookups, vfs_stats.hits, vfs_stats.negative_hits, vfs_stats.fs_lookups);
+    printk("hash probes: %d, inode cache hits %d, evictions %d\n",
+           vfs_stats.probes, vfs_stats.inode_hits, vfs_stats.evictions);
+}
+
+// "/" is a ramfs with an empty /mnt to mount disks on
+void vfs_init() {
+    if (!vfs_mount("ramfs", NULL, "/")) {
+        printk("vfs: could not mount the root file system\n");
+        return;
+    }
+    vfs_mkdir("/mnt");
+}
@@ -0,0 +1,157 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../Drivers/block.h"
+#include "exFAT.h"
+#include "ramfs.h"
+
+#define VFS_MAX_MOUNTS     8
+#define VFS_MAX_FILES      32
+#define VFS_INODE_COUNT    128
+#define VFS_INODE_HASH     64
+#define VFS_DENTRY_COUNT   512
+#define VFS_DENTRY_HASH    256
+#define VFS_DNAME_INLINE   40       // Longer names get a dentry that is never hashed
+#define VFS_NAME_MAX       767      // Bytes of UTF-8, with room for 255 UTF-16 units
+#define VFS_PATH_MAX       256
+
+// vfs_open() flags
+#define VFS_O_CREATE  0x01
+#define VFS_O_TRUNC   0x02
+#define VFS_O_APPEND  0x04
+
+typedef struct vfs_mount vfs_mount_t;
+typedef struct vfs_inode vfs_inode_t;
+typedef struct vfs_dentry vfs_dentry_t;
+
+typedef struct {
+    char name[VFS_NAME_MAX + 1];
+    bool directory;
+    uint64_t size;
+} vfs_dirent_t;
+
+// What a file system provides. lookup() and create() fill in a blank inode
+// (ino, directory, size and the file system's part of the union), the VFS
+// decides whether it is new or already cached and calls evict() on the copy
+// it does not keep.
+typedef struct {
+    const char *name;
+    bool case_fold;                 // Names match regardless of (ASCII) case
+    bool page_cache;                // File data is read through the page cache
+    bool (*mount)(vfs_mount_t *mnt, block_device_t *dev, vfs_inode_t *root);
+    void (*unmount)(vfs_mount_t *mnt);
+    bool (*sync)(vfs_mount_t *mnt);
+    bool (*lookup)(vfs_inode_t *dir, const char *name, vfs_inode_t *out);
+    bool (*readdir)(vfs_inode_t *dir, uint32_t *pos, vfs_dirent_t *out);
+    int (*read)(vfs_inode_t *inode, uint64_t offset, void *buf, uint32_t len);
+    // Fill count whole pages starting at page index first, zero past the end
+    // of the file. May be NULL, the page cache then read()s them one by one.
+    bool (*readpages)(vfs_inode_t *inode, uint32_t first, uint8_t **pages, int count);
+    // Where page index of the file already sits in memory, for devices that
+    // live there, so the page cache can use it in place. NULL if it does
+    // not, and the hook itself may be NULL.
+    void *(*direct_page)(vfs_inode_t *inode, uint32_t index);
+    int (*write)(vfs_inode_t *inode, uint64_t offset, const void *buf, uint32_t len);
+    bool (*truncate)(vfs_inode_t *inode, uint64_t size);
+    bool (*create)(vfs_inode_t *dir, const char *name, bool directory, vfs_inode_t *out);
+    bool (*remove)(vfs_inode_t *dir, vfs_inode_t *inode);
+    void (*release)(vfs_inode_t *inode);    // Last open file closed, may be NULL
+    void (*evict)(vfs_inode_t *inode);      // Inode leaves the cache, may be NULL
+} vfs_fs_ops_t;
+
+struct vfs_inode {
+    vfs_mount_t *mnt;
+    uint64_t ino;                   // Unique within the mount
+    bool directory;
+    uint64_t size;
+    int refs;                       // Dentries and open files
+    int open_count;
+    uint32_t last_used;
+    vfs_inode_t *hash_next;
+    bool in_use;
+
+    // The file system's own state
+    union {
+        exfat_file_t exfat;
+        ramfs_node_t *ram;
+    } u;
+};
+
+struct vfs_dentry {
+    char name[VFS_DNAME_INLINE];
+    uint32_t hash;
+    vfs_dentry_t *parent;           // NULL for the root of a mount
+    vfs_inode_t *inode;             // NULL for a negative entry: the name is known not to exist
+    vfs_mount_t *mnt;
+    vfs_mount_t *mounted;           // File system mounted on this directory
+    int refs;                       // Children, open files, mounts and walkers
+    bool hashed;
+    bool in_use;
+    vfs_dentry_t *hash_next;
+    vfs_dentry_t *lru_prev, *lru_next;      // Unreferenced entries, oldest first
+};
+
+struct vfs_mount {
+    const vfs_fs_ops_t *ops;
+    block_device_t *dev;
+    vfs_dentry_t *root;
+    vfs_dentry_t *mountpoint;       // NULL for "/"
+    void *fs_data;
+    bool in_use;
+};
+
+typedef struct {
+    vfs_dentry_t *dentry;
+    uint64_t offset;
+    uint32_t dir_pos;               // readdir() cursor
+    uint32_t ra_next;               // Page a sequential reader asks for next
+    uint32_t ra_pages;              // Current readahead window
+    int flags;
+    bool in_use;
+} vfs_file_t;
+
+typedef struct {
+    uint32_t lookups;               // Path components resolved
+    uint32_t hits;                  // ... from the dentry cache
+    uint32_t negative_hits;
+    uint32_t probes;                // Hash chain entries compared
+    uint32_t fs_lookups;            // Went to the file system
+    uint32_t inode_hits;
+    uint32_t evictions;
+} vfs_stats_t;
+
+// File systems
+extern const vfs_fs_ops_t exfat_vfs_ops;
+extern const vfs_fs_ops_t ramfs_vfs_ops;
+
+void vfs_init();
+bool vfs_mount(const char *fs, block_device_t *dev, const char *path);
+bool vfs_umount(const char *path);
+bool vfs_sync();
+bool vfs_dev_mounted(block_device_t *dev);
+
+// Files
+vfs_file_t *vfs_open(const char *path, int flags);
+vfs_file_t *vfs_dup(vfs_file_t *file);
+void vfs_close(vfs_file_t *file);
+vfs_file_t *vfs_fd_file(int fd);
+int vfs_file_fd(vfs_file_t *file);
+int vfs_read(vfs_file_t *file, void *buf, uint32_t len);
+int vfs_write(vfs_file_t *file, const void *buf, uint32_t len);
+bool vfs_seek(vfs_file_t *file, uint64_t offset);
+bool vfs_truncate(vfs_file_t *file, uint64_t size);
+bool vfs_fsync(vfs_file_t *file);
+bool vfs_readdir(vfs_file_t *dir, vfs_dirent_t *out);
+uint64_t vfs_size(vfs_file_t *file);
+bool vfs_is_dir(vfs_file_t *file);
+
+// Names
+bool vfs_mkdir(const char *path);
+bool vfs_unlink(const char *path);
+
+void vfs_print_stats();
+
+#endif // VFS_H